@@ -3,7 +3,7 @@ Rot13 Service
 
 This service watches a folder for files. When a new file is found, 
 it transforms text in the file with a ROT13 encryption. This version
-uses LuaFileSystem (available separately from the Keppler Project) 
+uses the directory index built into LuaService (service.dirindex) 
 to scan its folder. A better implementation would be to use a 
 Windows folder change event to reduce the impact on the system, but
 testing by copying 300 files to the watched folder shows that the
@@ -11,8 +11,7 @@ impact of doing it this way isn't as large as might be feared.
 
 Usage:
 
-Copy the LuaService executable to this folder, along with lua5.1.dll
-and lfs.dll.
+Copy the LuaService executable to this folder, along with lua5.1.dll.
 
 LuaService -i		Create and start the ticker service
 LuaService -r 		Start the service
@@ -25,13 +24,21 @@ is a good choice.
 
 Once the service is running, copy a file to \tmp\rot and notice that 
 about a second later it has had its content scrambled. Rename the file,
-and notice that a second scramble restores the content.
+and notice that a second scramble restores the content. Edit and save
+the file, and it will be scrambled again.
+
+The files already seen are remembered in rot13.idx in the service 
+folder, so restarting the service does not scramble them again.
+
+The folder to watch and the time in ms between scans may be passed in
+service.argv[1] and service.argv[2] instead. LuaBench does this to 
+drive the service, see bench/LuaBenchLoad.c.
 
 A brief history of ROT13 is at http://en.wikipedia.org/wiki/Rot13
 --]]--------------
-assert(require"lfs")
-
-local watched = [[\tmp\rot]]	-- folder to watch
+local watched = service.argv and service.argv[1] or [[\tmp\rot]]	-- folder to watch
+local interval = tonumber(service.argv and service.argv[2]) or 1000	-- ms between scans
+local dirsep = string.sub(package.config, 1, 1)
 
 
 -- ROT13 a string. Copied from the Lua-L archive, from a 
@@ -42,54 +49,41 @@ local function Rotate13(t)
       function (char)
         local offset = (char < 'a') and byte_A or byte_a
         local b = string.byte(char) - offset -- 0 to 25
-        b = math.mod(b  + 13, 26) + offset -- Rotate
+        b = (b  + 13) % 26 + offset -- Rotate
         return string.char(b)
       end
     ))
 end
 
 
-local found = {}	-- memory of files seen in the folder
+-- Index of the files already seen in the folder. It is kept in
+-- rot13.idx in the service folder, so files transformed before a
+-- restart are not transformed again, and a file rewritten under
+-- the same name is noticed as changed.
+local index = service.dirindex(watched, "rot13.idx")
 
--- examine a folder for files that are new since the last peek.
+-- examine a folder for files that are new or changed since the 
+-- last peek. Files that were deleted are simply forgotten.
 local function CheckForFiles()
-	-- list of new files
-	local r = {}
-	for f in lfs.dir(watched) do
-		local ff = watched..[[\]]..f
-		if lfs.attributes(ff, "mode") == "file" then
-			if not found[ff] then 
-				found[ff] = "new"
-				r[#r+1] = ff
-			else
-				found[ff] = "newish"
-			end
-		end
-	end
-	-- scan for old files that have been deleted
-	local d = {}
-	for k,f in pairs(found) do
-		if f == "old" then 
-			d[#d+1] = k
-		else
-			found[k] = "old"
-		end
+	local added, changed, removed = index:scan()
+	for i,f in ipairs(changed) do
+		added[#added+1] = f
 	end
-	-- forget about the deleted files
-	for i,k in ipairs(d) do
-		found[k] = nil
+	for i,f in ipairs(removed) do
+		index:forget(f)
 	end
-	return #r>0 and r or nil
+	return #added>0 and added or nil
 end
 
--- Apply ROT13 to an entire file. If the file
--- has gone missing, delete it from the table
--- of remembered files.
-local function Rot13File(file)
+-- Apply ROT13 to an entire file, then remember the file as it
+-- is now so our own rewrite is not seen as a change. If the file
+-- has gone missing, the commit drops it from the index.
+local function Rot13File(name)
+	local file = watched..dirsep..name
 	service.print("Rot13: ", file)
 	local f,err = io.open(file, "r+")
 	if f == nil then 
-		found[ff] = nil
+		index:commit(name)
 		service.print(file,": ", err)
 		return
 	end
@@ -97,12 +91,13 @@ local function Rot13File(file)
 	f:seek("set",0)
 	f:write(Rotate13(txt))
 	f:close()
+	index:commit(name)
 end
 
 -- main service implementation
 service.print("ROT13 service started, named ", service.name)
 while true do					-- loop forever
-	service.sleep(1000)			-- sleep 1 second
+	service.sleep(interval)		-- sleep 1 second by default
 	if service.stopping() then	-- Test for STOP request 
   		break					--  " and halt service if requested
 	end
@@ -111,7 +106,9 @@ while true do					-- loop forever
 		for i,f in ipairs(files) do
 			Rot13File(f)
 		end
+		index:save()
 	end
 end
+index:close()
 service.print("ROT13 service stopped.")
 
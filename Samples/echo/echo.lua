@@ -1,7 +1,4 @@
 local service = require "LuaService"
-local uv      = require "lluv"
-
-local EOF = uv.error('LIBUV', uv.EOF)
 
 local function logerror(...)
   service.print('[ERROR] ' .. string.format(...))
@@ -21,84 +18,83 @@ if not port then
   return 1
 end
 
-local function on_write(cli, err)
-  if err then
-    if err == EOF then
-      loginfo('on write close socket')
-    else
-      logerror('on write error: %s', tostring(err))
-    end
-    return cli:close()
-  end
-end
+local loop = service.reactor()
 
-local function on_read(cli, err, data)
-  if err then
-    if err == EOF then
-      loginfo('on read close socket')
-    else
-      logerror('on read error: %s', tostring(err))
-    end
-    return cli:close()
-  end
-  cli:write(data, on_write)
+local server, err = loop:listen(host, port)
+if not server then
+  logerror("Can not bind: %s", tostring(err))
+  return 1
 end
 
-uv.tcp():bind(host, port, function(server, err, host, port)
-  if err then
-    logerror("Can not bind: %s", tostring(err))
-    return server:close()
-  end
+loginfo("Bind on: %s:%s", host, port)
+
+-- echo what a client sends, keeping what did not fit until the socket
+-- is writable again
+local function on_client(cli)
+  local pending, pos
+
+  return function(w, readable, writable)
+    if writable then
+      local n, err = cli:write(pending, pos)
+      if not n then
+        logerror('on write error: %s', tostring(err))
+        return cli:close()
+      end
+      pos = pos + n
+      if pos <= #pending then return end
+      pending = nil
+      return w:events('r')
+    end
 
-  loginfo("Bind on: %s:%s", tostring(host), tostring(port))
+    local data, err = cli:read()
+    if not data then
+      if err == 'wouldblock' then return end
+      if err == 'closed' then
+        loginfo('on read close socket')
+      else
+        logerror('on read error: %s', tostring(err))
+      end
+      return cli:close()
+    end
 
-  server:listen(function(server, err)
-    if err then
-      logerror('listen error: %s', tostring(err))
-      return
+    local n, err = cli:write(data)
+    if not n then
+      logerror('on write error: %s', tostring(err))
+      return cli:close()
+    end
+    if n < #data then
+      pending, pos = data, n + 1
+      w:events('w')
     end
+  end
+end
 
-    -- create client socket in same loop as server
-    local cli, err = server:accept()
-    if not cli then
-      logerror('accept error: %s', tostring(err))
-      return
+loop:watch(server, 'r', function()
+  local cli, peer = server:accept()
+  if not cli then
+    if peer ~= 'wouldblock' then
+      logerror('accept error: %s', tostring(peer))
     end
+    return
+  end
 
-    loginfo('accepted: %s:%s', cli:getpeername())
+  loginfo('accepted: %s', peer)
 
-    cli:start_read(on_read)
-  end)
+  loop:watch(cli, 'r', on_client(cli))
 end)
 
 -- handle service control
 
-local function stop_service()
+loop:on_stop(function()
   loginfo("stopping service...")
-  uv.stop()
-end
+  loop:stop()
+end)
 
 loginfo("running service...")
 
-if service.RUN_AS_SERVICE then
-
-  loginfo("run as service")
-
-  uv.timer():start(1000, 1000, function()
-    if service.check_stop(0) then
-      stop_service()
-    end
-  end)
-
-else
-
-  loginfo("run as console")
-
-  uv.signal():start(uv.SIGINT,   stop_service)
-
-  uv.signal():start(uv.SIGBREAK, stop_service)
-end
+loop:run()
 
-uv.run()
+server:close()
+loop:close()
 
 loginfo("service stopped")
@@ -0,0 +1,647 @@
+/*! \file LuaBench.c
+ *  \brief Benchmarks of the service runtime core.
+ *
+ * LuaBench is built from the same sources as LuaService, less its
+ * main(), and times the parts of the runtime that every service pays
+ * for:
+ *
+ * - <code>startup_cold</code>, <code>startup</code> -- running init.lua
+ *   and loading and starting the service script, up to its first line.
+ *   The first is timed once, as the first thing the process does; the
+ *   second is the same sequence repeated once everything is cached.
+ * - <code>worker_load</code>, <code>worker_run</code>,
+ *   <code>worker_cleanup</code> -- LuaWorkerLoad(), LuaWorkerRun() and
+ *   LuaWorkerCleanup() of an empty script.
+ * - <code>print</code>, <code>trace_off</code>, <code>trace</code>,
+ *   <code>trace_str</code> -- service.print() from Lua, and
+ *   SvcDebugTrace() and SvcDebugTraceStr() with tracing off and on.
+ *   On POSIX systems the output is sent to the null device, so this
+ *   measures formatting and the write, not the terminal.
+ * - <code>sleep_1ms</code>, <code>sleep_10ms</code>,
+ *   <code>service_sleep_1ms</code> -- how long SvcSleep() and
+ *   service.sleep() really sleep.
+ * - <code>alloc_raw_default</code>, <code>alloc_raw_luaalloc</code>
+ *   -- a mix of allocations, reallocations and frees made directly
+ *   through Lua's own allocator and through LuaAlloc().
+ * - <code>alloc_default</code>, <code>alloc_luaalloc</code>,
+ *   <code>alloc_heap_off</code>, <code>alloc_heap_on</code> -- a
+ *   script that allocates, in a state using Lua's own allocator, using
+ *   LuaAlloc(), and using LuaAlloc() wrapped by the heap profiler with
+ *   the profiler off and on.
+ * - <code>result_string</code>, <code>result_int</code>,
+ *   <code>result_field_string</code>, <code>result_field_int</code>
+ *   -- the LuaResult* accessors.
+ *
+ * Each benchmark takes a number of samples, each timing a batch of
+ * operations, and prints one line of <code>key=value</code> pairs:
+ *
+ * <pre>
+ * bench=worker_load n=200 batch=1 mean_us=812.4 p50_us=790.0 ...
+ * </pre>
+ *
+ * with the mean, median, 90th and 99th percentile, minimum and maximum
+ * time of one operation in microseconds, and the operations per
+ * second. Lines starting with <code>#</code> describe the build. The
+ * script compare.lua compares two such outputs and reports the
+ * benchmarks that got slower.
+ *
+ * The command line is <code>LuaBench [-n scale] [name ...]</code>,
+ * where the scale multiplies the number of samples and the names
+ * select the benchmarks whose names start with any of them. The
+ * commands <code>LuaBench echo</code> and <code>LuaBench rot13</code>
+ * run the end-to-end workloads of LuaBenchLoad.c instead.
+ *
+ * Like LuaService, LuaBench finds init.lua and its scripts in the
+ * folder holding the executable, which is this folder.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include "../src/luaservice.h"
+#include "LuaBench.h"
+
+/** A benchmark body, timing one batch of operations.
+ *
+ * \param ctx The benchmark's context.
+ * \param batch The number of operations to time.
+ * \returns The time taken in microseconds, which leaves out any setup
+ * the body does around the operations.
+ */
+typedef SvcU64 (*BenchFunc)(void *ctx, int batch);
+
+/** Multiplier for the number of samples, from <code>-n</code>. */
+static int BenchScale = 1;
+
+/** The names given on the command line, or none for all. */
+static char **BenchNames;
+static int BenchNameCount;
+
+/** Decide if a benchmark was selected on the command line. */
+static int BenchSelected(const char *name)
+{
+    int i;
+
+    if (!BenchNameCount)
+        return 1;
+    for (i = 0; i < BenchNameCount; ++i)
+        if (strncmp(name, BenchNames[i], strlen(BenchNames[i])) == 0)
+            return 1;
+    return 0;
+}
+
+/** Order sample times for qsort(). */
+static int BenchCompare(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/** Print the line of results of a benchmark.
+ *
+ * \param name The benchmark.
+ * \param us The time of one operation in each sample, which is sorted.
+ * \param n The number of samples.
+ * \param batch The number of operations in each sample.
+ */
+void BenchReport(const char *name, double *us, int n, int batch)
+{
+    double sum = 0;
+    int i;
+
+    qsort(us, n, sizeof(double), BenchCompare);
+    for (i = 0; i < n; ++i)
+        sum += us[i];
+    sum /= n;
+    printf("bench=%s n=%d batch=%d mean_us=%.3f p50_us=%.3f p90_us=%.3f "
+            "p99_us=%.3f min_us=%.3f max_us=%.3f ops_s=%.0f\n",
+            name, n, batch, sum, us[(n - 1) * 50 / 100],
+            us[(n - 1) * 90 / 100], us[(n - 1) * 99 / 100], us[0],
+            us[n - 1], sum > 0 ? 1e6 / sum : 0.0);
+    fflush(stdout);
+}
+
+/** Run a benchmark if it was selected.
+ *
+ * \param name The benchmark.
+ * \param samples The number of samples, before scaling.
+ * \param batch The number of operations in each sample.
+ * \param fn The body.
+ * \param ctx The body's context.
+ */
+static void BenchRun(const char *name, int samples, int batch,
+        BenchFunc fn, void *ctx)
+{
+    double *us;
+    int i;
+
+    if (!BenchSelected(name))
+        return;
+    samples *= BenchScale;
+    us = (double *)malloc(samples * sizeof(double));
+    if (!us) {
+        fprintf(stderr, "%s: out of memory\n", name);
+        return;
+    }
+    fn(ctx, 1);     /* warm up */
+    for (i = 0; i < samples; ++i)
+        us[i] = (double)fn(ctx, batch) / batch;
+    BenchReport(name, us, samples, batch);
+    free(us);
+}
+
+#ifndef _WIN32
+/** Saved stderr while BenchQuiet() is in effect. */
+static int BenchStderr = -1;
+#endif
+
+/** Send trace output to the null device, or back.
+ *
+ * Only needed where trace output goes to stderr. On Windows it goes to
+ * OutputDebugString(), which costs about the same whether anyone is
+ * listening or not.
+ *
+ * \param quiet Non-zero to discard trace output, zero to restore it.
+ */
+void BenchQuiet(int quiet)
+{
+#ifndef _WIN32
+    int fd;
+
+    fflush(stderr);
+    if (quiet && BenchStderr < 0) {
+        fd = open("/dev/null", O_WRONLY);
+        if (fd < 0)
+            return;
+        BenchStderr = dup(STDERR_FILENO);
+        dup2(fd, STDERR_FILENO);
+        close(fd);
+    } else if (!quiet && BenchStderr >= 0) {
+        dup2(BenchStderr, STDERR_FILENO);
+        close(BenchStderr);
+        BenchStderr = -1;
+    }
+#else
+    (void)quiet;
+#endif
+}
+
+/** Get the full name of a file in the folder of the executable.
+ *
+ * \returns The name, from malloc(), or NULL.
+ */
+char *BenchPath(const char *name)
+{
+    char *exe = SvcExePath();
+    char *path, *cp;
+
+    if (!exe)
+        return NULL;
+    cp = strrchr(exe, SVC_DIRSEP);
+    if (cp)
+        cp[1] = '\0';
+    else
+        exe[0] = '\0';
+    path = (char *)malloc(strlen(exe) + strlen(name) + 1);
+    if (path) {
+        strcpy(path, exe);
+        strcat(path, name);
+    }
+    free(exe);
+    return path;
+}
+
+/** Run init.lua and start the service script, as a service does.
+ *
+ * \param argv The command line, for LuaServiceStartup().
+ * \returns The time taken in microseconds, or zero if it failed.
+ */
+static SvcU64 BenchStartup(char **argv)
+{
+    SvcU64 t0 = SvcMicros();
+    LUAHANDLE wk;
+    SvcU64 t;
+
+    if (LuaServiceStartup(1, argv) != EXIT_SUCCESS)
+        return 0;
+    wk = LuaServiceLoadWorker();
+    if (!wk || !LuaWorkerRun(wk)) {
+        LuaWorkerCleanup(wk);
+        return 0;
+    }
+    t = SvcMicros() - t0;
+    LuaWorkerCleanup(wk);
+    return t ? t : 1;
+}
+
+/** Body of <code>startup</code>. */
+static SvcU64 BenchStartupRun(void *ctx, int batch)
+{
+    SvcU64 t = 0;
+    int i;
+
+    for (i = 0; i < batch; ++i)
+        t += BenchStartup((char **)ctx);
+    return t;
+}
+
+/** Body of <code>worker_load</code>. */
+static SvcU64 BenchWorkerLoad(void *ctx, int batch)
+{
+    LUAHANDLE wk;
+    SvcU64 t = 0, t0;
+    int i;
+
+    (void)ctx;
+    for (i = 0; i < batch; ++i) {
+        t0 = SvcMicros();
+        wk = LuaWorkerLoad(NULL, "first.lua");
+        t += SvcMicros() - t0;
+        LuaWorkerCleanup(wk);
+    }
+    return t;
+}
+
+/** Body of <code>worker_run</code>. */
+static SvcU64 BenchWorkerRun(void *ctx, int batch)
+{
+    LUAHANDLE wk;
+    SvcU64 t = 0, t0;
+    int i;
+
+    (void)ctx;
+    for (i = 0; i < batch; ++i) {
+        wk = LuaWorkerLoad(NULL, "first.lua");
+        t0 = SvcMicros();
+        LuaWorkerRun(wk);
+        t += SvcMicros() - t0;
+        LuaWorkerCleanup(wk);
+    }
+    return t;
+}
+
+/** Body of <code>worker_cleanup</code>. */
+static SvcU64 BenchWorkerCleanup(void *ctx, int batch)
+{
+    LUAHANDLE wk;
+    SvcU64 t = 0, t0;
+    int i;
+
+    (void)ctx;
+    for (i = 0; i < batch; ++i) {
+        wk = LuaWorkerLoad(NULL, "first.lua");
+        LuaWorkerRun(wk);
+        t0 = SvcMicros();
+        LuaWorkerCleanup(wk);
+        t += SvcMicros() - t0;
+    }
+    return t;
+}
+
+/** Body of <code>print</code>, running print.lua in the state \a ctx. */
+static SvcU64 BenchPrint(void *ctx, int batch)
+{
+    SvcU64 t0;
+
+    LuaWorkerSetInt(ctx, "bench_n", batch);
+    t0 = SvcMicros();
+    LuaWorkerRun(ctx);
+    return SvcMicros() - t0;
+}
+
+/** Body of <code>trace_off</code> and <code>trace</code>. */
+static SvcU64 BenchTrace(void *ctx, int batch)
+{
+    SvcU64 t0 = SvcMicros();
+    int i;
+
+    (void)ctx;
+    for (i = 0; i < batch; ++i)
+        SvcDebugTrace("LuaBench trace %d\n", (DWORD)i);
+    return SvcMicros() - t0;
+}
+
+/** Body of <code>trace_str</code>. */
+static SvcU64 BenchTraceStr(void *ctx, int batch)
+{
+    SvcU64 t0 = SvcMicros();
+    int i;
+
+    (void)ctx;
+    for (i = 0; i < batch; ++i)
+        SvcDebugTraceStr("LuaBench trace %s\n", "string");
+    return SvcMicros() - t0;
+}
+
+/** Body of the SvcSleep() benchmarks, sleeping \a ctx ms. */
+static SvcU64 BenchSleep(void *ctx, int batch)
+{
+    SvcU64 t0 = SvcMicros();
+    int i;
+
+    for (i = 0; i < batch; ++i)
+        SvcSleep(*(DWORD *)ctx);
+    return SvcMicros() - t0;
+}
+
+/** Body of <code>service_sleep_1ms</code>, running sleep.lua. */
+static SvcU64 BenchServiceSleep(void *ctx, int batch)
+{
+    SvcU64 t0 = SvcMicros();
+    int i;
+
+    for (i = 0; i < batch; ++i)
+        LuaWorkerRun(ctx);
+    return SvcMicros() - t0;
+}
+
+/** An allocator under test, with its opaque argument. */
+typedef struct BenchAlloc {
+    lua_Alloc f;
+    void *ud;
+} BenchAlloc;
+
+/** Number of blocks live at once in the raw allocator benchmarks. */
+#define BENCH_BLOCKS 256
+
+/** Body of the raw allocator benchmarks.
+ *
+ * One operation is an allocation of 16 to 528 bytes, its growth to
+ * twice the size, and its free, made in rounds of BENCH_BLOCKS blocks
+ * so that the allocator sees blocks of mixed size come and go.
+ */
+static SvcU64 BenchAllocRaw(void *ctx, int batch)
+{
+    BenchAlloc *a = (BenchAlloc *)ctx;
+    void *p[BENCH_BLOCKS];
+    size_t sz[BENCH_BLOCKS];
+    SvcU64 t0 = SvcMicros();
+    int i, j, n;
+
+    for (i = 0; i < batch; i += n) {
+        n = batch - i < BENCH_BLOCKS ? batch - i : BENCH_BLOCKS;
+        for (j = 0; j < n; ++j) {
+            sz[j] = 16 + ((i + j) * 37) % 513;
+            p[j] = a->f(a->ud, NULL, 0, sz[j]);
+        }
+        for (j = 0; j < n; ++j) {
+            p[j] = a->f(a->ud, p[j], sz[j], 2 * sz[j]);
+            sz[j] *= 2;
+        }
+        for (j = n - 1; j >= 0; --j)
+            a->f(a->ud, p[j], sz[j], 0);
+    }
+    return SvcMicros() - t0;
+}
+
+/** How the state of an allocator benchmark is created. */
+enum BenchState {
+    BENCH_DEFAULT,      /**< luaL_newstate(), Lua's own allocator */
+    BENCH_LUAALLOC,     /**< lua_newstate() with LuaAlloc() */
+    BENCH_HEAP_OFF,     /**< LuaAlloc() and LuaHeapAttach() */
+    BENCH_HEAP_ON       /**< The same with heap profiling */
+};
+
+/** Body of the allocator benchmarks, running alloc.lua in a new state.
+ *
+ * One operation is one item built by the script. The time includes
+ * creating and closing the state.
+ */
+static SvcU64 BenchAllocScript(void *ctx, int batch)
+{
+    int how = *(int *)ctx;
+    int profile = ServiceHeapProfile;
+    char *path = BenchPath("alloc.lua");
+    lua_State *L;
+    lua_Alloc f;
+    void *ud;
+    SvcU64 t0;
+
+    if (!path)
+        return 0;
+    t0 = SvcMicros();
+    if (how == BENCH_DEFAULT)
+        L = luaL_newstate();
+    else
+        L = lua_newstate(LuaAlloc, NULL);
+    if (!L) {
+        free(path);
+        return 0;
+    }
+    if (how >= BENCH_HEAP_OFF) {
+        ServiceHeapProfile = how == BENCH_HEAP_ON;
+        LuaHeapAttach(L);
+        ServiceHeapProfile = profile;
+    }
+    luaL_openlibs(L);
+    if (luaL_loadfile(L, path) == 0) {
+        lua_pushinteger(L, batch);
+        if (lua_pcall(L, 1, 0, 0) != 0)
+            fprintf(stderr, "alloc.lua: %s\n", lua_tostring(L, -1));
+    } else
+        fprintf(stderr, "%s\n", lua_tostring(L, -1));
+    f = lua_getallocf(L, &ud);
+    lua_close(L);
+    if (f == LuaHeapAllocf)
+        LuaHeapFree(ud);
+    t0 = SvcMicros() - t0;
+    free(path);
+    return t0;
+}
+
+/** The LuaResult* accessor timed by a benchmark. */
+enum BenchResult {
+    BENCH_RESULT_STRING,
+    BENCH_RESULT_INT,
+    BENCH_RESULT_FIELD_STRING,
+    BENCH_RESULT_FIELD_INT
+};
+
+/** Context of the accessor benchmarks. */
+typedef struct BenchResultCtx {
+    LUAHANDLE wk;       /**< The state that ran result.lua. */
+    int which;          /**< The accessor, from enum BenchResult. */
+} BenchResultCtx;
+
+/** Body of the accessor benchmarks. */
+static SvcU64 BenchResultGet(void *ctx, int batch)
+{
+    BenchResultCtx *r = (BenchResultCtx *)ctx;
+    SvcU64 t0 = SvcMicros();
+    int i;
+
+    for (i = 0; i < batch; ++i) {
+        switch (r->which) {
+        case BENCH_RESULT_STRING:
+            free(LuaResultString(r->wk, 1));
+            break;
+        case BENCH_RESULT_INT:
+            LuaResultInt(r->wk, 2);
+            break;
+        case BENCH_RESULT_FIELD_STRING:
+            free(LuaResultFieldString(r->wk, 3, "name"));
+            break;
+        default:
+            LuaResultFieldInt(r->wk, 3, "count");
+            break;
+        }
+    }
+    return SvcMicros() - t0;
+}
+
+/** Run the benchmarks that use a script in a worker state.
+ *
+ * \param name The benchmark.
+ * \param script The script, which is loaded once and run by \a fn.
+ * \param samples The number of samples, before scaling.
+ * \param batch The number of operations in each sample.
+ * \param fn The body.
+ */
+static void BenchScript(const char *name, const char *script, int samples,
+        int batch, BenchFunc fn)
+{
+    LUAHANDLE wk;
+
+    if (!BenchSelected(name))
+        return;
+    wk = LuaWorkerLoad(NULL, script);
+    if (!wk) {
+        fprintf(stderr, "%s: can't load %s\n", name, script);
+        return;
+    }
+    LuaWorkerSetInt(wk, "bench_ms", 1);
+    BenchRun(name, samples, batch, fn, wk);
+    LuaWorkerCleanup(wk);
+}
+
+/** Show the command line usage. */
+static void BenchUsage(void)
+{
+    printf("Usage: LuaBench [-n scale] [name ...]\n"
+            "       LuaBench echo|rot13 [options]\n"
+            "  -n scale  Multiply the number of samples by scale\n"
+            "  name      Run only the benchmarks whose names start with name\n"
+            "  echo      Load the echo sample, see LuaBench echo -h\n"
+            "  rot13     Load the Rot13 sample, see LuaBench rot13 -h\n");
+}
+
+/** Process entry point.
+ *
+ * \param argc The count of arguments.
+ * \param argv The list of arguments.
+ * \returns The ANSI C process exit status.
+ */
+int main(int argc, char *argv[])
+{
+    static const char *names[] = {
+        "alloc_default", "alloc_luaalloc", "alloc_heap_off", "alloc_heap_on"
+    };
+    static const char *results[] = {
+        "result_string", "result_int", "result_field_string",
+        "result_field_int"
+    };
+    BenchResultCtx r;
+    BenchAlloc a;
+    DWORD ms;
+    double cold;
+    int i, tracelevel;
+    lua_State *L;
+
+    if (argc > 1 && (strcmp(argv[1], "echo") == 0
+            || strcmp(argv[1], "rot13") == 0)) {
+        if (LuaServiceStartup(1, argv) != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+        if (strcmp(argv[1], "echo") == 0)
+            return BenchEchoMain(argc - 1, argv + 1);
+        return BenchRot13Main(argc - 1, argv + 1);
+    }
+    for (i = 1; i < argc && argv[i][0] == '-'; ++i) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc
+                && atoi(argv[i + 1]) > 0)
+            BenchScale = atoi(argv[++i]);
+        else {
+            BenchUsage();
+            return EXIT_FAILURE;
+        }
+    }
+    BenchNames = argv + i;
+    BenchNameCount = argc - i;
+
+    /* Timed first, while nothing of LuaService or Lua has been used. */
+    cold = (double)BenchStartup(argv);
+    if (!cold) {
+        fprintf(stderr, "Can't run init.lua and first.lua\n");
+        return EXIT_FAILURE;
+    }
+    tracelevel = SvcDebugTraceLevel;
+    SvcDebugTraceLevel = 0;
+
+    printf("# LuaBench %s\n", LUA_RELEASE);
+#if USE_LUA_ALLOCATOR
+    printf("# allocator=lua\n");
+#else
+    printf("# allocator=luaalloc\n");
+#endif
+    printf("# scale=%d\n", BenchScale);
+    if (BenchSelected("startup_cold"))
+        BenchReport("startup_cold", &cold, 1, 1);
+    BenchRun("startup", 50, 1, BenchStartupRun, argv);
+    SvcDebugTraceLevel = 0;
+
+    BenchRun("worker_load", 200, 1, BenchWorkerLoad, NULL);
+    BenchRun("worker_run", 200, 1, BenchWorkerRun, NULL);
+    BenchRun("worker_cleanup", 200, 1, BenchWorkerCleanup, NULL);
+
+    BenchQuiet(1);
+    BenchScript("print", "print.lua", 50, 1000, BenchPrint);
+    BenchRun("trace_off", 50, 10000, BenchTrace, NULL);
+    SvcDebugTraceLevel = 1;
+    BenchRun("trace", 50, 1000, BenchTrace, NULL);
+    BenchRun("trace_str", 50, 1000, BenchTraceStr, NULL);
+    SvcDebugTraceLevel = 0;
+    BenchQuiet(0);
+
+    ms = 1;
+    BenchRun("sleep_1ms", 200, 1, BenchSleep, &ms);
+    BenchScript("service_sleep_1ms", "sleep.lua", 200, 1, BenchServiceSleep);
+    ms = 10;
+    BenchRun("sleep_10ms", 50, 1, BenchSleep, &ms);
+
+    L = luaL_newstate();
+    if (L) {
+        a.f = lua_getallocf(L, &a.ud);
+        BenchRun("alloc_raw_default", 50, 10000, BenchAllocRaw, &a);
+        lua_close(L);
+    }
+    a.f = LuaAlloc;
+    a.ud = NULL;
+    BenchRun("alloc_raw_luaalloc", 50, 10000, BenchAllocRaw, &a);
+    for (i = BENCH_DEFAULT; i <= BENCH_HEAP_ON; ++i)
+        BenchRun(names[i], 20, 10000, BenchAllocScript, &i);
+
+    r.wk = NULL;
+    for (i = 0; i < 4; ++i) {
+        if (!BenchSelected(results[i]))
+            continue;
+        if (!r.wk) {
+            r.wk = LuaWorkerLoad(NULL, "result.lua");
+            if (!r.wk || !LuaWorkerRun(r.wk)) {
+                fprintf(stderr, "Can't run result.lua\n");
+                break;
+            }
+        }
+        r.which = i;
+        BenchRun(results[i], 50, 10000, BenchResultGet, &r);
+    }
+    LuaWorkerCleanup(r.wk);
+
+    SvcDebugTraceLevel = tracelevel;
+    return EXIT_SUCCESS;
+}
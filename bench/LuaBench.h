@@ -0,0 +1,17 @@
+/*!
+ * \file LuaBench.h
+ * \brief Declarations shared by the parts of LuaBench.
+ */
+#ifndef LUABENCH_H_
+#define LUABENCH_H_
+
+// From LuaBench.c
+extern void BenchReport(const char *name, double *us, int n, int batch);
+extern void BenchQuiet(int quiet);
+extern char *BenchPath(const char *name);
+
+// From LuaBenchLoad.c
+extern int BenchEchoMain(int argc, char *argv[]);
+extern int BenchRot13Main(int argc, char *argv[]);
+
+#endif /*LUABENCH_H_*/
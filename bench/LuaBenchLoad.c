@@ -0,0 +1,593 @@
+/*! \file LuaBenchLoad.c
+ *  \brief End-to-end workloads of LuaBench, driving the sample services.
+ *
+ * The micro benchmarks in LuaBench.c time the runtime one part at a
+ * time. These run a whole service, one of the samples, in a thread of
+ * LuaBench exactly as <tt>LuaService run</tt> would, and load it from
+ * the main thread the way its clients would:
+ *
+ * - <code>LuaBench echo [-c conns] [-n msgs] [-s bytes] [-p port]
+ *   [-a host:port]</code> runs Samples/echo and connects \a conns
+ *   clients to it, each sending \a msgs messages of \a bytes bytes and
+ *   waiting for each echo before sending the next. It reports the round
+ *   trip time of a message as <code>echo_rtt</code> and the messages
+ *   and bytes per second of all clients together as
+ *   <code>echo_throughput</code>. With <code>-a</code> it drives an
+ *   echo service that is already running instead.
+ * - <code>LuaBench rot13 [-n files] [-s bytes] [-i ms]</code> runs
+ *   Samples/Rot13 on the folder bench/rot, scanning every \a ms, and
+ *   moves \a files files of \a bytes bytes into it at once. It reports
+ *   the time from the move of a file until its content has been
+ *   transformed as <code>rot13_latency</code>, and the files per second
+ *   from the first move to the last transformed file as
+ *   <code>rot13_throughput</code>.
+ *
+ * The output is in the format of the micro benchmarks, so compare.lua
+ * compares it the same way. The samples find LuaService.lua in the src
+ * folder, as they do under LuaService.
+ */
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <signal.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/luaservice.h"
+#include "LuaBench.h"
+
+#ifdef _WIN32
+typedef SOCKET BenchSocket;
+#define BenchCloseSocket closesocket
+#else
+typedef int BenchSocket;
+#define INVALID_SOCKET (-1)
+#define BenchCloseSocket close
+#endif
+
+/** Time in ms the service gets to start, or to stop when asked. */
+#define BENCH_SERVICE_WAIT 10000
+
+/** Time in ms the Rot13 service gets to transform all the files. */
+#define BENCH_ROT13_WAIT 120000
+
+/** Set by the service thread when the service script has finished. */
+static volatile int BenchServiceDone;
+
+/** Body of the service thread.
+ *
+ * Loads ServiceScript and runs it under SvcSupervise(), as
+ * LuaServiceRunConsole() does.
+ */
+static unsigned BenchServiceThread(void *arg)
+{
+    LUAHANDLE wk = NULL;
+    DWORD specificError = 0;
+
+    (void)arg;
+    if (LuaServiceInitialization(&wk, &specificError) == NO_ERROR)
+        SvcSupervise(wk);
+    else
+        fprintf(stderr, "Can't load %s\n", ServiceScript);
+    BenchServiceDone = 1;
+    return 0;
+}
+
+/** Start a sample service in a thread of LuaBench.
+ *
+ * \param script The service script, relative to the bench folder.
+ * \param argv The arguments seen by the script as service.argv.
+ * \param argc The count of \a argv.
+ * \returns The thread, or NULL if it could not be started.
+ */
+static SvcThread *BenchServiceStart(const char *script, const char **argv,
+        size_t argc)
+{
+    SvcThread *t;
+
+    /* The samples load LuaService.lua with require. Set here rather
+     * than in init.lua, so the micro benchmarks do without it. */
+    if (!LuaPackagePath)
+        LuaPackagePath = "!/../src/?.lua;;";
+    ServiceScript = script;
+    LuaServiceArgv = argv;
+    LuaServiceArgc = argc;
+    BenchServiceDone = 0;
+    t = SvcThreadStart(BenchServiceThread, NULL);
+    if (!t)
+        fprintf(stderr, "Can't start the service thread (%lu)\n",
+                (unsigned long)SvcLastError());
+    return t;
+}
+
+/** Stop a sample service started by BenchServiceStart(). */
+static void BenchServiceStop(SvcThread *t)
+{
+    LuaServiceStop();
+    LuaControlWake();
+    if (!SvcThreadWait(t, BENCH_SERVICE_WAIT))
+        fprintf(stderr, "%s did not stop\n", ServiceScript);
+}
+
+/** Report that a sample service finished before the benchmark did. */
+static void BenchServiceFailed(const char *sample)
+{
+    fprintf(stderr, "%s stopped early. Run it with `LuaService run` in "
+            "Samples/%s to see why.\n", ServiceScript, sample);
+}
+
+/** One client connection of the echo workload. */
+typedef struct EchoConn {
+    SvcThread *thread;          /**< The thread running the client. */
+    const struct addrinfo *ai;  /**< The service's address. */
+    int msgs;                   /**< The messages to send. */
+    int size;                   /**< The size of a message. */
+    double *us;                 /**< The round trip time of each message. */
+    int done;                   /**< The messages echoed. */
+} EchoConn;
+
+/** Connect to the echo service.
+ *
+ * \returns The socket, or INVALID_SOCKET.
+ */
+static BenchSocket EchoConnect(const struct addrinfo *ai)
+{
+    BenchSocket s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    int on = 1;
+
+    if (s == INVALID_SOCKET)
+        return s;
+    if (connect(s, ai->ai_addr, (int)ai->ai_addrlen) != 0) {
+        BenchCloseSocket(s);
+        return INVALID_SOCKET;
+    }
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char *)&on, sizeof(on));
+    return s;
+}
+
+/** Body of a client thread of the echo workload. */
+static unsigned EchoClient(void *arg)
+{
+    EchoConn *c = (EchoConn *)arg;
+    char *out = (char *)malloc(c->size);
+    char *in = (char *)malloc(c->size);
+    BenchSocket s;
+    SvcU64 t0;
+    int i, n, got;
+
+    if (!out || !in) {
+        free(out);
+        free(in);
+        return 1;
+    }
+    for (i = 0; i < c->size; ++i)
+        out[i] = (char)('a' + i % 26);
+    s = EchoConnect(c->ai);
+    for (i = 0; s != INVALID_SOCKET && i < c->msgs; ++i) {
+        t0 = SvcMicros();
+        if (send(s, out, c->size, 0) != c->size)
+            break;
+        for (got = 0; got < c->size; got += n) {
+            n = recv(s, in + got, c->size - got, 0);
+            if (n <= 0)
+                break;
+        }
+        if (got < c->size)
+            break;
+        c->us[c->done++] = (double)(SvcMicros() - t0);
+    }
+    if (s != INVALID_SOCKET)
+        BenchCloseSocket(s);
+    free(out);
+    free(in);
+    return 0;
+}
+
+/** Show the command line usage of the echo workload. */
+static void EchoUsage(void)
+{
+    printf("Usage: LuaBench echo [-c conns] [-n msgs] [-s bytes] [-p port] "
+            "[-a host:port]\n"
+            "  -c conns      Clients connected at once (16)\n"
+            "  -n msgs       Messages sent by each client (1000)\n"
+            "  -s bytes      Size of a message (64)\n"
+            "  -p port       Port of the echo service started (5678)\n"
+            "  -a host:port  Drive a running echo service instead\n");
+}
+
+/** Run the echo workload.
+ *
+ * \param argc The count of arguments, starting with "echo".
+ * \param argv The list of arguments.
+ * \returns The ANSI C process exit status.
+ */
+int BenchEchoMain(int argc, char *argv[])
+{
+    static char endpoint[64];
+    static const char *svcargv[2];
+    int conns = 16, msgs = 1000, size = 64, port = 5678;
+    const char *address = NULL;
+    char host[64], service[16];
+    struct addrinfo hints, *ai = NULL;
+    SvcThread *svc = NULL;
+    EchoConn *c;
+    double *us;
+    SvcU64 t0, elapsed;
+    BenchSocket s;
+    DWORD start;
+    int i, n, status = EXIT_FAILURE;
+    const char *cp;
+#ifdef _WIN32
+    WSADATA wsa;
+
+    WSAStartup(MAKEWORD(2, 2), &wsa);
+#else
+    signal(SIGPIPE, SIG_IGN);
+#endif
+
+    for (i = 1; i < argc; ++i) {
+        if (i + 1 < argc && strcmp(argv[i], "-c") == 0)
+            conns = atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "-n") == 0)
+            msgs = atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "-s") == 0)
+            size = atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "-p") == 0)
+            port = atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "-a") == 0)
+            address = argv[++i];
+        else
+            conns = 0;
+    }
+    if (conns <= 0 || msgs <= 0 || size <= 0 || port <= 0) {
+        EchoUsage();
+        return EXIT_FAILURE;
+    }
+    if (!address) {
+        sprintf(endpoint, "127.0.0.1:%d", port);
+        address = endpoint;
+    }
+    cp = strrchr(address, ':');
+    if (!cp || cp - address >= (int)sizeof(host)
+            || strlen(cp + 1) >= sizeof(service)) {
+        EchoUsage();
+        return EXIT_FAILURE;
+    }
+    memcpy(host, address, cp - address);
+    host[cp - address] = '\0';
+    strcpy(service, cp + 1);
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, service, &hints, &ai) != 0 || !ai) {
+        fprintf(stderr, "Can't resolve %s\n", address);
+        return EXIT_FAILURE;
+    }
+
+    c = (EchoConn *)calloc(conns, sizeof(EchoConn));
+    us = (double *)malloc((size_t)conns * msgs * sizeof(double));
+    if (!c || !us) {
+        fprintf(stderr, "Out of memory\n");
+        goto done;
+    }
+
+    if (address == endpoint) {
+        svcargv[0] = "LuaBench";
+        svcargv[1] = endpoint;
+        svc = BenchServiceStart("../Samples/echo/echo.lua", svcargv, 2);
+        if (!svc)
+            goto done;
+    }
+    /* Wait for the service to listen. */
+    start = SvcTicks();
+    while ((s = EchoConnect(ai)) == INVALID_SOCKET) {
+        if (BenchServiceDone) {
+            BenchServiceFailed("echo");
+            goto done;
+        }
+        if (SvcTicks() - start > BENCH_SERVICE_WAIT) {
+            fprintf(stderr, "Can't connect to %s\n", address);
+            goto done;
+        }
+        SvcSleep(50);
+    }
+    BenchCloseSocket(s);
+
+    BenchQuiet(1);
+    t0 = SvcMicros();
+    for (i = 0; i < conns; ++i) {
+        c[i].ai = ai;
+        c[i].msgs = msgs;
+        c[i].size = size;
+        c[i].us = us + (size_t)i * msgs;
+        c[i].thread = SvcThreadStart(EchoClient, &c[i]);
+    }
+    for (i = 0; i < conns; ++i)
+        if (c[i].thread)
+            SvcThreadWait(c[i].thread, SVC_INFINITE);
+    elapsed = SvcMicros() - t0;
+    BenchQuiet(0);
+
+    /* Gather the samples of all clients at the start of us. */
+    for (i = n = 0; i < conns; ++i) {
+        memmove(us + n, c[i].us, c[i].done * sizeof(double));
+        n += c[i].done;
+    }
+    if (n < conns * msgs)
+        fprintf(stderr, "Only %d of %d messages were echoed\n", n,
+                conns * msgs);
+    if (n > 0) {
+        BenchReport("echo_rtt", us, n, 1);
+        printf("bench=echo_throughput conns=%d msgs=%d size=%d seconds=%.3f "
+                "msgs_s=%.0f mb_s=%.3f\n", conns, n, size, elapsed / 1e6,
+                n * 1e6 / (elapsed ? elapsed : 1),
+                (double)n * size / (elapsed ? elapsed : 1));
+        status = n == conns * msgs ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+done:
+    if (svc)
+        BenchServiceStop(svc);
+    freeaddrinfo(ai);
+    free(c);
+    free(us);
+    return status;
+}
+
+/** One file of the Rot13 workload. */
+typedef struct Rot13File {
+    char *path;         /**< Its name in the watched folder. */
+    SvcU64 moved;       /**< When it was moved there. */
+    int done;           /**< Set once it has been transformed. */
+} Rot13File;
+
+/** Apply ROT13 to a buffer. */
+static void Rot13(char *p, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; ++i) {
+        if (p[i] >= 'a' && p[i] <= 'z')
+            p[i] = (char)('a' + (p[i] - 'a' + 13) % 26);
+        else if (p[i] >= 'A' && p[i] <= 'Z')
+            p[i] = (char)('A' + (p[i] - 'A' + 13) % 26);
+    }
+}
+
+/** Write a file in one go.
+ *
+ * \returns Non-zero on success.
+ */
+static int Rot13Write(const char *path, const char *p, size_t n)
+{
+    SvcFile f = SvcFileOpen(path, SVC_FILE_WRITE|SVC_FILE_CREATE|SVC_FILE_TRUNC);
+    int ok;
+
+    if (f == SVC_BADFILE)
+        return 0;
+    ok = SvcFileWrite(f, 0, p, n);
+    SvcFileClose(f);
+    return ok;
+}
+
+/** Decide if a file holds exactly the expected content.
+ *
+ * \param path The file.
+ * \param want The content expected.
+ * \param buf A buffer at least one byte longer than the content.
+ * \param n The length of the content.
+ */
+static int Rot13Check(const char *path, const char *want, char *buf, size_t n)
+{
+    SvcFile f = SvcFileOpen(path, SVC_FILE_READ);
+    long got;
+
+    if (f == SVC_BADFILE)
+        return 0;
+    got = SvcFileRead(f, 0, buf, n + 1);
+    SvcFileClose(f);
+    return got == (long)n && memcmp(buf, want, n) == 0;
+}
+
+/** Remove the files of a folder, but not its sub-folders. */
+static void Rot13Clear(const char *dir)
+{
+    SvcDirEntry e;
+    SvcDir *d = SvcDirOpen(dir);
+    char path[MAX_PATH];
+
+    if (!d)
+        return;
+    while (SvcDirNext(d, &e)) {
+        if (e.isdir || strlen(dir) + strlen(e.name) + 2 > sizeof(path))
+            continue;
+        sprintf(path, "%s%c%s", dir, SVC_DIRSEP, e.name);
+        SvcFileDelete(path);
+    }
+    SvcDirClose(d);
+}
+
+/** Show the command line usage of the Rot13 workload. */
+static void Rot13Usage(void)
+{
+    printf("Usage: LuaBench rot13 [-n files] [-s bytes] [-i ms]\n"
+            "  -n files  Files moved into the watched folder (100)\n"
+            "  -s bytes  Size of a file (4096)\n"
+            "  -i ms     Time between scans of the folder (1000)\n");
+}
+
+/** Run the Rot13 workload.
+ *
+ * \param argc The count of arguments, starting with "rot13".
+ * \param argv The list of arguments.
+ * \returns The ANSI C process exit status.
+ */
+int BenchRot13Main(int argc, char *argv[])
+{
+    static char interval[16];
+    static const char *svcargv[3];
+    int files = 100, size = 4096, ms = 1000;
+    char *watched = BenchPath("rot");
+    char *staging = BenchPath("rot.tmp");
+    char *index = BenchPath("rot13.idx");
+    char *text = NULL, *want = NULL, *buf = NULL, *tmp = NULL;
+    Rot13File *f = NULL;
+    SvcThread *svc = NULL;
+    double *us = NULL;
+    SvcU64 first, last = 0;
+    DWORD start;
+    int i, left, status = EXIT_FAILURE;
+
+    for (i = 1; i < argc; ++i) {
+        if (i + 1 < argc && strcmp(argv[i], "-n") == 0)
+            files = atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "-s") == 0)
+            size = atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "-i") == 0)
+            ms = atoi(argv[++i]);
+        else
+            files = 0;
+    }
+    if (files <= 0 || size <= 0 || ms <= 0) {
+        Rot13Usage();
+        goto done;
+    }
+    if (!watched || !staging || !index)
+        goto nomem;
+    if (!SvcDirCreate(watched) || !SvcDirCreate(staging)) {
+        fprintf(stderr, "Can't create %s (%lu)\n", watched,
+                (unsigned long)SvcLastError());
+        goto done;
+    }
+    Rot13Clear(watched);
+    Rot13Clear(staging);
+    SvcFileDelete(index);
+
+    f = (Rot13File *)calloc(files + 1, sizeof(Rot13File));
+    us = (double *)malloc(files * sizeof(double));
+    text = (char *)malloc(size);
+    want = (char *)malloc(size);
+    buf = (char *)malloc(size + 1);
+    tmp = (char *)malloc(strlen(staging) + 16);
+    if (!f || !us || !text || !want || !buf || !tmp)
+        goto nomem;
+    for (i = 0; i <= files; ++i) {
+        f[i].path = (char *)malloc(strlen(watched) + 16);
+        if (!f[i].path)
+            goto nomem;
+        sprintf(f[i].path, "%s%cf%05d.txt", watched, SVC_DIRSEP, i);
+    }
+    /* Letters and spaces only, so text mode does not change the size. */
+    for (i = 0; i < size; ++i)
+        text[i] = i % 8 == 7 ? ' ' : (char)((i % 3 ? 'a' : 'A') + (i * 7) % 26);
+    memcpy(want, text, size);
+    Rot13(want, size);
+    sprintf(tmp, "%s%cfile.txt", staging, SVC_DIRSEP);
+
+    sprintf(interval, "%d", ms);
+    svcargv[0] = "LuaBench";
+    svcargv[1] = watched;
+    svcargv[2] = interval;
+    svc = BenchServiceStart("../Samples/Rot13/rot13svc.lua", svcargv, 3);
+    if (!svc)
+        goto done;
+
+    BenchQuiet(1);
+    /* The first file shows that the service is scanning. */
+    start = SvcTicks();
+    if (!Rot13Write(tmp, text, size) || !SvcFileReplace(tmp, f[files].path)) {
+        BenchQuiet(0);
+        fprintf(stderr, "Can't write %s (%lu)\n", f[files].path,
+                (unsigned long)SvcLastError());
+        goto done;
+    }
+    while (!Rot13Check(f[files].path, want, buf, size)) {
+        if (BenchServiceDone || SvcTicks() - start
+                > (DWORD)(BENCH_SERVICE_WAIT + ms)) {
+            BenchQuiet(0);
+            if (BenchServiceDone)
+                BenchServiceFailed("Rot13");
+            else
+                fprintf(stderr, "%s was not transformed\n", f[files].path);
+            goto done;
+        }
+        SvcSleep(10);
+    }
+
+    first = SvcMicros();
+    for (i = 0; i < files; ++i) {
+        if (!Rot13Write(tmp, text, size)) {
+            BenchQuiet(0);
+            fprintf(stderr, "Can't write %s (%lu)\n", tmp,
+                    (unsigned long)SvcLastError());
+            goto done;
+        }
+        f[i].moved = SvcMicros();
+        if (!SvcFileReplace(tmp, f[i].path)) {
+            BenchQuiet(0);
+            fprintf(stderr, "Can't move to %s (%lu)\n", f[i].path,
+                    (unsigned long)SvcLastError());
+            goto done;
+        }
+    }
+    start = SvcTicks();
+    for (left = files; left > 0 && !BenchServiceDone
+            && SvcTicks() - start < BENCH_ROT13_WAIT; ) {
+        for (i = 0; i < files; ++i) {
+            if (f[i].done || !Rot13Check(f[i].path, want, buf, size))
+                continue;
+            last = SvcMicros();
+            us[files - left] = (double)(last - f[i].moved);
+            f[i].done = 1;
+            --left;
+        }
+        if (left)
+            SvcSleep(1);
+    }
+    BenchQuiet(0);
+
+    if (left)
+        fprintf(stderr, "Only %d of %d files were transformed\n",
+                files - left, files);
+    if (left < files) {
+        BenchReport("rot13_latency", us, files - left, 1);
+        printf("bench=rot13_throughput files=%d size=%d interval_ms=%d "
+                "seconds=%.3f files_s=%.1f\n", files - left, size, ms,
+                (last - first) / 1e6,
+                (files - left) * 1e6 / (last > first ? last - first : 1));
+    }
+    status = left ? EXIT_FAILURE : EXIT_SUCCESS;
+    goto done;
+
+nomem:
+    fprintf(stderr, "Out of memory\n");
+done:
+    if (svc)
+        BenchServiceStop(svc);
+    if (watched && staging && index) {
+        Rot13Clear(watched);
+        Rot13Clear(staging);
+        SvcFileDelete(index);
+    }
+    if (f)
+        for (i = 0; i <= files; ++i)
+            free(f[i].path);
+    free(f);
+    free(us);
+    free(text);
+    free(want);
+    free(buf);
+    free(tmp);
+    free(watched);
+    free(staging);
+    free(index);
+    return status;
+}
@@ -0,0 +1,15 @@
+-- Allocation workload for the allocator benchmarks, run in a plain Lua
+-- state with the number of items to build as its argument.
+local n = ...
+local t = {}
+for i = 1, n do
+  t[i] = { i, tostring(i), name = "item" .. i }
+end
+for i = 1, n, 2 do
+  t[i] = nil
+end
+for i = 1, n, 2 do
+  t[i] = string.rep("x", i % 64)
+end
+collectgarbage()
+return #t
@@ -0,0 +1,85 @@
+-- Compare two outputs of LuaBench, see LuaBench.c.
+--
+--   lua compare.lua base.txt new.txt [percent]
+--
+-- Prints the change in the median and the mean of every benchmark found
+-- in both, and marks those whose median got slower by more than percent
+-- (10 by default). The throughput lines of the workloads, which report
+-- a rate such as files_s instead, are marked if the rate fell by more
+-- than percent. Exits with status 1 if any benchmark got slower, so that
+-- it can gate a release.
+
+local base, new, limit = arg[1], arg[2], tonumber(arg[3] or 10)
+if not base or not new or not limit then
+  io.stderr:write("usage: lua compare.lua base.txt new.txt [percent]\n")
+  os.exit(2)
+end
+
+-- Read the benchmarks of one output, in order, keyed by name.
+local function read(name)
+  local fp = assert(io.open(name, "r"))
+  local list = {}
+  for line in fp:lines() do
+    if not line:match("^#") then
+      local r = {}
+      for k, v in line:gmatch("(%w+)=(%S+)") do
+        r[k] = tonumber(v) or v
+      end
+      if r.bench then
+        list[#list + 1] = r
+        list[r.bench] = r
+      end
+    end
+  end
+  fp:close()
+  return list
+end
+
+local function change(a, b)
+  if not a or not b or a == 0 then return 0 end
+  return (b - a) * 100 / a
+end
+
+-- The rate a throughput line reports, such as msgs_s, if it has one.
+local function rate(r)
+  for k, v in pairs(r) do
+    if k ~= "ops_s" and k:match("_s$") and type(v) == "number" then
+      return k, v
+    end
+  end
+end
+
+local old, cur = read(base), read(new)
+local slower = 0
+print(string.format("%-24s %12s %12s %8s %8s", "bench", "base", "new",
+    "change %", "mean %"))
+for _, r in ipairs(cur) do
+  local o = old[r.bench]
+  local key = rate(r)
+  if o and r.p50_us and o.p50_us then
+    -- A time per operation: the median is compared, and more is worse.
+    local p50 = change(o.p50_us, r.p50_us)
+    local mark = ""
+    if p50 > limit then
+      mark = "  SLOWER"
+      slower = slower + 1
+    end
+    print(string.format("%-24s %12.3f %12.3f %+8.1f %+8.1f%s", r.bench,
+        o.p50_us, r.p50_us, p50, change(o.mean_us, r.mean_us), mark))
+  elseif o and key and o[key] then
+    -- A rate: less is worse.
+    local c = change(o[key], r[key])
+    local mark = ""
+    if -c > limit then
+      mark = "  SLOWER"
+      slower = slower + 1
+    end
+    print(string.format("%-24s %12.1f %12.1f %+8.1f %8s%s", r.bench,
+        o[key], r[key], c, "", mark))
+  end
+end
+if slower > 0 then
+  print(string.format("%d benchmark(s) slower by more than %g%%", slower,
+      limit))
+  os.exit(1)
+end
@@ -0,0 +1,6 @@
+-- init.lua for LuaBench, see LuaBench.c
+return {
+  tracelevel = 0,       -- Framework trace level, the benchmarks set their own
+  name = "LuaBench",    -- Service name, used only in trace output
+  script = "first.lua", -- Script timed by the startup benchmarks
+}
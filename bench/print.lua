@@ -0,0 +1,5 @@
+-- Calls service.print() service.bench_n times.
+local print = service.print
+for i = 1, service.bench_n do
+  print("LuaBench", i)
+end
@@ -0,0 +1,2 @@
+-- Results for the LuaResult* accessor benchmarks.
+return "LuaBench", 42, { name = "LuaBench", count = 7 }
@@ -0,0 +1,3 @@
+-- Calls service.sleep(service.bench_ms) once, for the sleep accuracy
+-- benchmark, which includes the idle work done by service.sleep().
+service.sleep(service.bench_ms)
@@ -0,0 +1,245 @@
+/*! \file LuaCancel.c
+ *  \brief Cancellation of the service script on stop, and its finalizers.
+ *
+ * A stop request only sets the flag returned by service.stopping(), so
+ * a script busy in a long computation does not see it until it next
+ * polls, and may run on until the process is ended under it. The
+ * framework therefore cancels a script that is still running
+ * <code>stop_grace</code> ms after the stop request.
+ *
+ * While the script runs, a watcher thread waits for the stop request
+ * and the grace period. It then asks for the shared count hook of
+ * LuaHook.c, which fires at the very next VM instruction and raises
+ * the error service.cancelled there, on the worker thread. The hook
+ * stays installed and raises the error again every so many
+ * instructions, so a script that catches it with pcall() is cancelled
+ * again at the next safe point. The error ends the script with a traceback, and
+ * supervision does not restart a script of a stopping service.
+ *
+ * After the script has finished, for whatever reason, the functions
+ * registered with service.on_stop(fn) are called if the service is
+ * stopping, the most recently registered first. Each is called in
+ * protected mode and its errors are traced. They may use the time
+ * left of <code>stop_timeout</code>, and are cancelled in the same way
+ * when it runs out, just before the service is reported stopped.
+ *
+ * As with the profiler, the hook fires only in the coroutine it was
+ * set on and coroutines created after, so code inside a coroutine is
+ * cancelled when it yields back. Code blocked in a C function is
+ * cancelled when it returns to Lua. The hook replaces any hook set
+ * with debug.sethook().
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "luaservice.h"
+
+#if LUA_VERSION_NUM >= 502
+#  define cancelRawLen lua_rawlen
+#else
+#  define cancelRawLen lua_objlen
+#endif
+
+/** The error raised in a cancelled script, also found in
+ * service.cancelled. */
+#define CANCELLED "service cancelled"
+
+/** Time in ms between checks while the service is not stopping. */
+#define CANCEL_IDLE 500
+
+/** Private registry key of the list of service.on_stop() functions. */
+static const char *ON_STOP = "On Stop Functions";
+
+/** Guards CancelQuit for the watcher's timed wait. */
+static SvcMutex CancelLock = SVC_MUTEX_INIT;
+
+/** Wakes the watcher to quit. */
+static SvcCond CancelWake;
+
+/** The watcher thread, while a script runs. */
+static SvcThread *CancelThread;
+
+/** Set to ask the watcher to quit. */
+static volatile int CancelQuit;
+
+/** Set once the running script has been cancelled. */
+static volatile int CancelArmed;
+
+/** Set while the service.on_stop() functions run. */
+static volatile int CancelDeadline;
+
+/** Handle LUAHOOK_CANCEL in the count hook, see LuaHook.c.
+ *
+ * Raises service.cancelled in a cancelled script, and in the
+ * service.on_stop() functions once <code>stop_timeout</code> has run
+ * out, which is checked again and again until then.
+ *
+ * \context
+ * Service worker thread
+ *
+ * \param L The Lua state the hook fired in.
+ * \returns LUAHOOK_RAISE with the error pushed, LUAHOOK_AGAIN, or
+ * LUAHOOK_DONE.
+ */
+int LuaCancelHook(lua_State *L)
+{
+    if (!CancelArmed) {
+        if (!CancelDeadline)
+            return LUAHOOK_DONE;
+        if (!ServiceStopping || LuaServiceStopLeft() > 0)
+            return LUAHOOK_AGAIN;
+    }
+    lua_pushliteral(L, CANCELLED);
+    return LUAHOOK_RAISE;
+}
+
+/** Body of the watcher thread.
+ *
+ * Cancels the script once the service has been stopping for
+ * <code>stop_grace</code> ms, and asks for the hook again every 
+ * CANCEL_IDLE ms after, in case something such as debug.sethook() 
+ * has replaced it.
+ */
+static unsigned CancelWatcher(void *arg)
+{
+    lua_State *L = (lua_State *)arg;
+    DWORD spent, wait;
+
+    SvcMutexLock(&CancelLock);
+    while (!CancelQuit) {
+        wait = CANCEL_IDLE;
+        if (ServiceStopping) {
+            spent = SvcTicks() - ServiceStopTicks;
+            if (spent < (DWORD)ServiceStopGrace)
+                wait = (DWORD)ServiceStopGrace - spent;
+            else {
+                if (!CancelArmed)
+                    SvcDebugTrace("Cancelling service script %d ms after "
+                            "stop\n", spent);
+                CancelArmed = 1;
+                LuaHookRequest(L, LUAHOOK_CANCEL);
+            }
+            if (wait > CANCEL_IDLE)
+                wait = CANCEL_IDLE;
+        }
+        SvcCondWait(&CancelWake, &CancelLock, wait);
+    }
+    SvcMutexUnlock(&CancelLock);
+    return 0;
+}
+
+/** Watch a service script about to run, to cancel it on stop.
+ *
+ * \context
+ * Service worker thread
+ *
+ * \param h The loaded service script.
+ */
+void LuaCancelAttach(LUAHANDLE h)
+{
+    if (!h || CancelThread)
+        return;
+    CancelQuit = 0;
+    CancelArmed = 0;
+    SvcCondInit(&CancelWake);
+    CancelThread = SvcThreadStart(CancelWatcher, h);
+    if (!CancelThread) {
+        SvcDebugTrace("Can't start cancellation watcher (%d)\n",
+                SvcLastError());
+        SvcCondDestroy(&CancelWake);
+    }
+}
+
+/** Stop watching a service script that has finished, and call the
+ * service.on_stop() functions if the service is stopping.
+ *
+ * \context
+ * Service worker thread
+ *
+ * \param h The service script that finished.
+ */
+void LuaCancelFinal(LUAHANDLE h)
+{
+    lua_State *L = (lua_State *)h;
+    SvcU64 start;
+    int i, n;
+
+    if (!L)
+        return;
+    if (CancelThread) {
+        SvcMutexLock(&CancelLock);
+        CancelQuit = 1;
+        SvcCondSignal(&CancelWake);
+        SvcMutexUnlock(&CancelLock);
+        SvcThreadWait(CancelThread, SVC_INFINITE);
+        CancelThread = NULL;
+        SvcCondDestroy(&CancelWake);
+    }
+    CancelArmed = 0;
+    if (!ServiceStopping)
+        return;
+
+    lua_pushlightuserdata(L, (void *)ON_STOP);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        return;
+    }
+    n = (int)cancelRawLen(L, -1);
+    SvcDebugTrace("Calling %d on_stop functions\n", n);
+    start = SvcMicros();
+    CancelDeadline = 1;
+    LuaHookRequest(L, LUAHOOK_CANCEL);
+    for (i = n; i > 0; --i) {
+        lua_rawgeti(L, -1, i);
+        if (lua_pcall(L, 0, 0, 0)) {
+            SvcDebugTraceStr("on_stop function failed: %s\n",
+                    lua_isstring(L, -1) ? lua_tostring(L, -1) : "?");
+            lua_pop(L, 1);
+        }
+    }
+    CancelDeadline = 0;
+    lua_pop(L, 1);
+    SvcSpan("on_stop", start);
+}
+
+/** Implement the Lua function service.on_stop(fn).
+ *
+ * Register \a fn to be called without arguments when the service
+ * script has finished because the service is stopping, including when
+ * it was cancelled. Functions are called in the reverse order of
+ * their registration.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+int LuaCancelOnStop(lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    lua_pushlightuserdata(L, (void *)ON_STOP);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushlightuserdata(L, (void *)ON_STOP);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, LUA_REGISTRYINDEX);
+    }
+    lua_pushvalue(L, 1);
+    lua_rawseti(L, -2, (int)cancelRawLen(L, -2) + 1);
+    return 0;
+}
+
+/** Add service.cancelled to the service table at the top of the stack.
+ *
+ * \param L Lua state context to get the field.
+ */
+void LuaCancelRegister(lua_State *L)
+{
+    lua_pushliteral(L, CANCELLED);
+    lua_setfield(L, -2, "cancelled");
+}
@@ -0,0 +1,599 @@
+/*! \file LuaCheckpoint.c
+ *  \brief Checkpoint of service state and warm restart.
+ *
+ * A service may register one table as its checkpoint with
+ * service.checkpoint(t). The framework then saves that table to the
+ * file named by the <code>checkpoint</code> field of init.lua every
+ * <code>checkpoint_interval</code> ms and once more when the service
+ * script finishes. When the service starts again the saved table is
+ * handed back as service.restored before the service script runs.
+ *
+ * Saving happens in two steps. The table is serialized in the worker
+ * thread, which is the only thread allowed to touch the Lua state, at
+ * one of the points where the script is idle anyway (service.sleep()
+ * or service.stopping()). The bytes are then written by a short-lived
+ * background thread, so the disk never holds up the script.
+ *
+ * The serialized form is compact and binary. It preserves nil,
+ * booleans, numbers, strings and tables, including tables shared
+ * between several places and cycles. Functions, userdata and threads
+ * cannot be saved and are silently left out.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "luaservice.h"
+
+/** Signature of a checkpoint file. */
+#define CKPT_MAGIC 0x5043534C /* "LSCP" */
+
+/** Version of the serialized layout. */
+#define CKPT_VERSION 1
+
+/** Deepest nesting of tables that will be saved. */
+#define CKPT_MAXDEPTH 200
+
+/** Type tags of serialized values. */
+enum {
+    CK_NIL, CK_FALSE, CK_TRUE, CK_NUMBER, CK_INTEGER,
+    CK_STRING, CK_TABLE, CK_REF, CK_END
+};
+
+/** Private registry key of the registered checkpoint table. */
+static const char *CHECKPOINT_TABLE = "Checkpoint Table";
+
+/** A growable output buffer. */
+typedef struct CkBuf {
+    char *p;
+    size_t len, cap;
+    int nomem;        /**< Set if an allocation failed. */
+    unsigned int ids; /**< Tables numbered so far. */
+} CkBuf;
+
+/** A bounded input buffer. */
+typedef struct CkIn {
+    const unsigned char *p, *end;
+    unsigned int ids; /**< Tables created so far. */
+} CkIn;
+
+/** Data handed to the writer thread. */
+typedef struct CkWrite {
+    char *data;
+    size_t len;
+} CkWrite;
+
+/** Background writer of the last snapshot, or NULL. */
+static SvcThread *CheckpointWriter;
+
+/** Tick count of the last snapshot. */
+static DWORD CheckpointLast;
+
+/** Full path of CheckpointFile, once resolved. */
+static char *CheckpointPath;
+
+static void CkPut(CkBuf *b, const void *p, size_t n)
+{
+    if (b->nomem)
+        return;
+    if (b->len + n > b->cap) {
+        size_t cap = b->cap ? b->cap : 4096;
+        char *q;
+        while (cap < b->len + n)
+            cap *= 2;
+        q = (char *)realloc(b->p, cap);
+        if (!q) {
+            b->nomem = 1;
+            return;
+        }
+        b->p = q;
+        b->cap = cap;
+    }
+    memcpy(b->p + b->len, p, n);
+    b->len += n;
+}
+
+static void CkByte(CkBuf *b, int c)
+{
+    unsigned char u = (unsigned char)c;
+    CkPut(b, &u, 1);
+}
+
+/** Write an unsigned integer in 7 bit groups, low group first. */
+static void CkVarint(CkBuf *b, SvcU64 v)
+{
+    unsigned char tmp[10];
+    int n = 0;
+    do {
+        tmp[n] = (unsigned char)(v & 0x7F);
+        v >>= 7;
+        if (v)
+            tmp[n] |= 0x80;
+        ++n;
+    } while (v);
+    CkPut(b, tmp, n);
+}
+
+/** Test whether a value is of a type that can be saved. */
+static int CkSavable(lua_State *L, int idx)
+{
+    switch (lua_type(L, idx)) {
+    case LUA_TNIL: case LUA_TBOOLEAN: case LUA_TNUMBER:
+    case LUA_TSTRING: case LUA_TTABLE:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/** Serialize the value at \a idx.
+ *
+ * \param seen Absolute stack index of a table mapping each table
+ *             already written to its number.
+ */
+static void CkValue(lua_State *L, CkBuf *b, int idx, int seen, int depth)
+{
+    size_t len;
+    const char *s;
+
+    switch (lua_type(L, idx)) {
+    case LUA_TBOOLEAN:
+        CkByte(b, lua_toboolean(L, idx) ? CK_TRUE : CK_FALSE);
+        break;
+    case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+        if (lua_isinteger(L, idx)) {
+            lua_Integer i = lua_tointeger(L, idx);
+            CkByte(b, CK_INTEGER);
+            CkPut(b, &i, sizeof(i));
+            break;
+        }
+#endif
+        {
+            lua_Number n = lua_tonumber(L, idx);
+            CkByte(b, CK_NUMBER);
+            CkPut(b, &n, sizeof(n));
+        }
+        break;
+    case LUA_TSTRING:
+        s = lua_tolstring(L, idx, &len);
+        CkByte(b, CK_STRING);
+        CkVarint(b, len);
+        CkPut(b, s, len);
+        break;
+    case LUA_TTABLE:
+        lua_pushvalue(L, idx);
+        lua_rawget(L, seen);
+        if (!lua_isnil(L, -1)) {
+            CkByte(b, CK_REF);
+            CkVarint(b, (SvcU64)lua_tonumber(L, -1));
+            lua_pop(L, 1);
+            break;
+        }
+        lua_pop(L, 1);
+        if (depth >= CKPT_MAXDEPTH)
+            luaL_error(L, "checkpoint tables nested too deeply");
+        luaL_checkstack(L, 4, "checkpoint tables nested too deeply");
+        lua_pushvalue(L, idx);
+        lua_pushnumber(L, ++b->ids);
+        lua_rawset(L, seen);
+        CkByte(b, CK_TABLE);
+        lua_pushnil(L);
+        while (lua_next(L, idx)) {
+            int top = lua_gettop(L);
+            if (CkSavable(L, top - 1) && CkSavable(L, top)) {
+                CkValue(L, b, top - 1, seen, depth + 1);
+                CkValue(L, b, top, seen, depth + 1);
+            }
+            lua_pop(L, 1);
+        }
+        CkByte(b, CK_END);
+        break;
+    default:
+        CkByte(b, CK_NIL);
+        break;
+    }
+}
+
+/** Protected part of LuaStateSerialize(). */
+static int CkSerializeP(lua_State *L)
+{
+    CkBuf *b = (CkBuf *)lua_touserdata(L, 2);
+    lua_settop(L, 1);
+    lua_newtable(L);
+    CkValue(L, b, 1, 2, 0);
+    return 0;
+}
+
+/** Serialize a Lua value to a compact binary form.
+ *
+ * \param L The Lua state.
+ * \param idx Stack index of the value.
+ * \param plen Receives the length of the result.
+ * \returns A buffer from malloc() that the caller must free, or
+ * NULL (with an error message traced) on failure.
+ */
+char *LuaStateSerialize(lua_State *L, int idx, size_t *plen)
+{
+    CkBuf b;
+    unsigned int hdr[2];
+    int status;
+
+    memset(&b, 0, sizeof(b));
+    hdr[0] = CKPT_MAGIC;
+    hdr[1] = CKPT_VERSION;
+    CkPut(&b, hdr, sizeof(hdr));
+    if (idx < 0)
+        idx = lua_gettop(L) + idx + 1;
+    lua_pushcfunction(L, CkSerializeP);
+    lua_pushvalue(L, idx);
+    lua_pushlightuserdata(L, &b);
+    status = lua_pcall(L, 2, 0, 0);
+    if (status || b.nomem) {
+        SvcDebugTraceStr("Serialize failed: %s\n",
+                status ? lua_tostring(L, -1) : "not enough memory");
+        if (status)
+            lua_pop(L, 1);
+        free(b.p);
+        return NULL;
+    }
+    *plen = b.len;
+    return b.p;
+}
+
+static int CkGetByte(lua_State *L, CkIn *in)
+{
+    if (in->p >= in->end)
+        luaL_error(L, "checkpoint data truncated");
+    return *in->p++;
+}
+
+static SvcU64 CkGetVarint(lua_State *L, CkIn *in)
+{
+    SvcU64 v = 0;
+    int shift = 0, c;
+    do {
+        c = CkGetByte(L, in);
+        if (shift > 63)
+            luaL_error(L, "checkpoint data damaged");
+        v |= (SvcU64)(c & 0x7F) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return v;
+}
+
+static void CkGet(lua_State *L, CkIn *in, void *p, size_t n)
+{
+    if ((size_t)(in->end - in->p) < n)
+        luaL_error(L, "checkpoint data truncated");
+    memcpy(p, in->p, n);
+    in->p += n;
+}
+
+/** Read one value and push it.
+ *
+ * \param tag The tag of the value, already read.
+ * \param refs Absolute stack index of a table of tables by number.
+ */
+static void CkRead(lua_State *L, CkIn *in, int tag, int refs, int depth)
+{
+    switch (tag) {
+    case CK_NIL:
+        lua_pushnil(L);
+        break;
+    case CK_FALSE:
+    case CK_TRUE:
+        lua_pushboolean(L, tag == CK_TRUE);
+        break;
+    case CK_NUMBER: {
+        lua_Number n;
+        CkGet(L, in, &n, sizeof(n));
+        lua_pushnumber(L, n);
+        break;
+    }
+    case CK_INTEGER: {
+        lua_Integer i;
+        CkGet(L, in, &i, sizeof(i));
+        lua_pushinteger(L, i);
+        break;
+    }
+    case CK_STRING: {
+        SvcU64 len = CkGetVarint(L, in);
+        if ((SvcU64)(in->end - in->p) < len)
+            luaL_error(L, "checkpoint data truncated");
+        lua_pushlstring(L, (const char *)in->p, (size_t)len);
+        in->p += len;
+        break;
+    }
+    case CK_REF:
+        lua_rawgeti(L, refs, (int)CkGetVarint(L, in));
+        if (lua_isnil(L, -1))
+            luaL_error(L, "checkpoint data damaged");
+        break;
+    case CK_TABLE: {
+        int t;
+        if (depth >= CKPT_MAXDEPTH)
+            luaL_error(L, "checkpoint data damaged");
+        luaL_checkstack(L, 4, "checkpoint tables nested too deeply");
+        lua_newtable(L);
+        t = lua_gettop(L);
+        lua_pushvalue(L, t);
+        lua_rawseti(L, refs, ++in->ids);
+        while ((tag = CkGetByte(L, in)) != CK_END) {
+            CkRead(L, in, tag, refs, depth + 1);
+            CkRead(L, in, CkGetByte(L, in), refs, depth + 1);
+            if (lua_isnil(L, -2))
+                lua_pop(L, 2);
+            else
+                lua_rawset(L, t);
+        }
+        break;
+    }
+    default:
+        luaL_error(L, "checkpoint data damaged");
+    }
+}
+
+/** Protected part of LuaStateDeserialize(). */
+static int CkDeserializeP(lua_State *L)
+{
+    CkIn *in = (CkIn *)lua_touserdata(L, 1);
+    unsigned int hdr[2];
+
+    lua_settop(L, 0);
+    lua_newtable(L);
+    CkGet(L, in, hdr, sizeof(hdr));
+    if (hdr[0] != CKPT_MAGIC || hdr[1] != CKPT_VERSION)
+        return luaL_error(L, "not checkpoint data");
+    CkRead(L, in, CkGetByte(L, in), 1, 0);
+    return 1;
+}
+
+/** Rebuild a value from the form made by LuaStateSerialize().
+ *
+ * \param L The Lua state.
+ * \param p The serialized bytes.
+ * \param len Their length.
+ * \returns Non-zero with the value pushed on success; zero with
+ * nothing pushed (and an error message traced) on failure.
+ */
+int LuaStateDeserialize(lua_State *L, const char *p, size_t len)
+{
+    CkIn in;
+    int status;
+
+    in.p = (const unsigned char *)p;
+    in.end = in.p + len;
+    in.ids = 0;
+    lua_pushcfunction(L, CkDeserializeP);
+    lua_pushlightuserdata(L, &in);
+    status = lua_pcall(L, 1, 1, 0);
+    if (status) {
+        SvcDebugTraceStr("Deserialize failed: %s\n", lua_tostring(L, -1));
+        lua_pop(L, 1);
+        return 0;
+    }
+    return 1;
+}
+
+/** Write bytes to the checkpoint file, replacing it atomically.
+ *
+ * \returns Zero on success, or a system error code.
+ */
+static DWORD CkWriteFile(const char *data, size_t len)
+{
+    const char *path = CheckpointPath ? CheckpointPath : CheckpointFile;
+    size_t plen = strlen(path);
+    char *tmp = (char *)malloc(plen + 5);
+    SvcFile f;
+    DWORD err = 0;
+
+    if (!tmp)
+        return SVC_ENOMEM;
+    strcpy(tmp, path);
+    strcat(tmp, ".new");
+    f = SvcFileOpen(tmp, SVC_FILE_WRITE|SVC_FILE_CREATE|SVC_FILE_TRUNC);
+    if (f == SVC_BADFILE)
+        err = SvcLastError();
+    else {
+        if (!SvcFileWrite(f, 0, data, len) || !SvcFileSync(f))
+            err = SvcLastError();
+        SvcFileClose(f);
+        if (!err && !SvcFileReplace(tmp, path))
+            err = SvcLastError();
+        if (err)
+            SvcFileDelete(tmp);
+    }
+    free(tmp);
+    return err;
+}
+
+/** Body of the background writer thread. */
+static unsigned CkWriterThread(void *arg)
+{
+    CkWrite *w = (CkWrite *)arg;
+    DWORD err = CkWriteFile(w->data, w->len);
+    if (err)
+        SvcDebugTrace("Checkpoint write failed (%d)\n", err);
+    else
+        SvcDebugTrace("Checkpoint written, %d bytes\n", (DWORD)w->len);
+    free(w->data);
+    free(w);
+    return 0;
+}
+
+/** Serialize the registered table, if there is one.
+ *
+ * \returns A buffer from malloc(), or NULL.
+ */
+static char *CkSnapshot(lua_State *L, size_t *plen)
+{
+    char *data;
+    lua_pushlightuserdata(L, (void *)CHECKPOINT_TABLE);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        return NULL;
+    }
+    data = LuaStateSerialize(L, -1, plen);
+    lua_pop(L, 1);
+    return data;
+}
+
+/** Test whether the previous background write has finished. */
+static int CkWriterIdle(void)
+{
+    if (!CheckpointWriter)
+        return 1;
+    if (!SvcThreadWait(CheckpointWriter, 0))
+        return 0;
+    CheckpointWriter = NULL;
+    return 1;
+}
+
+/** Take a snapshot and hand it to a background writer.
+ *
+ * If the previous snapshot is still being written, this one is
+ * skipped; the next one will carry the newer state anyway.
+ */
+static void CkSave(lua_State *L)
+{
+    CkWrite *w;
+
+    CheckpointLast = SvcTicks();
+    if (!CheckpointFile || !CkWriterIdle())
+        return;
+    w = (CkWrite *)malloc(sizeof(CkWrite));
+    if (!w)
+        return;
+    w->data = CkSnapshot(L, &w->len);
+    if (!w->data) {
+        free(w);
+        return;
+    }
+    CheckpointWriter = SvcThreadStart(CkWriterThread, w);
+    if (!CheckpointWriter) {
+        free(w->data);
+        free(w);
+    }
+}
+
+/** Give the checkpoint a chance to run at an idle point of the script.
+ *
+ * Called from service.sleep() and service.stopping(), which the worker
+ * calls regularly. Takes a snapshot if the interval has elapsed.
+ *
+ * \param L The worker's Lua state.
+ */
+void LuaCheckpointPoll(lua_State *L)
+{
+    if (CheckpointFile && CheckpointInterval > 0
+            && SvcTicks() - CheckpointLast >= (DWORD)CheckpointInterval)
+        CkSave(L);
+}
+
+/** Implement the Lua function service.checkpoint([t]).
+ *
+ * With a table argument, registers that table as the state to save.
+ * Registering replaces any previous table. Without arguments, takes
+ * a snapshot of the registered table now.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+int LuaCheckpointSet(lua_State *L)
+{
+    if (lua_isnoneornil(L, 1)) {
+        CkSave(L);
+        lua_pushboolean(L, CheckpointFile != NULL);
+        return 1;
+    }
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_pushlightuserdata(L, (void *)CHECKPOINT_TABLE);
+    lua_pushvalue(L, 1);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+    if (!CheckpointLast)
+        CheckpointLast = SvcTicks();
+    lua_pushboolean(L, CheckpointFile != NULL);
+    return 1;
+}
+
+/** Load the saved checkpoint into service.restored.
+ *
+ * Called once the service script is loaded but before it runs. A
+ * missing or unreadable file leaves service.restored nil, so the
+ * script simply starts cold.
+ *
+ * \param h The worker's Lua state.
+ */
+void LuaCheckpointRestore(LUAHANDLE h)
+{
+    lua_State *L = (lua_State *)h;
+    SvcFile f;
+    SvcU64 size;
+    char *data;
+    long got;
+
+    if (!L || !CheckpointFile)
+        return;
+    /* Pin the name down now, while the current directory is still the
+     * service folder; the script is free to change it later. */
+    if (!CheckpointPath)
+        CheckpointPath = SvcFullPath(CheckpointFile);
+    f = SvcFileOpen(CheckpointPath ? CheckpointPath : CheckpointFile,
+            SVC_FILE_READ);
+    if (f == SVC_BADFILE) {
+        SvcDebugTraceStr("No checkpoint %s, starting cold\n", CheckpointFile);
+        return;
+    }
+    if (!SvcFileSize(f, &size) || size > 0x7FFFFFFF
+            || !(data = (char *)malloc((size_t)size + 1))) {
+        SvcFileClose(f);
+        return;
+    }
+    got = SvcFileRead(f, 0, data, (size_t)size);
+    if (got >= 0 && (SvcU64)got == size) {
+        lua_getglobal(L, "service");
+        if (lua_istable(L, -1) && LuaStateDeserialize(L, data, (size_t)got)) {
+            lua_setfield(L, -2, "restored");
+            SvcDebugTrace("Restored checkpoint, %d bytes\n", (DWORD)got);
+        }
+        lua_pop(L, 1);
+    }
+    SvcFileClose(f);
+    free(data);
+}
+
+/** Take the final snapshot after the service script finished.
+ *
+ * Unlike the periodic snapshots this one is written before returning,
+ * after any background write still in progress.
+ *
+ * \param h The worker's Lua state.
+ */
+void LuaCheckpointFinal(LUAHANDLE h)
+{
+    lua_State *L = (lua_State *)h;
+    char *data;
+    size_t len;
+    DWORD err;
+
+    if (!L || !CheckpointFile)
+        return;
+    if (CheckpointWriter) {
+        SvcThreadWait(CheckpointWriter, SVC_INFINITE);
+        CheckpointWriter = NULL;
+    }
+    data = CkSnapshot(L, &len);
+    if (!data)
+        return;
+    err = CkWriteFile(data, len);
+    if (err)
+        SvcDebugTrace("Final checkpoint write failed (%d)\n", err);
+    else
+        SvcDebugTrace("Final checkpoint written, %d bytes\n", (DWORD)len);
+    free(data);
+}
@@ -0,0 +1,634 @@
+/*! \file LuaCommands.c
+ *  \brief Local control endpoint for commands to the running service.
+ *
+ * Besides the few controls the service manager passes on, there is no
+ * way into a running service. With the init.lua field
+ * <code>control_socket</code> set, the service also listens on a local
+ * endpoint, a Unix socket at that path on POSIX systems and a named
+ * pipe of that name on Windows, and answers commands sent to it with
+ * <tt>LuaService ctl</tt> \a command [\a arg ...]:
+ *
+ * - <code>help</code> lists the commands.
+ * - <code>stats</code> describes the service as <tt>LuaService stat</tt>
+ *   does, see LuaStatus.c.
+ * - <code>tracelevel</code> [\a level] shows or sets the trace level.
+ * - <code>profile</code> starts or stops the profiler, as
+ *   <tt>LuaService profile</tt> does.
+ * - <code>traceback</code> shows where the script is running Lua code.
+ * - <code>gc</code> runs a full garbage collection in the script's Lua
+ *   state.
+ *
+ * Any other command is looked up among the handlers the script has
+ * registered with service.command(name, fn), and \a fn is called with
+ * the arguments as strings. What it returns is sent back, separated
+ * by tabs as print() would; an error it raises is sent back as
+ * <code>error:</code> and the message.
+ *
+ * \code
+ * service.command("queue", function(what)
+ *   if what == "flush" then flush() end
+ *   return #queue
+ * end)
+ * \endcode
+ *
+ * The endpoint is served by a thread of its own, one connection at a
+ * time: the client writes a line with the command and reads the answer
+ * until the connection is closed. A client that has not sent its line
+ * within CMD_READ_WAIT ms is dropped, and so is one that does not
+ * read its answer within CMD_WRITE_WAIT ms, so that it cannot hold up
+ * the clients after it. The first five commands are answered
+ * on that thread. The Lua state is only safe to touch from the worker,
+ * so <code>gc</code> and the script's commands are handed to it and
+ * run at its next idle point, such as a call to service.sleep(); an
+ * answer that has not come after CMD_WAIT ms is given up. A traceback
+ * is taken by the shared count hook of LuaHook.c, as the watchdog's
+ * is, at the next Lua instruction the script runs.
+ *
+ * The Unix socket is only accessible to the owner of the service
+ * process. A named pipe has the default security of pipes, which only
+ * lets the administrators, the system and the owner write to it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "luaservice.h"
+
+/** Longest command line, including its newline. */
+#define CMD_MAXLINE 1024
+
+/** Most words in a command line. */
+#define CMD_MAXARGS 32
+
+/** Longest time in ms the endpoint waits for a client's command line. */
+#define CMD_READ_WAIT 1000
+
+/** Longest time in ms the endpoint waits for a client to take more of
+ * the reply. */
+#define CMD_WRITE_WAIT 1000
+
+/** Longest time in ms the endpoint waits for the worker's answer. */
+#define CMD_WAIT 10000
+
+/** Longest time in ms the endpoint waits for a traceback. */
+#define CMD_TRACE_WAIT 1000
+
+/** Size of the text of a traceback. */
+#define CMD_STACK 8192
+
+/** Private registry key of the table of service.command() handlers. */
+static const char *COMMANDS = "Service Commands";
+
+/** Guards everything below but the thread and its listener. */
+static SvcMutex CmdLock = SVC_MUTEX_INIT;
+
+/** Signaled when the worker has answered, or a traceback is taken. */
+static SvcCond CmdDone;
+
+/** The endpoint's thread, while it serves. */
+static SvcThread *CmdThread;
+
+/** The endpoint. */
+static SvcListener *CmdListener;
+
+/** Set to ask the endpoint's thread to quit. */
+static volatile int CmdQuit;
+
+/** The worker's Lua state, while a script runs. */
+static lua_State *CmdState;
+
+/** The command handed to the worker. */
+static char CmdLine[CMD_MAXLINE];
+
+/** Count of commands handed to the worker, numbering them. */
+static long CmdSeq;
+
+/** Set while CmdLine waits for the worker to take it. */
+static volatile int CmdWanted;
+
+/** The number of the command CmdReply answers. */
+static long CmdAnswered;
+
+/** The worker's answer, from malloc(). */
+static char *CmdReply;
+
+/** Set while the worker runs a command, so none runs inside another. */
+static int CmdRunning;
+
+/** Set while a traceback is wanted from the hook. */
+static volatile int CmdStackWanted;
+
+/** The traceback the hook took, from malloc(). */
+static char *CmdStack;
+
+/** Copy a string with malloc().
+ *
+ * \returns The copy, or NULL.
+ */
+static char *CmdDup(const char *s)
+{
+    char *p = (char *)malloc(strlen(s) + 1);
+    if (p)
+        strcpy(p, s);
+    return p;
+}
+
+/** Split a command line into words, in place.
+ *
+ * \param line The command line.
+ * \param argv Receives the words, CMD_MAXARGS of them at most.
+ * \returns The number of words.
+ */
+static int CmdSplit(char *line, char **argv)
+{
+    int argc = 0;
+
+    for (;;) {
+        while (*line == ' ' || *line == '\t')
+            *line++ = '\0';
+        if (!*line || argc == CMD_MAXARGS)
+            return argc;
+        argv[argc++] = line;
+        while (*line && *line != ' ' && *line != '\t')
+            ++line;
+    }
+}
+
+/** Get the bytes in use by a Lua state. */
+static double CmdHeap(lua_State *L)
+{
+    return (double)lua_gc(L, LUA_GCCOUNT, 0) * 1024
+            + lua_gc(L, LUA_GCCOUNTB, 0);
+}
+
+/** Run a command on the worker, for LuaCommandPoll().
+ *
+ * \param L Lua state context of the worker.
+ * \param line The command line, which is split in place.
+ * \returns The answer, from malloc(), or NULL.
+ */
+static char *CmdRun(lua_State *L, char *line)
+{
+    char *argv[CMD_MAXARGS];
+    char buf[128];
+    char *reply;
+    double before;
+    int argc = CmdSplit(line, argv);
+    int top = lua_gettop(L);
+    int i, n;
+
+    if (strcmp(argv[0], "gc") == 0) {
+        before = CmdHeap(L);
+        lua_gc(L, LUA_GCCOLLECT, 0);
+        sprintf(buf, "heap %.0f bytes, was %.0f bytes\n", CmdHeap(L),
+                before);
+        return CmdDup(buf);
+    }
+    lua_pushlightuserdata(L, (void *)COMMANDS);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    if (lua_istable(L, -1))
+        lua_getfield(L, -1, argv[0]);
+    if (!lua_isfunction(L, -1)) {
+        lua_settop(L, top);
+        sprintf(buf, "error: unknown command %.64s, try help\n", argv[0]);
+        return CmdDup(buf);
+    }
+    for (i = 1; i < argc; ++i)
+        lua_pushstring(L, argv[i]);
+    if (lua_pcall(L, argc - 1, LUA_MULTRET, 0)) {
+        lua_pushliteral(L, "error: ");
+        lua_insert(L, -2);
+        if (!lua_isstring(L, -1)) {
+            lua_pop(L, 1);
+            lua_pushliteral(L, "?");
+        }
+        lua_pushliteral(L, "\n");
+        lua_concat(L, 3);
+    } else {
+        n = lua_gettop(L) - top - 1;
+        for (i = 0; i < n; ++i) {
+            lua_pushvalue(L, top + 2 + i);
+            if (lua_isboolean(L, -1)) {
+                lua_pushstring(L, lua_toboolean(L, -1) ? "true" : "false");
+                lua_remove(L, -2);
+            } else if (!lua_isstring(L, -1)) {
+                lua_pushstring(L, luaL_typename(L, -1));
+                lua_remove(L, -2);
+            }
+            lua_pushstring(L, i + 1 < n ? "\t" : "\n");
+        }
+        lua_concat(L, 2 * n);
+    }
+    reply = CmdDup(lua_tostring(L, -1));
+    lua_settop(L, top);
+    return reply;
+}
+
+/** Run the command handed to the worker, if there is one.
+ *
+ * \context
+ * Service worker thread
+ *
+ * \param L Lua state context of the worker.
+ */
+void LuaCommandPoll(lua_State *L)
+{
+    char line[CMD_MAXLINE];
+    char *reply;
+    long seq;
+
+    if (!CmdWanted || CmdRunning)
+        return;
+    SvcMutexLock(&CmdLock);
+    if (!CmdWanted) {
+        SvcMutexUnlock(&CmdLock);
+        return;
+    }
+    strcpy(line, CmdLine);
+    seq = CmdSeq;
+    CmdWanted = 0;
+    SvcMutexUnlock(&CmdLock);
+
+    CmdRunning = 1;
+    reply = CmdRun(L, line);
+    CmdRunning = 0;
+
+    SvcMutexLock(&CmdLock);
+    if (seq == CmdSeq) {
+        free(CmdReply);
+        CmdReply = reply;
+        CmdAnswered = seq;
+        SvcCondSignal(&CmdDone);
+    } else
+        free(reply);
+    SvcMutexUnlock(&CmdLock);
+}
+
+/** Hand a command to the worker and wait for its answer.
+ *
+ * \param line The command line.
+ * \returns The answer, from malloc(), or NULL.
+ */
+static char *CmdAsk(const char *line)
+{
+    DWORD start = SvcTicks();
+    DWORD spent;
+    char *reply;
+    long seq;
+
+    SvcMutexLock(&CmdLock);
+    if (!CmdState) {
+        SvcMutexUnlock(&CmdLock);
+        return CmdDup("error: no script is running\n");
+    }
+    seq = ++CmdSeq;
+    strcpy(CmdLine, line);
+    CmdWanted = 1;
+    while (CmdAnswered != seq && (spent = SvcTicks() - start) < CMD_WAIT)
+        SvcCondWait(&CmdDone, &CmdLock, CMD_WAIT - spent);
+    if (CmdAnswered == seq) {
+        reply = CmdReply;
+        CmdReply = NULL;
+    } else {
+        reply = CmdDup(CmdWanted
+                ? "error: the script did not reach an idle point in time\n"
+                : "error: the command is still running\n");
+        CmdWanted = 0;
+    }
+    SvcMutexUnlock(&CmdLock);
+    return reply;
+}
+
+/** Handle LUAHOOK_TRACEBACK in the count hook, see LuaHook.c.
+ *
+ * Takes the traceback, if CmdTraceback() still waits for it.
+ *
+ * \context
+ * Service worker thread
+ *
+ * \param L The Lua state the hook fired in.
+ * \returns LUAHOOK_DONE.
+ */
+int LuaCommandHook(lua_State *L)
+{
+    char stack[CMD_STACK];
+
+    if (!CmdStackWanted)
+        return LUAHOOK_DONE;
+    LuaWatchdogStack(L, stack, sizeof(stack));
+    SvcMutexLock(&CmdLock);
+    if (CmdStackWanted) {
+        CmdStackWanted = 0;
+        free(CmdStack);
+        CmdStack = (char *)malloc(strlen(stack) + 20);
+        if (CmdStack)
+            sprintf(CmdStack, "stack traceback:%s\n", stack);
+        SvcCondSignal(&CmdDone);
+    }
+    SvcMutexUnlock(&CmdLock);
+    return LUAHOOK_DONE;
+}
+
+/** Take a traceback of the running script.
+ *
+ * \returns The answer, from malloc(), or NULL.
+ */
+static char *CmdTraceback(void)
+{
+    DWORD start = SvcTicks();
+    DWORD spent;
+    char *reply;
+
+    SvcMutexLock(&CmdLock);
+    if (!CmdState)
+        reply = CmdDup("error: no script is running\n");
+    else {
+        free(CmdStack);
+        CmdStack = NULL;
+        CmdStackWanted = 1;
+        LuaHookRequest(CmdState, LUAHOOK_TRACEBACK);
+        while (!CmdStack && CmdStackWanted
+                && (spent = SvcTicks() - start) < CMD_TRACE_WAIT)
+            SvcCondWait(&CmdDone, &CmdLock, CMD_TRACE_WAIT - spent);
+        reply = CmdStack;
+        CmdStack = NULL;
+        CmdStackWanted = 0;
+        if (!reply)
+            reply = CmdDup("error: the script is not running Lua code; "
+                    "it is asleep or in a C function\n");
+    }
+    SvcMutexUnlock(&CmdLock);
+    return reply;
+}
+
+/** Answer a command, on the endpoint's thread or by the worker.
+ *
+ * \param line The command line, without its newline.
+ * \returns The answer, from malloc(), or NULL.
+ */
+static char *CmdExecute(const char *line)
+{
+    char words[CMD_MAXLINE];
+    char *argv[CMD_MAXARGS];
+    char buf[128];
+    int argc;
+
+    strcpy(words, line);
+    argc = CmdSplit(words, argv);
+    if (argc == 0 || strcmp(argv[0], "help") == 0)
+        return CmdDup("help\tthis list\n"
+                "stats\tthe status of the service\n"
+                "tracelevel [level]\tshow or set the trace level\n"
+                "profile\tstart or stop the profiler\n"
+                "traceback\twhere the script is running Lua code\n"
+                "gc\trun a full garbage collection\n"
+                "and the commands of the script's service.command()\n");
+    if (strcmp(argv[0], "stats") == 0)
+        return LuaStatusText();
+    if (strcmp(argv[0], "tracelevel") == 0) {
+        if (argc > 1)
+            SvcDebugTraceLevel = atoi(argv[1]);
+        sprintf(buf, "trace level %d\n", SvcDebugTraceLevel);
+        return CmdDup(buf);
+    }
+    if (strcmp(argv[0], "profile") == 0) {
+        ServiceProfileToggle = 1;
+        return CmdDup("profiler starts or stops at the next idle point\n");
+    }
+    if (strcmp(argv[0], "traceback") == 0)
+        return CmdTraceback();
+    return CmdAsk(line);
+}
+
+/** Read a command from a connection and send back the answer.
+ *
+ * \param f The connection.
+ */
+static void CmdAnswer(SvcFile f)
+{
+    char line[CMD_MAXLINE];
+    char *reply;
+    size_t len = 0;
+    DWORD start = SvcTicks(), spent;
+    long got;
+
+    while (len < sizeof(line) - 1 && !memchr(line, '\n', len)) {
+        spent = SvcTicks() - start;
+        if (spent >= CMD_READ_WAIT || (got = SvcPipeRead(f, line + len,
+                sizeof(line) - 1 - len, CMD_READ_WAIT - spent)) < 0) {
+            SvcDebugTrace("Dropped a command connection without a "
+                    "command\n", 0);
+            return;
+        }
+        if (got == 0)
+            break;
+        len += (size_t)got;
+    }
+    line[len] = '\0';
+    line[strcspn(line, "\r\n")] = '\0';
+    SvcDebugTraceStr("Command: %s\n", line);
+    reply = CmdExecute(line);
+    if (!reply)
+        reply = CmdDup("error: out of memory\n");
+    if (reply)
+        SvcPipeWrite(f, reply, strlen(reply), CMD_WRITE_WAIT);
+    free(reply);
+}
+
+/** Body of the endpoint's thread. */
+static unsigned CmdServe(void *arg)
+{
+    SvcFile f;
+
+    (void)arg;
+    while (!CmdQuit) {
+        f = SvcListenAccept(CmdListener);
+        if (f == SVC_BADFILE) {
+            SvcDebugTrace("Can't accept command connection (%d)\n",
+                    SvcLastError());
+            SvcSleep(1000);
+            continue;
+        }
+        if (!CmdQuit)
+            CmdAnswer(f);
+        SvcPipeClose(f);
+    }
+    return 0;
+}
+
+/** Start serving the control endpoint, if init.lua names one.
+ *
+ * Called as the service starts, so not by a process that only
+ * controls the service.
+ */
+void LuaCommandStart(void)
+{
+    if (!ServiceControlSocket || CmdThread)
+        return;
+    CmdListener = SvcListen(ServiceControlSocket);
+    if (!CmdListener) {
+        SvcDebugTraceStr("Can't listen for commands on %s",
+                ServiceControlSocket);
+        SvcDebugTrace(" (%d)\n", SvcLastError());
+        return;
+    }
+    SvcCondInit(&CmdDone);
+    CmdQuit = 0;
+    CmdThread = SvcThreadStart(CmdServe, NULL);
+    if (!CmdThread) {
+        SvcDebugTrace("Can't start command endpoint (%d)\n", SvcLastError());
+        SvcListenClose(CmdListener);
+        CmdListener = NULL;
+        SvcCondDestroy(&CmdDone);
+        return;
+    }
+    SvcDebugTraceStr("Listening for commands on %s\n", ServiceControlSocket);
+}
+
+/** Stop serving the control endpoint.
+ *
+ * The endpoint's thread is woken by a connection of our own. One busy
+ * reading a client's command or taking a traceback is waited for, but
+ * one waiting for an answer from the worker, which is the caller, is
+ * left to the end of the process.
+ *
+ * \context
+ * Service worker thread
+ */
+void LuaCommandStop(void)
+{
+    SvcFile f;
+
+    if (!CmdThread)
+        return;
+    CmdQuit = 1;
+    f = SvcConnect(ServiceControlSocket);
+    if (f != SVC_BADFILE)
+        SvcPipeClose(f);
+    if (!SvcThreadWait(CmdThread, CMD_READ_WAIT + CMD_TRACE_WAIT)) {
+        SvcDebugTrace("Command endpoint did not stop\n", 0);
+        return;
+    }
+    CmdThread = NULL;
+    SvcListenClose(CmdListener);
+    CmdListener = NULL;
+    SvcCondDestroy(&CmdDone);
+}
+
+/** Let commands reach a service script about to run.
+ *
+ * \context
+ * Service worker thread
+ *
+ * \param h The loaded service script.
+ */
+void LuaCommandAttach(LUAHANDLE h)
+{
+    SvcMutexLock(&CmdLock);
+    CmdState = (lua_State *)h;
+    SvcMutexUnlock(&CmdLock);
+}
+
+/** Stop commands reaching a service script that has finished.
+ *
+ * \context
+ * Service worker thread
+ *
+ * \param h The service script that finished.
+ */
+void LuaCommandDetach(LUAHANDLE h)
+{
+    (void)h;
+    SvcMutexLock(&CmdLock);
+    CmdState = NULL;
+    CmdWanted = 0;
+    CmdStackWanted = 0;
+    SvcMutexUnlock(&CmdLock);
+}
+
+/** Implement the Lua function service.command(name, fn).
+ *
+ * Register \a fn to answer the command \a name sent to the control
+ * endpoint, or remove the handler if \a fn is nil. The commands built
+ * into the endpoint cannot be replaced.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+int LuaCommandSet(lua_State *L)
+{
+    luaL_checkstring(L, 1);
+    if (!lua_isnoneornil(L, 2))
+        luaL_checktype(L, 2, LUA_TFUNCTION);
+    lua_settop(L, 2);
+    lua_pushlightuserdata(L, (void *)COMMANDS);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushlightuserdata(L, (void *)COMMANDS);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, LUA_REGISTRYINDEX);
+    }
+    lua_pushvalue(L, 1);
+    lua_pushvalue(L, 2);
+    lua_rawset(L, -3);
+    return 0;
+}
+
+/** Send a command to the running service, for <tt>LuaService ctl</tt>,
+ * and print its answer.
+ *
+ * \param argc Count of words in \a argv.
+ * \param argv The command and its arguments.
+ * \returns Exit status, as from main(): EXIT_FAILURE if the service
+ * could not be reached or answered with an error.
+ */
+int LuaCommandClient(int argc, char *argv[])
+{
+    char buf[CMD_MAXLINE];
+    size_t len = 0;
+    long got;
+    int i, first = 1, failed = 0;
+    SvcFile f;
+
+    if (!ServiceControlSocket) {
+        fprintf(stderr, "init.lua sets no control_socket for %s\n",
+                ServiceName);
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < argc; ++i) {
+        if (len + strlen(argv[i]) + 2 > sizeof(buf)) {
+            fprintf(stderr, "Command too long\n");
+            return EXIT_FAILURE;
+        }
+        if (i)
+            buf[len++] = ' ';
+        strcpy(buf + len, argv[i]);
+        len += strlen(argv[i]);
+    }
+    buf[len++] = '\n';
+    f = SvcConnect(ServiceControlSocket);
+    if (f == SVC_BADFILE) {
+        fprintf(stderr, "Can't connect to %s (%lu)\n", ServiceControlSocket,
+                (unsigned long)SvcLastError());
+        return EXIT_FAILURE;
+    }
+    if (!SvcPipeWrite(f, buf, len, SVC_INFINITE)) {
+        fprintf(stderr, "Can't send the command (%lu)\n",
+                (unsigned long)SvcLastError());
+        SvcPipeClose(f);
+        return EXIT_FAILURE;
+    }
+    while ((got = SvcPipeRead(f, buf, sizeof(buf), SVC_INFINITE)) > 0) {
+        if (first && strncmp(buf, "error:", got < 6 ? (size_t)got : 6) == 0)
+            failed = 1;
+        first = 0;
+        fwrite(buf, 1, (size_t)got, stdout);
+    }
+    SvcPipeClose(f);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
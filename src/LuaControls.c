@@ -0,0 +1,264 @@
+/*! \file LuaControls.c
+ *  \brief Queue of service controls delivered to the service script.
+ *
+ * The service manager talks to the service through controls, which
+ * arrive on a thread of their own: the SCM's control handler on
+ * Windows, the signal loop of SvcPosix.c elsewhere. Besides acting on
+ * the ones the framework understands, the handler puts every control
+ * into a small queue, from which the script takes them with
+ * service.controls(). Nothing is queued before the script first calls
+ * it, so a script that never does cannot fill the queue with controls
+ * it would only see much later:
+ *
+ * \code
+ * while true do
+ *   for name, code in service.controls(1000) do
+ *     if name == "stop" then return
+ *     elseif name == "pause" then paused = true
+ *     elseif name == "continue" then paused = false
+ *     elseif code == 130 then flush_caches()
+ *     end
+ *   end
+ *   if not paused then do_work() end
+ * end
+ * \endcode
+ *
+ * Each control is named for the SCM control it is, or came from:
+ * <code>stop</code>, <code>pause</code>, <code>continue</code>,
+ * <code>shutdown</code>, <code>paramchange</code>, <code>reload</code>
+ * and <code>profile</code>. The other custom controls 128 to 255,
+ * which the framework does not use, are named <code>custom</code> and
+ * are sent with <tt>sc control</tt> \a name \a code on Windows, or
+ * with <tt>LuaService control</tt> \a code anywhere.
+ *
+ * The SCM only sends PAUSE and CONTINUE to a script that has asked for
+ * controls, which tells it that the script will act on them. A pause
+ * is reported to the SCM as complete when the script takes it from
+ * the queue, and so is a continue.
+ *
+ * The queue is a ring with the worker as its only consumer. Controls
+ * come from several threads at once, such as the SCM's handler, the
+ * console handler and the start coordinator. So a producer reserves a
+ * slot by moving the tail with a compare and swap, and then writes the
+ * control into it. A slot holds zero until its control is written,
+ * and the worker only takes a control once it is there. Putting a
+ * control in needs no lock, so it is safe from a signal handler; a
+ * control that finds the queue full is dropped and counted. The
+ * worker waits for controls on a condition the producer signals, and
+ * looks at the queue at least every CTL_SLICE ms for controls put in
+ * from a signal handler, which cannot signal it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "luaservice.h"
+
+/** Controls the queue holds, a power of two. */
+#define CTL_QUEUE 64
+
+/** Longest time in ms the worker waits without looking at the queue. */
+#define CTL_SLICE 100
+
+/** Longest wait in ms service.controls() accepts; longer ones are cut
+ * to it. */
+#define CTL_MAXWAIT 0x7FFFFFFF
+
+/** The queued controls, each zero until it is written. */
+static volatile DWORD CtlCodes[CTL_QUEUE];
+
+/** Count of controls taken out of the queue, by the worker. */
+static volatile DWORD CtlHead;
+
+/** Count of slots reserved by producers. */
+static volatile DWORD CtlTail;
+
+/** Count of controls dropped because the queue was full. */
+static volatile long CtlDropped;
+
+/** Guards the wait for controls. */
+static SvcMutex CtlLock = SVC_MUTEX_INIT;
+
+/** Signaled when a control is queued. */
+static SvcCond CtlWake;
+
+/** Set once CtlWake is ready and the script has asked for controls. */
+static volatile int CtlReady;
+
+/** Get the name of a control.
+ *
+ * \param code The control.
+ * \returns Its name, a literal.
+ */
+static const char *CtlName(DWORD code)
+{
+    switch (code) {
+    case LUASERVICE_CONTROL_STOP:           return "stop";
+    case LUASERVICE_CONTROL_PAUSE:          return "pause";
+    case LUASERVICE_CONTROL_CONTINUE:       return "continue";
+    case LUASERVICE_CONTROL_SHUTDOWN:       return "shutdown";
+    case LUASERVICE_CONTROL_PARAMCHANGE:    return "paramchange";
+    case LUASERVICE_CONTROL_RELOAD:         return "reload";
+    case LUASERVICE_CONTROL_PROFILE:        return "profile";
+    default:                                return "custom";
+    }
+}
+
+/** Put a control into the queue for the service script.
+ *
+ * Takes no lock, so that it may be called from a signal handler, and
+ * from any number of threads at once. The worker is not woken; see
+ * LuaControlWake().
+ *
+ * \context
+ * Control handler, signal handler, start coordinator
+ *
+ * \param code The control, which is never zero.
+ * \returns Non-zero if it was queued, zero if the script does not take
+ * controls or the queue was full.
+ */
+int LuaControlPush(DWORD code)
+{
+    DWORD tail;
+
+    if (!CtlReady)
+        return 0;
+    do {
+        tail = CtlTail;
+        if (tail - CtlHead >= CTL_QUEUE) {
+            SvcAtomicAdd(&CtlDropped, 1);
+            return 0;
+        }
+    } while (SvcAtomicCompareSwap(&CtlTail, tail, tail + 1) != tail);
+    SvcAtomicSwap(&CtlCodes[tail & (CTL_QUEUE - 1)], code);
+    return 1;
+}
+
+/** Tell whether the control at the head of the queue has been written. */
+static int CtlQueued(void)
+{
+    return CtlCodes[CtlHead & (CTL_QUEUE - 1)] != 0;
+}
+
+/** Wake the worker if it is waiting for controls, for records of a
+ * shared memory queue, or in a reactor.
+ *
+ * \context
+ * Control handler
+ */
+void LuaControlWake(void)
+{
+    LuaShmQueueWake();
+    LuaReactorWake();
+    if (!CtlReady)
+        return;
+    SvcMutexLock(&CtlLock);
+    SvcCondSignal(&CtlWake);
+    SvcMutexUnlock(&CtlLock);
+}
+
+/** Tell whether a control is queued for a script that takes controls.
+ *
+ * \returns Non-zero if service.controls() has been called and there is
+ * a control for it.
+ */
+int LuaControlPending(void)
+{
+    return CtlReady && CtlQueued();
+}
+
+/** Wait at most \a ms ms for a control to be queued.
+ *
+ * \returns Non-zero if one is queued.
+ */
+static int CtlWait(DWORD ms)
+{
+    DWORD start = SvcTicks();
+    DWORD spent;
+
+    SvcMutexLock(&CtlLock);
+    while (!CtlQueued() && (spent = SvcTicks() - start) < ms)
+        SvcCondWait(&CtlWake, &CtlLock,
+                ms - spent < CTL_SLICE ? ms - spent : CTL_SLICE);
+    SvcMutexUnlock(&CtlLock);
+    return CtlQueued();
+}
+
+/** The iterator returned by service.controls().
+ *
+ * Returns the name and code of the next queued control, waiting for
+ * one on the first call if its upvalue is a positive time in ms, no
+ * more than CTL_MAXWAIT, or nil once the queue is empty.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int CtlNext(lua_State *L)
+{
+    lua_Number wait = lua_tonumber(L, lua_upvalueindex(1));
+    long dropped;
+    DWORD code;
+
+    if (wait > 0 && !CtlQueued()) {
+        lua_pushnumber(L, 0);
+        lua_replace(L, lua_upvalueindex(1));
+        LuaProfilerSleep(L, 1);
+        LuaWatchdogSleep(1);
+        CtlWait((DWORD)wait);
+        LuaWatchdogSleep(0);
+        LuaProfilerSleep(L, 0);
+    }
+    dropped = CtlDropped;
+    if (dropped) {
+        SvcAtomicAdd(&CtlDropped, -dropped);
+        SvcDebugTrace("Control queue full, %d controls dropped\n",
+                (DWORD)dropped);
+    }
+    if (!CtlQueued())
+        return 0;
+    code = SvcAtomicSwap(&CtlCodes[CtlHead & (CTL_QUEUE - 1)], 0);
+    SvcAtomicAdd32(&CtlHead, 1);
+    LuaStatusControl(code);
+    if (code == LUASERVICE_CONTROL_PAUSE && !ServiceStopping)
+        SvcManager->paused(1);
+    else if (code == LUASERVICE_CONTROL_CONTINUE && !ServiceStopping)
+        SvcManager->paused(0);
+    lua_pushstring(L, CtlName(code));
+    lua_pushinteger(L, (lua_Integer)code);
+    return 2;
+}
+
+/** Implement the Lua function service.controls([ms]).
+ *
+ * Return an iterator over the queued controls, for use in a generic
+ * for. If none is queued, the first step waits up to \a ms ms for one,
+ * like service.sleep(). The first call also tells the service manager
+ * that the script now takes pause and continue controls, and queues a
+ * stop if one was asked for before.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+int LuaControls(lua_State *L)
+{
+    lua_Number wait = luaL_optnumber(L, 1, 0);
+
+    luaL_argcheck(L, wait >= 0, 1, "wait must not be negative");
+    if (wait > CTL_MAXWAIT)
+        wait = CTL_MAXWAIT;
+    if (!CtlReady) {
+        SvcCondInit(&CtlWake);
+        CtlReady = 1;
+        if (ServiceStopping)
+            LuaControlPush(LUASERVICE_CONTROL_STOP);
+        SvcManager->controlsOpened();
+    }
+    LuaIdle(L);
+    lua_pushnumber(L, wait);
+    lua_pushcclosure(L, CtlNext, 1);
+    return 1;
+}
@@ -0,0 +1,797 @@
+/*! \file LuaDirIndex.c
+ *  \brief Persistent incremental index of the files in a folder.
+ *
+ * A directory index remembers the size, modification time and
+ * (optionally) a content hash of every file in one folder, and can
+ * compare that memory against the folder in a single pass of
+ * SvcDirNext(). The index is saved in a compact binary file that is
+ * written and read through a file mapping, so a service that restarts
+ * picks up where it left off instead of treating every file in its
+ * folder as new. An index saved with hashing on or off the other way
+ * is kept, and its hashes are computed or dropped when it is loaded.
+ *
+ * From Lua, the index is created by service.dirindex() and used
+ * through methods of the returned object:
+ *
+ * \verbatim
+ * local idx = service.dirindex([[\tmp\rot]], "rot.idx", {hash=true})
+ * local added, changed, removed = idx:scan()
+ * for _, name in ipairs(added) do process(name); idx:commit(name) end
+ * idx:save()
+ * \endverbatim
+ *
+ * File names reported by the index are relative to the folder.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "luaservice.h"
+
+/** Metatable name for directory index userdata. */
+#define DIRINDEX_META "LuaService.dirindex"
+
+/** Signature of a saved index file. */
+#define DIRINDEX_MAGIC 0x5844534C /* "LSDX" */
+
+/** Version of the saved index file layout. */
+#define DIRINDEX_VERSION 1
+
+/** Index flag: content hashes are maintained. */
+#define DIRINDEX_F_HASH 0x0001
+
+/** Header of a saved index file.
+ *
+ * The header is followed by \a count DirIndexEntry records and
+ * then by \a pool bytes of file names. Names are not terminated,
+ * each entry carries its own offset and length into the pool.
+ */
+typedef struct DirIndexHeader {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int flags;
+    unsigned int count;
+    unsigned int pool;
+    unsigned int reserved;
+} DirIndexHeader;
+
+/** One file known to the index.
+ *
+ * This is also the on-disk record layout, except that \a mark is
+ * only meaningful in memory.
+ */
+typedef struct DirIndexEntry {
+    SvcU64 size;             /**< File size in bytes. */
+    SvcU64 mtime;            /**< Last write time, see SvcFileStat(). */
+    SvcU64 hash;             /**< FNV-1a hash of content, or zero. */
+    unsigned int name_off;   /**< Offset of the name in the pool. */
+    unsigned int name_len;   /**< Length of the name in bytes. */
+    unsigned int mark;       /**< Scan generation that last saw the file. */
+    unsigned int unused;
+} DirIndexEntry;
+
+/** State of an open directory index. */
+typedef struct DirIndex {
+    char *folder;            /**< Folder being indexed. */
+    char *file;              /**< Name of the saved index file. */
+    unsigned int flags;      /**< DIRINDEX_F_xxx. */
+    DirIndexEntry *entries;  /**< Entry array. */
+    unsigned int count;      /**< Used entries. */
+    unsigned int alloc;      /**< Allocated entries. */
+    char *pool;              /**< Name pool. */
+    unsigned int pool_len;   /**< Used bytes of pool. */
+    unsigned int pool_alloc; /**< Allocated bytes of pool. */
+    unsigned int *slots;     /**< Open addressed hash of entry index+1. */
+    unsigned int nslots;     /**< Slot count, always a power of two. */
+    unsigned int gen;        /**< Current scan generation. */
+    int dirty;               /**< Modified since load or save. */
+} DirIndex;
+
+/** FNV-1a 32 bit hash of a name, used for the in-memory table. */
+static unsigned int NameHash(const char *s, size_t len)
+{
+    unsigned int h = 2166136261u;
+    while (len--) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/** Compute the FNV-1a 64 bit hash of the content of a file.
+ *
+ * \param path The file to read.
+ * \param phash Receives the hash.
+ * \returns Non-zero on success.
+ */
+static int ContentHash(const char *path, SvcU64 *phash)
+{
+    char buf[65536];
+    SvcU64 h = 14695981039346656037ull;
+    SvcU64 off = 0;
+    long n, i;
+    SvcFile f;
+
+    f = SvcFileOpen(path, SVC_FILE_READ);
+    if (f == SVC_BADFILE)
+        return 0;
+    while ((n = SvcFileRead(f, off, buf, sizeof(buf))) > 0) {
+        for (i = 0; i < n; ++i) {
+            h ^= (unsigned char)buf[i];
+            h *= 1099511628211ull;
+        }
+        off += (SvcU64)n;
+    }
+    SvcFileClose(f);
+    *phash = h;
+    return 1;
+}
+
+/** Find the slot that holds, or would hold, a name.
+ *
+ * \returns The slot number. The slot is empty if the name is absent.
+ */
+static unsigned int FindSlot(DirIndex *d, const char *name, size_t len)
+{
+    unsigned int mask = d->nslots - 1;
+    unsigned int i = NameHash(name, len) & mask;
+    while (d->slots[i]) {
+        DirIndexEntry *e = &d->entries[d->slots[i] - 1];
+        if (e->name_len == len && memcmp(d->pool + e->name_off, name, len) == 0)
+            break;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+/** Rebuild the hash table with room for at least \a want entries. */
+static int Rehash(DirIndex *d, unsigned int want)
+{
+    unsigned int n = 64;
+    unsigned int i;
+
+    while (n < want * 2)
+        n <<= 1;
+    free(d->slots);
+    d->slots = (unsigned int *)calloc(n, sizeof(unsigned int));
+    if (!d->slots) {
+        d->nslots = 0;
+        return 0;
+    }
+    d->nslots = n;
+    for (i = 0; i < d->count; ++i) {
+        DirIndexEntry *e = &d->entries[i];
+        d->slots[FindSlot(d, d->pool + e->name_off, e->name_len)] = i + 1;
+    }
+    return 1;
+}
+
+/** Add an entry for a name that is known to be absent.
+ *
+ * \returns The new entry, or NULL if memory is exhausted.
+ */
+static DirIndexEntry *AddEntry(DirIndex *d, const char *name, size_t len)
+{
+    DirIndexEntry *e;
+
+    if (d->count + 1 > d->nslots / 2 && !Rehash(d, d->count + 1))
+        return NULL;
+    if (d->count == d->alloc) {
+        unsigned int n = d->alloc ? d->alloc * 2 : 256;
+        DirIndexEntry *p = (DirIndexEntry *)realloc(d->entries, n * sizeof(*p));
+        if (!p)
+            return NULL;
+        d->entries = p;
+        d->alloc = n;
+    }
+    if (d->pool_len + len > d->pool_alloc) {
+        unsigned int n = d->pool_alloc ? d->pool_alloc : 4096;
+        char *p;
+        while (n < d->pool_len + len)
+            n *= 2;
+        p = (char *)realloc(d->pool, n);
+        if (!p)
+            return NULL;
+        d->pool = p;
+        d->pool_alloc = n;
+    }
+    e = &d->entries[d->count];
+    memset(e, 0, sizeof(*e));
+    memcpy(d->pool + d->pool_len, name, len);
+    e->name_off = d->pool_len;
+    e->name_len = (unsigned int)len;
+    d->pool_len += (unsigned int)len;
+    d->slots[FindSlot(d, name, len)] = ++d->count;
+    d->dirty = 1;
+    return e;
+}
+
+/** Remove the entry stored in a slot.
+ *
+ * The last entry is moved into the hole so the array stays dense,
+ * and the hash chain is repaired by shifting later members back.
+ * The name bytes stay in the pool until the next save.
+ */
+static void RemoveSlot(DirIndex *d, unsigned int slot)
+{
+    unsigned int mask = d->nslots - 1;
+    unsigned int victim = d->slots[slot] - 1;
+    unsigned int i, j;
+
+    d->slots[slot] = 0;
+    for (i = (slot + 1) & mask; d->slots[i]; i = (i + 1) & mask) {
+        DirIndexEntry *e = &d->entries[d->slots[i] - 1];
+        unsigned int home = NameHash(d->pool + e->name_off, e->name_len) & mask;
+        /* move the entry back if the hole lies between its home and here */
+        if (((i - home) & mask) >= ((i - slot) & mask)) {
+            d->slots[slot] = d->slots[i];
+            d->slots[i] = 0;
+            slot = i;
+        }
+    }
+    if (victim != d->count - 1) {
+        DirIndexEntry *last = &d->entries[d->count - 1];
+        j = FindSlot(d, d->pool + last->name_off, last->name_len);
+        d->entries[victim] = *last;
+        d->slots[j] = victim + 1;
+    }
+    d->count--;
+    d->dirty = 1;
+}
+
+/** Load a saved index file through a read-only file mapping.
+ *
+ * A missing file yields an empty index. A damaged file is reported
+ * to the trace and also yields an empty index, since the worst that
+ * can happen is that every file is seen as new once.
+ *
+ * \returns Non-zero if the loaded index was saved with other flags,
+ * see RebuildHashes().
+ */
+static int LoadIndex(DirIndex *d)
+{
+    SvcFile f;
+    SvcMap m;
+    SvcU64 size;
+    const unsigned char *base;
+    const DirIndexHeader *h;
+    const DirIndexEntry *src;
+    unsigned int i;
+    int stale;
+
+    f = SvcFileOpen(d->file, SVC_FILE_READ);
+    if (f == SVC_BADFILE)
+        return 0;
+    if (!SvcFileSize(f, &size) || size < sizeof(*h)
+            || !SvcFileMap(f, size, 0, &m)) {
+        SvcFileClose(f);
+        return 0;
+    }
+    SvcFileClose(f);
+    base = (const unsigned char *)m.base;
+
+    h = (const DirIndexHeader *)base;
+    if (h->magic != DIRINDEX_MAGIC || h->version != DIRINDEX_VERSION
+            || (SvcU64)sizeof(*h)
+               + (SvcU64)h->count * sizeof(DirIndexEntry)
+               + h->pool != size) {
+        SvcDebugTraceStr("Directory index %s is damaged, ignored\n", d->file);
+        SvcFileUnmap(&m);
+        return 0;
+    }
+
+    src = (const DirIndexEntry *)(base + sizeof(*h));
+    d->entries = (DirIndexEntry *)malloc((h->count ? h->count : 1) * sizeof(DirIndexEntry));
+    d->pool = (char *)malloc(h->pool ? h->pool : 1);
+    if (!d->entries || !d->pool) {
+        SvcFileUnmap(&m);
+        return 0;
+    }
+    memcpy(d->pool, base + sizeof(*h) + h->count * sizeof(DirIndexEntry), h->pool);
+    d->alloc = h->count ? h->count : 1;
+    d->pool_len = d->pool_alloc = h->pool;
+    for (i = 0; i < h->count; ++i) {
+        if ((SvcU64)src[i].name_off + src[i].name_len > h->pool)
+            continue;
+        d->entries[d->count] = src[i];
+        d->entries[d->count].mark = 0;
+        d->count++;
+    }
+    stale = h->flags != d->flags;
+    SvcFileUnmap(&m);
+    Rehash(d, d->count);
+    SvcDebugTrace("Directory index loaded %d entries\n", d->count);
+    return stale;
+}
+
+/** Write the index to its file.
+ *
+ * The index is written compactly (discarding names of removed entries)
+ * through a file mapping of a temporary file, which then replaces the
+ * previous index file in a single rename.
+ *
+ * \returns Zero on success, or a system error code.
+ */
+static DWORD SaveIndex(DirIndex *d)
+{
+    size_t tlen = strlen(d->file);
+    char *tmp;
+    SvcFile f;
+    SvcMap m;
+    unsigned char *base;
+    DirIndexHeader *h;
+    DirIndexEntry *dst;
+    char *pool;
+    SvcU64 size;
+    unsigned int i, pool_len = 0;
+    DWORD err = 0;
+
+    for (i = 0; i < d->count; ++i)
+        pool_len += d->entries[i].name_len;
+    size = sizeof(*h) + (SvcU64)d->count * sizeof(DirIndexEntry) + pool_len;
+
+    tmp = (char *)malloc(tlen + 5);
+    if (!tmp)
+        return SVC_ENOMEM;
+    strcpy(tmp, d->file);
+    strcat(tmp, ".new");
+
+    f = SvcFileOpen(tmp, SVC_FILE_WRITE|SVC_FILE_CREATE|SVC_FILE_TRUNC);
+    if (f == SVC_BADFILE) {
+        err = SvcLastError();
+        free(tmp);
+        return err;
+    }
+    if (!SvcFileMap(f, size, 1, &m)) {
+        err = SvcLastError();
+        SvcFileClose(f);
+        SvcFileDelete(tmp);
+        free(tmp);
+        return err;
+    }
+    base = (unsigned char *)m.base;
+
+    h = (DirIndexHeader *)base;
+    h->magic = DIRINDEX_MAGIC;
+    h->version = DIRINDEX_VERSION;
+    h->flags = d->flags;
+    h->count = d->count;
+    h->pool = pool_len;
+    h->reserved = 0;
+    dst = (DirIndexEntry *)(base + sizeof(*h));
+    pool = (char *)(dst + d->count);
+    pool_len = 0;
+    for (i = 0; i < d->count; ++i) {
+        dst[i] = d->entries[i];
+        dst[i].mark = 0;
+        dst[i].name_off = pool_len;
+        memcpy(pool + pool_len, d->pool + d->entries[i].name_off, d->entries[i].name_len);
+        pool_len += d->entries[i].name_len;
+    }
+    /* take the compacted names back so the pool does not grow forever */
+    if (pool_len)
+        memcpy(d->pool, pool, pool_len);
+    for (i = 0; i < d->count; ++i)
+        d->entries[i].name_off = dst[i].name_off;
+    d->pool_len = pool_len;
+
+    if (!SvcFileMapSync(&m) || !SvcFileSync(f))
+        err = SvcLastError();
+    SvcFileUnmap(&m);
+    SvcFileClose(f);
+    if (!err && !SvcFileReplace(tmp, d->file))
+        err = SvcLastError();
+    if (err)
+        SvcFileDelete(tmp);
+    free(tmp);
+    if (!err)
+        d->dirty = 0;
+    return err;
+}
+
+/** Release everything owned by an index, without saving. */
+static void FreeIndex(DirIndex *d)
+{
+    free(d->folder);
+    free(d->file);
+    free(d->entries);
+    free(d->pool);
+    free(d->slots);
+    memset(d, 0, sizeof(*d));
+}
+
+/** Get the index object at stack index 1, raising an error if closed. */
+static DirIndex *CheckIndex(lua_State *L)
+{
+    DirIndex *d = (DirIndex *)luaL_checkudata(L, 1, DIRINDEX_META);
+    if (!d->folder)
+        luaL_error(L, "directory index is closed");
+    return d;
+}
+
+/** Build "folder/name" (with the native separator) in a buffer of MAX_PATH+1 chars.
+ *
+ * \returns Non-zero if the result fit.
+ */
+static int JoinPath(char *buf, const char *folder, const char *name, size_t len)
+{
+    size_t flen = strlen(folder);
+    if (flen + 1 + len >= MAX_PATH)
+        return 0;
+    memcpy(buf, folder, flen);
+    buf[flen] = SVC_DIRSEP;
+    memcpy(buf + flen + 1, name, len);
+    buf[flen + 1 + len] = '\0';
+    return 1;
+}
+
+/** Bring the hashes of an index saved with other flags in line with
+ * its current ones.
+ *
+ * With hashing now off the hashes are dropped. With hashing now on,
+ * a file that still has the recorded size and time is hashed, and
+ * any other is left without a hash; its size or time already shows
+ * that it changed.
+ */
+static void RebuildHashes(DirIndex *d)
+{
+    char path[MAX_PATH + 1];
+    SvcU64 size, mtime;
+    unsigned int i;
+    int isdir;
+
+    SvcDebugTraceStr("Directory index %s was saved with other options, "
+            "rebuilding its hashes\n", d->file);
+    for (i = 0; i < d->count; ++i) {
+        DirIndexEntry *e = &d->entries[i];
+        e->hash = 0;
+        if ((d->flags & DIRINDEX_F_HASH)
+                && JoinPath(path, d->folder, d->pool + e->name_off, e->name_len)
+                && SvcFileStat(path, &size, &mtime, &isdir)
+                && !isdir && size == e->size && mtime == e->mtime)
+            ContentHash(path, &e->hash);
+    }
+    d->dirty = 1;
+}
+
+/** Implement the Lua method idx:scan([commit]).
+ *
+ * Enumerate the folder once, and compare each file with the index.
+ * Returns three arrays of names: files added to the folder, files
+ * whose size, time or (when hashing) content changed, and files
+ * removed from the folder.
+ *
+ * If \a commit is true, the index is updated to match the folder.
+ * Otherwise the index is left alone, so that each file can be
+ * committed with idx:commit() once it has actually been processed.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int dirScan(lua_State *L)
+{
+    DirIndex *d = CheckIndex(L);
+    int commit = lua_toboolean(L, 2);
+    SvcDirEntry fd;
+    char path[MAX_PATH + 1];
+    SvcDir *h;
+    int na = 0, nc = 0, nr = 0;
+    unsigned int i;
+
+    lua_settop(L, 1);
+    lua_newtable(L); /* 2: added */
+    lua_newtable(L); /* 3: changed */
+    lua_newtable(L); /* 4: removed */
+
+    if (++d->gen == 0)
+        d->gen = 1;
+
+    h = SvcDirOpen(d->folder);
+    if (!h)
+        return luaL_error(L, "listing folder failed (%d)", SvcLastError());
+    while (SvcDirNext(h, &fd)) {
+        size_t len;
+        unsigned int slot;
+        SvcU64 size, mtime;
+        DirIndexEntry *e;
+
+        if (fd.isdir)
+            continue;
+        len = strlen(fd.name);
+        size = fd.size;
+        mtime = fd.mtime;
+        slot = FindSlot(d, fd.name, len);
+
+        if (!d->slots[slot]) {
+            lua_pushlstring(L, fd.name, len);
+            lua_rawseti(L, 2, ++na);
+            if (commit) {
+                e = AddEntry(d, fd.name, len);
+                if (!e) {
+                    SvcDirClose(h);
+                    return luaL_error(L, "not enough memory");
+                }
+                e->size = size;
+                e->mtime = mtime;
+                if ((d->flags & DIRINDEX_F_HASH) && JoinPath(path, d->folder, fd.name, len))
+                    ContentHash(path, &e->hash);
+                e->mark = d->gen;
+            }
+            continue;
+        }
+
+        e = &d->entries[d->slots[slot] - 1];
+        e->mark = d->gen;
+        if (e->size == size && e->mtime == mtime)
+            continue;
+        if ((d->flags & DIRINDEX_F_HASH) && e->size == size) {
+            /* only the time moved; a matching hash means the same content */
+            SvcU64 hash;
+            if (JoinPath(path, d->folder, fd.name, len)
+                    && ContentHash(path, &hash) && hash == e->hash) {
+                e->mtime = mtime;
+                d->dirty = 1;
+                continue;
+            }
+        }
+        lua_pushlstring(L, fd.name, len);
+        lua_rawseti(L, 3, ++nc);
+        if (commit) {
+            e->size = size;
+            e->mtime = mtime;
+            if ((d->flags & DIRINDEX_F_HASH) && JoinPath(path, d->folder, fd.name, len))
+                ContentHash(path, &e->hash);
+            d->dirty = 1;
+        }
+    }
+    SvcDirClose(h);
+
+    /* anything not marked by this pass has gone away */
+    for (i = 0; i < d->count; ) {
+        DirIndexEntry *e = &d->entries[i];
+        if (e->mark == d->gen) {
+            ++i;
+            continue;
+        }
+        lua_pushlstring(L, d->pool + e->name_off, e->name_len);
+        lua_rawseti(L, 4, ++nr);
+        if (commit)
+            RemoveSlot(d, FindSlot(d, d->pool + e->name_off, e->name_len));
+        else
+            ++i;
+    }
+
+    SvcDebugTrace("Directory scan added %d", na);
+    SvcDebugTrace(" changed %d", nc);
+    SvcDebugTrace(" removed %d\n", nr);
+    return 3;
+}
+
+/** Implement the Lua method idx:commit(name).
+ *
+ * Record the current state of one file in the index, typically after
+ * the service has finished processing it. If the file no longer exists
+ * it is forgotten.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int dirCommit(lua_State *L)
+{
+    DirIndex *d = CheckIndex(L);
+    size_t len;
+    const char *name = luaL_checklstring(L, 2, &len);
+    char path[MAX_PATH + 1];
+    unsigned int slot;
+    SvcU64 size, mtime;
+    int isdir;
+    DirIndexEntry *e;
+
+    if (!JoinPath(path, d->folder, name, len))
+        return luaL_error(L, "file name too long");
+    slot = FindSlot(d, name, len);
+    if (!SvcFileStat(path, &size, &mtime, &isdir) || isdir) {
+        if (d->slots[slot])
+            RemoveSlot(d, slot);
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+    if (d->slots[slot])
+        e = &d->entries[d->slots[slot] - 1];
+    else if (!(e = AddEntry(d, name, len)))
+        return luaL_error(L, "not enough memory");
+    e->size = size;
+    e->mtime = mtime;
+    e->hash = 0;
+    if (d->flags & DIRINDEX_F_HASH)
+        ContentHash(path, &e->hash);
+    e->mark = d->gen;
+    d->dirty = 1;
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/** Implement the Lua method idx:forget(name).
+ *
+ * Drop one file from the index so that the next scan reports it as
+ * added again.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int dirForget(lua_State *L)
+{
+    DirIndex *d = CheckIndex(L);
+    size_t len;
+    const char *name = luaL_checklstring(L, 2, &len);
+    unsigned int slot = FindSlot(d, name, len);
+    lua_pushboolean(L, d->slots[slot] != 0);
+    if (d->slots[slot])
+        RemoveSlot(d, slot);
+    return 1;
+}
+
+/** Implement the Lua method idx:get(name).
+ *
+ * Returns the size, modification time (as a FILETIME count) and content
+ * hash (as a hex string, or nil without hashing) recorded for a file, or
+ * nothing if the file is not in the index.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int dirGet(lua_State *L)
+{
+    DirIndex *d = CheckIndex(L);
+    size_t len;
+    const char *name = luaL_checklstring(L, 2, &len);
+    unsigned int slot = FindSlot(d, name, len);
+    DirIndexEntry *e;
+    char hex[17];
+
+    if (!d->slots[slot])
+        return 0;
+    e = &d->entries[d->slots[slot] - 1];
+    lua_pushnumber(L, (lua_Number)e->size);
+    lua_pushnumber(L, (lua_Number)e->mtime);
+    if (!(d->flags & DIRINDEX_F_HASH))
+        return 2;
+    sprintf(hex, "%08x%08x", (unsigned int)(e->hash >> 32), (unsigned int)e->hash);
+    lua_pushstring(L, hex);
+    return 3;
+}
+
+/** Implement the Lua method idx:count().
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int dirCount(lua_State *L)
+{
+    DirIndex *d = CheckIndex(L);
+    lua_pushinteger(L, d->count);
+    return 1;
+}
+
+/** Implement the Lua method idx:save().
+ *
+ * Write the index file if anything changed since it was last written.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int dirSave(lua_State *L)
+{
+    DirIndex *d = CheckIndex(L);
+    DWORD err;
+
+    if (d->dirty && (err = SaveIndex(d)) != 0)
+        return luaL_error(L, "saving directory index %s failed (%d)", d->file, err);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/** Implement the Lua method idx:close() and the __gc metamethod.
+ *
+ * Save the index if needed and release its memory. Closing an index
+ * twice is harmless.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int dirClose(lua_State *L)
+{
+    DirIndex *d = (DirIndex *)luaL_checkudata(L, 1, DIRINDEX_META);
+    DWORD err = 0;
+
+    if (d->folder) {
+        if (d->dirty && (err = SaveIndex(d)) != 0)
+            SvcDebugTrace("Saving directory index failed (%d)\n", err);
+        FreeIndex(d);
+    }
+    lua_pushboolean(L, err == 0);
+    return 1;
+}
+
+/** Methods of a directory index object. */
+static const struct luaL_Reg dirMethods[] = {
+        {"scan", dirScan},
+        {"commit", dirCommit},
+        {"forget", dirForget},
+        {"get", dirGet},
+        {"count", dirCount},
+        {"save", dirSave},
+        {"close", dirClose},
+        {NULL, NULL},
+};
+
+/** Implement the Lua function service.dirindex(folder, file [, options]).
+ *
+ * Open the index of \a folder saved in \a file, creating an empty index
+ * if the file does not exist yet. A relative \a file is relative to the
+ * service folder, like every other file the service opens.
+ *
+ * The options table may contain:
+ * - hash -- if true, a content hash of every file is kept, so that a file
+ *   whose time changed but whose content did not is not reported.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+int LuaDirIndexOpen(lua_State *L)
+{
+    const char *folder = luaL_checkstring(L, 1);
+    const char *file = luaL_checkstring(L, 2);
+    size_t flen = strlen(folder);
+    DirIndex *d;
+    int stale;
+
+    d = (DirIndex *)lua_newuserdata(L, sizeof(DirIndex));
+    memset(d, 0, sizeof(*d));
+    if (luaL_newmetatable(L, DIRINDEX_META)) {
+        lua_newtable(L);
+        luaL_register(L, NULL, dirMethods);
+        lua_setfield(L, -2, "__index");
+        lua_pushcfunction(L, dirClose);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+
+    if (lua_istable(L, 3)) {
+        lua_getfield(L, 3, "hash");
+        if (lua_toboolean(L, -1))
+            d->flags |= DIRINDEX_F_HASH;
+        lua_pop(L, 1);
+    }
+
+    /* strip any trailing separators so names join cleanly */
+    while (flen > 1 && (folder[flen - 1] == '\\' || folder[flen - 1] == '/'))
+        --flen;
+    d->folder = (char *)malloc(flen + 1);
+    d->file = strdup(file);
+    if (!d->folder || !d->file) {
+        FreeIndex(d);
+        return luaL_error(L, "not enough memory");
+    }
+    memcpy(d->folder, folder, flen);
+    d->folder[flen] = '\0';
+
+    stale = LoadIndex(d);
+    if (!d->slots && !Rehash(d, 0)) {
+        FreeIndex(d);
+        return luaL_error(L, "not enough memory");
+    }
+    if (stale)
+        RebuildHashes(d);
+    return 1;
+}
@@ -0,0 +1,726 @@
+/*! \file LuaHeap.c
+ *  \brief Heap profiler attributing memory to Lua allocation sites.
+ *
+ * Every Lua state created by LuaWorkerLoad() has its allocator, which
+ * is LuaAlloc() or Lua's own depending on USE_LUA_ALLOCATOR, wrapped
+ * by LuaHeapAllocf() with LuaHeapAttach(). While the heap profiler is
+ * off, that costs one test per allocation.
+ *
+ * While it is on, the profiler samples by bytes rather than by calls:
+ * of every <code>heap_sample</code> bytes allocated, the allocation
+ * that contains the sampled byte is charged to its allocation site,
+ * weighted with the bytes it stands for. So large allocations are
+ * always seen and small ones in proportion to how much they allocate.
+ * The site is the Lua call stack at the time, found with
+ * lua_getstack() and lua_getinfo() before the memory manager is
+ * called, while the stack is still in a consistent state.
+ *
+ * A sampled block stays charged to its site until it is freed, so the
+ * profiler reports both the sites that allocate most and the sites
+ * whose memory is still in use, which for a leak are the sites that
+ * created what is leaking. A block that is reallocated stays charged
+ * to the site that first allocated it.
+ *
+ * The stack is always that of the state's main thread. While a
+ * coroutine runs, its allocations are charged to the
+ * coroutine.resume() that runs it. Allocations made by C code on
+ * behalf of the script are charged to the Lua code that called it.
+ *
+ * The profiler is controlled with service.heap, or with the init.lua
+ * field <code>heap_profile</code>. The report is written to
+ * <code>heap_file</code> when the script finishes, when profiling is
+ * turned off in init.lua, and on <tt>LuaService profile</tt>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "luaservice.h"
+
+/** Deepest stack recorded for a site; deeper stacks are cut at the root. */
+#define HEAP_MAXDEPTH 16
+
+/** Longest single frame name recorded. */
+#define HEAP_MAXFRAME 80
+
+/** Most distinct sites kept; samples of any more go to "[other]". */
+#define HEAP_MAXSITES 5000
+
+/** Number of hash buckets for sites. */
+#define HEAP_SITEBUCKETS 1024
+
+/** Sites listed in each section of the written report. */
+#define HEAP_REPORTSITES 100
+
+/** One allocation site. */
+typedef struct HeapSite {
+    struct HeapSite *next;      /**< Next site in the same bucket. */
+    unsigned int hash;          /**< Hash of \a stack. */
+    SvcU64 allocBytes;          /**< Bytes allocated here, estimated. */
+    SvcU64 liveBytes;           /**< Bytes still in use, estimated. */
+    unsigned long allocCount;   /**< Samples taken here. */
+    unsigned long liveCount;    /**< Sampled blocks not yet freed. */
+    char stack[1];              /**< Folded stack, allocated in line. */
+} HeapSite;
+
+/** A sampled block that has not been freed. */
+typedef struct HeapBlock {
+    struct HeapBlock *next;     /**< Next block in the same bucket. */
+    void *ptr;                  /**< The block. */
+    HeapSite *site;             /**< Site charged with it. */
+    SvcU64 weight;              /**< Bytes it stands for. */
+} HeapBlock;
+
+/** Heap profiler state of one Lua state. */
+typedef struct LuaHeap {
+    lua_Alloc raw;              /**< Allocator that does the work. */
+    void *rawud;                /**< Its opaque argument. */
+    lua_State *L;               /**< The Lua state, once created. */
+    int enabled;                /**< Non-zero while profiling. */
+    int configured;             /**< ServiceHeapProfile last acted upon. */
+    SvcU64 rate;                /**< Sampling interval in bytes. */
+    SvcU64 until;               /**< Bytes left until the next sample. */
+    SvcU64 allocated;           /**< Bytes allocated while profiling. */
+    SvcU64 freed;               /**< Bytes freed while profiling. */
+    HeapSite *sites[HEAP_SITEBUCKETS];
+    unsigned long nsites;       /**< Distinct sites in \a sites. */
+    HeapSite *other;            /**< The "[other]" site, or NULL. */
+    HeapBlock **blocks;         /**< Hash table of sampled blocks. */
+    size_t nbuckets;            /**< Size of \a blocks, a power of 2. */
+    size_t nblocks;             /**< Blocks in \a blocks. */
+} LuaHeap;
+
+/** Full path of ServiceHeapFile, once resolved. */
+static char *HeapPath;
+
+/** Get the heap profiler of a Lua state, or NULL if it has none. */
+static LuaHeap *HeapOf(lua_State *L)
+{
+    void *ud = NULL;
+    if (lua_getallocf(L, &ud) != LuaHeapAllocf)
+        return NULL;
+    return (LuaHeap *)ud;
+}
+
+/** Hash a string with FNV-1a. */
+static unsigned int HeapHash(const char *s)
+{
+    unsigned int h = 2166136261u;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/** Get the bucket of a block. */
+static size_t HeapBucket(LuaHeap *h, void *p)
+{
+    return (size_t)(((size_t)p >> 4) * 2654435761u) & (h->nbuckets - 1);
+}
+
+/** Make a new site record, or NULL if out of memory. */
+static HeapSite *HeapNewSite(const char *stack, unsigned int hash)
+{
+    size_t len = strlen(stack);
+    HeapSite *s = (HeapSite *)calloc(1, sizeof(HeapSite) + len);
+    if (!s)
+        return NULL;
+    s->hash = hash;
+    memcpy(s->stack, stack, len + 1);
+    return s;
+}
+
+/** Find or add the site of a folded stack. */
+static HeapSite *HeapSiteFor(LuaHeap *h, const char *stack)
+{
+    unsigned int hash = HeapHash(stack);
+    HeapSite **pp = &h->sites[hash % HEAP_SITEBUCKETS];
+    HeapSite *s;
+
+    for (s = *pp; s; s = s->next)
+        if (s->hash == hash && strcmp(s->stack, stack) == 0)
+            return s;
+    if (h->nsites < HEAP_MAXSITES && (s = HeapNewSite(stack, hash)) != NULL) {
+        s->next = *pp;
+        *pp = s;
+        ++h->nsites;
+        return s;
+    }
+    if (!h->other)
+        h->other = HeapNewSite("[other]", 0);
+    return h->other;
+}
+
+/** Describe one stack frame in \a buf, which holds HEAP_MAXFRAME chars. */
+static void HeapFrame(lua_Debug *ar, char *buf)
+{
+    char *cp;
+
+    if (*ar->what == 'C')
+        sprintf(buf, "%.60s [C]", ar->name ? ar->name : "?");
+    else
+        sprintf(buf, "%.60s:%d", ar->short_src, ar->currentline);
+    for (cp = buf; *cp; ++cp)
+        if (*cp == ';' || *cp == '\n')
+            *cp = ':';
+}
+
+/** Find the site of the allocation being made.
+ *
+ * Must be called before the memory manager, since the allocation may
+ * be moving the very stack that is walked.
+ */
+static HeapSite *HeapSiteHere(LuaHeap *h)
+{
+    char frames[HEAP_MAXDEPTH][HEAP_MAXFRAME];
+    char stack[HEAP_MAXDEPTH * (HEAP_MAXFRAME + 1) + 16];
+    lua_Debug ar;
+    char *cp = stack;
+    int n, level;
+
+    for (n = 0; n < HEAP_MAXDEPTH && lua_getstack(h->L, n, &ar); ++n) {
+        lua_getinfo(h->L, "Sln", &ar);
+        HeapFrame(&ar, frames[n]);
+    }
+    if (n == 0)
+        return HeapSiteFor(h, "[no Lua code]");
+    if (n == HEAP_MAXDEPTH && lua_getstack(h->L, n, &ar)) {
+        strcpy(cp, "[truncated];");
+        cp += strlen(cp);
+    }
+    for (level = n - 1; level >= 0; --level) {
+        size_t len = strlen(frames[level]);
+        memcpy(cp, frames[level], len);
+        cp += len;
+        *cp++ = level ? ';' : '\0';
+    }
+    return HeapSiteFor(h, stack);
+}
+
+/** Add a block to the table of sampled blocks, growing it as needed.
+ *
+ * If there is no memory for the table, the block is forgotten.
+ */
+static void HeapLink(LuaHeap *h, HeapBlock *b)
+{
+    size_t i;
+
+    if (h->nblocks >= h->nbuckets * 2) {
+        size_t n = h->nbuckets ? h->nbuckets * 2 : 256;
+        HeapBlock **nb = (HeapBlock **)calloc(n, sizeof(HeapBlock *));
+        if (nb) {
+            HeapBlock **old = h->blocks;
+            size_t oldn = h->nbuckets;
+            HeapBlock *p, *next;
+            h->blocks = nb;
+            h->nbuckets = n;
+            for (i = 0; i < oldn; ++i) {
+                for (p = old[i]; p; p = next) {
+                    next = p->next;
+                    p->next = nb[HeapBucket(h, p->ptr)];
+                    nb[HeapBucket(h, p->ptr)] = p;
+                }
+            }
+            free(old);
+        }
+    }
+    if (!h->blocks) {
+        b->site->liveBytes -= b->weight;
+        --b->site->liveCount;
+        free(b);
+        return;
+    }
+    i = HeapBucket(h, b->ptr);
+    b->next = h->blocks[i];
+    h->blocks[i] = b;
+    ++h->nblocks;
+}
+
+/** Remove a block from the table of sampled blocks.
+ *
+ * \returns The block's record, or NULL if it was not sampled.
+ */
+static HeapBlock *HeapUnlink(LuaHeap *h, void *ptr)
+{
+    HeapBlock **pp, *b;
+
+    if (!h->nblocks)
+        return NULL;
+    for (pp = &h->blocks[HeapBucket(h, ptr)]; (b = *pp) != NULL; pp = &b->next) {
+        if (b->ptr == ptr) {
+            *pp = b->next;
+            --h->nblocks;
+            return b;
+        }
+    }
+    return NULL;
+}
+
+/** Discard everything recorded. */
+static void HeapReset(LuaHeap *h)
+{
+    HeapSite *s, *snext;
+    HeapBlock *b, *bnext;
+    size_t i;
+
+    for (i = 0; i < HEAP_SITEBUCKETS; ++i) {
+        for (s = h->sites[i]; s; s = snext) {
+            snext = s->next;
+            free(s);
+        }
+        h->sites[i] = NULL;
+    }
+    free(h->other);
+    h->other = NULL;
+    h->nsites = 0;
+    for (i = 0; i < h->nbuckets; ++i)
+        for (b = h->blocks[i]; b; b = bnext) {
+            bnext = b->next;
+            free(b);
+        }
+    free(h->blocks);
+    h->blocks = NULL;
+    h->nbuckets = h->nblocks = 0;
+    h->allocated = h->freed = 0;
+}
+
+/** Start profiling, discarding anything recorded before. */
+static void HeapStart(LuaHeap *h, SvcU64 rate)
+{
+    h->enabled = 0;
+    HeapReset(h);
+    h->rate = h->until = rate ? rate : 1;
+    h->enabled = 1;
+    SvcDebugTrace("Heap profiler started, sampling every %d bytes\n",
+            (DWORD)h->rate);
+}
+
+/** Stop profiling and discard what was recorded. */
+static void HeapStop(LuaHeap *h)
+{
+    if (!h->enabled)
+        return;
+    h->enabled = 0;
+    HeapReset(h);
+    SvcDebugTrace("Heap profiler stopped\n", 0);
+}
+
+/** Give a new Lua state a heap profiler.
+ *
+ * Wraps the state's allocator with LuaHeapAllocf(), which must be
+ * done before the state has run any code. Starts profiling if the
+ * init.lua field <code>heap_profile</code> is set.
+ *
+ * \param L The new Lua state.
+ */
+void LuaHeapAttach(lua_State *L)
+{
+    LuaHeap *h = (LuaHeap *)calloc(1, sizeof(LuaHeap));
+    if (!h)
+        return;
+    h->raw = lua_getallocf(L, &h->rawud);
+    h->L = L;
+    lua_setallocf(L, LuaHeapAllocf, h);
+    h->configured = ServiceHeapProfile;
+    if (ServiceHeapProfile)
+        HeapStart(h, (SvcU64)ServiceHeapSample);
+}
+
+/** Free the heap profiler of a Lua state that has been closed.
+ *
+ * \param ud The opaque argument of the closed state's allocator,
+ * which was LuaHeapAllocf().
+ */
+void LuaHeapFree(void *ud)
+{
+    LuaHeap *h = (LuaHeap *)ud;
+    if (!h)
+        return;
+    h->enabled = 0;
+    HeapReset(h);
+    free(h);
+}
+
+/** Allocate, resize or free memory for a Lua state.
+ *
+ * The lua_Alloc function installed by LuaHeapAttach(). Hands the
+ * request to the state's own allocator, and records samples while
+ * profiling.
+ *
+ * \param ud The state's profiler.
+ * \param ptr Pointer to any existing memory for this transaction.
+ * \param osize Size of the existing memory block.
+ * \param nsize Size of the memory block needed.
+ * \returns The block, or NULL if freed or out of memory.
+ */
+void *LuaHeapAllocf(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+    LuaHeap *h = (LuaHeap *)ud;
+    HeapSite *site = NULL;
+    HeapBlock *b;
+    SvcU64 weight = 0;
+    void *p;
+
+    if (!h->enabled)
+        return h->raw(h->rawud, ptr, osize, nsize);
+    if (!ptr)
+        osize = 0; /* Lua 5.2 and later pass the object type here. */
+    if (nsize > osize) {
+        SvcU64 grow = nsize - osize;
+        if (grow < h->until) {
+            h->until -= grow;
+        } else {
+            SvcU64 over = grow - h->until;
+            weight = (over / h->rate + 1) * h->rate;
+            h->until = h->rate - over % h->rate;
+            site = HeapSiteHere(h);
+        }
+    }
+    b = ptr ? HeapUnlink(h, ptr) : NULL;
+    p = h->raw(h->rawud, ptr, osize, nsize);
+    if (nsize && !p) {
+        if (b)
+            HeapLink(h, b);
+        return NULL;
+    }
+    if (nsize > osize)
+        h->allocated += nsize - osize;
+    else
+        h->freed += osize - nsize;
+
+    if (site) {
+        site->allocBytes += weight;
+        ++site->allocCount;
+    }
+    if (b) {
+        if (!nsize) {
+            b->site->liveBytes -= b->weight;
+            --b->site->liveCount;
+            free(b);
+            return NULL;
+        }
+        b->ptr = p;
+        b->weight += weight;
+        b->site->liveBytes += weight;
+        HeapLink(h, b);
+    } else if (site && p) {
+        b = (HeapBlock *)malloc(sizeof(HeapBlock));
+        if (b) {
+            b->ptr = p;
+            b->site = site;
+            b->weight = weight;
+            site->liveBytes += weight;
+            ++site->liveCount;
+            HeapLink(h, b);
+        }
+    }
+    return p;
+}
+
+/** Collect the sites of a profiler, sorted by \a live or allocated bytes.
+ *
+ * \returns A malloc'd array of *\a pn sites, or NULL.
+ */
+static HeapSite **HeapSorted(LuaHeap *h, int live, size_t *pn)
+{
+    HeapSite **v, *s, *t;
+    size_t n = 0, i, j;
+
+    *pn = 0;
+    v = (HeapSite **)malloc((h->nsites + 1) * sizeof(HeapSite *));
+    if (!v)
+        return NULL;
+    for (i = 0; i < HEAP_SITEBUCKETS; ++i)
+        for (s = h->sites[i]; s; s = s->next)
+            v[n++] = s;
+    if (h->other)
+        v[n++] = h->other;
+    /* Insertion sort, which is plenty for a report. */
+    for (i = 1; i < n; ++i) {
+        t = v[i];
+        for (j = i; j > 0 && (live ? v[j-1]->liveBytes < t->liveBytes
+                : v[j-1]->allocBytes < t->allocBytes); --j)
+            v[j] = v[j-1];
+        v[j] = t;
+    }
+    *pn = n;
+    return v;
+}
+
+/** Write one section of the report. */
+static void HeapWriteSection(FILE *fp, LuaHeap *h, int live)
+{
+    HeapSite **v;
+    size_t n, i;
+
+    fprintf(fp, live ? "# top retaining sites: bytes blocks stack\n"
+            : "# top allocating sites: bytes samples stack\n");
+    v = HeapSorted(h, live, &n);
+    for (i = 0; i < n && i < HEAP_REPORTSITES; ++i) {
+        HeapSite *s = v[i];
+        if (live ? !s->liveBytes : !s->allocBytes)
+            break;
+        fprintf(fp, "%.0f %lu %s\n",
+                (double)(live ? s->liveBytes : s->allocBytes),
+                live ? s->liveCount : s->allocCount, s->stack);
+    }
+    free(v);
+}
+
+/** Write the report of a profiler.
+ *
+ * \param h The profiler.
+ * \param path The file to write.
+ * \returns Non-zero on success.
+ */
+static int HeapWrite(LuaHeap *h, const char *path)
+{
+    FILE *fp;
+    int ok;
+
+    fp = fopen(path, "w");
+    if (!fp) {
+        SvcDebugTraceStr("Can't write heap report %s\n", path);
+        return 0;
+    }
+    fprintf(fp, "# heap profile, one sample per %.0f bytes\n"
+            "# allocated %.0f bytes, freed %.0f bytes\n",
+            (double)h->rate, (double)h->allocated, (double)h->freed);
+    HeapWriteSection(fp, h, 0);
+    HeapWriteSection(fp, h, 1);
+    ok = !ferror(fp);
+    if (fclose(fp) != 0)
+        ok = 0;
+    SvcDebugTraceStr("Heap report written to %s\n", path);
+    return ok;
+}
+
+/** Get the configured heap report file as a full path. */
+static const char *HeapDefaultPath(void)
+{
+    if (!HeapPath)
+        HeapPath = SvcFullPath(ServiceHeapFile);
+    return HeapPath ? HeapPath : ServiceHeapFile;
+}
+
+/** Act on requests made from outside the worker.
+ *
+ * Writes the report if one was requested with <tt>LuaService
+ * profile</tt>, and starts or stops profiling if the init.lua field
+ * <code>heap_profile</code> changed since it was last seen. Stopping
+ * writes the report first.
+ *
+ * \context
+ * Service worker thread
+ *
+ * \param L Lua state context of the worker.
+ */
+void LuaHeapPoll(lua_State *L)
+{
+    LuaHeap *h = HeapOf(L);
+
+    if (!h)
+        return;
+    if (ServiceHeapReportPending) {
+        ServiceHeapReportPending = 0;
+        if (h->enabled)
+            HeapWrite(h, HeapDefaultPath());
+    }
+    if (h->configured != ServiceHeapProfile) {
+        h->configured = ServiceHeapProfile;
+        if (ServiceHeapProfile && !h->enabled) {
+            HeapStart(h, (SvcU64)ServiceHeapSample);
+        } else if (!ServiceHeapProfile && h->enabled) {
+            HeapWrite(h, HeapDefaultPath());
+            HeapStop(h);
+        }
+    }
+    if (h->enabled && h->rate != (SvcU64)ServiceHeapSample) {
+        h->rate = (SvcU64)ServiceHeapSample;
+        if (h->until > h->rate)
+            h->until = h->rate;
+    }
+}
+
+/** Write the heap report of a service script that has finished.
+ *
+ * \param wk The worker's Lua state.
+ */
+void LuaHeapFinal(LUAHANDLE wk)
+{
+    LuaHeap *h;
+
+    if (!wk)
+        return;
+    h = HeapOf((lua_State *)wk);
+    if (h && h->enabled)
+        HeapWrite(h, HeapDefaultPath());
+}
+
+/** Get the profiler of the calling state, raising an error if none. */
+static LuaHeap *heapCheck(lua_State *L)
+{
+    LuaHeap *h = HeapOf(L);
+    if (!h)
+        luaL_error(L, "heap profiler not available");
+    return h;
+}
+
+/** Implement the Lua function service.heap.start([rate]).
+ *
+ * Start sampling one allocation per \a rate bytes, by default the
+ * init.lua field <code>heap_sample</code>. Anything recorded before
+ * is discarded.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int heapStart(lua_State *L)
+{
+    LuaHeap *h = heapCheck(L);
+    int rate = (int)luaL_optinteger(L, 1, ServiceHeapSample);
+    luaL_argcheck(L, rate > 0, 1, "rate must be positive");
+    HeapStart(h, (SvcU64)rate);
+    return 0;
+}
+
+/** Implement the Lua function service.heap.stop().
+ *
+ * Stop sampling, and discard what was recorded.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int heapStop(lua_State *L)
+{
+    HeapStop(heapCheck(L));
+    return 0;
+}
+
+/** Push a list of the top \a n sites by allocated or \a live bytes. */
+static void heapPushSites(lua_State *L, LuaHeap *h, int live, int n)
+{
+    HeapSite **v;
+    size_t count, i;
+
+    v = HeapSorted(h, live, &count);
+    lua_newtable(L);
+    for (i = 0; i < count && (int)i < n; ++i) {
+        HeapSite *s = v[i];
+        if (live ? !s->liveBytes : !s->allocBytes)
+            break;
+        lua_newtable(L);
+        lua_pushstring(L, s->stack);
+        lua_setfield(L, -2, "site");
+        lua_pushnumber(L, (lua_Number)(live ? s->liveBytes : s->allocBytes));
+        lua_setfield(L, -2, "bytes");
+        lua_pushnumber(L, (lua_Number)(live ? s->liveCount : s->allocCount));
+        lua_setfield(L, -2, "count");
+        lua_rawseti(L, -2, (int)i + 1);
+    }
+    free(v);
+}
+
+/** Implement the Lua function service.heap.report([n]).
+ *
+ * Return a table with two lists of the top \a n sites, 20 by default:
+ * <code>allocated</code>, by bytes allocated, and
+ * <code>retained</code>, by bytes still in use. Each entry has the
+ * fields <code>site</code> (the call stack, outermost frame first),
+ * <code>bytes</code> and <code>count</code>.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int heapReport(lua_State *L)
+{
+    LuaHeap *h = heapCheck(L);
+    int n = (int)luaL_optinteger(L, 1, 20);
+
+    lua_newtable(L);
+    heapPushSites(L, h, 0, n);
+    lua_setfield(L, -2, "allocated");
+    heapPushSites(L, h, 1, n);
+    lua_setfield(L, -2, "retained");
+    return 1;
+}
+
+/** Implement the Lua function service.heap.dump([file]).
+ *
+ * Write the report to \a file, by default the init.lua field
+ * <code>heap_file</code>.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int heapDump(lua_State *L)
+{
+    LuaHeap *h = heapCheck(L);
+    const char *path = luaL_optstring(L, 1, NULL);
+    if (!HeapWrite(h, path ? path : HeapDefaultPath())) {
+        lua_pushnil(L);
+        lua_pushstring(L, "can't write heap report");
+        return 2;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/** Implement the Lua function service.heap.stats().
+ *
+ * Return a table with the fields <code>running</code>,
+ * <code>rate</code>, <code>allocated</code> and <code>freed</code>
+ * (exact byte counts since profiling started), <code>sites</code> and
+ * <code>blocks</code> (sampled blocks not yet freed).
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int heapStats(lua_State *L)
+{
+    LuaHeap *h = heapCheck(L);
+
+    lua_newtable(L);
+    lua_pushboolean(L, h->enabled);
+    lua_setfield(L, -2, "running");
+    lua_pushnumber(L, (lua_Number)h->rate);
+    lua_setfield(L, -2, "rate");
+    lua_pushnumber(L, (lua_Number)h->allocated);
+    lua_setfield(L, -2, "allocated");
+    lua_pushnumber(L, (lua_Number)h->freed);
+    lua_setfield(L, -2, "freed");
+    lua_pushnumber(L, (lua_Number)h->nsites);
+    lua_setfield(L, -2, "sites");
+    lua_pushnumber(L, (lua_Number)h->nblocks);
+    lua_setfield(L, -2, "blocks");
+    return 1;
+}
+
+/** Functions of the service.heap table. */
+static const struct luaL_Reg heapFunctions[] = {
+        {"start", heapStart},
+        {"stop", heapStop},
+        {"report", heapReport},
+        {"dump", heapDump},
+        {"stats", heapStats},
+        {NULL, NULL},
+};
+
+/** Add the heap table to the service table at the top of the stack.
+ *
+ * \param L Lua state context to get the table.
+ */
+void LuaHeapRegister(lua_State *L)
+{
+    lua_newtable(L);
+    luaL_register(L, NULL, heapFunctions);
+    lua_setfield(L, -2, "heap");
+}
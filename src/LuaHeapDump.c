@@ -0,0 +1,676 @@
+/*! \file LuaHeapDump.c
+ *  \brief Census of the live Lua heap, by type and by root.
+ *
+ * The heap profiler in LuaHeap.c tells where memory was allocated.
+ * This module tells why it is still alive. service.heapdump(file)
+ * walks every object reachable from the roots of the worker's Lua
+ * state, and writes to \a file:
+ *
+ * - the number and estimated size of the objects of each type,
+ * - the estimated size retained by each root, and
+ * - the largest single objects and the roots that retain them.
+ *
+ * The roots are, in this order, each field of the globals table, each
+ * local, upvalue and function of the calling thread's stack, and each
+ * entry of the registry. Every object is charged to the first root
+ * from which it is reached, so the size of a root is the memory that
+ * would become free if that root, and none of the roots before it,
+ * let go. An object shared between two globals is charged to the one
+ * visited first.
+ *
+ * Sizes are estimates from the typical layout of each type on a 64
+ * bit system, as the Lua API does not expose the real ones. Function
+ * prototypes (bytecode and constants) are not counted.
+ *
+ * The walk runs incrementally: each call to service.sleep() or
+ * service.stopping() takes a slice of a few ms of it, so even a large
+ * heap never stops the script for long. Objects created after the
+ * walk started may be missed, and objects the script drops during the
+ * walk may still be counted. A single table is always walked in one
+ * go, however large.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "luaservice.h"
+
+#if LUA_VERSION_NUM >= 502
+#  define hdRawLen lua_rawlen
+#else
+#  define hdRawLen lua_objlen
+#endif
+
+/** Estimated sizes of Lua objects, in bytes. */
+#define HD_STRING      24   /**< A string, not counting its text. */
+#define HD_TABLE       56   /**< An empty table. */
+#define HD_ARRAYSLOT   16   /**< A slot in the array part of a table. */
+#define HD_HASHSLOT    40   /**< A node in the hash part of a table. */
+#define HD_FUNCTION    40   /**< A closure, not counting upvalues. */
+#define HD_UPVALUE     40   /**< An upvalue of a closure. */
+#define HD_USERDATA    40   /**< A userdata, not counting its block. */
+#define HD_THREAD      200  /**< A coroutine, not counting its stack. */
+
+/** Default time slice per idle point, in ms. */
+#define HD_SLICE 10
+
+/** Number of largest objects listed. */
+#define HD_BIGGEST 20
+
+/** Most roots listed. */
+#define HD_REPORTROOTS 100
+
+/** Indices of the tables in the walk's state table. */
+enum { HD_SEEN = 1, HD_WORK, HD_WORKROOT, HD_ROOTS };
+
+/** A root of the walk and what it retains. */
+typedef struct HdRoot {
+    char *name;
+    SvcU64 bytes;
+    unsigned long objects;
+} HdRoot;
+
+/** One of the largest objects. */
+typedef struct HdBig {
+    SvcU64 bytes;
+    int type;
+    size_t root;
+} HdBig;
+
+/** Registry key of the walk's state table, present while it runs. */
+static const char *HEAPDUMP_STATE = "Heap Dump State";
+
+/** The file to write, non-NULL while a walk runs. */
+static char *HdPath;
+
+/** Time slice in ms per idle point, zero to run to completion. */
+static DWORD HdSlice;
+
+/** The roots, and how many of them have been started. */
+static HdRoot *HdRoots;
+static size_t HdNRoots, HdRootCap, HdNextRoot;
+
+/** Number of objects waiting in the work list. */
+static int HdWorkTop;
+
+/** Totals by type. */
+static unsigned long HdTypeObjects[LUA_TTHREAD + 1];
+static SvcU64 HdTypeBytes[LUA_TTHREAD + 1];
+
+/** The largest objects, largest first. */
+static HdBig HdBiggest[HD_BIGGEST];
+static int HdNBiggest;
+
+/** Statistics of the walk. */
+static unsigned long HdObjects, HdSteps;
+static SvcU64 HdMicros;
+
+/** Test whether a value is an object the walk follows. */
+static int hdCollectable(int t)
+{
+    return t == LUA_TSTRING || t == LUA_TTABLE || t == LUA_TFUNCTION
+            || t == LUA_TUSERDATA || t == LUA_TTHREAD;
+}
+
+/** Push the walk's state table, or nil if no walk is running. */
+static void hdPushState(lua_State *L)
+{
+    lua_pushlightuserdata(L, (void *)HEAPDUMP_STATE);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+}
+
+/** Discard the C side of the walk. */
+static void hdReset(void)
+{
+    size_t i;
+    for (i = 0; i < HdNRoots; ++i)
+        free(HdRoots[i].name);
+    free(HdRoots);
+    HdRoots = NULL;
+    HdNRoots = HdRootCap = HdNextRoot = 0;
+    HdWorkTop = 0;
+    memset(HdTypeObjects, 0, sizeof(HdTypeObjects));
+    memset(HdTypeBytes, 0, sizeof(HdTypeBytes));
+    HdNBiggest = 0;
+    HdObjects = HdSteps = 0;
+    HdMicros = 0;
+    free(HdPath);
+    HdPath = NULL;
+}
+
+/** Mark a value as seen, so the walk leaves it alone.
+ *
+ * \returns Non-zero if it had not been seen before.
+ */
+static int hdMark(lua_State *L, int seen, int idx)
+{
+    lua_pushvalue(L, idx);
+    lua_rawget(L, seen);
+    if (!lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        return 0;
+    }
+    lua_pop(L, 1);
+    lua_pushvalue(L, idx);
+    lua_pushboolean(L, 1);
+    lua_rawset(L, seen);
+    return 1;
+}
+
+/** Queue the value at \a idx to be walked on behalf of \a root. */
+static void hdQueue(lua_State *L, int st, int idx, size_t root)
+{
+    if (!hdCollectable(lua_type(L, idx)) || !hdMark(L, st + HD_SEEN, idx))
+        return;
+    ++HdWorkTop;
+    lua_pushvalue(L, idx);
+    lua_rawseti(L, st + HD_WORK, HdWorkTop);
+    lua_pushnumber(L, (lua_Number)root);
+    lua_rawseti(L, st + HD_WORKROOT, HdWorkTop);
+}
+
+/** Charge an object to a root. */
+static void hdCharge(size_t root, int type, SvcU64 bytes)
+{
+    int i;
+
+    ++HdObjects;
+    ++HdTypeObjects[type];
+    HdTypeBytes[type] += bytes;
+    HdRoots[root].bytes += bytes;
+    ++HdRoots[root].objects;
+    if (HdNBiggest == HD_BIGGEST && bytes <= HdBiggest[HD_BIGGEST-1].bytes)
+        return;
+    if (HdNBiggest < HD_BIGGEST)
+        ++HdNBiggest;
+    for (i = HdNBiggest - 1; i > 0 && HdBiggest[i-1].bytes < bytes; --i)
+        HdBiggest[i] = HdBiggest[i-1];
+    HdBiggest[i].bytes = bytes;
+    HdBiggest[i].type = type;
+    HdBiggest[i].root = root;
+}
+
+/** Add the value at the top of the stack as a root, and pop it. */
+static void hdAddRoot(lua_State *L, int st, const char *name)
+{
+    if (!hdCollectable(lua_type(L, -1))) {
+        lua_pop(L, 1);
+        return;
+    }
+    if (HdNRoots == HdRootCap) {
+        size_t cap = HdRootCap ? HdRootCap * 2 : 64;
+        HdRoot *p = (HdRoot *)realloc(HdRoots, cap * sizeof(HdRoot));
+        if (!p) {
+            lua_pop(L, 1);
+            return;
+        }
+        HdRoots = p;
+        HdRootCap = cap;
+    }
+    HdRoots[HdNRoots].name = strdup(name);
+    HdRoots[HdNRoots].bytes = 0;
+    HdRoots[HdNRoots].objects = 0;
+    ++HdNRoots;
+    lua_rawseti(L, st + HD_ROOTS, (int)HdNRoots);
+}
+
+/** Describe the key at \a idx for a root name, in \a buf. */
+static void hdKeyName(lua_State *L, int idx, const char *prefix, char *buf)
+{
+    if (lua_type(L, idx) == LUA_TSTRING)
+        sprintf(buf, "%s.%.100s", prefix, lua_tostring(L, idx));
+    else if (lua_type(L, idx) == LUA_TNUMBER)
+        sprintf(buf, "%s[%.14g]", prefix, (double)lua_tonumber(L, idx));
+    else
+        sprintf(buf, "%s[%s]", prefix, lua_typename(L, lua_type(L, idx)));
+}
+
+/** Add the locals, upvalues and functions of a thread's stack as roots. */
+static void hdStackRoots(lua_State *L, int st)
+{
+    lua_Debug ar;
+    char func[128], buf[256];
+    const char *name;
+    int level, i;
+
+    for (level = 0; lua_getstack(L, level, &ar); ++level) {
+        lua_getinfo(L, "Snf", &ar);
+        if (*ar.what == 'C')
+            sprintf(func, "%.60s [C]", ar.name ? ar.name : "?");
+        else
+            sprintf(func, "%.40s %.50s:%d", ar.name ? ar.name : "?",
+                    ar.short_src, ar.linedefined);
+        for (i = 1; (name = lua_getupvalue(L, -1, i)) != NULL; ++i) {
+            sprintf(buf, "upvalue %.60s of %s", *name ? name : "?", func);
+            hdAddRoot(L, st, buf);
+        }
+        sprintf(buf, "function %s", func);
+        hdAddRoot(L, st, buf);
+        for (i = 1; (name = lua_getlocal(L, &ar, i)) != NULL; ++i) {
+            sprintf(buf, "local %.60s in %s", name, func);
+            hdAddRoot(L, st, buf);
+        }
+    }
+}
+
+/** Push the globals table. */
+static void hdPushGlobals(lua_State *L)
+{
+#if LUA_VERSION_NUM >= 502
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+#else
+    lua_pushvalue(L, LUA_GLOBALSINDEX);
+#endif
+}
+
+/** Begin a walk, collecting its roots. */
+static void hdStart(lua_State *L, const char *path, DWORD slice)
+{
+    char buf[200];
+    int st, g;
+
+    hdReset();
+    HdPath = SvcFullPath(path);
+    if (!HdPath)
+        HdPath = strdup(path);
+    HdSlice = slice;
+    lua_checkstack(L, 12);
+
+    lua_newtable(L);
+    st = lua_gettop(L);
+    lua_newtable(L);                    /* seen, with weak keys */
+    lua_newtable(L);
+    lua_pushstring(L, "k");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_rawseti(L, st, HD_SEEN);
+    lua_newtable(L);
+    lua_rawseti(L, st, HD_WORK);
+    lua_newtable(L);
+    lua_rawseti(L, st, HD_WORKROOT);
+    lua_newtable(L);
+    lua_rawseti(L, st, HD_ROOTS);
+    lua_pushlightuserdata(L, (void *)HEAPDUMP_STATE);
+    lua_pushvalue(L, st);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
+    /* Work on absolute indices st+1 .. st+4 from here on. */
+    lua_rawgeti(L, st, HD_SEEN);
+    lua_rawgeti(L, st, HD_WORK);
+    lua_rawgeti(L, st, HD_WORKROOT);
+    lua_rawgeti(L, st, HD_ROOTS);
+    hdMark(L, st + HD_SEEN, st);
+    hdMark(L, st + HD_SEEN, st + HD_SEEN);
+    hdMark(L, st + HD_SEEN, st + HD_WORK);
+    hdMark(L, st + HD_SEEN, st + HD_WORKROOT);
+    hdMark(L, st + HD_SEEN, st + HD_ROOTS);
+
+    /* The globals table is the first root, and each of its fields
+     * another. It is marked as seen so that it is not walked as a
+     * whole, see hdGlobals(). */
+    hdPushGlobals(L);
+    g = lua_gettop(L);
+    hdMark(L, st + HD_SEEN, g);
+    lua_pushvalue(L, g);
+    hdAddRoot(L, st, "[globals table]");
+    lua_pushnil(L);
+    while (lua_next(L, g)) {
+        hdKeyName(L, -2, "_G", buf);
+        hdAddRoot(L, st, buf);
+    }
+    lua_pop(L, 1);
+
+    hdStackRoots(L, st);
+
+    lua_pushnil(L);
+    while (lua_next(L, LUA_REGISTRYINDEX)) {
+        if (lua_touserdata(L, -2) == (void *)HEAPDUMP_STATE) {
+            lua_pop(L, 1);
+            continue;
+        }
+        hdKeyName(L, -2, "registry", buf);
+        hdAddRoot(L, st, buf);
+    }
+    lua_settop(L, st - 1);
+    SvcDebugTrace("Heap dump started with %d roots\n", (DWORD)HdNRoots);
+}
+
+/** Walk one object, charging it to \a root and queueing what it refers to.
+ *
+ * \param L Lua state context.
+ * \param st Index of the state table, with its tables above it.
+ * \param obj Index of the object.
+ * \param root The root it is charged to.
+ */
+static void hdVisit(lua_State *L, int st, int obj, size_t root)
+{
+    SvcU64 bytes = 0;
+    int type = lua_type(L, obj);
+    size_t len;
+
+    lua_checkstack(L, 8);
+    switch (type) {
+    case LUA_TSTRING:
+        lua_tolstring(L, obj, &len);
+        bytes = HD_STRING + len + 1;
+        break;
+
+    case LUA_TTABLE: {
+        int weakk = 0, weakv = 0;
+        unsigned long n = 0;
+        size_t arr;
+        if (lua_getmetatable(L, obj)) {
+            hdQueue(L, st, lua_gettop(L), root);
+            lua_pushstring(L, "__mode");
+            lua_rawget(L, -2);
+            if (lua_type(L, -1) == LUA_TSTRING) {
+                const char *mode = lua_tostring(L, -1);
+                weakk = strchr(mode, 'k') != NULL;
+                weakv = strchr(mode, 'v') != NULL;
+            }
+            lua_pop(L, 2);
+        }
+        lua_pushnil(L);
+        while (lua_next(L, obj)) {
+            ++n;
+            if (!weakk)
+                hdQueue(L, st, lua_gettop(L) - 1, root);
+            if (!weakv)
+                hdQueue(L, st, lua_gettop(L), root);
+            lua_pop(L, 1);
+        }
+        arr = hdRawLen(L, obj);
+        bytes = HD_TABLE + (SvcU64)arr * HD_ARRAYSLOT
+                + (SvcU64)(n > arr ? n - arr : 0) * HD_HASHSLOT;
+        break;
+    }
+
+    case LUA_TFUNCTION: {
+        int i;
+        bytes = HD_FUNCTION;
+        for (i = 1; lua_getupvalue(L, obj, i) != NULL; ++i) {
+            bytes += HD_UPVALUE;
+            hdQueue(L, st, lua_gettop(L), root);
+            lua_pop(L, 1);
+        }
+#if LUA_VERSION_NUM < 502
+        lua_getfenv(L, obj);
+        hdQueue(L, st, lua_gettop(L), root);
+        lua_pop(L, 1);
+#endif
+        break;
+    }
+
+    case LUA_TUSERDATA:
+        bytes = HD_USERDATA + hdRawLen(L, obj);
+        if (lua_getmetatable(L, obj)) {
+            hdQueue(L, st, lua_gettop(L), root);
+            lua_pop(L, 1);
+        }
+#if LUA_VERSION_NUM < 502
+        lua_getfenv(L, obj);
+#else
+        lua_getuservalue(L, obj);
+#endif
+        hdQueue(L, st, lua_gettop(L), root);
+        lua_pop(L, 1);
+        break;
+
+    case LUA_TTHREAD: {
+        lua_State *co = lua_tothread(L, obj);
+        lua_Debug ar;
+        int level, i, top;
+        bytes = HD_THREAD;
+        if (co == L)
+            break;
+        /* As debug.getlocal() does for another thread. */
+        top = lua_gettop(co);
+        for (i = 1; i <= top && lua_checkstack(co, 1); ++i) {
+            lua_pushvalue(co, i);
+            lua_xmove(co, L, 1);
+            hdQueue(L, st, lua_gettop(L), root);
+            lua_pop(L, 1);
+        }
+        for (level = 0; lua_getstack(co, level, &ar); ++level) {
+            if (!lua_checkstack(co, 1))
+                break;
+            lua_getinfo(co, "f", &ar);
+            lua_xmove(co, L, 1);
+            hdQueue(L, st, lua_gettop(L), root);
+            lua_pop(L, 1);
+            for (i = 1; lua_getlocal(co, &ar, i) != NULL; ++i) {
+                lua_xmove(co, L, 1);
+                hdQueue(L, st, lua_gettop(L), root);
+                lua_pop(L, 1);
+            }
+        }
+        break;
+    }
+    }
+    hdCharge(root, type, bytes);
+}
+
+/** Walk the globals table, the first root.
+ *
+ * Only its keys and metatable are charged to it. Its values are roots
+ * of their own.
+ */
+static void hdGlobals(lua_State *L, int st)
+{
+    unsigned long n = 0;
+    size_t arr;
+    int g;
+
+    hdPushGlobals(L);
+    g = lua_gettop(L);
+    if (lua_getmetatable(L, g)) {
+        hdQueue(L, st, lua_gettop(L), 0);
+        lua_pop(L, 1);
+    }
+    lua_pushnil(L);
+    while (lua_next(L, g)) {
+        ++n;
+        hdQueue(L, st, lua_gettop(L) - 1, 0);
+        lua_pop(L, 1);
+    }
+    arr = hdRawLen(L, g);
+    hdCharge(0, LUA_TTABLE, HD_TABLE + (SvcU64)arr * HD_ARRAYSLOT
+            + (SvcU64)(n > arr ? n - arr : 0) * HD_HASHSLOT);
+    lua_pop(L, 1);
+}
+
+/** Compare roots by size, largest first, for qsort(). */
+static int hdCompareRoots(const void *a, const void *b)
+{
+    const HdRoot *x = *(const HdRoot * const *)a;
+    const HdRoot *y = *(const HdRoot * const *)b;
+    return x->bytes < y->bytes ? 1 : x->bytes > y->bytes ? -1 : 0;
+}
+
+/** Write the results of the finished walk to HdPath. */
+static void hdWrite(lua_State *L)
+{
+    HdRoot **order;
+    SvcU64 total = 0;
+    FILE *fp;
+    size_t i;
+    int t;
+
+    fp = fopen(HdPath, "w");
+    if (!fp) {
+        SvcDebugTraceStr("Can't write heap dump %s\n", HdPath);
+        return;
+    }
+    for (t = 0; t <= LUA_TTHREAD; ++t)
+        total += HdTypeBytes[t];
+    fprintf(fp, "# heap dump: %lu objects, %.0f bytes (estimated), "
+            "%lu roots, %.0f ms in %lu steps\n", HdObjects, (double)total,
+            (unsigned long)HdNRoots, (double)HdMicros / 1000, HdSteps);
+    fprintf(fp, "# by type: type objects bytes\n");
+    for (t = 0; t <= LUA_TTHREAD; ++t)
+        if (HdTypeObjects[t])
+            fprintf(fp, "%s %lu %.0f\n", lua_typename(L, t),
+                    HdTypeObjects[t], (double)HdTypeBytes[t]);
+
+    fprintf(fp, "# by root: bytes objects root\n");
+    order = (HdRoot **)malloc((HdNRoots + 1) * sizeof(HdRoot *));
+    if (order) {
+        for (i = 0; i < HdNRoots; ++i)
+            order[i] = &HdRoots[i];
+        qsort(order, HdNRoots, sizeof(HdRoot *), hdCompareRoots);
+        for (i = 0; i < HdNRoots && i < HD_REPORTROOTS && order[i]->bytes; ++i)
+            fprintf(fp, "%.0f %lu %s\n", (double)order[i]->bytes,
+                    order[i]->objects, order[i]->name);
+        free(order);
+    }
+
+    fprintf(fp, "# largest objects: bytes type root\n");
+    for (t = 0; t < HdNBiggest; ++t)
+        fprintf(fp, "%.0f %s %s\n", (double)HdBiggest[t].bytes,
+                lua_typename(L, HdBiggest[t].type),
+                HdRoots[HdBiggest[t].root].name);
+    if (ferror(fp))
+        SvcDebugTraceStr("Error writing heap dump %s\n", HdPath);
+    fclose(fp);
+    SvcDebugTraceStr("Heap dump written to %s\n", HdPath);
+}
+
+/** Run the walk for one time slice, or to the end if HdSlice is zero.
+ *
+ * \returns Non-zero if the walk finished, in which case its results
+ * have been written and its state discarded.
+ */
+static int hdStep(lua_State *L)
+{
+    SvcU64 start = SvcMicros();
+    unsigned long count = 0;
+    int base = lua_gettop(L);
+    int st, obj, done = 0;
+    size_t root;
+
+    lua_checkstack(L, 12);
+    hdPushState(L);
+    st = lua_gettop(L);
+    lua_rawgeti(L, st, HD_SEEN);
+    lua_rawgeti(L, st, HD_WORK);
+    lua_rawgeti(L, st, HD_WORKROOT);
+    lua_rawgeti(L, st, HD_ROOTS);
+    obj = lua_gettop(L) + 1;
+    for (;;) {
+        if (HdWorkTop == 0) {
+            if (HdNextRoot >= HdNRoots) {
+                done = 1;
+                break;
+            }
+            if (++HdNextRoot == 1) {
+                hdGlobals(L, st);
+                continue;
+            }
+            lua_rawgeti(L, st + HD_ROOTS, (int)HdNextRoot);
+            hdQueue(L, st, obj, HdNextRoot - 1);
+            lua_pop(L, 1);
+            continue;
+        }
+        lua_rawgeti(L, st + HD_WORK, HdWorkTop);
+        lua_rawgeti(L, st + HD_WORKROOT, HdWorkTop);
+        root = (size_t)lua_tonumber(L, -1);
+        lua_pop(L, 1);
+        lua_pushnil(L);
+        lua_rawseti(L, st + HD_WORK, HdWorkTop);
+        --HdWorkTop;
+        hdVisit(L, st, obj, root);
+        lua_settop(L, obj - 1);
+        if ((++count & 63) == 0 && HdSlice
+                && SvcMicros() - start >= (SvcU64)HdSlice * 1000)
+            break;
+    }
+    ++HdSteps;
+    HdMicros += SvcMicros() - start;
+    lua_settop(L, base);
+    if (done) {
+        hdWrite(L);
+        lua_pushlightuserdata(L, (void *)HEAPDUMP_STATE);
+        lua_pushnil(L);
+        lua_rawset(L, LUA_REGISTRYINDEX);
+        SvcDebugTrace("Heap dump finished, %d objects\n", HdObjects);
+        hdReset();
+    }
+    return done;
+}
+
+/** Continue a heap dump running in this state, for one time slice.
+ *
+ * \context
+ * Service worker thread
+ *
+ * \param L Lua state context of the worker.
+ */
+void LuaHeapDumpPoll(lua_State *L)
+{
+    int running;
+
+    if (!HdPath)
+        return;
+    hdPushState(L);
+    running = lua_istable(L, -1);
+    lua_pop(L, 1);
+    if (running)
+        hdStep(L);
+}
+
+/** Abandon a heap dump running in a state about to be closed.
+ *
+ * \param L The Lua state.
+ */
+void LuaHeapDumpAbort(lua_State *L)
+{
+    int running;
+
+    if (!HdPath)
+        return;
+    hdPushState(L);
+    running = lua_istable(L, -1);
+    lua_pop(L, 1);
+    if (running) {
+        SvcDebugTrace("Heap dump abandoned\n", 0);
+        hdReset();
+    }
+}
+
+/** Implement the Lua function service.heapdump([file [, slice]]).
+ *
+ * Start a census of the heap, to be written to \a file once complete.
+ * The walk then advances by \a slice ms, 10 by default, at each call
+ * to service.sleep() or service.stopping(). A \a slice of zero walks
+ * the whole heap at once, and the file is written before returning.
+ *
+ * Called with no arguments, returns whether a census is running and
+ * the number of objects it has seen so far.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+int LuaHeapDump(lua_State *L)
+{
+    const char *path = luaL_optstring(L, 1, NULL);
+    int slice = (int)luaL_optinteger(L, 2, HD_SLICE);
+
+    if (!path) {
+        lua_pushboolean(L, HdPath != NULL);
+        lua_pushnumber(L, (lua_Number)HdObjects);
+        return 2;
+    }
+    luaL_argcheck(L, slice >= 0, 2, "slice must not be negative");
+    if (HdPath) {
+        lua_pushnil(L);
+        lua_pushstring(L, "a heap dump is already running");
+        return 2;
+    }
+    hdStart(L, path, (DWORD)slice);
+    hdStep(L);
+    lua_pushboolean(L, 1);
+    return 1;
+}
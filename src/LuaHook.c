@@ -0,0 +1,131 @@
+/*! \file LuaHook.c
+ *  \brief The count hook the framework's features share.
+ *
+ * Several features need the worker to stop at its next VM instruction
+ * and run some code there, on the worker thread, where the Lua stack
+ * may safely be walked: the profiler takes a sample, the command
+ * endpoint a traceback, the watchdog traces or fails a hung script,
+ * and a stopping script is cancelled. A Lua state has only one hook,
+ * so they do not set it themselves. Each asks for it with
+ * LuaHookRequest(), from whatever thread notices the need, which sets
+ * the feature's request flag and installs LuaHook(), the only hook
+ * the framework uses.
+ *
+ * The hook takes all the flags at once and calls the handler of each
+ * feature that asked. A handler is done with one call, or asks to be
+ * called again after LUAHOOK_REPEAT more instructions, or also raises
+ * an error in the script. The hook then installs itself for the
+ * repeats, or removes itself if there are none, and so the script
+ * runs with no hook at all when nothing is wanted.
+ *
+ * A handler is called whenever its flag is set, including for a
+ * request made just before the feature stopped wanting it, so each
+ * handler checks its own state first and is simply done if there is
+ * nothing to do. The hook is left alone when a script finishes, and
+ * removes itself at its next call.
+ *
+ * The hook replaces any hook set with debug.sethook().
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "luaservice.h"
+
+/** Instructions between calls of a handler that wants to be called
+ * again. */
+#define LUAHOOK_REPEAT 1000
+
+/** The LUAHOOK_ flags of the features that want the hook called. */
+static volatile DWORD HookWanted;
+
+/** The handlers of the features, in the order they are called. Once
+ * one has raised an error, the ones after it wait for the repeat. */
+static const struct {
+    DWORD what;                         /**< The LUAHOOK_ flag. */
+    int (*handler)(lua_State *L);       /**< Called with the flag set. */
+} HookHandlers[] = {
+    { LUAHOOK_SAMPLE,       LuaProfilerHook },
+    { LUAHOOK_TRACEBACK,    LuaCommandHook },
+    { LUAHOOK_WATCHDOG,     LuaWatchdogHook },
+    { LUAHOOK_CANCEL,       LuaCancelHook },
+    { 0, NULL }
+};
+
+/** Set request flags.
+ *
+ * \param what The LUAHOOK_ flags to set.
+ */
+static void HookSet(DWORD what)
+{
+    DWORD old;
+
+    do
+        old = HookWanted;
+    while (SvcAtomicCompareSwap(&HookWanted, old, old | what) != old);
+}
+
+/** The framework's count hook.
+ *
+ * Calls the handlers of the features that asked for it, and installs
+ * itself again for those that want to be called again.
+ *
+ * \context
+ * Service worker thread
+ */
+static void LuaHook(lua_State *L, lua_Debug *ar)
+{
+    DWORD wanted, again = 0;
+    int raise = 0;
+    int i;
+
+    (void)ar;
+    wanted = SvcAtomicSwap(&HookWanted, 0);
+    for (i = 0; HookHandlers[i].what; ++i) {
+        if (!(wanted & HookHandlers[i].what))
+            continue;
+        if (raise) {
+            again |= HookHandlers[i].what;
+            continue;
+        }
+        switch (HookHandlers[i].handler(L)) {
+        case LUAHOOK_RAISE:
+            raise = 1;
+            again |= HookHandlers[i].what;
+            break;
+        case LUAHOOK_AGAIN:
+            again |= HookHandlers[i].what;
+            break;
+        default:
+            break;
+        }
+    }
+    if (again) {
+        HookSet(again);
+        lua_sethook(L, LuaHook, LUA_MASKCOUNT, LUAHOOK_REPEAT);
+    } else
+        lua_sethook(L, NULL, 0, 0);
+    // a request made while the handlers ran must not wait for a repeat,
+    // nor be lost with the hook just removed
+    if (HookWanted & ~again)
+        lua_sethook(L, LuaHook, LUA_MASKCOUNT, 1);
+    if (raise)
+        lua_error(L);
+}
+
+/** Ask for the handler of a feature to be called at the next VM
+ * instruction of a Lua state.
+ *
+ * \context
+ * Any thread
+ *
+ * \param L The Lua state, which is running on the worker.
+ * \param what The LUAHOOK_ flag of the feature.
+ */
+void LuaHookRequest(lua_State *L, DWORD what)
+{
+    HookSet(what);
+    lua_sethook(L, LuaHook, LUA_MASKCOUNT, 1);
+}
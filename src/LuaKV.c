@@ -0,0 +1,1154 @@
+/*! \file LuaKV.c
+ *  \brief Embedded append-only key-value store.
+ *
+ * A store is a single log file of records, each holding a key and
+ * either a value or a deletion marker. The location of the latest
+ * record of every live key is kept in an in-memory hash index that
+ * is rebuilt by reading the log when the store is opened.
+ *
+ * Writes are appended to a memory buffer and handed to the disk by
+ * a writer thread that belongs to the store. The writer performs
+ * group commit: every record buffered since its last pass goes out
+ * in one write followed by (depending on the sync policy) one call
+ * to SvcFileSync(), no matter how many writers were waiting.
+ * The same thread rewrites the log without its dead records when
+ * enough of it is garbage.
+ *
+ * Stores are shared by the whole process. Opening a file that is
+ * already open in any Lua state returns the same store, so state
+ * can be shared by Lua states running in different threads.
+ *
+ * \verbatim
+ * local db = service.kv.open("state.kv", {sync="batch", interval=50})
+ * db:put("last", os.time())
+ * for k, v in db:pairs() do print(k, v) end
+ * db:close()
+ * \endverbatim
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "luaservice.h"
+
+/** Metatable name for store handles. */
+#define KV_META "LuaService.kv"
+
+/** Metatable name for snapshot iterators. */
+#define KVSNAP_META "LuaService.kv.snapshot"
+
+/** Value length marking a deletion record. */
+#define KV_TOMBSTONE 0xFFFFFFFFu
+
+/** Buffered bytes that make a batch writer start early. */
+#define KV_EAGER (4 << 20)
+
+/** Largest key or value accepted. */
+#define KV_MAXITEM 0x7FFFFFFFu
+
+/** Size of a record header: crc, key length, value length. */
+#define KV_HDR 12
+
+/** Sync policies. */
+enum { KV_SYNC_NONE, KV_SYNC_BATCH, KV_SYNC_ALWAYS };
+
+/** One live key in the index. */
+typedef struct KvKey {
+    struct KvKey *next;       /**< Next key in the same bucket. */
+    unsigned int hash;        /**< Hash of the key bytes. */
+    unsigned int klen;        /**< Key length. */
+    unsigned int vlen;        /**< Value length. */
+    SvcU64 off;               /**< Log offset of the record. */
+    char key[1];              /**< Key bytes (klen of them). */
+} KvKey;
+
+/** An open store. */
+typedef struct KvStore {
+    struct KvStore *link;     /**< Next store in the process list. */
+    char *path;               /**< File name as given to open. */
+    volatile long refs;       /**< Open handles in all Lua states. */
+    SvcMutex lock;            /**< Guards everything below. */
+    SvcCond work;             /**< Wakes the writer thread. */
+    SvcCond done;             /**< Signalled after each writer pass. */
+    SvcFile file;             /**< The log file. */
+    SvcThread *thread;        /**< The writer thread. */
+    int sync;                 /**< KV_SYNC_xxx. */
+    DWORD interval;           /**< Writer period in ms. */
+    double compact_ratio;     /**< Dead fraction that triggers compaction. */
+    SvcU64 file_end;          /**< Bytes in the file. */
+    SvcU64 durable;           /**< Bytes known to be on disk. */
+    char *wbuf;               /**< Buffer being written by the writer, or
+                               * left by a failed write to be retried. */
+    size_t wbuf_len, wbuf_alloc;
+    char *buf;                /**< Buffer accumulating new records. */
+    size_t buf_len, buf_alloc;
+    KvKey **buckets;          /**< Hash index. */
+    size_t nbuckets;
+    size_t count;             /**< Live keys. */
+    SvcU64 live;              /**< Bytes of live records. */
+    int pins;                 /**< Live snapshots; compaction waits for zero. */
+    int compact;              /**< Compaction requested. */
+    int compacting;           /**< Compaction is copying records. */
+    int flush;                /**< Someone waits for a writer pass. */
+    int stopping;             /**< Writer should exit. */
+    DWORD error;              /**< Last write error, reported to callers. */
+} KvStore;
+
+/** A Lua handle on a store. */
+typedef struct KvHandle {
+    KvStore *s;
+} KvHandle;
+
+/** One item of a snapshot. */
+typedef struct KvSnapItem {
+    SvcU64 off;
+    unsigned int klen, vlen;
+} KvSnapItem;
+
+/** A Lua snapshot iterator. */
+typedef struct KvSnap {
+    KvStore *s;
+    KvSnapItem *items;
+    size_t n, next;
+} KvSnap;
+
+/** Open stores in this process. */
+static KvStore *KvStores;
+
+/** Guards KvStores and the CRC table. */
+static SvcMutex KvListLock = SVC_MUTEX_INIT;
+
+/** CRC-32 table, built on first open. */
+static unsigned int KvCrcTable[256];
+
+static void KvCrcInit(void)
+{
+    unsigned int i, j, c;
+    if (KvCrcTable[1])
+        return;
+    for (i = 0; i < 256; ++i) {
+        c = i;
+        for (j = 0; j < 8; ++j)
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        KvCrcTable[i] = c;
+    }
+}
+
+static unsigned int KvCrc(unsigned int crc, const void *p, size_t n)
+{
+    const unsigned char *b = (const unsigned char *)p;
+    crc = ~crc;
+    while (n--)
+        crc = KvCrcTable[(crc ^ *b++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+static unsigned int KvHash(const char *s, size_t len)
+{
+    unsigned int h = 2166136261u;
+    while (len--) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/** Size of the record for a key. */
+#define KvRecSize(k) (KV_HDR + (SvcU64)(k)->klen + (k)->vlen)
+
+/** Find a key in the index, or NULL. Caller holds the lock. */
+static KvKey *KvFind(KvStore *s, const char *key, size_t klen, unsigned int h)
+{
+    KvKey *k;
+    for (k = s->buckets[h & (s->nbuckets - 1)]; k; k = k->next)
+        if (k->hash == h && k->klen == klen && memcmp(k->key, key, klen) == 0)
+            return k;
+    return NULL;
+}
+
+/** Grow the bucket array when the load factor reaches one. */
+static void KvGrow(KvStore *s)
+{
+    size_t n = s->nbuckets * 2, i;
+    KvKey **b = (KvKey **)calloc(n, sizeof(KvKey *));
+    if (!b)
+        return; /* keep working with longer chains */
+    for (i = 0; i < s->nbuckets; ++i) {
+        KvKey *k = s->buckets[i], *next;
+        for (; k; k = next) {
+            next = k->next;
+            k->next = b[k->hash & (n - 1)];
+            b[k->hash & (n - 1)] = k;
+        }
+    }
+    free(s->buckets);
+    s->buckets = b;
+    s->nbuckets = n;
+}
+
+/** Record the location of a key's latest record. Caller holds the lock.
+ *
+ * \returns Zero if memory is exhausted.
+ */
+static int KvIndexSet(KvStore *s, const char *key, unsigned int klen,
+        unsigned int vlen, SvcU64 off)
+{
+    unsigned int h = KvHash(key, klen);
+    KvKey *k = KvFind(s, key, klen, h);
+    KvKey **pp;
+
+    if (vlen == KV_TOMBSTONE) {
+        if (!k)
+            return 1;
+        for (pp = &s->buckets[h & (s->nbuckets - 1)]; *pp != k; pp = &(*pp)->next)
+            ;
+        *pp = k->next;
+        s->live -= KvRecSize(k);
+        s->count--;
+        free(k);
+        return 1;
+    }
+    if (!k) {
+        k = (KvKey *)malloc(sizeof(KvKey) + klen);
+        if (!k)
+            return 0;
+        k->hash = h;
+        k->klen = klen;
+        memcpy(k->key, key, klen);
+        k->next = s->buckets[h & (s->nbuckets - 1)];
+        s->buckets[h & (s->nbuckets - 1)] = k;
+        s->count++;
+        if (s->count > s->nbuckets)
+            KvGrow(s);
+    } else
+        s->live -= KvRecSize(k);
+    k->vlen = vlen;
+    k->off = off;
+    s->live += KvRecSize(k);
+    return 1;
+}
+
+/** Read bytes at an absolute file offset. */
+static int KvReadAt(SvcFile f, SvcU64 off, void *p, size_t n)
+{
+    return SvcFileRead(f, off, p, n) == (long)n;
+}
+
+/** Copy bytes of the log, wherever they currently live. Caller holds the lock.
+ *
+ * The log is the file followed by the buffer in flight to the writer
+ * and then the buffer still accumulating.
+ */
+static int KvReadLog(KvStore *s, SvcU64 off, void *p, size_t n)
+{
+    if (off >= s->file_end + s->wbuf_len) {
+        memcpy(p, s->buf + (off - s->file_end - s->wbuf_len), n);
+        return 1;
+    }
+    if (off >= s->file_end) {
+        memcpy(p, s->wbuf + (off - s->file_end), n);
+        return 1;
+    }
+    return KvReadAt(s->file, off, p, n);
+}
+
+/** Make sure \a need bytes of the log are in the replay chunk.
+ *
+ * The chunk holds the log starting at offset \a off from position
+ * \a *pos. Unused bytes are moved to the front and more of the file
+ * is read after them.
+ *
+ * \returns 1 if the bytes are available, 0 if the file ends before
+ * them, or -1 with \a *perr set if they could not be read.
+ */
+static int KvFill(KvStore *s, char **chunk, size_t *cap, size_t *have,
+        size_t *pos, SvcU64 off, SvcU64 end, size_t need, DWORD *perr)
+{
+    SvcU64 left;
+    size_t n;
+    long got;
+
+    if (*have - *pos >= need)
+        return 1;
+    memmove(*chunk, *chunk + *pos, *have - *pos);
+    *have -= *pos;
+    *pos = 0;
+    if (need > *cap) {
+        char *p = (char *)realloc(*chunk, need);
+        if (!p) {
+            *perr = SVC_ENOMEM;
+            return -1;
+        }
+        *chunk = p;
+        *cap = need;
+    }
+    left = end - (off + *have);
+    n = (size_t)((*cap - *have) < left ? (*cap - *have) : left);
+    if (n) {
+        got = SvcFileRead(s->file, off + *have, *chunk + *have, n);
+        if (got < 0) {
+            *perr = SvcLastError();
+            return -1;
+        }
+        *have += (size_t)got;
+    }
+    return *have >= need;
+}
+
+/** Rebuild the index by reading the whole log.
+ *
+ * A damaged or incomplete record at the tail, as left by a crash in
+ * the middle of a write, is cut off so that new records follow the
+ * last good one. A read error or lack of memory fails the open and
+ * leaves the file as it is.
+ *
+ * \returns Non-zero on success, or zero with \a *perr set.
+ */
+static int KvReplay(KvStore *s, DWORD *perr)
+{
+    SvcU64 off = 0, end;
+    size_t cap = 1 << 20, have = 0, pos = 0;
+    char *chunk = (char *)malloc(cap);
+    int r = 1;
+
+    if (!chunk) {
+        *perr = SVC_ENOMEM;
+        return 0;
+    }
+    if (!SvcFileSize(s->file, &end)) {
+        *perr = SvcLastError();
+        free(chunk);
+        return 0;
+    }
+    while (off < end) {
+        unsigned int crc, klen, vlen;
+        size_t need;
+
+        r = KvFill(s, &chunk, &cap, &have, &pos, off, end, KV_HDR, perr);
+        if (r <= 0)
+            break;
+        memcpy(&crc, chunk + pos, 4);
+        memcpy(&klen, chunk + pos + 4, 4);
+        memcpy(&vlen, chunk + pos + 8, 4);
+        if (klen > KV_MAXITEM || (vlen != KV_TOMBSTONE && vlen > KV_MAXITEM))
+            break;
+        need = KV_HDR + (size_t)klen + (vlen == KV_TOMBSTONE ? 0 : vlen);
+        if (off + need > end)
+            break;
+        r = KvFill(s, &chunk, &cap, &have, &pos, off, end, need, perr);
+        if (r <= 0 || KvCrc(0, chunk + pos + 4, need - 4) != crc)
+            break;
+        if (!KvIndexSet(s, chunk + pos + KV_HDR, klen, vlen, off)) {
+            *perr = SVC_ENOMEM;
+            r = -1;
+            break;
+        }
+        off += need;
+        pos += need;
+    }
+    free(chunk);
+    if (r < 0) {
+        SvcDebugTraceStr("kv: can't read %s\n", s->path);
+        return 0;
+    }
+
+    if (off < end) {
+        SvcDebugTraceStr("kv: truncating damaged tail of %s\n", s->path);
+        SvcFileTruncate(s->file, off);
+    }
+    s->file_end = s->durable = off;
+    return 1;
+}
+
+/** Append one record to the accumulating buffer. Caller holds the lock.
+ *
+ * \returns The log offset of the record, or (SvcU64)-1 if
+ * memory is exhausted.
+ */
+static SvcU64 KvAppend(KvStore *s, const char *key, unsigned int klen,
+        const char *val, unsigned int vlen)
+{
+    size_t vbytes = vlen == KV_TOMBSTONE ? 0 : vlen;
+    size_t need = KV_HDR + klen + vbytes;
+    SvcU64 off;
+    char *p;
+    unsigned int crc;
+
+    if (s->buf_len + need > s->buf_alloc) {
+        size_t n = s->buf_alloc ? s->buf_alloc : 65536;
+        while (n < s->buf_len + need)
+            n *= 2;
+        p = (char *)realloc(s->buf, n);
+        if (!p)
+            return (SvcU64)-1;
+        s->buf = p;
+        s->buf_alloc = n;
+    }
+    p = s->buf + s->buf_len;
+    memcpy(p + 4, &klen, 4);
+    memcpy(p + 8, &vlen, 4);
+    memcpy(p + KV_HDR, key, klen);
+    if (vbytes)
+        memcpy(p + KV_HDR + klen, val, vbytes);
+    crc = KvCrc(0, p + 4, need - 4);
+    memcpy(p, &crc, 4);
+    off = s->file_end + s->wbuf_len + s->buf_len;
+    s->buf_len += need;
+    return off;
+}
+
+/** Compare snapshot items by offset, for sequential copying. */
+static int KvCmpOff(const void *a, const void *b)
+{
+    SvcU64 x = ((const KvSnapItem *)a)->off;
+    SvcU64 y = ((const KvSnapItem *)b)->off;
+    return x < y ? -1 : x > y;
+}
+
+/** Rewrite the log without dead records. Called by the writer with the lock held.
+ *
+ * The live records are copied to a new file with the lock released,
+ * so readers and writers are not held up by the bulk of the work.
+ * Nothing reaches the old file meanwhile, since only this thread
+ * writes it; new records pile up in the buffer. With the lock held
+ * again the new file replaces the old one and every index entry is
+ * moved to its new offset.
+ */
+static void KvCompact(KvStore *s)
+{
+    size_t n = s->count, i, j;
+    KvSnapItem *items;
+    SvcU64 *newoff, end0, out = 0, delta;
+    char *tmp = NULL, *rec = NULL;
+    size_t reccap = 0;
+    SvcFile nf = SVC_BADFILE;
+    DWORD err = 0;
+
+    end0 = s->file_end;
+    items = (KvSnapItem *)malloc((n ? n : 1) * sizeof(KvSnapItem));
+    newoff = (SvcU64 *)malloc((n ? n : 1) * sizeof(SvcU64));
+    tmp = (char *)malloc(strlen(s->path) + 6);
+    if (!items || !newoff || !tmp)
+        goto done;
+    for (i = j = 0; i < s->nbuckets; ++i) {
+        KvKey *k;
+        for (k = s->buckets[i]; k; k = k->next)
+            if (k->off < end0) {
+                items[j].off = k->off;
+                items[j].klen = k->klen;
+                items[j].vlen = k->vlen;
+                ++j;
+            }
+    }
+    n = j;
+    qsort(items, n, sizeof(*items), KvCmpOff);
+    strcpy(tmp, s->path);
+    strcat(tmp, ".pack");
+
+    s->compacting = 1;
+    SvcMutexUnlock(&s->lock);
+    SvcDebugTraceStr("kv: compacting %s\n", s->path);
+    nf = SvcFileOpen(tmp, SVC_FILE_WRITE|SVC_FILE_CREATE|SVC_FILE_TRUNC);
+    if (nf == SVC_BADFILE)
+        err = SvcLastError();
+    for (i = 0; !err && i < n; ++i) {
+        size_t len = KV_HDR + (size_t)items[i].klen + items[i].vlen;
+        if (len > reccap) {
+            char *p = (char *)realloc(rec, len);
+            if (!p) {
+                err = SVC_ENOMEM;
+                break;
+            }
+            rec = p;
+            reccap = len;
+        }
+        if (!KvReadAt(s->file, items[i].off, rec, len)
+                || !SvcFileWrite(nf, out, rec, len)) {
+            err = SvcLastError();
+            break;
+        }
+        newoff[i] = out;
+        out += len;
+    }
+    if (!err && !SvcFileSync(nf))
+        err = SvcLastError();
+    if (nf != SVC_BADFILE)
+        SvcFileClose(nf);
+    SvcMutexLock(&s->lock);
+    s->compacting = 0;
+    if (err) {
+        SvcFileDelete(tmp);
+        goto done;
+    }
+
+    SvcFileClose(s->file);
+    if (!SvcFileReplace(tmp, s->path)) {
+        /* the old log is still complete, keep using it */
+        err = SvcLastError();
+        SvcFileDelete(tmp);
+        s->file = SvcFileOpen(s->path, SVC_FILE_WRITE);
+        if (s->file == SVC_BADFILE)
+            s->error = SvcLastError();
+        goto done;
+    }
+    s->file = SvcFileOpen(s->path, SVC_FILE_WRITE);
+    if (s->file == SVC_BADFILE)
+        s->error = SvcLastError();
+
+    /* records still in memory simply follow the shorter file */
+    delta = out - end0;
+    for (i = 0; i < s->nbuckets; ++i) {
+        KvKey *k;
+        for (k = s->buckets[i]; k; k = k->next) {
+            if (k->off >= end0)
+                k->off += delta;
+            else {
+                KvSnapItem key, *hit;
+                key.off = k->off;
+                hit = (KvSnapItem *)bsearch(&key, items, n, sizeof(*items), KvCmpOff);
+                if (hit)
+                    k->off = newoff[hit - items];
+            }
+        }
+    }
+    s->file_end = s->durable = out;
+    SvcDebugTrace("kv: compacted to %d bytes\n", (DWORD)out);
+
+done:
+    if (err)
+        SvcDebugTrace("kv: compaction failed (%d)\n", err);
+    free(rec);
+    free(tmp);
+    free(items);
+    free(newoff);
+}
+
+/** Body of a store's writer thread.
+ *
+ * Each pass moves the accumulating buffer to the disk in one write,
+ * makes it durable according to the sync policy, and wakes everyone
+ * who was waiting for it.
+ */
+static unsigned KvWriter(void *arg)
+{
+    KvStore *s = (KvStore *)arg;
+
+    SvcMutexLock(&s->lock);
+    for (;;) {
+        /* the log could not be reopened after compaction: nothing can
+         * be written any more, so stop and fail everyone who waits */
+        if (s->file == SVC_BADFILE)
+            break;
+        /* batch writers wait out the period unless the buffer gets large */
+        if (!s->stopping && !s->compact && !s->flush && !s->wbuf
+                && (s->sync == KV_SYNC_ALWAYS ? !s->buf_len : s->buf_len < KV_EAGER))
+            SvcCondWait(&s->work, &s->lock, s->interval);
+        s->flush = 0;
+        if (s->wbuf || s->buf_len) {
+            SvcU64 at = s->file_end;
+            DWORD err = 0;
+
+            /* a batch that failed before goes first, then the newer one */
+            if (!s->wbuf) {
+                s->wbuf = s->buf;
+                s->wbuf_len = s->buf_len;
+                s->wbuf_alloc = s->buf_alloc;
+                s->buf = NULL;
+                s->buf_len = s->buf_alloc = 0;
+            }
+            SvcMutexUnlock(&s->lock);
+            if (!SvcFileWrite(s->file, at, s->wbuf, s->wbuf_len))
+                err = SvcLastError();
+            else if (s->sync != KV_SYNC_NONE && !SvcFileSync(s->file))
+                err = SvcLastError();
+            SvcMutexLock(&s->lock);
+            if (err) {
+                /* keep the batch in wbuf, still ahead of anything newer */
+                SvcDebugTrace("kv: write failed (%d)\n", err);
+                s->error = err;
+                SvcCondBroadcast(&s->done);
+                if (s->stopping)
+                    break;
+                SvcCondWait(&s->work, &s->lock, s->interval);
+                continue;
+            }
+            s->error = 0;
+            s->file_end += s->wbuf_len;
+            if (s->sync != KV_SYNC_NONE)
+                s->durable = s->file_end;
+            /* reuse the written buffer if none has been started since */
+            if (!s->buf) {
+                s->buf = s->wbuf;
+                s->buf_alloc = s->wbuf_alloc;
+            } else
+                free(s->wbuf);
+            s->wbuf = NULL;
+            s->wbuf_len = s->wbuf_alloc = 0;
+            SvcCondBroadcast(&s->done);
+        }
+        if (!s->pins && (s->compact || (s->compact_ratio > 0
+                && s->file_end > (1 << 20)
+                && (double)(s->file_end - s->live) > s->compact_ratio * (double)s->file_end))) {
+            s->compact = 0;
+            KvCompact(s);
+            SvcCondBroadcast(&s->done);
+        }
+        if (s->stopping && !s->buf_len)
+            break;
+    }
+    if (s->sync == KV_SYNC_NONE && s->file != SVC_BADFILE)
+        SvcFileSync(s->file);
+    if (!s->error)
+        s->durable = s->file_end;
+    SvcCondBroadcast(&s->done);
+    SvcMutexUnlock(&s->lock);
+    return 0;
+}
+
+/** Wait until everything written so far is on the disk. Caller holds the lock.
+ *
+ * With the "none" policy the writer never flushes, so the flush is
+ * done here once the writer has written everything.
+ *
+ * \returns Zero, or the error that stopped the writer.
+ */
+static DWORD KvSync(KvStore *s)
+{
+    SvcU64 upto = s->file_end + s->wbuf_len + s->buf_len;
+
+    s->flush = 1;
+    SvcCondSignal(&s->work);
+    if (s->sync == KV_SYNC_NONE) {
+        while (s->file_end < upto && !s->error)
+            SvcCondWait(&s->done, &s->lock, SVC_INFINITE);
+        if (s->file_end < upto)
+            return s->error;
+        if (s->durable < upto) {
+            if (!SvcFileSync(s->file))
+                return SvcLastError();
+            s->durable = upto;
+        }
+        return 0;
+    }
+    while (s->durable < upto && !s->error)
+        SvcCondWait(&s->done, &s->lock, SVC_INFINITE);
+    return s->durable < upto ? s->error : 0;
+}
+
+/** Close a store and free everything it owns. */
+static void KvDestroy(KvStore *s)
+{
+    size_t i;
+
+    SvcMutexLock(&s->lock);
+    s->stopping = 1;
+    SvcCondSignal(&s->work);
+    SvcMutexUnlock(&s->lock);
+    if (s->thread)
+        SvcThreadWait(s->thread, SVC_INFINITE);
+    if (s->file != SVC_BADFILE)
+        SvcFileClose(s->file);
+    for (i = 0; i < s->nbuckets; ++i) {
+        KvKey *k = s->buckets[i], *next;
+        for (; k; k = next) {
+            next = k->next;
+            free(k);
+        }
+    }
+    free(s->buckets);
+    free(s->wbuf);
+    free(s->buf);
+    free(s->path);
+    SvcCondDestroy(&s->work);
+    SvcCondDestroy(&s->done);
+    SvcMutexDestroy(&s->lock);
+    free(s);
+}
+
+/** Open a store, or find it already open, and take a reference.
+ *
+ * The options only apply when the store is opened for the first time
+ * in the process.
+ */
+static KvStore *KvOpen(const char *path, int sync, DWORD interval,
+        double ratio, DWORD *perr)
+{
+    KvStore *s;
+
+    SvcMutexLock(&KvListLock);
+    KvCrcInit();
+    for (s = KvStores; s; s = s->link)
+        if (SvcPathCompare(s->path, path) == 0) {
+            SvcAtomicAdd(&s->refs, 1);
+            SvcMutexUnlock(&KvListLock);
+            return s;
+        }
+
+    s = (KvStore *)calloc(1, sizeof(KvStore));
+    if (!s) {
+        SvcMutexUnlock(&KvListLock);
+        *perr = SVC_ENOMEM;
+        return NULL;
+    }
+    SvcMutexInit(&s->lock);
+    SvcCondInit(&s->work);
+    SvcCondInit(&s->done);
+    s->refs = 1;
+    s->sync = sync;
+    s->interval = interval;
+    s->compact_ratio = ratio;
+    s->nbuckets = 1024;
+    s->path = strdup(path);
+    s->buckets = (KvKey **)calloc(s->nbuckets, sizeof(KvKey *));
+    s->file = SvcFileOpen(path, SVC_FILE_WRITE|SVC_FILE_CREATE);
+    if (s->file == SVC_BADFILE)
+        *perr = SvcLastError();
+    else if (!s->path || !s->buckets)
+        *perr = SVC_ENOMEM;
+    else if (KvReplay(s, perr)) {
+        s->thread = SvcThreadStart(KvWriter, s);
+        if (!s->thread)
+            *perr = SvcLastError();
+    }
+    if (!s->thread) {
+        SvcMutexUnlock(&KvListLock);
+        KvDestroy(s);
+        return NULL;
+    }
+    s->link = KvStores;
+    KvStores = s;
+    SvcMutexUnlock(&KvListLock);
+    SvcDebugTraceStr("kv: opened %s\n", path);
+    return s;
+}
+
+/** Drop a reference, closing the store with the last one. */
+static void KvRelease(KvStore *s)
+{
+    KvStore **pp;
+
+    SvcMutexLock(&KvListLock);
+    if (SvcAtomicAdd(&s->refs, -1) > 0) {
+        SvcMutexUnlock(&KvListLock);
+        return;
+    }
+    for (pp = &KvStores; *pp; pp = &(*pp)->link)
+        if (*pp == s) {
+            *pp = s->link;
+            break;
+        }
+    SvcMutexUnlock(&KvListLock);
+    SvcDebugTraceStr("kv: closing %s\n", s->path);
+    KvDestroy(s);
+}
+
+/** Get the store of the handle at stack index 1, raising an error if closed. */
+static KvStore *CheckStore(lua_State *L)
+{
+    KvHandle *h = (KvHandle *)luaL_checkudata(L, 1, KV_META);
+    if (!h->s)
+        luaL_error(L, "key-value store is closed");
+    return h->s;
+}
+
+/** Store a record and apply the sync policy, for put and delete. */
+static int KvWrite(lua_State *L, const char *key, size_t klen,
+        const char *val, size_t vlen)
+{
+    KvStore *s = CheckStore(L);
+    SvcU64 off;
+    DWORD err = 0;
+
+    if (klen > KV_MAXITEM || (val && vlen > KV_MAXITEM))
+        return luaL_error(L, "key or value too large");
+    SvcMutexLock(&s->lock);
+    if (s->file == SVC_BADFILE) {
+        /* the writer has stopped, see KvWriter() */
+        err = s->error;
+        SvcMutexUnlock(&s->lock);
+        return luaL_error(L, "key-value store write failed (%d)", err);
+    }
+    off = KvAppend(s, key, (unsigned int)klen, val,
+            val ? (unsigned int)vlen : KV_TOMBSTONE);
+    if (off == (SvcU64)-1
+            || !KvIndexSet(s, key, (unsigned int)klen,
+                    val ? (unsigned int)vlen : KV_TOMBSTONE, off))
+        err = SVC_ENOMEM;
+    else if (s->sync == KV_SYNC_ALWAYS)
+        err = KvSync(s);
+    else if (s->buf_len >= KV_EAGER)
+        SvcCondSignal(&s->work);
+    SvcMutexUnlock(&s->lock);
+    if (err)
+        return luaL_error(L, "key-value store write failed (%d)", err);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/** Implement the Lua method db:put(key, value).
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int kvPut(lua_State *L)
+{
+    size_t klen, vlen;
+    const char *key = luaL_checklstring(L, 2, &klen);
+    const char *val = luaL_checklstring(L, 3, &vlen);
+    return KvWrite(L, key, klen, val, vlen);
+}
+
+/** Implement the Lua method db:delete(key).
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int kvDelete(lua_State *L)
+{
+    size_t klen;
+    const char *key = luaL_checklstring(L, 2, &klen);
+    return KvWrite(L, key, klen, NULL, 0);
+}
+
+/** Implement the Lua method db:get(key).
+ *
+ * Returns the value stored for \a key, or nil.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int kvGet(lua_State *L)
+{
+    KvStore *s = CheckStore(L);
+    size_t klen;
+    const char *key = luaL_checklstring(L, 2, &klen);
+    KvKey *k;
+    char *val = NULL;
+    unsigned int vlen = 0;
+    int ok = 1;
+
+    SvcMutexLock(&s->lock);
+    k = KvFind(s, key, klen, KvHash(key, klen));
+    if (k) {
+        vlen = k->vlen;
+        val = (char *)malloc(vlen ? vlen : 1);
+        ok = val && KvReadLog(s, k->off + KV_HDR + k->klen, val, vlen);
+    }
+    SvcMutexUnlock(&s->lock);
+    if (!k)
+        return 0;
+    if (!ok) {
+        free(val);
+        return luaL_error(L, "key-value store read failed (%d)", SvcLastError());
+    }
+    lua_pushlstring(L, val, vlen);
+    free(val);
+    return 1;
+}
+
+/** Implement the Lua method db:flush().
+ *
+ * Wait until everything written so far is on the disk, regardless of
+ * the sync policy.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int kvFlush(lua_State *L)
+{
+    KvStore *s = CheckStore(L);
+    DWORD err;
+
+    SvcMutexLock(&s->lock);
+    err = KvSync(s);
+    SvcMutexUnlock(&s->lock);
+    if (err)
+        return luaL_error(L, "key-value store flush failed (%d)", err);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/** Implement the Lua method db:compact().
+ *
+ * Ask the writer thread to rewrite the log without its dead records.
+ * The call returns at once; compaction happens in the background.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int kvCompact(lua_State *L)
+{
+    KvStore *s = CheckStore(L);
+    SvcMutexLock(&s->lock);
+    s->compact = 1;
+    SvcCondSignal(&s->work);
+    SvcMutexUnlock(&s->lock);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/** Implement the Lua method db:stats().
+ *
+ * Returns a table with the number of keys, the size of the log, the
+ * bytes of live records, and the bytes not yet durable.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int kvStats(lua_State *L)
+{
+    KvStore *s = CheckStore(L);
+    lua_Number count, size, live, pending;
+
+    SvcMutexLock(&s->lock);
+    count = (lua_Number)s->count;
+    size = (lua_Number)(s->file_end + s->wbuf_len + s->buf_len);
+    live = (lua_Number)s->live;
+    pending = size - (lua_Number)s->durable;
+    SvcMutexUnlock(&s->lock);
+    lua_createtable(L, 0, 4);
+    lua_pushnumber(L, count);
+    lua_setfield(L, -2, "count");
+    lua_pushnumber(L, size);
+    lua_setfield(L, -2, "size");
+    lua_pushnumber(L, live);
+    lua_setfield(L, -2, "live");
+    lua_pushnumber(L, pending);
+    lua_setfield(L, -2, "pending");
+    return 1;
+}
+
+/** Release a snapshot's pin on its store. */
+static void KvSnapRelease(KvSnap *sn)
+{
+    if (!sn->s)
+        return;
+    SvcMutexLock(&sn->s->lock);
+    if (--sn->s->pins == 0)
+        SvcCondSignal(&sn->s->work);
+    SvcMutexUnlock(&sn->s->lock);
+    KvRelease(sn->s);
+    free(sn->items);
+    sn->s = NULL;
+    sn->items = NULL;
+}
+
+/** Iterator function of db:pairs(). */
+static int kvSnapNext(lua_State *L)
+{
+    KvSnap *sn = (KvSnap *)luaL_checkudata(L, 1, KVSNAP_META);
+    KvSnapItem *it;
+    char *rec;
+    int ok;
+    size_t len;
+
+    if (!sn->s || sn->next >= sn->n) {
+        KvSnapRelease(sn);
+        return 0;
+    }
+    it = &sn->items[sn->next++];
+    len = (size_t)it->klen + it->vlen;
+    rec = (char *)malloc(len ? len : 1);
+    if (!rec)
+        return luaL_error(L, "not enough memory");
+    SvcMutexLock(&sn->s->lock);
+    ok = KvReadLog(sn->s, it->off + KV_HDR, rec, len);
+    SvcMutexUnlock(&sn->s->lock);
+    if (!ok) {
+        free(rec);
+        return luaL_error(L, "key-value store read failed (%d)", SvcLastError());
+    }
+    lua_pushlstring(L, rec, it->klen);
+    lua_pushlstring(L, rec + it->klen, it->vlen);
+    free(rec);
+    return 2;
+}
+
+/** __gc metamethod of a snapshot. */
+static int kvSnapGc(lua_State *L)
+{
+    KvSnapRelease((KvSnap *)luaL_checkudata(L, 1, KVSNAP_META));
+    return 0;
+}
+
+/** Implement the Lua method db:pairs().
+ *
+ * Returns an iterator over the keys and values as they were at the
+ * moment of the call. Writes made while iterating are not seen, and
+ * compaction is held off until the iteration finishes or the iterator
+ * is collected.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int kvPairs(lua_State *L)
+{
+    KvStore *s = CheckStore(L);
+    KvSnap *sn;
+    size_t i, j;
+
+    sn = (KvSnap *)lua_newuserdata(L, sizeof(KvSnap));
+    memset(sn, 0, sizeof(*sn));
+    if (luaL_newmetatable(L, KVSNAP_META)) {
+        lua_pushcfunction(L, kvSnapGc);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+
+    SvcMutexLock(&s->lock);
+    while (s->compacting)
+        SvcCondWait(&s->done, &s->lock, SVC_INFINITE);
+    sn->items = (KvSnapItem *)malloc((s->count ? s->count : 1) * sizeof(KvSnapItem));
+    if (!sn->items) {
+        SvcMutexUnlock(&s->lock);
+        return luaL_error(L, "not enough memory");
+    }
+    for (i = j = 0; i < s->nbuckets; ++i) {
+        KvKey *k;
+        for (k = s->buckets[i]; k; k = k->next) {
+            sn->items[j].off = k->off;
+            sn->items[j].klen = k->klen;
+            sn->items[j].vlen = k->vlen;
+            ++j;
+        }
+    }
+    sn->n = j;
+    s->pins++;
+    SvcAtomicAdd(&s->refs, 1);
+    sn->s = s;
+    SvcMutexUnlock(&s->lock);
+
+    lua_pushcfunction(L, kvSnapNext);
+    lua_insert(L, -2);
+    return 2;
+}
+
+/** Implement the Lua method db:close() and the __gc metamethod.
+ *
+ * Everything written is made durable. The store itself stays open
+ * while other handles on it exist.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int kvClose(lua_State *L)
+{
+    KvHandle *h = (KvHandle *)luaL_checkudata(L, 1, KV_META);
+    if (h->s) {
+        KvStore *s = h->s;
+        h->s = NULL;
+        SvcMutexLock(&s->lock);
+        KvSync(s);
+        SvcMutexUnlock(&s->lock);
+        KvRelease(s);
+    }
+    return 0;
+}
+
+/** Methods of a store handle. */
+static const struct luaL_Reg kvMethods[] = {
+        {"put", kvPut},
+        {"get", kvGet},
+        {"delete", kvDelete},
+        {"pairs", kvPairs},
+        {"flush", kvFlush},
+        {"compact", kvCompact},
+        {"stats", kvStats},
+        {"close", kvClose},
+        {NULL, NULL},
+};
+
+/** Implement the Lua function service.kv.open(file [, options]).
+ *
+ * Open the store kept in \a file, creating it if needed. A relative
+ * name is relative to the service folder.
+ *
+ * The options table may contain:
+ * - sync -- "always" to make each write durable before it returns
+ *   (concurrent writers share one disk flush), "batch" (the default)
+ *   to flush every \a interval ms, or "none" to leave it to the OS.
+ * - interval -- writer period in ms, default 100.
+ * - compact -- fraction of dead bytes in the log that triggers a
+ *   background compaction, default 0.5; zero disables it.
+ *
+ * Options are ignored if the store is already open in the process.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int kvOpen(lua_State *L)
+{
+    static const char *const syncs[] = {"none", "batch", "always"};
+    const char *path = luaL_checkstring(L, 1);
+    int sync = KV_SYNC_BATCH;
+    DWORD interval = 100;
+    double ratio = 0.5;
+    DWORD err = 0;
+    KvHandle *h;
+
+    if (lua_istable(L, 2)) {
+        lua_getfield(L, 2, "sync");
+        if (!lua_isnil(L, -1)) {
+            const char *opt = lua_tostring(L, -1);
+            for (sync = 0; sync < 3; ++sync)
+                if (opt && strcmp(opt, syncs[sync]) == 0)
+                    break;
+            if (sync == 3)
+                return luaL_error(L, "invalid sync option '%s'", opt ? opt : "?");
+        }
+        lua_getfield(L, 2, "interval");
+        if (lua_isnumber(L, -1) && lua_tonumber(L, -1) >= 1)
+            interval = (DWORD)lua_tonumber(L, -1);
+        lua_getfield(L, 2, "compact");
+        if (lua_isnumber(L, -1))
+            ratio = lua_tonumber(L, -1);
+        lua_pop(L, 3);
+    }
+
+    h = (KvHandle *)lua_newuserdata(L, sizeof(KvHandle));
+    h->s = NULL;
+    if (luaL_newmetatable(L, KV_META)) {
+        lua_newtable(L);
+        luaL_register(L, NULL, kvMethods);
+        lua_setfield(L, -2, "__index");
+        lua_pushcfunction(L, kvClose);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+
+    h->s = KvOpen(path, sync, interval, ratio, &err);
+    if (!h->s) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "%s: can't open key-value store (%d)", path, (int)err);
+        return 2;
+    }
+    return 1;
+}
+
+/** Functions of the service.kv table. */
+static const struct luaL_Reg kvFunctions[] = {
+        {"open", kvOpen},
+        {NULL, NULL},
+};
+
+/** Add the kv table to the service table at the top of the stack.
+ *
+ * \param L Lua state context to get the table.
+ */
+void LuaKVRegister(lua_State *L)
+{
+    lua_newtable(L);
+    luaL_register(L, NULL, kvFunctions);
+    lua_setfield(L, -2, "kv");
+}
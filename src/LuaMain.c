@@ -4,7 +4,7 @@
 #include <stdio.h>
 #include <stddef.h>
 #include <stdlib.h>
-#include <windows.h>
+#include <string.h>
 #include <lua.h>
 #include <lualib.h>
 #include <lauxlib.h>
@@ -36,9 +36,54 @@ void luaL_register (lua_State *L, const char *libname, const luaL_Reg *l){
 
 #endif
 
+/** Configuration generation whose settings the worker has applied. */
+static int AppliedGeneration = 0;
+
+/** Apply the configured garbage collector settings to a Lua state.
+ * 
+ * \param L Lua state context to configure.
+ */
+static void LuaApplyGc(lua_State *L)
+{
+#ifdef LUA_GCSETPAUSE
+    if (ServiceGcPause > 0)
+        lua_gc(L, LUA_GCSETPAUSE, ServiceGcPause);
+    if (ServiceGcStepmul > 0)
+        lua_gc(L, LUA_GCSETSTEPMUL, ServiceGcStepmul);
+#else
+    (void)L;
+#endif
+}
+
+/** Do the framework's housekeeping at an idle point of the script.
+ * 
+ * Called from service.sleep(), service.stopping() and the other
+ * functions such as service.controls() that a well behaved service
+ * script calls regularly, and which are the only points where the
+ * framework may safely touch the worker's Lua state.
+ * 
+ * \param L Lua state context of the worker.
+ */
+void LuaIdle(lua_State *L)
+{
+    if (AppliedGeneration != ServiceConfigGeneration) {
+        AppliedGeneration = ServiceConfigGeneration;
+        LuaApplyGc(L);
+    }
+    LuaCheckpointPoll(L);
+    LuaReloadPoll(L);
+    LuaProfilerPoll(L);
+    LuaHeapPoll(L);
+    LuaHeapDumpPoll(L);
+    LuaTimelinePoll(L);
+    LuaStatusPoll(L);
+    LuaCommandPoll(L);
+    LuaWatchdogBeat();
+}
+
 /** Implement the Lua function sleep(ms).
  * 
- * Call the Windows Sleep() API to delay thread execution for 
+ * Call SvcSleep() to delay thread execution for 
  * approximately \a ms ms.
  * 
  * \param L Lua state context for the function.
@@ -50,7 +95,12 @@ static int dbgSleep(lua_State *L)
     int t;
     t = luaL_checkinteger(L,1);
     if (t < 0) t = 0;
-    Sleep((DWORD)t);
+    LuaProfilerSleep(L, 1);
+    LuaWatchdogSleep(1);
+    SvcSleep((DWORD)t);
+    LuaWatchdogSleep(0);
+    LuaProfilerSleep(L, 0);
+    LuaIdle(L);
     return 0;
 }
 
@@ -59,8 +109,9 @@ static int dbgSleep(lua_State *L)
  * Construct a message from all the arguments to print(), passing
  * each through the global function tostring() make certain they 
  * are strings, and separating them with tab characters. The message
- * is ultimately passed to the Windows service OutputDebugString()
- * for display in a debugger or debug message logger.
+ * is ultimately passed to SvcDebugOutput(), which is the Windows
+ * OutputDebugString() for display in a debugger or debug message 
+ * logger, and stderr or syslog on POSIX systems.
  * 
  * \param L Lua state context for the function.
  * \returns The number of values on the Lua stack to be returned
@@ -82,7 +133,7 @@ static int dbgPrint(lua_State *L)
             luaL_addchar(&b, '\t');
     }
     luaL_pushresult(&b);
-    OutputDebugStringA(lua_tostring(L, -1)); 		//fputs(s, stdout);
+    SvcDebugOutput(lua_tostring(L, -1)); 		//fputs(s, stdout);
     lua_pop(L,1);
     return 0;
 }
@@ -103,16 +154,10 @@ static int dbgPrint(lua_State *L)
  */
 static int dbgGetCurrentDirectory(lua_State *L)
 {
-    char *buf = 0;
-    DWORD len = 0;
-    len = GetCurrentDirectoryA(0,NULL);
-    if (!len)
-        return luaL_error(L, "GetCurrentDirectory failed (%d)", GetLastError());
-    buf = malloc(len+1);
+    char *buf = SvcGetCwd();
     if (!buf)
-        return luaL_error(L,"GetCurrentDirectory can't allocate %ld chars", len);
-    GetCurrentDirectoryA(len+1, buf);
-    lua_pushlstring(L, buf, len);
+        return luaL_error(L, "GetCurrentDirectory failed (%d)", SvcLastError());
+    lua_pushstring(L, buf);
     free(buf);
     return 1;
 }
@@ -127,9 +172,8 @@ static int dbgGetCurrentDirectory(lua_State *L)
  */
 static int dbgSetCurrentDirectory(lua_State *L)
 {
-    BOOL ret = SetCurrentDirectoryA(luaL_checkstring(L, 1));
-    if (!ret)
-        return luaL_error(L, "SetCurrentDirectory failed (%d)", GetLastError());
+    if (!SvcSetCwd(luaL_checkstring(L, 1)))
+        return luaL_error(L, "SetCurrentDirectory failed (%d)", SvcLastError());
     lua_pushboolean(L, 1);
     return 1;
 }
@@ -146,10 +190,64 @@ static int dbgSetCurrentDirectory(lua_State *L)
  */
 static int dbgStopping(lua_State *L)
 {
-    lua_pushboolean(L,ServiceStopping);
+    LuaIdle(L);
+    lua_pushboolean(L,ServiceStopping || LuaReloadRetiring(L));
     return 1;
 }
 
+/** Implement the Lua function progress([ms]).
+ * 
+ * Report that the script is still making progress finishing its work 
+ * after a stop request, which advances the checkpoint the stop 
+ * coordinator reports to the SCM. Returns the time in ms left before
+ * the service is stopped anyway.
+ * 
+ * Before the script has called ready(), the same is done for the 
+ * startup instead, and \a ms, if given, is the time the next step is
+ * expected to take, which becomes the wait hint. Returns the time in
+ * ms left of <code>ready_timeout</code>.
+ * 
+ * Returns nil if the service is neither starting nor stopping.
+ * 
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int dbgProgress(lua_State *L)
+{
+    lua_Integer hint = luaL_optinteger(L, 1, 0);
+
+    LuaIdle(L);
+    if (ServiceStopping) {
+        SvcAtomicAdd(&ServiceStopProgress, 1);
+        lua_pushinteger(L, (lua_Integer)LuaServiceStopLeft());
+    } else if (!ServiceReady) {
+        if (hint > 0)
+            ServiceStartHint = (DWORD)hint;
+        SvcAtomicAdd(&ServiceStartProgress, 1);
+        lua_pushinteger(L, (lua_Integer)LuaServiceReadyLeft());
+    } else
+        lua_pushnil(L);
+    return 1;
+}
+
+/** Implement the Lua function ready().
+ * 
+ * Report that the script is now able to do its work, so that the 
+ * service is reported running. Only needed with the init.lua field
+ * <code>ready_timeout</code> set, and harmless otherwise.
+ * 
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int dbgReady(lua_State *L)
+{
+    LuaIdle(L);
+    LuaServiceReady();
+    return 0;
+}
+
 /** Implement the Lua function tracelevel(level).
  * 
  * Control the verbosity of trace output to the debug console.
@@ -196,6 +294,7 @@ static int dbgTracelevel(lua_State *L)
     SvcDebugTraceStr("  " f ": %s\n", (s));	\
     }while(0)
 
+#ifdef _WIN32
 /** Implement the Lua function GetCurrentConfiguration().
  * 
  * Discover some details about the service's configuration as 
@@ -303,6 +402,7 @@ static int dbgGetCurrentConfiguration(lua_State *L)
     CloseServiceHandle(schManager);
     return 1;
 }
+#endif
 
 /** Private key for a pending compiled but unexecuted Lua chunk. */
 static const char *PENDING_WORK = "Pending Work";
@@ -345,61 +445,28 @@ static const struct luaL_Reg dbgFunctions[] = {
         {"sleep", dbgSleep },
         {"print", dbgPrint },
         {"stopping", dbgStopping },
+        {"progress", dbgProgress },
+        {"ready", dbgReady },
+        {"on_stop", LuaCancelOnStop },
+        {"heartbeat", LuaWatchdogHeartbeat },
+        {"controls", LuaControls },
+        {"gauge", LuaStatusGauge },
+        {"command", LuaCommandSet },
+        {"shmqueue", LuaShmQueueOpen },
+        {"reactor", LuaReactorOpen },
         {"tracelevel", dbgTracelevel },
         {"GetCurrentDirectory", dbgGetCurrentDirectory},
         {"SetCurrentDirectory", dbgSetCurrentDirectory},
+#ifdef _WIN32
         {"GetCurrentConfiguration", dbgGetCurrentConfiguration},
+#endif
+        {"dirindex", LuaDirIndexOpen},
+        {"checkpoint", LuaCheckpointSet},
+        {"heapdump", LuaHeapDump},
+        {"span", LuaTimelineSpan},
         {NULL, NULL},
 };
 
-/** Get full path and file name of application
- *
- */
-static char* GetApplicationFileName()
-{
-    size_t pathSize = MAX_PATH + 2;
-    char *szPath = 0;
-    int i;
-
-    /* limit number attempts to ~10M */
-    for(i = 1; i < 10; ++i){
-        DWORD size;
-
-#ifdef USE_ONLY_MALLOC
-        if (szPath) {
-            free(szPath);
-        }
-        szPath = (char *)malloc(pathSize);
-#else
-        szPath = (char *)realloc((void*)szPath, pathSize);
-#endif
-
-        if (!szPath) {
-            return 0;
-        }
-
-        size = GetModuleFileNameA(GetModuleHandle(NULL), szPath, pathSize - 1);
-
-        /*Check either we get some error*/
-        if (size == 0) {
-            free(szPath);
-            return 0;
-        }
-
-        /*we can be sure that path fit to buffer*/
-        if (size < pathSize - 1) {
-            /*GetModuleFileName may not add EOL*/
-            szPath[pathSize - 1] = 0;
-            return szPath;
-        }
-
-        /*buffer may be too small or path equal to pathSize*/
-        pathSize *= 1.5;
-    }
-
-    return 0;
-}
-
 static void LuaInitEnv(lua_State *L){
     const int top = lua_gettop(L);
     int status;
@@ -452,7 +519,8 @@ static void LuaInitEnv(lua_State *L){
  * - service.filename	-- a string containing the filename of the service program
  * - service.path		-- the path of the service folder
  * - service.sleep(ms)	-- a function to sleep for \a ms ms
- * - service.print(...) -- like standalone Lua's print(), but with OutputDebugString()
+ * - service.print(...) -- like standalone Lua's print(), but with SvcDebugOutput()
+ * - service.kv -- the key-value store functions from LuaKV.c
  * - print -- a copy of service.print
  * - sleep -- a copy of service.sleep
  * 
@@ -467,17 +535,16 @@ static void initGlobals(lua_State *L)
 
     lua_newtable(L);
 
-    szPath = GetApplicationFileName();
+    szPath = SvcExePath();
     if (szPath) {
         char *cp;
         lua_pushstring(L,szPath);
         lua_setfield(L,-2,"filename");
-        cp = strrchr(szPath, '\\');
+        cp = strrchr(szPath, SVC_DIRSEP);
         if (cp) {
             cp[0] = '\0';
             lua_pushstring(L,szPath);
             lua_setfield(L,-2,"path");
-            SetCurrentDirectoryA(szPath);
         }
         free(szPath);
     }
@@ -486,6 +553,10 @@ static void initGlobals(lua_State *L)
     lua_setfield(L,-2,"name");
     // define a few useful utility functions
     luaL_register(L, NULL, dbgFunctions);
+    LuaKVRegister(L);
+    LuaProfilerRegister(L);
+    LuaHeapRegister(L);
+    LuaCancelRegister(L);
     lua_setglobal(L, "service");
 
     if (LuaPackagePath) {
@@ -536,6 +607,90 @@ static void initGlobals(lua_State *L)
     LuaInitEnv(L);
 }
 
+/** Load a script of the service folder, but don't call it.
+ *
+ * The compiled script is stored in the registry at the private key
+ * PENDING_WORK, and any previous work results are released to the
+ * garbage collector.
+ *
+ * \param L Lua state context, set up for the script.
+ * \param arg The name of the script file.
+ * \returns Zero, or raises an error.
+ */
+static int LoadPending(lua_State *L, const char *arg)
+{
+    char *szPath, *cp, *scriptPath;
+    size_t scriptPathSize;
+    char span[64];
+    int status;
+    SvcU64 start;
+
+    // first, release any past results
+    lua_pushnil(L);
+    local_setreg(L,WORK_RESULTS);
+    lua_pushnil(L);
+    local_setreg(L,PENDING_WORK);
+
+    /**
+     * \note A relative script file name is always relative to the 
+     * service folder, never to the current directory. This protects 
+     * against substitution of the script by a third party, at least 
+     * to some degree.
+     */
+    if (SvcPathIsAbsolute(arg)) {
+        SvcDebugTraceStr("Script: %s\n", arg);
+        start = SvcMicros();
+        status = luaL_loadfile(L, arg);
+        SvcSpan("load script", start);
+        if (status)
+            return luaL_error(L,"%s\n",lua_tostring(L,-1));
+        local_setreg(L,PENDING_WORK);
+        return 0;
+    }
+    szPath = SvcExePath();
+    if(!szPath){
+        return luaL_error(L, "Can not detect service path");
+    }
+
+    cp = strrchr(szPath, SVC_DIRSEP);
+
+    if (!cp) {
+        lua_pushstring(L, "Module name '");
+        lua_pushstring(L, szPath);
+        lua_pushstring(L, "' isn't fully qualified");
+        free(szPath);
+        return lua_error(L);
+    }
+
+    cp[1] = '\0';
+    scriptPathSize = (cp - szPath) + strlen(arg) + 1;
+    scriptPath = (char*)malloc(scriptPathSize + 1);
+    if (!scriptPath) {
+        free(szPath);
+        return luaL_error(L,"No enouth memory");
+    }
+
+    strcpy(scriptPath, szPath);
+    strcat(scriptPath, arg);
+
+    SvcDebugTraceStr("Script: %s\n", scriptPath);
+    start = SvcMicros();
+    status = luaL_loadfile(L, scriptPath);
+    strcpy(span, "load ");
+    strncat(span, arg, sizeof(span) - 6);
+    SvcSpan(span, start);
+
+    free(szPath);
+    free(scriptPath);
+
+    if (status) { 
+        return luaL_error(L,"%s\n",lua_tostring(L,-1));
+    }
+
+    local_setreg(L,PENDING_WORK);
+    return 0;
+}
+
 /** Function called in a protected Lua state.
  * 
  * Initialize the Lua state if the global service has not been defined,
@@ -567,77 +722,24 @@ static int pmain(lua_State *L)
 {
     char *arg;
     int status;
+    SvcU64 start;
 
     arg = (char *)lua_touserdata(L,-1);
     lua_getglobal(L, "service");
     if (arg) {
         lua_gc(L, LUA_GCSTOP, 0); /* stop gc during initialization */
+        start = SvcMicros();
         luaL_openlibs(L); /* open libraries */
+        SvcSpan("luaL_openlibs", start);
+        start = SvcMicros();
         initGlobals(L);
+        SvcSpan("initGlobals", start);
         lua_gc(L, LUA_GCRESTART, 0);
+        LuaApplyGc(L);
     }
     lua_pop(L,2); /* don't need the light userdata or service objects on the stack */
     if (arg) {
-        // load but don't call the code
-        char *szPath, *cp, *scriptPath;
-        size_t scriptPathSize;
-
-        // first, release any past results
-        lua_pushnil(L);
-        local_setreg(L,WORK_RESULTS);
-        lua_pushnil(L);
-        local_setreg(L,PENDING_WORK);
-
-        /**
-         * \note The script file name is always relative to the 
-         * service folder. This protects against substitution of
-         * the script by a third party, at least to some degree.
-         */
-        szPath = GetApplicationFileName();
-        if(!szPath){
-            return luaL_error(L, "Can not detect service path");
-        }
-
-        cp = strrchr(szPath, '\\');
-
-        if (!cp) {
-            lua_pushstring(L, "Module name '");
-            lua_pushstring(L, szPath);
-            lua_pushstring(L, "' isn't fully qualified");
-            free(szPath);
-            return lua_error(L);
-        }
-
-        cp[1] = '\0';
-        scriptPathSize = (cp - szPath) + strlen(arg) + 1;
-        if (scriptPathSize <= MAX_PATH) {
-            strcpy(cp+1, arg);
-            scriptPath = szPath;
-        }
-        else {
-            scriptPath = (char*)malloc(scriptPathSize + 1);
-            if (!scriptPath) {
-                return luaL_error(L,"No enouth memory");
-            }
-
-            strcpy(scriptPath, szPath);
-            strcat(scriptPath, arg);
-        }
-
-        SvcDebugTraceStr("Script: %s\n", scriptPath);
-        status = luaL_loadfile(L, scriptPath);
-
-        free(szPath);
-        if (szPath != scriptPath) {
-            free(scriptPath);
-        }
-
-        if (status) { 
-            return luaL_error(L,"%s\n",lua_tostring(L,-1));
-        }
-
-        local_setreg(L,PENDING_WORK);
-        return 0;
+        return LoadPending(L, arg);
     } else {
         int n;
         int i;
@@ -684,6 +786,26 @@ static int pmain(lua_State *L)
     }
 }
 
+/** Function called in a protected Lua state to load a configuration
+ * script.
+ * 
+ * Like pmain() with a script name, but only opens the standard 
+ * libraries. There is no service table, and the current directory is 
+ * left alone, so this may run on any thread while the worker runs.
+ * 
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int pconfig(lua_State *L)
+{
+    const char *arg = (const char *)lua_touserdata(L,-1);
+
+    lua_pop(L,1);
+    luaL_openlibs(L);
+    return LoadPending(L, arg);
+}
+
 /** Lua allocator function.
  * 
  * Borrowed verbatim from the Lua sources, found in lauxlib.c.
@@ -697,15 +819,16 @@ static int pmain(lua_State *L)
  * block it points to will be either freed or reallocated depending
  * on the value of \a nsize.
  * 
- * \note This is a good place to introduce memory performance hooks 
- * for a Lua state in some future version.
+ * The heap profiler wraps this allocator, or Lua's own, see
+ * LuaHeapAttach(). It is public only so that LuaBench can compare it
+ * with Lua's own.
  * 
  * \param ud	Opaque token provided when the Lua state was created.
  * \param ptr	Pointer to any existing memory for this transaction.
  * \param osize	Size of the existing memory block.
  * \param nsize	Size of the memory block needed.
  */
-static void *LuaAlloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+void *LuaAlloc(void *ud, void *ptr, size_t osize, size_t nsize) {
     void *retv = NULL;
     (void)ud;
     (void)osize;
@@ -745,6 +868,19 @@ static void *LuaAlloc(void *ud, void *ptr, size_t osize, size_t nsize) {
     return retv;
 }
 
+/** Close a Lua state, and free its heap profiler if it has one.
+ * 
+ * \param L The Lua state.
+ */
+static void LuaCloseState(lua_State *L)
+{
+    void *ud = NULL;
+    lua_Alloc f = lua_getallocf(L, &ud);
+    lua_close(L);
+    if (f == LuaHeapAllocf)
+        LuaHeapFree(ud);
+}
+
 /** The panic function for a Lua state.
  * 
  * This function is called as a last resort if an error is thrown
@@ -759,7 +895,7 @@ static void *LuaAlloc(void *ud, void *ptr, size_t osize, size_t nsize) {
  * could result in the SCM becoming confused about the current state
  * of the service. 
  * 
- * To prevent SCM confusion, this function simply calls ExitThread() 
+ * To prevent SCM confusion, this function simply calls SvcThreadExit() 
  * to kill the current thread without necessarily killing the whole
  * process.
  * 
@@ -769,7 +905,7 @@ static int LuaPanic (lua_State *L) {
   (void)L;  /* to avoid warnings */
   SvcDebugTrace("PANIC: unprotected error in call to Lua API...",0);
   SvcDebugTrace(lua_tostring(L, -1), 0);
-  ExitThread(EXIT_FAILURE);
+  SvcThreadExit(EXIT_FAILURE);
   return 0;
 }
 
@@ -792,19 +928,22 @@ LUAHANDLE LuaWorkerLoad(LUAHANDLE h, const char *cmd)
     int status;
     lua_State *L=(lua_State*)h;
     if (!h) {
+        SvcU64 start = SvcMicros();
 #if USE_LUA_ALLOCATOR
         L = luaL_newstate();
 #else
         L = lua_newstate(LuaAlloc, NULL);
 #endif
         assert(L);
+        LuaHeapAttach(L);
         lua_atpanic(L, &LuaPanic); 
+        SvcSpan("lua_newstate", start);
     }
     status = lua_cpcall(L, &pmain, (void*)cmd);
     if (status) {
         SvcDebugTrace("Load script cpcall status %d", status);
         SvcDebugTrace((char *)lua_tostring(L,-1), 0);
-        lua_close(L);
+        LuaCloseState(L);
         L = NULL;
     } else {
         SvcDebugTrace("Script loaded ok", 0);
@@ -812,6 +951,40 @@ LUAHANDLE LuaWorkerLoad(LUAHANDLE h, const char *cmd)
     return (void *)L;
 }
 
+/** Create a bare Lua state with a configuration script loaded.
+ * 
+ * Used to run init.lua again while the service runs. The state has 
+ * only the standard libraries, see pconfig(), and is run with 
+ * LuaWorkerRun(), read with the LuaResult functions and closed with 
+ * LuaWorkerCleanup() like any other.
+ * 
+ * \param cmd The script, relative to the service folder.
+ * \returns An opaque handle identifying the created Lua state, or 
+ *          NULL if the script could not be loaded.
+ */
+LUAHANDLE LuaConfigLoad(const char *cmd)
+{
+    int status;
+    lua_State *L;
+
+#if USE_LUA_ALLOCATOR
+    L = luaL_newstate();
+#else
+    L = lua_newstate(LuaAlloc, NULL);
+#endif
+    if (!L)
+        return NULL;
+    lua_atpanic(L, &LuaPanic); 
+    status = lua_cpcall(L, &pconfig, (void*)cmd);
+    if (status) {
+        SvcDebugTrace("Load configuration cpcall status %d", status);
+        SvcDebugTrace((char *)lua_tostring(L,-1), 0);
+        LuaCloseState(L);
+        L = NULL;
+    }
+    return (void *)L;
+}
+
 void LuaWorkerSetArgs(LUAHANDLE h, size_t argc, const char **argv){
     lua_State *L=(lua_State*)h;
     size_t i;
@@ -868,15 +1041,86 @@ LUAHANDLE LuaWorkerRun(LUAHANDLE h)
     return (void *)L;
 }
 
+/** Get the error message of a failed worker.
+ * 
+ * Only meaningful right after LuaWorkerRun() returned NULL, when the 
+ * message (with its traceback) is still on top of the Lua stack.
+ * 
+ * \note The string returned came from strdup(), and must be 
+ * freed by the caller.
+ * 
+ * \param h The opaque handle passed to the failed LuaWorkerRun().
+ * \returns The message (from strdup()) or NULL if there is none.
+ */
+char *LuaWorkerError(LUAHANDLE h)
+{
+    lua_State *L=(lua_State*)h;
+    const char *msg;
+    if (!h || !lua_gettop(L))
+        return NULL;
+    msg = lua_tostring(L,-1);
+    return msg ? strdup(msg) : NULL;
+}
+
+/** Set a string field of the service table.
+ * 
+ * \param h An opaque handle returned by a previous call to LuaWorkerLoad().
+ * \param field The name of the field.
+ * \param value The string to store, or NULL to clear the field.
+ */
+void LuaWorkerSetString(LUAHANDLE h, const char *field, const char *value)
+{
+    lua_State *L=(lua_State*)h;
+    if (!h)
+        return;
+    lua_getglobal(L, "service");
+    if (lua_istable(L, -1)) {
+        if (value)
+            lua_pushstring(L, value);
+        else
+            lua_pushnil(L);
+        lua_setfield(L, -2, field);
+    }
+    lua_pop(L, 1);
+}
+
+/** Set an integer field of the service table.
+ * 
+ * \param h An opaque handle returned by a previous call to LuaWorkerLoad().
+ * \param field The name of the field.
+ * \param value The value to store.
+ */
+void LuaWorkerSetInt(LUAHANDLE h, const char *field, int value)
+{
+    lua_State *L=(lua_State*)h;
+    if (!h)
+        return;
+    lua_getglobal(L, "service");
+    if (lua_istable(L, -1)) {
+        lua_pushinteger(L, value);
+        lua_setfield(L, -2, field);
+    }
+    lua_pop(L, 1);
+}
+
 /** Clean up after the worker by closing the Lua state.
+ * 
+ * A profiler running on the state is stopped first, and its samples
+ * written, see LuaProfiler.c. A heap dump still walking the state is
+ * abandoned.
  * 
  * \param h An opaque handle returned by a previous call to LuaWorkerRun().
  */
 void LuaWorkerCleanup(LUAHANDLE h)
 {
     lua_State *L=(lua_State*)h;
-    if (h)
-        lua_close(L);
+    if (h) {
+        SvcU64 start = SvcMicros();
+        LuaProfilerDetach(L);
+        LuaHeapDumpAbort(L);
+        LuaCloseState(L);
+        SvcSpan("lua_close", start);
+    }
 }
 
 /** Get a cached worker result item as a string.
@@ -968,6 +1212,35 @@ char *LuaResultFieldString(LUAHANDLE h, int item, const char *field)
     return ret;
 }
 
+/** Tell whether a field of a cached worker result item is set.
+ * 
+ * \param h An opaque handle returned by a previous call to LuaWorkerRun().
+ * \param item The index of the result item to look in. 
+ * The first result is index 1, consistent with Lua counting.
+ * \param field The name of the field to look for.
+ * \returns Non-zero if the item exists and its field is not nil.
+ */
+int LuaResultFieldIsSet(LUAHANDLE h, int item, const char *field)
+{
+    int ret;
+    lua_State *L = (lua_State*)h;
+    if (!h) return 0;
+    local_getreg(L,WORK_RESULTS);	// table
+    if (lua_type(L,-1) != LUA_TTABLE) {
+        lua_pop(L,1);
+        return 0;
+    }
+    lua_rawgeti(L,-1,item);			// table itemtable
+    if (lua_type(L,-1) != LUA_TTABLE) {
+        lua_pop(L,2);
+        return 0;
+    }
+    lua_getfield(L,-1,field);		// table itemtable fieldvalue
+    ret = !lua_isnil(L,-1);
+    lua_pop(L,3);
+    return ret;
+}
+
 /** Get a field of a cached worker result item as an integer.
  * 
  * 
@@ -976,7 +1249,8 @@ char *LuaResultFieldString(LUAHANDLE h, int item, const char *field)
  * The first result is index 1, consistent with Lua counting.
  * \param field The name of the field to retrieve.
  * \returns The integer value or 0 if the field or item
- * doesn't exist or can't be converted to a number.
+ * doesn't exist or can't be converted to a number. A boolean
+ * field is returned as 1 for true and 0 for false.
  */
 int LuaResultFieldInt(LUAHANDLE h, int item, const char *field)
 {
@@ -994,7 +1268,10 @@ int LuaResultFieldInt(LUAHANDLE h, int item, const char *field)
         return 0;
     }
     lua_getfield(L,-1,field);		// table itemtable fieldvalue
-    ret = (int)lua_tointeger(L,-1);
+    if (lua_isboolean(L,-1))
+        ret = lua_toboolean(L,-1);
+    else
+        ret = (int)lua_tointeger(L,-1);
     lua_pop(L,3);
     return ret;
 }
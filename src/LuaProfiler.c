@@ -0,0 +1,611 @@
+/*! \file LuaProfiler.c
+ *  \brief Sampling profiler for the service script.
+ *
+ * The profiler answers the question "where does the service spend its
+ * time" for a script that is already running in production, without
+ * restarting it and without a debugger attached.
+ *
+ * A background sampler thread wakes every <code>profile_interval</code>
+ * ms. Unless the worker is idle in service.sleep(), it asks for the
+ * shared count hook of LuaHook.c, which fires at the very next VM
+ * instruction. The hook, which runs on the worker thread and so may
+ * safely walk the Lua stack, records the current call stack and counts
+ * it. Between samples the script runs with no hook at all.
+ *
+ * The counts are kept in C, keyed by the stack in the folded format
+ * used by flame graph tools: frames from the outermost to the
+ * innermost, separated by semicolons. Dumping writes one line per
+ * distinct stack with its count, ready for flamegraph.pl or
+ * speedscope. The number of distinct stacks is bounded; samples of
+ * new stacks beyond the bound are counted as <code>[other]</code>.
+ *
+ * The time spent in the hook is measured. If it exceeds
+ * <code>profile_overhead</code> percent of the elapsed time, the
+ * sampling interval is doubled, up to once a second, and it is
+ * brought back down when the overhead falls again.
+ *
+ * The profiler is controlled with service.profiler, with the init.lua
+ * field <code>profile</code>, or from outside with the
+ * <tt>LuaService profile</tt> command. Profiling stops and the samples
+ * are written to <code>profile_file</code> when the script finishes.
+ *
+ * Only one Lua state is profiled at a time. A hook fires only in the
+ * coroutine it was set on (and in coroutines created while it was
+ * armed), so time spent inside a coroutine is charged to the resume
+ * that runs it. Time spent blocked in a C function is charged to the
+ * Lua code that runs after it returns. The hook replaces any hook set
+ * with debug.sethook().
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "luaservice.h"
+
+/** Deepest stack recorded; deeper stacks are cut off at the root. */
+#define PROF_MAXDEPTH 64
+
+/** Longest single frame name recorded. */
+#define PROF_MAXFRAME 128
+
+/** Most distinct stacks kept. */
+#define PROF_MAXSTACKS 10000
+
+/** Number of hash buckets. */
+#define PROF_BUCKETS 4096
+
+/** Longest sampling interval the overhead control backs off to. */
+#define PROF_MAXINTERVAL 1000
+
+/** Interval in microseconds over which the overhead is controlled. */
+#define PROF_WINDOW 1000000
+
+/** One distinct stack and the number of samples of it. */
+typedef struct ProfStack {
+    struct ProfStack *next;     /**< Next stack in the same bucket. */
+    unsigned int hash;          /**< Hash of \a stack. */
+    unsigned long count;        /**< Number of samples. */
+    char stack[1];              /**< Folded stack, allocated in line. */
+} ProfStack;
+
+/** The Lua state being profiled, or NULL if the profiler is stopped. */
+static lua_State *ProfL;
+
+/** The sampler thread. */
+static SvcThread *ProfThread;
+
+/** Guards ProfStopping for the sampler's timed wait. */
+static SvcMutex ProfLock = SVC_MUTEX_INIT;
+
+/** Wakes the sampler early when it should stop. */
+static SvcCond ProfWake;
+
+/** Set to tell the sampler thread to finish. */
+static int ProfStopping;
+
+/** Set while the hook is armed for the next sample. */
+static volatile int ProfArmed;
+
+/** Set while the worker is idle in service.sleep(). */
+static volatile int ProfSleeping;
+
+/** Requested sampling interval in ms. */
+static DWORD ProfBaseInterval;
+
+/** Current sampling interval in ms, raised by the overhead control. */
+static volatile DWORD ProfInterval;
+
+/** Counted stacks, hashed. */
+static ProfStack *ProfBuckets[PROF_BUCKETS];
+
+/** Number of distinct stacks in ProfBuckets. */
+static unsigned long ProfStacks;
+
+/** Samples taken since the profiler started. */
+static unsigned long ProfSamples;
+
+/** Samples of stacks that did not fit in ProfBuckets. */
+static unsigned long ProfOther;
+
+/** Microsecond counter when the profiler started. */
+static SvcU64 ProfStartMicros;
+
+/** Microseconds spent in the hook since the profiler started. */
+static SvcU64 ProfHookMicros;
+
+/** Start of the current overhead control window, and hook time in it. */
+static SvcU64 ProfWindowStart, ProfWindowHook;
+
+/** The value of ServiceProfile last acted upon. */
+static int ProfConfigured;
+
+/** Full path of ServiceProfileFile, once resolved. */
+static char *ProfPath;
+
+/** Registry key of the main thread, for Lua versions that do not
+ * keep it in the registry themselves. */
+#define PROF_MAINTHREAD "LuaService.mainthread"
+
+/** Hash a string with FNV-1a. */
+static unsigned int ProfHash(const char *s)
+{
+    unsigned int h = 2166136261u;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/** Count one sample of a folded stack. */
+static void ProfCount(const char *stack)
+{
+    unsigned int h = ProfHash(stack);
+    ProfStack **pp = &ProfBuckets[h % PROF_BUCKETS];
+    ProfStack *p;
+    size_t len;
+
+    ++ProfSamples;
+    for (p = *pp; p; p = p->next) {
+        if (p->hash == h && strcmp(p->stack, stack) == 0) {
+            ++p->count;
+            return;
+        }
+    }
+    len = strlen(stack);
+    if (ProfStacks >= PROF_MAXSTACKS
+            || (p = (ProfStack *)malloc(sizeof(ProfStack) + len)) == NULL) {
+        ++ProfOther;
+        return;
+    }
+    p->hash = h;
+    p->count = 1;
+    memcpy(p->stack, stack, len + 1);
+    p->next = *pp;
+    *pp = p;
+    ++ProfStacks;
+}
+
+/** Discard all counted stacks. */
+static void ProfReset(void)
+{
+    ProfStack *p, *next;
+    int i;
+
+    for (i = 0; i < PROF_BUCKETS; ++i) {
+        for (p = ProfBuckets[i]; p; p = next) {
+            next = p->next;
+            free(p);
+        }
+        ProfBuckets[i] = NULL;
+    }
+    ProfStacks = ProfSamples = ProfOther = 0;
+    ProfHookMicros = 0;
+    ProfStartMicros = ProfWindowStart = SvcMicros();
+    ProfWindowHook = 0;
+}
+
+/** Describe one stack frame in \a buf, which holds PROF_MAXFRAME chars. */
+static void ProfFrame(lua_Debug *ar, char *buf)
+{
+    char *cp;
+
+    if (*ar->what == 'C')
+        sprintf(buf, "%.100s [C]", ar->name ? ar->name : "?");
+    else if (*ar->what == 'm')
+        sprintf(buf, "main %.100s", ar->short_src);
+    else
+        sprintf(buf, "%.40s %.60s:%d", ar->name ? ar->name : "?",
+                ar->short_src, ar->linedefined);
+    for (cp = buf; *cp; ++cp)
+        if (*cp == ';' || *cp == '\n')
+            *cp = ':';
+}
+
+/** Record the current call stack of \a L. */
+static void ProfSample(lua_State *L)
+{
+    char frames[PROF_MAXDEPTH][PROF_MAXFRAME];
+    char stack[PROF_MAXDEPTH * (PROF_MAXFRAME + 1) + 16];
+    lua_Debug ar;
+    char *cp = stack;
+    int n, level;
+
+    for (n = 0; n < PROF_MAXDEPTH && lua_getstack(L, n, &ar); ++n) {
+        lua_getinfo(L, "Sn", &ar);
+        ProfFrame(&ar, frames[n]);
+    }
+    if (n == 0)
+        return;
+    if (n == PROF_MAXDEPTH && lua_getstack(L, n, &ar)) {
+        strcpy(cp, "[truncated];");
+        cp += strlen(cp);
+    }
+    for (level = n - 1; level >= 0; --level) {
+        size_t len = strlen(frames[level]);
+        memcpy(cp, frames[level], len);
+        cp += len;
+        *cp++ = level ? ';' : '\0';
+    }
+    ProfCount(stack);
+}
+
+/** Keep the time spent in the hook within ServiceProfileOverhead.
+ *
+ * Called from the hook with the time it took. Once every PROF_WINDOW,
+ * the interval is doubled if the overhead was too high, or halved
+ * towards ProfBaseInterval if it was well below the limit.
+ */
+static void ProfControl(SvcU64 spent)
+{
+    SvcU64 now = SvcMicros();
+    SvcU64 elapsed = now - ProfWindowStart;
+    DWORD pct;
+
+    ProfWindowHook += spent;
+    if (elapsed < PROF_WINDOW)
+        return;
+    pct = (DWORD)(ProfWindowHook * 100 / elapsed);
+    if (pct >= (DWORD)ServiceProfileOverhead
+            && ProfInterval < PROF_MAXINTERVAL) {
+        ProfInterval = ProfInterval * 2 < PROF_MAXINTERVAL
+                ? ProfInterval * 2 : PROF_MAXINTERVAL;
+        SvcDebugTrace("Profiler overhead high, interval now %d ms\n",
+                ProfInterval);
+    } else if (pct * 4 < (DWORD)ServiceProfileOverhead
+            && ProfInterval > ProfBaseInterval) {
+        ProfInterval = ProfInterval / 2 > ProfBaseInterval
+                ? ProfInterval / 2 : ProfBaseInterval;
+    }
+    ProfWindowStart = now;
+    ProfWindowHook = 0;
+}
+
+/** Handle LUAHOOK_SAMPLE in the count hook, see LuaHook.c.
+ *
+ * Takes one sample, if the sampler thread asked for it.
+ *
+ * \context
+ * Service worker thread
+ *
+ * \param L The Lua state the hook fired in.
+ * \returns LUAHOOK_DONE.
+ */
+int LuaProfilerHook(lua_State *L)
+{
+    SvcU64 start = SvcMicros();
+    SvcU64 spent;
+
+    if (!ProfArmed)
+        return LUAHOOK_DONE;
+    ProfArmed = 0;
+    if (!ProfL)
+        return LUAHOOK_DONE;
+    ProfSample(L);
+    spent = SvcMicros() - start;
+    ProfHookMicros += spent;
+    ProfControl(spent);
+    return LUAHOOK_DONE;
+}
+
+/** Body of the sampler thread. */
+static unsigned ProfSampler(void *arg)
+{
+    lua_State *L = (lua_State *)arg;
+
+    SvcMutexLock(&ProfLock);
+    while (!ProfStopping) {
+        SvcCondWait(&ProfWake, &ProfLock, ProfInterval);
+        if (ProfStopping)
+            break;
+        if (!ProfArmed && !ProfSleeping) {
+            ProfArmed = 1;
+            LuaHookRequest(L, LUAHOOK_SAMPLE);
+        }
+    }
+    SvcMutexUnlock(&ProfLock);
+    return 0;
+}
+
+/** Start profiling a Lua state.
+ *
+ * Any samples from an earlier run are discarded.
+ *
+ * \param L The Lua state to profile.
+ * \param interval Sampling interval in ms.
+ * \returns Non-zero if the profiler is running.
+ */
+static int ProfStart(lua_State *L, DWORD interval)
+{
+    if (ProfL)
+        return 1;
+    ProfReset();
+    ProfBaseInterval = ProfInterval = interval ? interval : 1;
+    ProfStopping = 0;
+    ProfArmed = 0;
+    ProfSleeping = 0;
+    SvcCondInit(&ProfWake);
+    ProfL = L;
+    ProfThread = SvcThreadStart(ProfSampler, L);
+    if (!ProfThread) {
+        SvcDebugTrace("Can't start profiler (%d)\n", SvcLastError());
+        SvcCondDestroy(&ProfWake);
+        ProfL = NULL;
+        return 0;
+    }
+    SvcDebugTrace("Profiler started, interval %d ms\n", ProfBaseInterval);
+    return 1;
+}
+
+/** Stop profiling, keeping the samples taken.
+ *
+ * \context
+ * Service worker thread
+ */
+static void ProfStop(void)
+{
+    if (!ProfL)
+        return;
+    SvcMutexLock(&ProfLock);
+    ProfStopping = 1;
+    SvcCondSignal(&ProfWake);
+    SvcMutexUnlock(&ProfLock);
+    SvcThreadWait(ProfThread, SVC_INFINITE);
+    ProfThread = NULL;
+    SvcCondDestroy(&ProfWake);
+    ProfArmed = 0;
+    ProfL = NULL;
+    SvcDebugTrace("Profiler stopped after %d samples\n", ProfSamples);
+}
+
+/** Write the samples in folded stack format.
+ *
+ * \param path The file to write.
+ * \returns Non-zero on success.
+ */
+static int ProfDump(const char *path)
+{
+    ProfStack *p;
+    FILE *fp;
+    int i, ok;
+
+    fp = fopen(path, "w");
+    if (!fp) {
+        SvcDebugTraceStr("Can't write profile %s\n", path);
+        return 0;
+    }
+    for (i = 0; i < PROF_BUCKETS; ++i)
+        for (p = ProfBuckets[i]; p; p = p->next)
+            fprintf(fp, "%s %lu\n", p->stack, p->count);
+    if (ProfOther)
+        fprintf(fp, "[other] %lu\n", ProfOther);
+    ok = !ferror(fp);
+    if (fclose(fp) != 0)
+        ok = 0;
+    SvcDebugTraceStr("Profile written to %s\n", path);
+    return ok;
+}
+
+/** Get the configured profile file as a full path. */
+static const char *ProfDefaultPath(void)
+{
+    if (!ProfPath)
+        ProfPath = SvcFullPath(ServiceProfileFile);
+    return ProfPath ? ProfPath : ServiceProfileFile;
+}
+
+/** Get the main thread of the state that \a L belongs to.
+ *
+ * The sampler keeps using the state it profiles, so it must be one
+ * that lives as long as the whole state, never a coroutine that may
+ * be collected. Lua 5.1 has no way to find the main thread, so
+ * LuaProfilerRegister() anchors it in the registry.
+ */
+static lua_State *ProfMainThread(lua_State *L)
+{
+    lua_State *main;
+#ifdef LUA_RIDX_MAINTHREAD
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+#else
+    lua_getfield(L, LUA_REGISTRYINDEX, PROF_MAINTHREAD);
+#endif
+    main = lua_tothread(L, -1);
+    lua_pop(L, 1);
+    return main ? main : L;
+}
+
+/** Start the profiler for a service script about to run, if
+ * init.lua asks for it.
+ *
+ * \context
+ * Service worker thread
+ *
+ * \param h The loaded service script.
+ */
+void LuaProfilerAttach(LUAHANDLE h)
+{
+    ProfConfigured = ServiceProfile;
+    if (h && ServiceProfile)
+        ProfStart(ProfMainThread((lua_State *)h),
+                (DWORD)ServiceProfileInterval);
+}
+
+/** Stop the profiler if it is profiling a state about to be closed,
+ * and write its samples to <code>profile_file</code>.
+ *
+ * \param L The Lua state, or any of its coroutines.
+ */
+void LuaProfilerDetach(lua_State *L)
+{
+    if (!ProfL || ProfMainThread(L) != ProfL)
+        return;
+    ProfStop();
+    ProfDump(ProfDefaultPath());
+}
+
+/** Note that the worker is going idle in service.sleep(), or is back.
+ *
+ * No samples are taken while it sleeps, so the profile shows where
+ * the script is busy rather than where it waits.
+ *
+ * \param L Lua state context of the worker.
+ * \param sleeping Non-zero on entry to the sleep, zero after it.
+ */
+void LuaProfilerSleep(lua_State *L, int sleeping)
+{
+    if (!ProfL || ProfMainThread(L) != ProfL)
+        return;
+    ProfSleeping = sleeping;
+    if (sleeping)
+        ProfArmed = 0;
+}
+
+/** Act on requests to start or stop the profiler.
+ *
+ * Handles the toggle requested with the <tt>profile</tt> control, and
+ * a change of the init.lua field <code>profile</code> since it was
+ * last seen. Stopping writes the samples to <code>profile_file</code>.
+ *
+ * \context
+ * Service worker thread
+ *
+ * \param L Lua state context of the worker.
+ */
+void LuaProfilerPoll(lua_State *L)
+{
+    int want = -1;
+
+    if (ServiceProfileToggle) {
+        ServiceProfileToggle = 0;
+        want = !ProfL;
+    }
+    if (ServiceProfile != ProfConfigured) {
+        ProfConfigured = ServiceProfile;
+        want = ServiceProfile;
+    }
+    if (ProfL && ProfBaseInterval != (DWORD)ServiceProfileInterval) {
+        ProfBaseInterval = (DWORD)ServiceProfileInterval;
+        ProfInterval = ProfBaseInterval;
+    }
+    if (want == 1 && !ProfL) {
+        ProfStart(ProfMainThread(L), (DWORD)ServiceProfileInterval);
+    } else if (want == 0 && ProfL) {
+        ProfStop();
+        ProfDump(ProfDefaultPath());
+    }
+}
+
+/** Implement the Lua function service.profiler.start([interval]).
+ *
+ * Start sampling the service script every \a interval ms, by default
+ * the init.lua field <code>profile_interval</code>. Samples from an
+ * earlier run are discarded. Does nothing if already running.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int profStart(lua_State *L)
+{
+    int interval = (int)luaL_optinteger(L, 1, ServiceProfileInterval);
+    luaL_argcheck(L, interval > 0, 1, "interval must be positive");
+    lua_pushboolean(L, ProfStart(ProfMainThread(L), (DWORD)interval));
+    return 1;
+}
+
+/** Implement the Lua function service.profiler.stop().
+ *
+ * Stop sampling, keeping the samples for dump() and stats().
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int profStop(lua_State *L)
+{
+    ProfStop();
+    lua_pushnumber(L, (lua_Number)ProfSamples);
+    return 1;
+}
+
+/** Implement the Lua function service.profiler.dump([file]).
+ *
+ * Write the samples so far in folded stack format, to \a file or by
+ * default to the init.lua field <code>profile_file</code>. The
+ * profiler may still be running.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int profDump(lua_State *L)
+{
+    const char *path = luaL_optstring(L, 1, NULL);
+    if (!ProfDump(path ? path : ProfDefaultPath())) {
+        lua_pushnil(L);
+        lua_pushstring(L, "can't write profile");
+        return 2;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/** Implement the Lua function service.profiler.stats().
+ *
+ * Return a table with the fields <code>running</code>,
+ * <code>samples</code>, <code>stacks</code>, <code>other</code>,
+ * <code>interval</code> (the current sampling interval in ms) and
+ * <code>overhead</code> (time spent sampling, in percent of the time
+ * since the profiler started).
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int profStats(lua_State *L)
+{
+    SvcU64 elapsed = SvcMicros() - ProfStartMicros;
+
+    lua_newtable(L);
+    lua_pushboolean(L, ProfL != NULL);
+    lua_setfield(L, -2, "running");
+    lua_pushnumber(L, (lua_Number)ProfSamples);
+    lua_setfield(L, -2, "samples");
+    lua_pushnumber(L, (lua_Number)ProfStacks);
+    lua_setfield(L, -2, "stacks");
+    lua_pushnumber(L, (lua_Number)ProfOther);
+    lua_setfield(L, -2, "other");
+    lua_pushnumber(L, (lua_Number)ProfInterval);
+    lua_setfield(L, -2, "interval");
+    lua_pushnumber(L, elapsed
+            ? (lua_Number)ProfHookMicros * 100 / (lua_Number)elapsed : 0);
+    lua_setfield(L, -2, "overhead");
+    return 1;
+}
+
+/** Functions of the service.profiler table. */
+static const struct luaL_Reg profFunctions[] = {
+        {"start", profStart},
+        {"stop", profStop},
+        {"dump", profDump},
+        {"stats", profStats},
+        {NULL, NULL},
+};
+
+/** Add the profiler table to the service table at the top of the stack.
+ *
+ * \param L Lua state context to get the table.
+ */
+void LuaProfilerRegister(lua_State *L)
+{
+#ifndef LUA_RIDX_MAINTHREAD
+    // called while the state is set up, so L is its main thread
+    lua_pushthread(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, PROF_MAINTHREAD);
+#endif
+    lua_newtable(L);
+    luaL_register(L, NULL, profFunctions);
+    lua_setfield(L, -2, "profiler");
+}
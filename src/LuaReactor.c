@@ -0,0 +1,1058 @@
+/*! \file LuaReactor.c
+ *  \brief Event loop for sockets, timers and the stop request.
+ *
+ * A service that talks over the network needed an event library such
+ * as lluv, and still had to poll service.stopping() on a timer, since
+ * the stop request is not something such a library can wait for.
+ * service.reactor() returns an event loop built into the framework,
+ * which waits in one system call for sockets to become ready, for the
+ * next timer, and for the stop request:
+ *
+ * \code
+ * local loop = service.reactor()
+ * local server = assert(loop:listen("*", 5678))
+ * loop:watch(server, "r", function()
+ *   local cli = server:accept()
+ *   if cli then
+ *     loop:watch(cli, "r", function(w)
+ *       local data, err = cli:read()
+ *       if data then cli:write(data)
+ *       elseif err ~= "wouldblock" then w:stop(); cli:close() end
+ *     end)
+ *   end
+ * end)
+ * loop:timer(60000, function() service.print("still here") end, 60000)
+ * loop:on_stop(function() server:close(); loop:stop() end)
+ * loop:run()
+ * \endcode
+ *
+ * The loop uses epoll on Linux, poll() on other POSIX systems, and
+ * WSAPoll() on Windows, see SvcPollerWait(). It waits for as long as
+ * nothing happens: a stop request wakes it through LuaControlWake(),
+ * the same way it wakes service.controls().
+ *
+ * The loop is driven by callbacks:
+ *
+ * - loop:watch(sock, events, fn) calls fn(w, readable, writable)
+ *   while \a sock is ready for the \a events "r", "w" or "rw", until
+ *   w:stop(). w:events(events) changes what it waits for. \a sock is
+ *   a socket of the loop, a socket number, or an object with a
+ *   getfd() method, such as a LuaSocket socket.
+ * - loop:timer(ms, fn [, period]) calls fn(t) after \a ms ms, and
+ *   then every \a period ms if given, until t:stop().
+ *   t:start(ms [, period]) sets it again.
+ * - loop:on_stop(fn) calls fn(loop) once, when the service is asked
+ *   to stop.
+ *
+ * loop:run() runs the loop until loop:stop(), or until the service is
+ * asked to stop if no on_stop function has been given. loop:step([ms])
+ * runs it once, waiting at most \a ms ms, for a script that has other
+ * work between steps. An error raised by a callback leaves the loop
+ * through run() or step(), and fails the script as any other error
+ * does.
+ *
+ * The loop comes with plain TCP sockets that never block:
+ * loop:listen(host, port) and loop:connect(host, port) open them, and
+ * the socket methods accept(), read([max]), write(data [, i]),
+ * getfd() and close() return nil and "wouldblock" where they would
+ * have had to wait, and nil and a message on other failures. Closing
+ * a socket stops its watch.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "luaservice.h"
+
+#if LUA_VERSION_NUM >= 502
+#  define rxRawLen lua_rawlen
+#else
+#  define rxRawLen lua_objlen
+#endif
+
+/** Metatable name for reactor userdata. */
+#define RX_META "LuaService.reactor"
+
+/** Metatable name for watch and timer userdata. */
+#define RXHANDLE_META "LuaService.reactor.handle"
+
+/** Metatable name for socket userdata. */
+#define RXSOCK_META "LuaService.socket"
+
+/** Most bytes sock:read() returns by default. */
+#define RX_READ 65536
+
+/** Longest address of the other end of a connection. */
+#define RX_PEER 80
+
+/** Kinds of handle. */
+enum { RX_WATCH, RX_TIMER };
+
+typedef struct RxLoop RxLoop;
+typedef struct RxHandle RxHandle;
+
+/** A socket of the reactor. */
+typedef struct RxSock {
+    SvcSocket s;            /**< The socket, or SVC_BADSOCKET once closed. */
+    RxHandle *watch;        /**< The active watch of the socket, if any. */
+} RxSock;
+
+/** A watch or a timer. */
+struct RxHandle {
+    RxLoop *loop;           /**< The reactor. */
+    int kind;               /**< RX_WATCH or RX_TIMER. */
+    int active;             /**< Set until stopped. */
+    int self;               /**< Registry reference to the handle while
+                             * active, which keeps it alive. */
+    int loopref;            /**< Registry reference to the reactor. */
+    int fn;                 /**< Registry reference to the callback. */
+    SvcSocket fd;           /**< Watch: the socket. */
+    int events;             /**< Watch: SVC_POLL_xxx flags wanted. */
+    RxSock *sock;           /**< Watch: the socket object, if it is one. */
+    int sockref;            /**< Watch: registry reference to it. */
+    SvcU64 due;             /**< Timer: when it fires, in ms. */
+    DWORD period;           /**< Timer: ms between firings, or zero. */
+    SvcU64 seq;             /**< Timer: order among equal \a due. */
+    size_t slot;            /**< Timer: index in the heap. */
+    RxHandle *prev, *next;  /**< The active handles of the reactor. */
+};
+
+/** A reactor made by service.reactor(). */
+struct RxLoop {
+    SvcPoller *poller;      /**< The sockets, or NULL once closed. */
+    RxHandle **heap;        /**< Active timers, a heap by \a due. */
+    size_t timers;          /**< Timers in \a heap. */
+    size_t room;            /**< Room in \a heap. */
+    SvcU64 seq;             /**< Count of timers set. */
+    RxHandle *active;       /**< The active handles. */
+    int stops;              /**< Registry reference to the array of
+                             * on_stop functions. */
+    int stopSeen;           /**< Set once the on_stop functions ran. */
+    int quit;               /**< Set by loop:stop(). */
+    RxLoop *next;           /**< Next open reactor. */
+};
+
+/** Guards RxOpen. */
+static SvcMutex RxLock = SVC_MUTEX_INIT;
+
+/** The open reactors, for LuaReactorWake(). */
+static RxLoop *RxOpen;
+
+/** Get the time for timers, in ms. */
+static SvcU64 RxNow(void)
+{
+    return SvcMicros() / 1000;
+}
+
+/** Tell whether timer \a a fires before timer \a b. */
+static int RxBefore(const RxHandle *a, const RxHandle *b)
+{
+    return a->due < b->due || (a->due == b->due && a->seq < b->seq);
+}
+
+/** Put timer \a h at \a slot of the heap. */
+static void RxHeapSet(RxLoop *loop, size_t slot, RxHandle *h)
+{
+    loop->heap[slot] = h;
+    h->slot = slot;
+}
+
+/** Move the timer at \a slot towards the top of the heap. */
+static void RxHeapUp(RxLoop *loop, size_t slot)
+{
+    RxHandle *h = loop->heap[slot];
+
+    while (slot > 0 && RxBefore(h, loop->heap[(slot - 1) / 2])) {
+        RxHeapSet(loop, slot, loop->heap[(slot - 1) / 2]);
+        slot = (slot - 1) / 2;
+    }
+    RxHeapSet(loop, slot, h);
+}
+
+/** Move the timer at \a slot towards the bottom of the heap. */
+static void RxHeapDown(RxLoop *loop, size_t slot)
+{
+    RxHandle *h = loop->heap[slot];
+    size_t child;
+
+    while ((child = 2 * slot + 1) < loop->timers) {
+        if (child + 1 < loop->timers
+                && RxBefore(loop->heap[child + 1], loop->heap[child]))
+            ++child;
+        if (!RxBefore(loop->heap[child], h))
+            break;
+        RxHeapSet(loop, slot, loop->heap[child]);
+        slot = child;
+    }
+    RxHeapSet(loop, slot, h);
+}
+
+/** Take the timer at \a slot out of the heap. */
+static void RxHeapRemove(RxLoop *loop, size_t slot)
+{
+    RxHandle *last = loop->heap[--loop->timers];
+
+    if (slot == loop->timers)
+        return;
+    RxHeapSet(loop, slot, last);
+    RxHeapUp(loop, slot);
+    RxHeapDown(loop, last->slot);
+}
+
+/** Set timer \a h to fire in \a ms ms, and put it in the heap if it is
+ * not there.
+ *
+ * \returns Non-zero on success, zero if out of memory.
+ */
+static int RxHeapSchedule(RxLoop *loop, RxHandle *h, DWORD ms)
+{
+    h->due = RxNow() + ms;
+    h->seq = ++loop->seq;
+    if (h->active) {
+        RxHeapUp(loop, h->slot);
+        RxHeapDown(loop, h->slot);
+        return 1;
+    }
+    if (loop->timers == loop->room) {
+        size_t room = loop->room ? 2 * loop->room : 16;
+        RxHandle **heap = (RxHandle **)realloc(loop->heap,
+                room * sizeof(RxHandle *));
+        if (!heap)
+            return 0;
+        loop->heap = heap;
+        loop->room = room;
+    }
+    RxHeapSet(loop, loop->timers++, h);
+    RxHeapUp(loop, h->slot);
+    return 1;
+}
+
+/** Get the reactor at \a idx, raising an error if it is closed. */
+static RxLoop *RxCheck(lua_State *L, int idx)
+{
+    RxLoop *loop = (RxLoop *)luaL_checkudata(L, idx, RX_META);
+
+    if (!loop->poller)
+        luaL_error(L, "reactor is closed");
+    return loop;
+}
+
+/** Get the socket at \a idx, raising an error if it is closed. */
+static RxSock *RxCheckSock(lua_State *L, int idx)
+{
+    RxSock *so = (RxSock *)luaL_checkudata(L, idx, RXSOCK_META);
+
+    if (so->s == SVC_BADSOCKET)
+        luaL_error(L, "socket is closed");
+    return so;
+}
+
+/** Get the socket at \a idx if it is a socket of the reactor.
+ *
+ * \returns The socket, or NULL if the value is something else.
+ */
+static RxSock *RxToSock(lua_State *L, int idx)
+{
+    void *p = lua_touserdata(L, idx);
+    int same;
+
+    if (!p || !lua_getmetatable(L, idx))
+        return NULL;
+    luaL_getmetatable(L, RXSOCK_META);
+    same = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+    return same ? (RxSock *)p : NULL;
+}
+
+/** Parse the events "r", "w" or "rw" at \a idx into SVC_POLL_xxx flags. */
+static int RxEvents(lua_State *L, int idx)
+{
+    const char *s = luaL_checkstring(L, idx);
+    int events = (strchr(s, 'r') ? SVC_POLL_IN : 0)
+            | (strchr(s, 'w') ? SVC_POLL_OUT : 0);
+
+    luaL_argcheck(L, events && strspn(s, "rw") == strlen(s), idx,
+            "events must be \"r\", \"w\" or \"rw\"");
+    return events;
+}
+
+/** Push the result of a failed socket call: nil and "wouldblock" if it
+ * would have had to wait, else nil and a message about \a what.
+ *
+ * \returns 2, the values to return.
+ */
+static int RxFail(lua_State *L, const char *what)
+{
+    DWORD err = SvcLastError();
+
+    lua_pushnil(L);
+    if (SvcSocketWouldBlock())
+        lua_pushliteral(L, "wouldblock");
+    else
+        lua_pushfstring(L, "%s failed (%d)", what, (int)err);
+    return 2;
+}
+
+/** Make a handle of \a kind of the reactor at \a loopidx, calling the
+ * function at \a fnidx, and leave it on the stack.
+ */
+static RxHandle *RxNewHandle(lua_State *L, RxLoop *loop, int loopidx,
+        int kind, int fnidx)
+{
+    RxHandle *h;
+
+    luaL_checktype(L, fnidx, LUA_TFUNCTION);
+    h = (RxHandle *)lua_newuserdata(L, sizeof(RxHandle));
+    memset(h, 0, sizeof(*h));
+    h->loop = loop;
+    h->kind = kind;
+    h->self = h->sockref = LUA_NOREF;
+    h->fd = SVC_BADSOCKET;
+    lua_pushvalue(L, fnidx);
+    h->fn = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_pushvalue(L, loopidx);
+    h->loopref = luaL_ref(L, LUA_REGISTRYINDEX);
+    luaL_getmetatable(L, RXHANDLE_META);
+    lua_setmetatable(L, -2);
+    return h;
+}
+
+/** Mark a handle active, keeping it alive until it is stopped. The
+ * handle is on top of the stack.
+ */
+static void RxStart(lua_State *L, RxHandle *h)
+{
+    RxLoop *loop = h->loop;
+
+    lua_pushvalue(L, -1);
+    h->self = luaL_ref(L, LUA_REGISTRYINDEX);
+    h->active = 1;
+    h->prev = NULL;
+    h->next = loop->active;
+    if (loop->active)
+        loop->active->prev = h;
+    loop->active = h;
+}
+
+/** Stop a handle. Stopping it twice is harmless.
+ *
+ * Once stopped, the handle may be collected unless the caller holds it.
+ */
+static void RxStop(lua_State *L, RxHandle *h)
+{
+    RxLoop *loop = h->loop;
+
+    if (!h->active)
+        return;
+    h->active = 0;
+    if (h->prev)
+        h->prev->next = h->next;
+    else
+        loop->active = h->next;
+    if (h->next)
+        h->next->prev = h->prev;
+    if (h->kind == RX_WATCH) {
+        if (loop->poller)
+            SvcPollerRemove(loop->poller, h->fd);
+        if (h->sock) {
+            h->sock->watch = NULL;
+            h->sock = NULL;
+            luaL_unref(L, LUA_REGISTRYINDEX, h->sockref);
+            h->sockref = LUA_NOREF;
+        }
+    } else
+        RxHeapRemove(loop, h->slot);
+    luaL_unref(L, LUA_REGISTRYINDEX, h->self);
+    h->self = LUA_NOREF;
+}
+
+/** Call the callback of handle \a h with the handle, which is at \a idx,
+ * and \a nargs values on top of the stack.
+ */
+static void RxCall(lua_State *L, RxHandle *h, int idx, int nargs)
+{
+    lua_rawgeti(L, LUA_REGISTRYINDEX, h->fn);
+    lua_pushvalue(L, idx);
+    if (nargs) {
+        lua_insert(L, -2 - nargs);
+        lua_insert(L, -2 - nargs);
+    }
+    lua_call(L, nargs + 1, 0);
+}
+
+/** Run the callbacks of the watches in \a ev.
+ *
+ * Each handle is put on the stack first, so that none is collected
+ * before its turn if an earlier callback stops it.
+ */
+static void RxDispatchWatches(lua_State *L, SvcPollEvent *ev, int n)
+{
+    int base = lua_gettop(L);
+    int i;
+
+    luaL_checkstack(L, n + 8, "too many ready sockets");
+    for (i = 0; i < n; ++i)
+        lua_rawgeti(L, LUA_REGISTRYINDEX, ((RxHandle *)ev[i].tag)->self);
+    for (i = 0; i < n; ++i) {
+        RxHandle *h = (RxHandle *)ev[i].tag;
+        int readable = (ev[i].events & (SVC_POLL_IN | SVC_POLL_ERR))
+                && (h->events & SVC_POLL_IN);
+        int writable = (ev[i].events & (SVC_POLL_OUT | SVC_POLL_ERR))
+                && (h->events & SVC_POLL_OUT);
+
+        if (!h->active || (!readable && !writable))
+            continue;
+        lua_pushboolean(L, readable);
+        lua_pushboolean(L, writable);
+        RxCall(L, h, base + i + 1, 2);
+    }
+    lua_settop(L, base);
+}
+
+/** Run the callbacks of the timers that are due.
+ *
+ * Timers set by the callbacks wait for the next step, even if they are
+ * due at once.
+ */
+static void RxDispatchTimers(lua_State *L, RxLoop *loop)
+{
+    SvcU64 now = RxNow();
+    SvcU64 last = loop->seq;
+    RxHandle *h;
+
+    while (loop->timers && (h = loop->heap[0])->due <= now && h->seq <= last) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, h->self);
+        if (h->period) {
+            h->due += h->period;
+            if (h->due <= now)
+                h->due = now + h->period;
+            h->seq = ++loop->seq;
+            RxHeapDown(loop, 0);
+        } else
+            RxStop(L, h);
+        RxCall(L, h, lua_gettop(L), 0);
+        lua_pop(L, 1);
+    }
+}
+
+/** Run the on_stop functions once the service is asked to stop, or end
+ * the loop if there are none.
+ *
+ * \param idx Index of the reactor on the stack.
+ */
+static void RxDispatchStop(lua_State *L, RxLoop *loop, int idx)
+{
+    int i, n;
+
+    if (!ServiceStopping)
+        return;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, loop->stops);
+    n = (int)rxRawLen(L, -1);
+    if (!n)
+        loop->quit = 1;
+    if (loop->stopSeen)
+        n = 0;
+    loop->stopSeen = 1;
+    for (i = 1; i <= n; ++i) {
+        lua_rawgeti(L, -1, i);
+        lua_pushvalue(L, idx);
+        lua_call(L, 1, 0);
+    }
+    lua_pop(L, 1);
+}
+
+/** Run one step of the reactor at \a idx: wait at most \a ms ms for
+ * something to happen, and run the callbacks of what did.
+ */
+static void RxStep(lua_State *L, RxLoop *loop, int idx, DWORD ms)
+{
+    SvcPollEvent ev[SVC_POLL_MAX];
+    SvcU64 now;
+    int n;
+
+    if (ServiceStopping && !loop->stopSeen)
+        ms = 0;
+    if (loop->timers) {
+        now = RxNow();
+        if (loop->heap[0]->due <= now)
+            ms = 0;
+        else if (loop->heap[0]->due - now < ms)
+            ms = (DWORD)(loop->heap[0]->due - now);
+    }
+    if (ms) {
+        LuaProfilerSleep(L, 1);
+        LuaWatchdogSleep(1);
+    }
+    n = SvcPollerWait(loop->poller, ev, SVC_POLL_MAX, ms);
+    if (ms) {
+        LuaWatchdogSleep(0);
+        LuaProfilerSleep(L, 0);
+    }
+    if (n < 0)
+        luaL_error(L, "reactor wait failed (%d)", (int)SvcLastError());
+    if (n > 0)
+        RxDispatchWatches(L, ev, n);
+    if (loop->poller)
+        RxDispatchTimers(L, loop);
+    if (loop->poller)
+        RxDispatchStop(L, loop, idx);
+    LuaIdle(L);
+}
+
+/** Implement the Lua method loop:run().
+ *
+ * Run the reactor until loop:stop() is called, or until the service is
+ * asked to stop if no on_stop function has been given.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int rxRun(lua_State *L)
+{
+    RxLoop *loop = RxCheck(L, 1);
+
+    lua_settop(L, 1);
+    loop->quit = 0;
+    while (!loop->quit && loop->poller)
+        RxStep(L, loop, 1, SVC_INFINITE);
+    return 0;
+}
+
+/** Implement the Lua method loop:step([ms]).
+ *
+ * Run one step of the reactor, waiting at most \a ms ms, by default
+ * not at all, for something to happen. Returns false once loop:stop()
+ * has been called, or once the service is asked to stop if no on_stop
+ * function has been given.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int rxStep(lua_State *L)
+{
+    RxLoop *loop = RxCheck(L, 1);
+    lua_Number ms = luaL_optnumber(L, 2, 0);
+
+    lua_settop(L, 1);
+    RxStep(L, loop, 1, ms > 0 ? (DWORD)ms : 0);
+    lua_pushboolean(L, !loop->quit && loop->poller);
+    return 1;
+}
+
+/** Implement the Lua method loop:stop().
+ *
+ * End loop:run() once the callback calling this returns.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int rxStopLoop(lua_State *L)
+{
+    RxLoop *loop = (RxLoop *)luaL_checkudata(L, 1, RX_META);
+
+    loop->quit = 1;
+    return 0;
+}
+
+/** Implement the Lua method loop:watch(sock, events, fn).
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int rxWatch(lua_State *L)
+{
+    RxLoop *loop = RxCheck(L, 1);
+    int events = RxEvents(L, 3);
+    RxSock *so = RxToSock(L, 2);
+    SvcSocket fd;
+    RxHandle *h;
+
+    if (so) {
+        fd = RxCheckSock(L, 2)->s;
+        if (so->watch)
+            return luaL_error(L, "socket is already watched");
+    } else if (lua_type(L, 2) == LUA_TNUMBER) {
+        fd = (SvcSocket)lua_tonumber(L, 2);
+    } else {
+        lua_getfield(L, 2, "getfd");
+        lua_pushvalue(L, 2);
+        lua_call(L, 1, 1);
+        luaL_argcheck(L, lua_type(L, -1) == LUA_TNUMBER, 2,
+                "socket, socket number or object with getfd() expected");
+        fd = (SvcSocket)lua_tonumber(L, -1);
+        lua_pop(L, 1);
+    }
+    h = RxNewHandle(L, loop, 1, RX_WATCH, 4);
+    h->fd = fd;
+    h->events = events;
+    if (!SvcPollerAdd(loop->poller, fd, events, h))
+        return luaL_error(L, "can't watch socket (%d)", (int)SvcLastError());
+    if (so) {
+        h->sock = so;
+        so->watch = h;
+        lua_pushvalue(L, 2);
+        h->sockref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    RxStart(L, h);
+    return 1;
+}
+
+/** Implement the Lua method loop:timer(ms, fn [, period]).
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int rxTimer(lua_State *L)
+{
+    RxLoop *loop = RxCheck(L, 1);
+    lua_Number ms = luaL_checknumber(L, 2);
+    lua_Number period = luaL_optnumber(L, 4, 0);
+    RxHandle *h;
+
+    luaL_argcheck(L, ms >= 0, 2, "time must not be negative");
+    luaL_argcheck(L, period >= 0, 4, "period must not be negative");
+    h = RxNewHandle(L, loop, 1, RX_TIMER, 3);
+    h->period = (DWORD)period;
+    if (!RxHeapSchedule(loop, h, (DWORD)ms))
+        return luaL_error(L, "not enough memory");
+    RxStart(L, h);
+    return 1;
+}
+
+/** Implement the Lua method loop:on_stop(fn).
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int rxOnStop(lua_State *L)
+{
+    RxLoop *loop = RxCheck(L, 1);
+
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, loop->stops);
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, -2, (int)rxRawLen(L, -2) + 1);
+    return 0;
+}
+
+/** Push a new socket object for \a s, or the failure of \a what if it
+ * is SVC_BADSOCKET.
+ *
+ * \returns The number of values pushed.
+ */
+static int RxPushSock(lua_State *L, SvcSocket s, const char *what)
+{
+    RxSock *so;
+
+    if (s == SVC_BADSOCKET)
+        return RxFail(L, what);
+    so = (RxSock *)lua_newuserdata(L, sizeof(RxSock));
+    so->s = s;
+    so->watch = NULL;
+    luaL_getmetatable(L, RXSOCK_META);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+/** Implement the Lua method loop:listen(host, port).
+ *
+ * Listen for TCP connections on \a port of \a host, which is "*" for
+ * every address.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int rxListen(lua_State *L)
+{
+    const char *host = luaL_checkstring(L, 2);
+    const char *port = luaL_checkstring(L, 3);
+
+    RxCheck(L, 1);
+    return RxPushSock(L, SvcTcpListen(host, port), "listen");
+}
+
+/** Implement the Lua method loop:connect(host, port).
+ *
+ * Start connecting to \a port of \a host. The socket becomes writable
+ * once connected; a failed connection shows as a failed read.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int rxConnect(lua_State *L)
+{
+    const char *host = luaL_checkstring(L, 2);
+    const char *port = luaL_checkstring(L, 3);
+
+    RxCheck(L, 1);
+    return RxPushSock(L, SvcTcpConnect(host, port), "connect");
+}
+
+/** Implement the Lua method loop:close() and the __gc metamethod.
+ *
+ * Stop every watch and timer, and forget the on_stop functions.
+ * Closing a reactor twice is harmless.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int rxClose(lua_State *L)
+{
+    RxLoop *loop = (RxLoop *)luaL_checkudata(L, 1, RX_META);
+    RxLoop **pp;
+
+    if (!loop->poller)
+        return 0;
+    while (loop->active)
+        RxStop(L, loop->active);
+    SvcMutexLock(&RxLock);
+    for (pp = &RxOpen; *pp; pp = &(*pp)->next)
+        if (*pp == loop) {
+            *pp = loop->next;
+            break;
+        }
+    SvcMutexUnlock(&RxLock);
+    SvcPollerClose(loop->poller);
+    loop->poller = NULL;
+    free(loop->heap);
+    loop->heap = NULL;
+    luaL_unref(L, LUA_REGISTRYINDEX, loop->stops);
+    loop->stops = LUA_NOREF;
+    loop->quit = 1;
+    return 0;
+}
+
+/** Implement the Lua method h:stop() of watches and timers.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int rxHandleStop(lua_State *L)
+{
+    RxStop(L, (RxHandle *)luaL_checkudata(L, 1, RXHANDLE_META));
+    return 0;
+}
+
+/** Implement the Lua method h:active() of watches and timers.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int rxHandleActive(lua_State *L)
+{
+    RxHandle *h = (RxHandle *)luaL_checkudata(L, 1, RXHANDLE_META);
+
+    lua_pushboolean(L, h->active);
+    return 1;
+}
+
+/** Implement the Lua method w:events(events) of an active watch.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int rxHandleEvents(lua_State *L)
+{
+    RxHandle *h = (RxHandle *)luaL_checkudata(L, 1, RXHANDLE_META);
+    int events = RxEvents(L, 2);
+
+    luaL_argcheck(L, h->kind == RX_WATCH && h->active, 1,
+            "active watch expected");
+    if (events != h->events
+            && !SvcPollerModify(h->loop->poller, h->fd, events, h))
+        return luaL_error(L, "can't watch socket (%d)", (int)SvcLastError());
+    h->events = events;
+    return 0;
+}
+
+/** Implement the Lua method t:start(ms [, period]) of a timer.
+ *
+ * Set the timer again, whether or not it is active.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int rxHandleStart(lua_State *L)
+{
+    RxHandle *h = (RxHandle *)luaL_checkudata(L, 1, RXHANDLE_META);
+    lua_Number ms = luaL_checknumber(L, 2);
+    lua_Number period = luaL_optnumber(L, 3, 0);
+    int active = h->active;
+
+    luaL_argcheck(L, h->kind == RX_TIMER, 1, "timer expected");
+    luaL_argcheck(L, ms >= 0, 2, "time must not be negative");
+    luaL_argcheck(L, period >= 0, 3, "period must not be negative");
+    if (!h->loop->poller)
+        return luaL_error(L, "reactor is closed");
+    h->period = (DWORD)period;
+    if (!RxHeapSchedule(h->loop, h, (DWORD)ms))
+        return luaL_error(L, "not enough memory");
+    if (!active) {
+        lua_settop(L, 1);
+        RxStart(L, h);
+    }
+    return 0;
+}
+
+/** __gc metamethod of watches and timers, which are only collected
+ * once stopped. */
+static int rxHandleGc(lua_State *L)
+{
+    RxHandle *h = (RxHandle *)luaL_checkudata(L, 1, RXHANDLE_META);
+
+    luaL_unref(L, LUA_REGISTRYINDEX, h->fn);
+    luaL_unref(L, LUA_REGISTRYINDEX, h->loopref);
+    h->fn = h->loopref = LUA_NOREF;
+    return 0;
+}
+
+/** Implement the Lua method sock:accept().
+ *
+ * Return a connection waiting on a listening socket and the address of
+ * its other end, or nil and "wouldblock" if none is waiting.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int rxSockAccept(lua_State *L)
+{
+    RxSock *so = RxCheckSock(L, 1);
+    char peer[RX_PEER];
+    int n = RxPushSock(L, SvcTcpAccept(so->s, peer, sizeof(peer)), "accept");
+
+    if (n == 1)
+        lua_pushstring(L, peer);
+    return 2;
+}
+
+/** Implement the Lua method sock:read([max]).
+ *
+ * Return what has arrived, at most \a max bytes, or nil and
+ * "wouldblock" if nothing has, or nil and "closed" once the other end
+ * has closed the connection.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int rxSockRead(lua_State *L)
+{
+    RxSock *so = RxCheckSock(L, 1);
+    lua_Number max = luaL_optnumber(L, 2, RX_READ);
+    size_t total = 0, want;
+    luaL_Buffer b;
+    long got = 0;
+
+    luaL_argcheck(L, max >= 1, 2, "max must be positive");
+    luaL_buffinit(L, &b);
+    while (total < (size_t)max) {
+        char *p = luaL_prepbuffer(&b);
+        want = (size_t)max - total < LUAL_BUFFERSIZE
+                ? (size_t)max - total : LUAL_BUFFERSIZE;
+        got = SvcSocketRecv(so->s, p, want);
+        if (got <= 0)
+            break;
+        luaL_addsize(&b, (size_t)got);
+        total += (size_t)got;
+        if ((size_t)got < want)
+            break;
+    }
+    if (total) {
+        luaL_pushresult(&b);
+        return 1;
+    }
+    if (got == 0) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "closed");
+        return 2;
+    }
+    return RxFail(L, "read");
+}
+
+/** Implement the Lua method sock:write(data [, i]).
+ *
+ * Write what fits of \a data from byte \a i on, and return the count
+ * of bytes written, which is zero if none fit. The caller writes the
+ * rest once the socket is writable again.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int rxSockWrite(lua_State *L)
+{
+    RxSock *so = RxCheckSock(L, 1);
+    size_t len, done = 0;
+    const char *data = luaL_checklstring(L, 2, &len);
+    lua_Integer i = luaL_optinteger(L, 3, 1);
+    long put;
+
+    luaL_argcheck(L, i >= 1, 3, "position must be positive");
+    if ((size_t)i > len) {
+        lua_pushinteger(L, 0);
+        return 1;
+    }
+    data += i - 1;
+    len -= (size_t)i - 1;
+    while (done < len) {
+        put = SvcSocketSend(so->s, data + done, len - done);
+        if (put < 0) {
+            if (SvcSocketWouldBlock())
+                break;
+            return RxFail(L, "write");
+        }
+        done += (size_t)put;
+    }
+    lua_pushinteger(L, (lua_Integer)done);
+    return 1;
+}
+
+/** Implement the Lua method sock:getfd().
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int rxSockGetfd(lua_State *L)
+{
+    lua_pushnumber(L, (lua_Number)RxCheckSock(L, 1)->s);
+    return 1;
+}
+
+/** Implement the Lua method sock:close() and the __gc metamethod.
+ *
+ * Stop the watch of the socket and close it. Closing a socket twice is
+ * harmless.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int rxSockClose(lua_State *L)
+{
+    RxSock *so = (RxSock *)luaL_checkudata(L, 1, RXSOCK_META);
+
+    if (so->watch)
+        RxStop(L, so->watch);
+    if (so->s != SVC_BADSOCKET) {
+        SvcSocketClose(so->s);
+        so->s = SVC_BADSOCKET;
+    }
+    return 0;
+}
+
+/** Methods of a reactor. */
+static const struct luaL_Reg rxMethods[] = {
+        {"run", rxRun},
+        {"step", rxStep},
+        {"stop", rxStopLoop},
+        {"watch", rxWatch},
+        {"timer", rxTimer},
+        {"on_stop", rxOnStop},
+        {"listen", rxListen},
+        {"connect", rxConnect},
+        {"close", rxClose},
+        {NULL, NULL},
+};
+
+/** Methods of watches and timers. */
+static const struct luaL_Reg rxHandleMethods[] = {
+        {"stop", rxHandleStop},
+        {"active", rxHandleActive},
+        {"events", rxHandleEvents},
+        {"start", rxHandleStart},
+        {NULL, NULL},
+};
+
+/** Methods of sockets. */
+static const struct luaL_Reg rxSockMethods[] = {
+        {"accept", rxSockAccept},
+        {"read", rxSockRead},
+        {"write", rxSockWrite},
+        {"getfd", rxSockGetfd},
+        {"close", rxSockClose},
+        {NULL, NULL},
+};
+
+/** Create the metatable \a name with \a methods and the __gc
+ * metamethod \a gc, if it does not exist yet. */
+static void RxMetatable(lua_State *L, const char *name,
+        const luaL_Reg *methods, lua_CFunction gc)
+{
+    if (luaL_newmetatable(L, name)) {
+        lua_newtable(L);
+        luaL_register(L, NULL, methods);
+        lua_setfield(L, -2, "__index");
+        lua_pushcfunction(L, gc);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_pop(L, 1);
+}
+
+/** Implement the Lua function service.reactor().
+ *
+ * Return a new reactor, see the description of LuaReactor.c.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+int LuaReactorOpen(lua_State *L)
+{
+    RxLoop *loop;
+
+    RxMetatable(L, RXHANDLE_META, rxHandleMethods, rxHandleGc);
+    RxMetatable(L, RXSOCK_META, rxSockMethods, rxSockClose);
+    loop = (RxLoop *)lua_newuserdata(L, sizeof(RxLoop));
+    memset(loop, 0, sizeof(*loop));
+    loop->stops = LUA_NOREF;
+    if (luaL_newmetatable(L, RX_META)) {
+        lua_newtable(L);
+        luaL_register(L, NULL, rxMethods);
+        lua_setfield(L, -2, "__index");
+        lua_pushcfunction(L, rxClose);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+    lua_newtable(L);
+    loop->stops = luaL_ref(L, LUA_REGISTRYINDEX);
+    loop->poller = SvcPollerOpen();
+    if (!loop->poller)
+        return luaL_error(L, "can't create reactor (%d)", (int)SvcLastError());
+    SvcMutexLock(&RxLock);
+    loop->next = RxOpen;
+    RxOpen = loop;
+    SvcMutexUnlock(&RxLock);
+    return 1;
+}
+
+/** Wake the script if it waits in a reactor, to look at the stop flag.
+ *
+ * \context
+ * Control handler
+ */
+void LuaReactorWake(void)
+{
+    RxLoop *loop;
+
+    SvcMutexLock(&RxLock);
+    for (loop = RxOpen; loop; loop = loop->next)
+        SvcPollerWake(loop->poller);
+    SvcMutexUnlock(&RxLock);
+}
@@ -0,0 +1,180 @@
+/*! \file LuaReload.c
+ *  \brief Hot reload of the service script.
+ *
+ * A reload replaces the running service script with a freshly loaded
+ * copy of ServiceScript without stopping the service process. It is
+ * requested with the custom service control LUASERVICE_CONTROL_RELOAD
+ * (sent by <code>LuaService reload</code>), or, if the init.lua field
+ * <code>reload_watch</code> is set, by a change to the script file.
+ *
+ * The request is acted on in the worker thread at the next idle point
+ * of the running script, see LuaIdle(), such as a call to
+ * service.sleep(), service.stopping() or service.controls(), where
+ * the script file is also checked for changes, at most once a second:
+ *
+ * -# The new script is loaded and compiled in a new Lua state. If that
+ *    fails, the request is dropped and the running script carries on
+ *    as if nothing happened.
+ * -# If the running script defined service.onreload, it is called and
+ *    its result is copied into the new state as service.handover. An
+ *    error in the hook also drops the request.
+ * -# From then on service.stopping() returns true in the running
+ *    script, which is expected to return as it would on a stop.
+ * -# Once it has returned, its final checkpoint is saved and the new
+ *    script runs in its place, see SvcSupervise().
+ *
+ * A script that never reaches an idle point cannot be reloaded.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "luaservice.h"
+
+/** Private registry key marking a state that is being replaced. */
+static const char *RELOAD_RETIRING = "Reload Retiring";
+
+/** The loaded state waiting to replace the running one, or NULL. */
+static LUAHANDLE ReloadNext;
+
+/** Last write time of the script when last checked. */
+static SvcU64 ReloadStamp;
+
+/** Tick count of the last check of the script file. */
+static DWORD ReloadChecked;
+
+/** Get the last write time of the service script.
+ *
+ * A relative ServiceScript is in the service folder, as for loading it.
+ *
+ * \param ft Receives the time.
+ * \returns Non-zero on success.
+ */
+static int RlScriptTime(SvcU64 *ft)
+{
+    char *path;
+    char *cp;
+    int ok = 0;
+
+    if (SvcPathIsAbsolute(ServiceScript))
+        return SvcFileStat(ServiceScript, NULL, ft, NULL);
+    path = SvcExePath();
+    if (path && (cp = strrchr(path, SVC_DIRSEP)) != NULL) {
+        char *full = (char *)malloc((cp - path) + 2 + strlen(ServiceScript));
+        if (full) {
+            sprintf(full, "%.*s%s", (int)(cp - path) + 1, path, ServiceScript);
+            ok = SvcFileStat(full, NULL, ft, NULL);
+            free(full);
+        }
+    }
+    free(path);
+    return ok;
+}
+
+/** Test whether a state is being replaced by a reload.
+ *
+ * \param L The Lua state.
+ * \returns Non-zero if \a L should finish so that its replacement can run.
+ */
+int LuaReloadRetiring(lua_State *L)
+{
+    int retiring;
+    lua_pushlightuserdata(L, (void *)RELOAD_RETIRING);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    retiring = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    return retiring;
+}
+
+/** Load the new script and arrange for it to replace \a L.
+ *
+ * \param L The running script's Lua state.
+ */
+static void RlSwap(lua_State *L)
+{
+    lua_State *N;
+    char *data = NULL;
+    size_t len = 0;
+
+    SvcDebugTraceStr("Reloading %s\n", ServiceScript);
+    N = (lua_State *)LuaServiceLoadWorker();
+    if (!N) {
+        SvcDebugTrace("Reload failed to load, keeping the running script\n", 0);
+        return;
+    }
+
+    lua_getglobal(L, "service");
+    lua_getfield(L, -1, "onreload");
+    if (lua_isfunction(L, -1)) {
+        if (lua_pcall(L, 0, 1, 0)) {
+            SvcDebugTraceStr("service.onreload failed: %s\n",
+                    lua_tostring(L, -1));
+            lua_pop(L, 2);
+            LuaWorkerCleanup(N);
+            SvcDebugTrace("Reload abandoned, keeping the running script\n", 0);
+            return;
+        }
+        if (!lua_isnil(L, -1) && !(data = LuaStateSerialize(L, -1, &len))) {
+            lua_pop(L, 2);
+            LuaWorkerCleanup(N);
+            SvcDebugTrace("Reload abandoned, keeping the running script\n", 0);
+            return;
+        }
+    }
+    lua_pop(L, 2);
+
+    if (data) {
+        lua_getglobal(N, "service");
+        if (lua_istable(N, -1) && LuaStateDeserialize(N, data, len))
+            lua_setfield(N, -2, "handover");
+        lua_pop(N, 1);
+        free(data);
+    }
+
+    ReloadNext = N;
+    lua_pushlightuserdata(L, (void *)RELOAD_RETIRING);
+    lua_pushboolean(L, 1);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+    SvcDebugTrace("New script loaded, waiting for the running one to finish\n", 0);
+}
+
+/** Act on a pending reload at an idle point of the script.
+ *
+ * Called from LuaIdle(). Also checks the script file for changes, at most once a second, if
+ * <code>reload_watch</code> is set.
+ *
+ * \param L The running script's Lua state.
+ */
+void LuaReloadPoll(lua_State *L)
+{
+    SvcU64 ft;
+
+    if (ReloadNext || LuaReloadRetiring(L))
+        return;
+    if (ServiceReloadWatch && SvcTicks() - ReloadChecked >= 1000) {
+        ReloadChecked = SvcTicks();
+        if (RlScriptTime(&ft)) {
+            if (ReloadStamp && ft != ReloadStamp)
+                ServiceReloadPending = 1;
+            ReloadStamp = ft;
+        }
+    }
+    if (!ServiceReloadPending)
+        return;
+    ServiceReloadPending = 0;
+    RlSwap(L);
+}
+
+/** Take the state loaded by a reload.
+ *
+ * \returns The state that replaces the one that just finished, or NULL
+ * if no reload is in progress.
+ */
+LUAHANDLE LuaReloadTake(void)
+{
+    LUAHANDLE h = ReloadNext;
+    ReloadNext = NULL;
+    return h;
+}
@@ -1,29 +1,23 @@
 /*! 
  * \file LuaService.c
- * \brief Windows Service framework and startup.
+ * \brief Service framework and startup.
  * 
  * \author Ross Berteig
  * \author Cheshire Engineering Corp.
  * 
  * Copyright (c) 2007, Ross Berteig, Cheshire Engineering Corp.
  * Licensed under the MIT license, see \ref license for the details.
- * 
- * \todo Supporting service PAUSE and CONTINUE control request will
- * require some effort beyond the bare framework guarded by the 
- * undefined macro LUASERVICE_CAN_PAUSE_CONTINUE. At minimum, 
- * some mechanism must be provided for the Lua side to become
- * aware of the request and actually pause; presumably an Event
- * could be waited on to implement the pause, and signaled to 
- * implement continue. However, since we assume that the Lua 
- * interpreter itself is not built for threading, we don't have
- * a good means to asynchronously notify the Lua code of the 
- * pause request in the first place, which would imply that the
- * Lua code is constantly polling.
+ *
+ * This file holds the parts of the service that do not depend on the
+ * service manager: configuration, tracing and loading the service
+ * script. The Windows SCM backend is in SvcWin32.c and SvcHandler.c,
+ * and the POSIX backend, which runs the service as a daemon driven by
+ * signals, is in SvcPosix.c.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <windows.h>
+#include <string.h>
 
 #include "luaservice.h"
 
@@ -99,39 +93,105 @@ const char *LuaPackageCPath = NULL;
  */
 const char *LuaInitScript = NULL;
 
-const char **LuaServiceArgv = NULL;
+/** Checkpoint file.
+ *
+ * Names the file that holds the table registered with
+ * service.checkpoint(). If NULL, no checkpoint is kept and
+ * service.restored is always nil.
+ *
+ * \note This value may be configured for a specific installation 
+ * of this framework by writing a lua script named init.lua that
+ * returns a table with a field <code>checkpoint</code>. The init.lua 
+ * script must be located in the same folder as LuaService.exe.
+ */
+const char *CheckpointFile = NULL;
 
-size_t LuaServiceArgc = 0;
+/** Checkpoint interval in ms.
+ *
+ * If positive, the checkpoint is also saved this often while the 
+ * service runs, and not just when the service script finishes.
+ *
+ * \note This value may be configured for a specific installation 
+ * of this framework by writing a lua script named init.lua that
+ * returns a table with a field <code>checkpoint_interval</code>. The 
+ * init.lua script must be located in the same folder as LuaService.exe.
+ */
+int CheckpointInterval = 0;
 
-/** Current service status.
- * 
- * \context 
- * Service main and worker threads
+/** Restart the service script if it fails.
+ *
+ * If zero, an error in the service script stops the service. 
+ * Otherwise the script is restarted in a fresh Lua state, as 
+ * described in SvcSupervisor.c.
+ *
+ * \note This value may be configured for a specific installation 
+ * of this framework by writing a lua script named init.lua that
+ * returns a table with a field <code>restart</code>. The init.lua 
+ * script must be located in the same folder as LuaService.exe.
  */
-SERVICE_STATUS LuaServiceStatus;
+int ServiceRestart = 0;
 
-/** Handle to the SCM for the running service to report status.
- * 
- * This is global because it is discovered by the worker thread,
- * and needed by the thread in which the control request handler
- * executes, which is apparently (but not particularly documented) 
- * the main thread.
- * 
- * \context 
- * Service main and worker threads
+/** Delay in ms before the first restart of a failed script.
+ *
+ * \note This value may be configured for a specific installation 
+ * of this framework by writing a lua script named init.lua that
+ * returns a table with a field <code>restart_delay</code>. The init.lua 
+ * script must be located in the same folder as LuaService.exe.
  */
-SERVICE_STATUS_HANDLE LuaServiceStatusHandle;
+int ServiceRestartDelay = 1000;
 
-/** Handle to the thread executing ServiceMain().
- * 
- * This will be initialized by ServiceMain() as a duplicate of
- * the thread handle, for use in the main() thread so that it has
- * a kernel object on which it can wait for the service thread 
- * to have exited when stopping the service.
- * 
- * Since it was created as a duplicate, it must be closed.
+/** Longest delay in ms before the restart of a failed script.
+ *
+ * \note This value may be configured for a specific installation 
+ * of this framework by writing a lua script named init.lua that
+ * returns a table with a field <code>restart_max_delay</code>. The 
+ * init.lua script must be located in the same folder as LuaService.exe.
  */
-HANDLE ServiceWorkerThread;
+int ServiceRestartMaxDelay = 60000;
+
+/** Most restarts allowed within one ServiceRestartWindow.
+ *
+ * \note This value may be configured for a specific installation 
+ * of this framework by writing a lua script named init.lua that
+ * returns a table with a field <code>restart_limit</code>. The init.lua 
+ * script must be located in the same folder as LuaService.exe.
+ */
+int ServiceRestartLimit = 5;
+
+/** Window in ms over which restarts are counted.
+ *
+ * \note This value may be configured for a specific installation 
+ * of this framework by writing a lua script named init.lua that
+ * returns a table with a field <code>restart_window</code>. The init.lua 
+ * script must be located in the same folder as LuaService.exe.
+ */
+int ServiceRestartWindow = 60000;
+
+/** Keep a loaded standby state for immediate restart.
+ *
+ * \note This value may be configured for a specific installation 
+ * of this framework by writing a lua script named init.lua that
+ * returns a table with a field <code>standby</code>. The init.lua 
+ * script must be located in the same folder as LuaService.exe.
+ */
+int ServiceStandby = 0;
+
+/** PID file of a POSIX daemon.
+ *
+ * If set, SvcPosix.c writes the process id to this file while the
+ * service runs, and the stop, reload and status commands use it to 
+ * find the running service. Not used on Windows.
+ *
+ * \note This value may be configured for a specific installation 
+ * of this framework by writing a lua script named init.lua that
+ * returns a table with a field <code>pidfile</code>. The init.lua 
+ * script must be located in the same folder as LuaService.exe.
+ */
+const char *ServicePidFile = NULL;
+
+const char **LuaServiceArgv = NULL;
+
+size_t LuaServiceArgc = 0;
 
 /** Trace level.
  * Controls the verbosity of the trace output. The level is tested
@@ -147,9 +207,10 @@ int SvcDebugTraceLevel = 1;
  * 
  * Set in the service control request handler to indicate that 
  * a STOP request has been received and that the SCM is being
- * informed that the service is now SERVICE_STOP_PENDING.
+ * informed that the service is now SERVICE_STOP_PENDING. A POSIX
+ * daemon sets it on SIGTERM or SIGINT.
  * 
- * About 25 seconds after setting this flag, the service will
+ * ServiceStopTimeout ms after setting this flag, the service will
  * forcefully die with or without cooperation from the worker
  * thread.
  * 
@@ -158,6 +219,303 @@ int SvcDebugTraceLevel = 1;
  */
 volatile int ServiceStopping = 0;
 
+/** Tick count of the stop request, see LuaServiceStop(). */
+volatile DWORD ServiceStopTicks = 0;
+
+/** SvcMicros() of the stop request, for the timeline's stop span. */
+volatile SvcU64 ServiceStopMicros = 0;
+
+/** Time in ms the service script gets to finish after a stop request.
+ *
+ * The SCM is told to expect the service to stop within the time left
+ * of it, and the process ends when it runs out.
+ *
+ * \note This value may be configured for a specific installation 
+ * of this framework by writing a lua script named init.lua that
+ * returns a table with a field <code>stop_timeout</code>. The init.lua 
+ * script must be located in the same folder as LuaService.exe.
+ */
+int ServiceStopTimeout = 25000;
+
+/** Time in ms the service script gets to notice a stop request before
+ * it is cancelled, see LuaCancel.c.
+ *
+ * Should be shorter than ServiceStopTimeout, to leave time for the
+ * functions registered with service.on_stop().
+ *
+ * \note This value may be configured for a specific installation 
+ * of this framework by writing a lua script named init.lua that
+ * returns a table with a field <code>stop_grace</code>. The init.lua 
+ * script must be located in the same folder as LuaService.exe.
+ */
+int ServiceStopGrace = 20000;
+
+/** Watchdog time in ms.
+ *
+ * If positive, a service script that goes this long without a
+ * heartbeat is taken to be hung, see LuaWatchdog.c.
+ *
+ * \note This value may be configured for a specific installation 
+ * of this framework by writing a lua script named init.lua that
+ * returns a table with a field <code>watchdog</code>. The init.lua 
+ * script must be located in the same folder as LuaService.exe.
+ */
+int ServiceWatchdog = 0;
+
+/** Fail a hung service script, instead of only tracing where it hangs.
+ *
+ * \note This value may be configured for a specific installation 
+ * of this framework by writing a lua script named init.lua that
+ * returns a table with a field <code>watchdog_restart</code>. The 
+ * init.lua script must be located in the same folder as LuaService.exe.
+ */
+int ServiceWatchdogRestart = 0;
+
+/** Publish the status page in shared memory, see LuaStatus.c.
+ *
+ * Only read when the service starts.
+ *
+ * \note This value may be configured for a specific installation 
+ * of this framework by writing a lua script named init.lua that
+ * returns a table with a field <code>status_page</code>. The 
+ * init.lua script must be located in the same folder as LuaService.exe.
+ */
+int ServiceStatusPage = 0;
+
+/** Local endpoint for commands, see LuaCommands.c.
+ *
+ * If set, the service listens for <tt>LuaService ctl</tt> commands on
+ * the Unix socket at this path, or on Windows the named pipe of this
+ * name.
+ *
+ * \note This value may be configured for a specific installation 
+ * of this framework by writing a lua script named init.lua that
+ * returns a table with a field <code>control_socket</code>. The 
+ * init.lua script must be located in the same folder as LuaService.exe.
+ */
+const char *ServiceControlSocket = NULL;
+
+/** Count of calls to service.progress() since the stop request.
+ *
+ * Advances the checkpoint reported to the SCM while the service is
+ * stopping, so that a script draining its work shows it is not hung.
+ */
+volatile long ServiceStopProgress = 0;
+
+/** Time in ms the last stop took, from the request until the service
+ * script finished or was abandoned. Zero until the service stops. */
+DWORD ServiceStopLatency = 0;
+
+/** Longest time in ms the service script may take to become ready.
+ *
+ * If positive, the service is reported as starting until the script
+ * calls service.ready(), and is stopped with an error if that takes
+ * longer than this from process start. Zero reports the service 
+ * running as soon as the script has loaded. Only read when the service
+ * starts.
+ *
+ * \note This value may be configured for a specific installation 
+ * of this framework by writing a lua script named init.lua that
+ * returns a table with a field <code>ready_timeout</code>. The init.lua 
+ * script must be located in the same folder as LuaService.exe.
+ */
+int ServiceReadyTimeout = 0;
+
+/** SvcMicros() when the service script had loaded, for the timeline's
+ * span of the time it took to get ready. */
+static SvcU64 LoadedMicros = 0;
+
+/** Service Ready Flag.
+ *
+ * Set by LuaServiceReady() once the service has been reported running.
+ */
+volatile int ServiceReady = 0;
+
+/** Count of calls to service.progress() while starting.
+ *
+ * Advances the checkpoint reported to the SCM while the script gets
+ * ready, like ServiceStopProgress.
+ */
+volatile long ServiceStartProgress = 0;
+
+/** Time in ms the script expects its next startup step to take, as
+ * passed to service.progress(), or zero if it has not said. */
+volatile DWORD ServiceStartHint = 0;
+
+/** Tick count when LuaServiceStartup() began, for startup timings. */
+DWORD LuaServiceStartTicks = 0;
+
+/** Service Reload Flag.
+ * 
+ * Set in the service control request handler when the custom control
+ * LUASERVICE_CONTROL_RELOAD is received, or by a POSIX daemon on
+ * SIGUSR1. The worker notices it at its
+ * next call to service.sleep() or service.stopping(), see LuaReload.c.
+ */
+volatile int ServiceReloadPending = 0;
+
+/** Reload the service script when its file changes.
+ *
+ * \note This value may be configured for a specific installation 
+ * of this framework by writing a lua script named init.lua that
+ * returns a table with a field <code>reload_watch</code>. The init.lua 
+ * script must be located in the same folder as LuaService.exe.
+ */
+int ServiceReloadWatch = 0;
+
+/** Garbage collector pause, in percent.
+ *
+ * If positive, passed to lua_gc(LUA_GCSETPAUSE) in every Lua state the
+ * service creates. Zero leaves Lua's default.
+ *
+ * \note This value may be configured for a specific installation 
+ * of this framework by writing a lua script named init.lua that
+ * returns a table with a field <code>gc_pause</code>. The init.lua 
+ * script must be located in the same folder as LuaService.exe.
+ */
+int ServiceGcPause = 0;
+
+/** Garbage collector step multiplier, in percent.
+ *
+ * If positive, passed to lua_gc(LUA_GCSETSTEPMUL) in every Lua state
+ * the service creates. Zero leaves Lua's default.
+ *
+ * \note This value may be configured for a specific installation 
+ * of this framework by writing a lua script named init.lua that
+ * returns a table with a field <code>gc_stepmul</code>. The init.lua 
+ * script must be located in the same folder as LuaService.exe.
+ */
+int ServiceGcStepmul = 0;
+
+/** Profile the service script.
+ *
+ * If non-zero, the sampling profiler in LuaProfiler.c runs from the
+ * start of the service script. Changing it while the service runs
+ * starts or stops the profiler.
+ *
+ * \note This value may be configured for a specific installation 
+ * of this framework by writing a lua script named init.lua that
+ * returns a table with a field <code>profile</code>. The init.lua 
+ * script must be located in the same folder as LuaService.exe.
+ */
+int ServiceProfile = 0;
+
+/** Profile file.
+ *
+ * Names the file the profiler writes its samples to, in folded stack
+ * format, when it stops.
+ *
+ * \note This value may be configured for a specific installation 
+ * of this framework by writing a lua script named init.lua that
+ * returns a table with a field <code>profile_file</code>. The init.lua 
+ * script must be located in the same folder as LuaService.exe.
+ */
+const char *ServiceProfileFile = "profile.folded";
+
+/** Profiler sampling interval, in ms.
+ *
+ * \note This value may be configured for a specific installation 
+ * of this framework by writing a lua script named init.lua that
+ * returns a table with a field <code>profile_interval</code>. The init.lua 
+ * script must be located in the same folder as LuaService.exe.
+ */
+int ServiceProfileInterval = 10;
+
+/** Most time the profiler may take, in percent.
+ *
+ * If sampling takes more than this share of the time, the profiler
+ * samples less often.
+ *
+ * \note This value may be configured for a specific installation 
+ * of this framework by writing a lua script named init.lua that
+ * returns a table with a field <code>profile_overhead</code>. The init.lua 
+ * script must be located in the same folder as LuaService.exe.
+ */
+int ServiceProfileOverhead = 2;
+
+/** Profiler Toggle Flag.
+ *
+ * Set when the custom control LUASERVICE_CONTROL_PROFILE is received,
+ * or by a POSIX daemon on SIGPROF. The worker starts or stops the
+ * profiler at its next call to service.sleep() or service.stopping().
+ */
+volatile int ServiceProfileToggle = 0;
+
+/** Profile the heap of the service script.
+ *
+ * If non-zero, the heap profiler in LuaHeap.c runs in every Lua state
+ * the service creates. Changing it while the service runs starts or
+ * stops it in the running script.
+ *
+ * \note This value may be configured for a specific installation 
+ * of this framework by writing a lua script named init.lua that
+ * returns a table with a field <code>heap_profile</code>. The init.lua 
+ * script must be located in the same folder as LuaService.exe.
+ */
+int ServiceHeapProfile = 0;
+
+/** Heap profiler sampling interval, in bytes allocated.
+ *
+ * \note This value may be configured for a specific installation 
+ * of this framework by writing a lua script named init.lua that
+ * returns a table with a field <code>heap_sample</code>. The init.lua 
+ * script must be located in the same folder as LuaService.exe.
+ */
+int ServiceHeapSample = 65536;
+
+/** Heap report file.
+ *
+ * Names the file the heap profiler writes its report to.
+ *
+ * \note This value may be configured for a specific installation 
+ * of this framework by writing a lua script named init.lua that
+ * returns a table with a field <code>heap_file</code>. The init.lua 
+ * script must be located in the same folder as LuaService.exe.
+ */
+const char *ServiceHeapFile = "heap.txt";
+
+/** Heap Report Flag.
+ *
+ * Set along with ServiceProfileToggle. The worker writes its heap
+ * report, if the heap profiler is running, at its next call to
+ * service.sleep() or service.stopping().
+ */
+volatile int ServiceHeapReportPending = 0;
+
+/** Timeline file.
+ *
+ * If set, the spans of the timeline in LuaTimeline.c are written to
+ * this file in Chrome trace event format. Not set by default, which
+ * turns the timeline off.
+ *
+ * \note This value may be configured for a specific installation 
+ * of this framework by writing a lua script named init.lua that
+ * returns a table with a field <code>timeline</code>. The init.lua 
+ * script must be located in the same folder as LuaService.exe.
+ */
+const char *ServiceTimelineFile = NULL;
+
+/** Timeline ring size, in spans.
+ *
+ * If positive, only this many of the latest spans of the timeline are
+ * kept, and written on demand, instead of all being written as they
+ * happen. Only read when the service starts.
+ *
+ * \note This value may be configured for a specific installation 
+ * of this framework by writing a lua script named init.lua that
+ * returns a table with a field <code>timeline_ring</code>. The init.lua 
+ * script must be located in the same folder as LuaService.exe.
+ */
+int ServiceTimelineRing = 0;
+
+/** Configuration generation.
+ *
+ * Incremented each time init.lua is applied again while the service
+ * runs, so that the worker can notice and apply the settings that 
+ * only it can, such as the garbage collector's.
+ */
+volatile int ServiceConfigGeneration = 0;
+
 /** Output a debug string.
  * 
  * The string is formatted and output only if SvcDebugTraceLevel is 
@@ -186,16 +544,16 @@ void SvcDebugTrace(LPCSTR fmt, DWORD dw)
     if (SvcDebugTraceLevel == 2)
         cp += sprintf(Buffer, "[%s] ", ServiceName);
     else if (SvcDebugTraceLevel >= 3)
-        cp += sprintf(Buffer, "[%s:%ld/%ld] ", ServiceName,
-                GetCurrentProcessId(), GetCurrentThreadId());
+        cp += sprintf(Buffer, "[%s:%lu/%lu] ", ServiceName,
+                (unsigned long)SvcProcessId(), (unsigned long)SvcThreadId());
     if (fmt == NULL) {
         strcpy(cp, "-nil-");
-        OutputDebugStringA(Buffer);
+        SvcDebugOutput(Buffer);
     } else if ((strlen(fmt)+12) < (sizeof(Buffer) - (cp - Buffer))) {
         sprintf(cp, fmt, dw);
-        OutputDebugStringA(Buffer);
+        SvcDebugOutput(Buffer);
     } else
-        OutputDebugStringA("--buffer overflow--");
+        SvcDebugOutput("--buffer overflow--");
 }
 
 /** Output a debug string.
@@ -226,92 +584,21 @@ void SvcDebugTraceStr(LPCSTR fmt, LPCSTR s)
     if (SvcDebugTraceLevel == 2)
         cp += sprintf(Buffer, "[%s] ", ServiceName);
     else if (SvcDebugTraceLevel >= 3)
-        cp += sprintf(Buffer, "[%s:%ld/%ld] ", ServiceName,
-                GetCurrentProcessId(), GetCurrentThreadId());
+        cp += sprintf(Buffer, "[%s:%lu/%lu] ", ServiceName,
+                (unsigned long)SvcProcessId(), (unsigned long)SvcThreadId());
     if (s == NULL)
         s = "-nil-";
     if (fmt == NULL)
         fmt = "-nil-";
     if ((strlen(fmt)+strlen(s)) < sizeof(Buffer) - (cp - Buffer)) {
         sprintf(cp, fmt, s);
-        OutputDebugStringA(Buffer);
+        SvcDebugOutput(Buffer);
     } else
-        OutputDebugStringA("--buffer overflow--");
+        SvcDebugOutput("--buffer overflow--");
 }
 
-/** Service Control Handler.
- * 
- * Called in the main thread when the SCM needs to deliver a
- * status or control request to the service.
- * 
- * \context
- * Service main thread
- * 
- * \param Opcode The control operation to handle.
- * 
- * \see ssSvc
- */
-void WINAPI LuaServiceCtrlHandler(DWORD Opcode)
-{
-    DWORD status;
-
-    SvcDebugTrace("Entered LuaServiceCtrlHandler(%d)\n", Opcode);
-    switch (Opcode) {
-#ifdef LUASERVICE_CAN_PAUSE_CONTINUE
-    case SERVICE_CONTROL_PAUSE:
-    // Do whatever it takes to pause here. 
-    LuaServiceStatus.dwCurrentState = SERVICE_PAUSED;
-    break;
-
-    case SERVICE_CONTROL_CONTINUE:
-    // Do whatever it takes to continue here. 
-    LuaServiceStatus.dwCurrentState = SERVICE_RUNNING;
-    break;
-#endif
-    case SERVICE_CONTROL_STOP:
-        // Do whatever it takes to stop here. 
-        SvcDebugTrace("Telling service to stop\n", 0);
-        ServiceStopping = 1;
-        LuaServiceStatus.dwWin32ExitCode = 0;
-        LuaServiceStatus.dwCurrentState = SERVICE_STOP_PENDING;
-        LuaServiceStatus.dwCheckPoint = 0;
-        LuaServiceStatus.dwWaitHint = 25250;
-
-        if (!SetServiceStatus(LuaServiceStatusHandle, &LuaServiceStatus)) {
-            status = GetLastError();
-            SvcDebugTrace("SetServiceStatus error %ld\n", status);
-        }
-        if (ServiceWorkerThread != NULL) {
-            SvcDebugTrace("Waiting 25 s for worker to stop\n", 0);
-            WaitForSingleObject(ServiceWorkerThread, 25000);
-            CloseHandle(ServiceWorkerThread);
-        }
-        LuaServiceStatus.dwCurrentState = SERVICE_STOPPED;
-        if (!SetServiceStatus(LuaServiceStatusHandle, &LuaServiceStatus)) {
-            status = GetLastError();
-            SvcDebugTrace("SetServiceStatus error %ld\n", status);
-        }
-
-        SvcDebugTrace("Leaving Service\n", 0);
-        return;
-
-    case SERVICE_CONTROL_INTERROGATE:
-        // Fall through to send current status. 
-        break;
-
-    default:
-        SvcDebugTrace("Unrecognized opcode %ld\n", Opcode);
-    }
-
-    // Send current status. 
-    if (!SetServiceStatus(LuaServiceStatusHandle, &LuaServiceStatus)) {
-        status = GetLastError();
-        SvcDebugTrace("SetServiceStatus error %ld\n", status);
-    }
-    return;
-}
-
-static void LuaAppendEnv(const char *name, const char *value){
+static void LuaAppendEnv(const char *name, const char *value,
+        const char *sep){
   const char *new_value;
 
   if (!value)
@@ -323,10 +610,10 @@ static void LuaAppendEnv(const char *name, const char *value){
   else {
     const char *existed_value = getenv(name);
     if (existed_value) {
-      size_t size = strlen(existed_value) + strlen(value) + 2;
+      size_t size = strlen(existed_value) + strlen(value) + strlen(sep) + 1;
       char *buffer = (char*) malloc(size);
       strcpy(buffer, value);
-      strcat(buffer, ";");
+      strcat(buffer, sep);
       strcat(buffer, existed_value);
       new_value = buffer;
     }
@@ -335,7 +622,7 @@ static void LuaAppendEnv(const char *name, const char *value){
     }
   }
 
-  _putenv_s(name, new_value);
+  SvcSetEnv(name, new_value);
 
   SvcDebugTraceStr("set env %s=", name); SvcDebugTraceStr("%s\n", new_value);
 
@@ -350,7 +637,7 @@ static void LuaSetEnv(const char *name, const char *value){
   if (!value)
     return;
 
-  _putenv_s(name, value);
+  SvcSetEnv(name, value);
 
   SvcDebugTraceStr("set env %s=", name); SvcDebugTraceStr("%s\n", value);
 }
@@ -361,201 +648,287 @@ static void LuaSetEnv(const char *name, const char *value){
  * is specified by the <code>script</code> field in the table returned by
  * init.lua.
  * 
- * \param argc Count of arguments passed to the service program by the SCM.
- * \param argv Array of argument strings passed to the service program by the SCM.
  * \param ph   Pointer to a LUAHANDLE that will be written with the handle 
  *             of an initialized Lua state that has all globals loaded and 
  *             the service's main script parsed and loaded.
- * \param perror Pointer to a DWORD to fill with the Win32 error code that
+ * \param perror Pointer to a DWORD to fill with the system error code that
  *             relates to initialization failure, if initialization failed.
  * 			   This value will be passed to the SCM for logging on failure.
  * \returns    Zero on success, non-zero exit status on failure.
  * 			   This value will be passed to the SCM for logging on failure.
  */
-DWORD LuaServiceInitialization(DWORD argc, LPTSTR *argv, LUAHANDLE *ph,
-        DWORD *perror)
+DWORD LuaServiceInitialization(LUAHANDLE *ph, DWORD *perror)
 {
-    if (!DuplicateHandle(GetCurrentProcess(), GetCurrentThread(),
-            GetCurrentProcess(), &ServiceWorkerThread, 0, 
-            FALSE, 
-            DUPLICATE_SAME_ACCESS)) {
-        *perror = GetLastError();
-        *ph = NULL;
-        return TRUE;
-    }
+    SvcU64 start;
+
     SvcDebugTraceStr("Load LuaService script %s\n", ServiceScript);
+    LuaTimelineStart();
+    LuaStatusStart();
+    LuaCommandStart();
+    start = SvcMicros();
 
     /* This will work only if LuaService.exe and luaXX.dll use 
      * same msvcr version and not `msvcrt.dll`. But we use this
      * because if Lua code creates new Lua state (e.g. new thread)
      * it can read this value.
      */
-    LuaAppendEnv("PATH",          LuaSystemPath);
-    LuaAppendEnv("LUA_PATH",      LuaPackagePath);
-    LuaAppendEnv("LUA_CPATH",     LuaPackageCPath);
+    LuaAppendEnv("PATH",          LuaSystemPath,   SVC_PATHLISTSEP);
+    LuaAppendEnv("LUA_PATH",      LuaPackagePath,  ";");
+    LuaAppendEnv("LUA_CPATH",     LuaPackageCPath, ";");
     LuaSetEnv(LUA_INIT_VAR,       LuaInitScript);
     LuaSetEnv(LUA_INITVARVERSION, LuaInitScript);
+    SvcSpan("environment", start);
 
-    *ph = LuaWorkerLoad(NULL, ServiceScript);
+    start = SvcMicros();
+    *ph = LuaServiceLoadWorker();
+    SvcSpan("load service script", start);
     if(!*ph){
-        *perror = -1;
+        *perror = (DWORD)-1;
         return TRUE;
     }
 
-    LuaWorkerSetArgs(*ph, LuaServiceArgc, LuaServiceArgv);
-
     *perror = 0;
+    LoadedMicros = SvcMicros();
     return NO_ERROR;
 }
 
-BOOL LuaServiceSetStatus(DWORD dwCurrentState, DWORD dwCheckPoint,
-        DWORD dwWaitHint)
+/** Make the service folder the current directory.
+ * 
+ * Done before init.lua runs at startup and before each run of the 
+ * service script, rather than as a Lua state is created, so that a 
+ * state loaded in the background leaves the running script's current 
+ * directory alone.
+ */
+void LuaServiceEnterFolder(void)
 {
-    LuaServiceStatus.dwCurrentState = dwCurrentState;
-    LuaServiceStatus.dwCheckPoint = dwCheckPoint;
-    LuaServiceStatus.dwWaitHint = dwWaitHint;
-    return SetServiceStatus(LuaServiceStatusHandle, &LuaServiceStatus);
+    char *szPath = SvcExePath();
+    char *cp;
+
+    if (!szPath)
+        return;
+    cp = strrchr(szPath, SVC_DIRSEP);
+    if (cp) {
+        cp[0] = '\0';
+        SvcSetCwd(szPath);
+    }
+    free(szPath);
 }
 
-/** Service Main function.
- * 
- * The entry point of the service's primary worker thread. Since
- * this thread was created by system library code, it apparently 
- * has not had the CRT completely initialized. 
+/** Load the service script into a new Lua state.
  * 
- * \todo Should LuaService push its Lua implementation into a second
- * worker thread that has its CRT properly initialized by using 
- * _beginthreadex() to create it instead of CreateThread()?
- * 
- * \context
- * Service worker thread
+ * \returns The handle of a Lua state with the service script loaded 
+ *          and service.argv set, or NULL if the script failed to load.
+ */
+LUAHANDLE LuaServiceLoadWorker(void)
+{
+    LUAHANDLE h = LuaWorkerLoad(NULL, ServiceScript);
+    if (h)
+        LuaWorkerSetArgs(h, LuaServiceArgc, LuaServiceArgv);
+    return h;
+}
+
+/** The init.lua fields that may change while the service runs.
  * 
- * \param argc The count of arguments.
- * \param argv The list of arguments.
+ * These are the fields whose values are read afresh by the worker each
+ * time they are needed, so changing them takes effect at once. A field
+ * that init.lua does not set keeps its value, as does a field marked
+ * positive that is not set to a positive number.
+ */
+static const struct {
+    const char *field;      /**< Name of the field in init.lua. */
+    int *value;             /**< The variable it configures. */
+    int positive;           /**< Non-zero if only positive values apply. */
+} LiveFields[] = {
+    { "tracelevel",          &SvcDebugTraceLevel,       0 },
+    { "checkpoint_interval", &CheckpointInterval,       0 },
+    { "restart",             &ServiceRestart,           0 },
+    { "standby",             &ServiceStandby,           0 },
+    { "reload_watch",        &ServiceReloadWatch,       0 },
+    { "restart_delay",       &ServiceRestartDelay,      1 },
+    { "restart_max_delay",   &ServiceRestartMaxDelay,   1 },
+    { "restart_limit",       &ServiceRestartLimit,      1 },
+    { "restart_window",      &ServiceRestartWindow,     1 },
+    { "gc_pause",            &ServiceGcPause,           0 },
+    { "gc_stepmul",          &ServiceGcStepmul,         0 },
+    { "profile",             &ServiceProfile,           0 },
+    { "profile_interval",    &ServiceProfileInterval,   1 },
+    { "profile_overhead",    &ServiceProfileOverhead,   1 },
+    { "heap_profile",        &ServiceHeapProfile,       0 },
+    { "heap_sample",         &ServiceHeapSample,        1 },
+    { "stop_timeout",        &ServiceStopTimeout,       1 },
+    { "stop_grace",          &ServiceStopGrace,         1 },
+    { "watchdog",            &ServiceWatchdog,          0 },
+    { "watchdog_restart",    &ServiceWatchdogRestart,   0 },
+    { NULL, NULL, 0 }
+};
+
+/** Apply the LiveFields that init.lua sets.
  * 
- * \see \ref ssSvc
+ * \param lh The Lua state in which init.lua was run.
  */
-void WINAPI LuaServiceMain(DWORD argc, LPTSTR *argv)
+static void LuaServiceConfigureLive(LUAHANDLE lh)
 {
-    DWORD status = 0;
-    DWORD specificError = 0;
-    LUAHANDLE wk = 0;
-
-    SvcDebugTrace("Entered LuaServiceMain\n", 0);
-
-    LuaServiceStatus.dwServiceType = SERVICE_WIN32_OWN_PROCESS; // SERVICE_WIN32; 
-    LuaServiceStatus.dwCurrentState = SERVICE_START_PENDING;
-    LuaServiceStatus.dwControlsAccepted = (0 | SERVICE_ACCEPT_STOP 
-                //| SERVICE_ACCEPT_SHUTDOWN
-#ifdef LUASERVICE_CAN_PAUSE_CONTINUE
-                | SERVICE_ACCEPT_PAUSE_CONTINUE
-#endif
-                );
-    LuaServiceStatus.dwWin32ExitCode = 0;
-    LuaServiceStatus.dwServiceSpecificExitCode = 0;
-    LuaServiceStatus.dwCheckPoint = 0;
-    LuaServiceStatus.dwWaitHint = 0;
-
-    LuaServiceStatusHandle = RegisterServiceCtrlHandler(
-            ServiceName,
-            LuaServiceCtrlHandler);
-
-    if (LuaServiceStatusHandle == (SERVICE_STATUS_HANDLE)0) {
-        SvcDebugTrace("RegisterServiceCtrlHandler failed %d\n",
-                GetLastError());
-        return;
+    int i, n;
+
+    for (i = 0; LiveFields[i].field; ++i) {
+        if (!LuaResultFieldIsSet(lh, 1, LiveFields[i].field))
+            continue;
+        n = LuaResultFieldInt(lh, 1, LiveFields[i].field);
+        if (n > 0 || !LiveFields[i].positive)
+            *LiveFields[i].value = n;
     }
+}
 
-    // Initialization code goes here. 
-    LuaServiceSetStatus(SERVICE_START_PENDING, 0, 5000);
-    status = LuaServiceInitialization(argc, (char **)argv, &wk,
-            &specificError);
-    if (status != NO_ERROR) {
-        // Handle error condition 
-        LuaServiceStatus.dwCurrentState = SERVICE_STOPPED;
-        LuaServiceStatus.dwCheckPoint = 0;
-        LuaServiceStatus.dwWaitHint = 0;
-        LuaServiceStatus.dwWin32ExitCode = status;
-        LuaServiceStatus.dwServiceSpecificExitCode = specificError;
-
-        SvcDebugTrace("LuaServiceInitialization exitCode %ld\n", status);
-        SvcDebugTrace("LuaServiceInitialization specificError %ld\n",
-                specificError);
-
-        SetServiceStatus(LuaServiceStatusHandle, &LuaServiceStatus);
-        return;
+/** The init.lua fields that take effect only when the service starts.
+ * 
+ * Each configures either a string or, if \a value is NULL, a number.
+ */
+static const struct {
+    const char *field;      /**< Name of the field in init.lua. */
+    const char **value;     /**< The string it configures, or NULL. */
+    int *number;            /**< The number it configures, or NULL. */
+} ColdFields[] = {
+    { "name",           &ServiceName,           NULL },
+    { "display_name",   &ServiceDisplayName,    NULL },
+    { "script",         &ServiceScript,         NULL },
+    { "path",           &LuaSystemPath,         NULL },
+    { "lua_path",       &LuaPackagePath,        NULL },
+    { "lua_cpath",      &LuaPackageCPath,       NULL },
+    { "lua_init",       &LuaInitScript,         NULL },
+    { "checkpoint",     &CheckpointFile,        NULL },
+    { "pidfile",        &ServicePidFile,        NULL },
+    { "profile_file",   &ServiceProfileFile,    NULL },
+    { "heap_file",      &ServiceHeapFile,       NULL },
+    { "timeline",       &ServiceTimelineFile,   NULL },
+    { "control_socket", &ServiceControlSocket,  NULL },
+    { "ready_timeout",  NULL,   &ServiceReadyTimeout },
+    { "status_page",    NULL,   &ServiceStatusPage },
+    { "timeline_ring",  NULL,   &ServiceTimelineRing },
+    { NULL, NULL, NULL }
+};
+
+/** Flags the ColdFields that were set by init.lua at startup. */
+static int ColdSet[sizeof(ColdFields) / sizeof(ColdFields[0])];
+
+/** Apply all of the fields of the table returned by init.lua.
+ * 
+ * \param lh The Lua state in which init.lua was run.
+ */
+static void LuaServiceConfigure(LUAHANDLE lh)
+{
+    char *cp;
+    int i;
+
+    LuaServiceConfigureLive(lh);
+    for (i = 0; ColdFields[i].field; ++i) {
+        if (!ColdFields[i].value) {
+            if (LuaResultFieldIsSet(lh, 1, ColdFields[i].field)) {
+                *ColdFields[i].number = 
+                        LuaResultFieldInt(lh, 1, ColdFields[i].field);
+                ColdSet[i] = 1;
+            }
+            continue;
+        }
+        cp = LuaResultFieldString(lh, 1, ColdFields[i].field);
+        if (cp) {
+            *ColdFields[i].value = cp;
+            ColdSet[i] = 1;
+        }
     }
+    SvcDebugTraceStr("... got name %s", ServiceName);
+    SvcDebugTraceStr("... got script %s", ServiceScript);
+}
 
-    // Initialization complete - report running status. 
-    if (!LuaServiceSetStatus(SERVICE_RUNNING, 0, 0)) {
-        status = GetLastError();
-        SvcDebugTrace("SetServiceStatus error %ld\n", status);
+/** Tell whether init.lua now gives a ColdFields entry a different value
+ * than it had at startup.
+ * 
+ * \param lh The Lua state in which init.lua was run again.
+ * \param i The index of the entry in ColdFields.
+ * \returns Non-zero if the field changed.
+ */
+static int LuaServiceColdChanged(LUAHANDLE lh, int i)
+{
+    char *cp;
+    const char *old;
+    int changed;
+
+    if (!ColdFields[i].value) {
+        if (!LuaResultFieldIsSet(lh, 1, ColdFields[i].field))
+            return ColdSet[i];
+        return LuaResultFieldInt(lh, 1, ColdFields[i].field) 
+                != *ColdFields[i].number;
     }
+    cp = LuaResultFieldString(lh, 1, ColdFields[i].field);
+    old = *ColdFields[i].value;
+    changed = cp ? (!old || strcmp(cp, old) != 0) : ColdSet[i];
+    free(cp);
+    return changed;
+}
 
-    // do the work of the service by running the loaded script.
-    LuaWorkerRun(wk);
-    LuaWorkerCleanup(wk);
-
-    if(!ServiceStopping){
-        SvcDebugTrace("Service main script exit. Stopping service... \n", 0);
-        LuaServiceStatus.dwCurrentState = SERVICE_STOPPED;
-        LuaServiceStatus.dwCheckPoint = 0;
-        LuaServiceStatus.dwWaitHint = 0;
-        LuaServiceStatus.dwWin32ExitCode = 1;
-        LuaServiceStatus.dwServiceSpecificExitCode = -1;
-        SetServiceStatus(LuaServiceStatusHandle, &LuaServiceStatus);
+/** Run init.lua again and apply what can be applied without a restart.
+ * 
+ * Called when the SCM sends SERVICE_CONTROL_PARAMCHANGE, or when a 
+ * POSIX daemon receives SIGHUP, before the control is queued for the
+ * script. init.lua runs in a bare Lua state of its own, see 
+ * LuaConfigLoad(), on the calling thread, so a script that is busy or 
+ * hung is reconfigured as well, and the current directory of the 
+ * running script is left alone.
+ * 
+ * The fields in LiveFields that init.lua sets are applied at once, and
+ * the garbage collector settings at the worker's next idle point, by 
+ * LuaIdle(). A changed field that only takes effect at startup is 
+ * traced, and otherwise ignored until the service is restarted. The 
+ * service manager is told once the new configuration is in place.
+ * 
+ * \context 
+ * Control handler
+ */
+void LuaServiceReconfigure(void)
+{
+    LUAHANDLE lh;
+    int i;
+
+    lh = LuaConfigLoad("init.lua");
+    if (!lh || !LuaWorkerRun(lh)) {
+        SvcDebugTrace("Can not run init.lua, configuration unchanged\n", 0);
+    } else {
+        LuaServiceConfigureLive(lh);
+        for (i = 0; ColdFields[i].field; ++i)
+            if (LuaServiceColdChanged(lh, i))
+                SvcDebugTraceStr("init.lua field %s changed, restart to apply\n",
+                        ColdFields[i].field);
+        ++ServiceConfigGeneration;
+        SvcDebugTrace("Configuration applied, tracelevel %d\n", 
+                SvcDebugTraceLevel);
     }
-
-    // we get here only if the script itself returned.
-    SvcDebugTrace("Returning to the Main Thread \n", 0);
-    return;
+    LuaWorkerCleanup(lh);
+    SvcManager->reconfigured();
 }
 
-/** Process entry point.
- * 
- * Invoked when the process starts either by a user at a command prompt 
- * to setup or control the service, or by the Service Control Manager to
- * start the service.
- * 
- * To Distinguish between the three kinds of service-related programs 
- * (the service program, the service control program, and the service 
- * configuration program) that we can call StartServiceCtrlDispatcher() 
- * early on and use its success or failure to connect to the SCM as an 
- * indication of the calling context. If it succeeds, then the process 
- * was started by the SCM and is the service program. If it fails with
- * the specific error code ERROR_FAILED_SERVICE_CONTROLLER_CONNECT, then
- * it is not the service program, and it can depend on its command line
- * to distinguish control from configuration. If any other error is 
- * returned, then it might have been a service program, but something
- * is so horribly wrong that the service cannot start.
- * 
- * \todo We could also support running our service thread interactively
- * to support easier debugging. If that is done, then we should consider
- * making SvcDebugTrace() and friends, as well as the implementation of
- * service.print() for Lua write to stdout rather than OutputDebugString().
+/** Run init.lua and apply its configuration.
+ * 
+ * The first thing done by the process entry point of every backend.
+ * Failures are reported on stderr, since there is nobody else to tell
+ * at this point.
  * 
  * \context 
  * Service, Configuration, Control
- *  
- * \param argc The count of arguments.
- * \param argv The list of arguments.
- * \returns The ANSI C process exit status.
  * 
- * \see ssSvc
+ * \param argc The count of arguments.
+ * \param argv The list of arguments, kept for service.argv.
+ * \returns EXIT_SUCCESS, or EXIT_FAILURE if init.lua could not be run.
  */
-int main(int argc, char *argv[])
+int LuaServiceStartup(int argc, char *argv[])
 {
+    SvcU64 start = SvcMicros();
+    SvcU64 t;
     LUAHANDLE lh;
-    SERVICE_TABLE_ENTRY DispatchTable[2]; // note room for terminating record.
-    char *cp;
-    int n;
 
-    LuaServiceArgv = argv;
+    LuaServiceStartTicks = SvcTicks();
+    LuaServiceArgv = (const char **)argv;
     LuaServiceArgc = argc;
 
-    memset(DispatchTable, 0, sizeof(DispatchTable));
-
-    SvcDebugTrace("Entered main\n", 0);
+    LuaServiceEnterFolder();
     lh = LuaWorkerLoad(NULL, "init.lua");
 
     if (!lh) {
@@ -565,59 +938,174 @@ int main(int argc, char *argv[])
 
     SvcDebugTrace("... ran init\n", 0);
 
+    t = SvcMicros();
     if (!LuaWorkerRun(lh)) {
         LuaWorkerCleanup(lh);
         fprintf(stderr, "Can not execute `init.lua` file");
         return EXIT_FAILURE;
     }
+    SvcSpan("run init.lua", t);
 
-    n = LuaResultFieldInt(lh, 1, "tracelevel");
-    SvcDebugTraceLevel = n;
-    cp = LuaResultFieldString(lh, 1, "name");
-    if (cp)
-        ServiceName = cp;
-    SvcDebugTraceStr("... got name %s", ServiceName);
-    cp = LuaResultFieldString(lh, 1, "display_name");
-    if (cp)
-        ServiceDisplayName = cp;
-    cp = LuaResultFieldString(lh, 1, "script");
-    if (cp)
-        ServiceScript = cp;
-    SvcDebugTraceStr("... got script %s", ServiceScript);
-    cp = LuaResultFieldString(lh, 1, "path");
-    if (cp)
-        LuaSystemPath = cp;
-    cp = LuaResultFieldString(lh, 1, "lua_path");
-    if (cp)
-        LuaPackagePath = cp;
-    cp = LuaResultFieldString(lh, 1, "lua_cpath");
-    if (cp)
-        LuaPackageCPath = cp;
-    cp = LuaResultFieldString(lh, 1, "lua_init");
-    if (cp)
-        LuaInitScript = cp;
+    LuaServiceConfigure(lh);
     SvcDebugTrace("Finished pre-init\n", 0);
     LuaWorkerCleanup(lh);
+    SvcSpan("init.lua", start);
+    return EXIT_SUCCESS;
+}
 
-    DispatchTable[0].lpServiceName = (LPSTR)ServiceName;
-    DispatchTable[0].lpServiceProc = LuaServiceMain;
-    SvcDebugTraceStr("Service name: %s\n", ServiceName);
-    if (!StartServiceCtrlDispatcher(DispatchTable)) {
-        DWORD err = GetLastError();
-        if (err == ERROR_FAILED_SERVICE_CONTROLLER_CONNECT) {
-            /*
-             * A failure to connect to the SCM implies we are not running 
-             * under the SCM's control, so we must not be the actual 
-             * service application. 
-             * 
-             * We try being a controller or configurer instead.
-             */
-            return SvcControlMain(argc, argv);
-        } else {
-            SvcDebugTrace("StartServiceCtrlDispatcher failed %ld\n", err);
-            return EXIT_FAILURE;
-        }
+/** Ask the service to stop.
+ * 
+ * Sets ServiceStopping, notes the time for the shutdown timing of
+ * LuaServiceRunConsole(), and queues a stop control for 
+ * service.controls(). Safe to call from a signal handler, but the 
+ * caller should then call LuaControlWake() if it is not one.
+ * 
+ * \context 
+ * Service main thread, console control handler
+ */
+void LuaServiceStop(void)
+{
+    ServiceStopTicks = SvcTicks();
+    ServiceStopMicros = SvcMicros();
+    ServiceStopping = 1;
+    LuaControlPush(LUASERVICE_CONTROL_STOP);
+}
+
+/** Get the time left for the service script to finish after a stop
+ * request.
+ * 
+ * \returns The time in ms left of ServiceStopTimeout, or zero once it
+ * has run out. ServiceStopTimeout if the service is not stopping.
+ */
+DWORD LuaServiceStopLeft(void)
+{
+    DWORD spent;
+
+    if (!ServiceStopping)
+        return (DWORD)ServiceStopTimeout;
+    spent = SvcTicks() - ServiceStopTicks;
+    return spent < (DWORD)ServiceStopTimeout
+            ? (DWORD)ServiceStopTimeout - spent : 0;
+}
+
+/** Record that the service has stopped, or has been given up on.
+ * 
+ * Sets ServiceStopLatency to the time since the stop request and
+ * traces it.
+ * 
+ * \context 
+ * Whichever thread reports the service stopped
+ * 
+ * \param finished Non-zero if the service script finished, zero if it
+ * ran out of time.
+ */
+void LuaServiceStopped(int finished)
+{
+    ServiceStopLatency = SvcTicks() - ServiceStopTicks;
+    if (finished)
+        SvcDebugTrace("Service stopped in %d ms\n", ServiceStopLatency);
+    else
+        SvcDebugTrace("Service did not stop in %d ms, giving up\n",
+                ServiceStopLatency);
+}
+
+/** Get the time left for the service script to become ready.
+ * 
+ * \returns The time in ms left of ServiceReadyTimeout since the process
+ * started, or zero once it has run out.
+ */
+DWORD LuaServiceReadyLeft(void)
+{
+    DWORD spent = SvcTicks() - LuaServiceStartTicks;
+
+    return spent < (DWORD)ServiceReadyTimeout
+            ? (DWORD)ServiceReadyTimeout - spent : 0;
+}
+
+/** Mark the service ready, and have the backend report it running.
+ * 
+ * Called by the backend once the script has loaded if ServiceReadyTimeout
+ * is not set, and by service.ready() otherwise. Only the first call 
+ * does anything.
+ * 
+ * \context 
+ * Service worker thread
+ */
+void LuaServiceReady(void)
+{
+    if (ServiceReady || ServiceStopping)
+        return;
+    ServiceReady = 1;
+    SvcDebugTrace("Service ready in %d ms\n", SvcTicks() - LuaServiceStartTicks);
+    if (ServiceReadyTimeout > 0 && LoadedMicros)
+        SvcSpan("get ready", LoadedMicros);
+    SvcManager->ready();
+}
+
+/** Give up on a service script that has not become ready within 
+ * ServiceReadyTimeout, and ask it to stop.
+ * 
+ * \context 
+ * Whichever thread watches the startup
+ */
+void LuaServiceStartHung(void)
+{
+    SvcDebugTrace("Service not ready in %d ms, stopping\n",
+            SvcTicks() - LuaServiceStartTicks);
+    LuaServiceStop();
+    LuaControlWake();
+}
+
+/** Run the service in the foreground of a console.
+ * 
+ * Implements <tt>LuaService run</tt>. The service script is loaded by 
+ * LuaServiceInitialization() and run by SvcSupervise() exactly as it is
+ * by the service backend, but in the calling thread, so that it can be
+ * run under a debugger or profiler. Trace output and service.print() go
+ * to stdout, and the time taken to start and to stop is reported.
+ * ServiceReadyTimeout is not enforced, but the time the script took to
+ * call service.ready() is traced.
+ * 
+ * The caller must arrange for Ctrl-C to call LuaServiceStop().
+ * 
+ * \context 
+ * Console main thread
+ * 
+ * \returns EXIT_SUCCESS if the script finished without error, or 
+ * EXIT_FAILURE.
+ */
+int LuaServiceRunConsole(void)
+{
+    LUAHANDLE wk = NULL;
+    DWORD specificError = 0;
+    DWORD started, finished;
+    int ok;
+
+    SvcDebugToConsole();
+    printf("%s: init.lua done in %lu ms\n", ServiceName,
+            (unsigned long)(SvcTicks() - LuaServiceStartTicks));
+    if (LuaServiceInitialization(&wk, &specificError) != NO_ERROR) {
+        fprintf(stderr, "%s: service script %s failed to load\n",
+                ServiceName, ServiceScript);
+        return EXIT_FAILURE;
     }
-    SvcDebugTrace("Leaving main\n", 0);
-    return EXIT_SUCCESS;
+    started = SvcTicks();
+    printf("%s: started in %lu ms, press Ctrl-C to stop\n", ServiceName,
+            (unsigned long)(started - LuaServiceStartTicks));
+    fflush(stdout);
+    if (ServiceReadyTimeout <= 0)
+        LuaServiceReady();
+
+    ok = SvcSupervise(wk);
+
+    finished = SvcTicks();
+    printf("%s: ran for %lu ms\n", ServiceName,
+            (unsigned long)(finished - started));
+    if (ServiceStopping)
+        printf("%s: stopped in %lu ms\n", ServiceName,
+                (unsigned long)(finished - ServiceStopTicks));
+    else
+        printf("%s: service script %s\n", ServiceName,
+                ok ? "returned" : "failed");
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
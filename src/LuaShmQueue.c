@@ -0,0 +1,495 @@
+/*! \file LuaShmQueue.c
+ *  \brief Records from other processes through shared memory queues.
+ *
+ * Files and sockets copy every record into the kernel and out again,
+ * and take system calls to do it, which dominates when collectors send
+ * a service many small records. service.shmqueue(name [, size [,
+ * multi]]) creates instead a ring of records in shared memory,
+ * described in SvcQueue.h, which producer processes linked with
+ * SvcQueue.c write into directly:
+ *
+ * \code
+ * local q = service.shmqueue("collector", 4 * 1024 * 1024)
+ * while not service.stopping() do
+ *   for rec in q:records(1000) do
+ *     handle(rec:sub(1, 4), rec:byte(5), #rec)
+ *   end
+ * end
+ * \endcode
+ *
+ * A record is not copied out of the ring for the script. The iterator
+ * of q:records() returns a view of the record where it lies, which
+ * reads it with #rec, rec:sub(), rec:byte() and tostring(rec), or
+ * hands it to C or an FFI with rec:ptr(). The iterator returns the
+ * same view each time, and a record is taken out of the ring, making
+ * room for producers, when the iterator moves on to the next, or when
+ * q:records() or q:wait() is called again after a loop ends early.
+ * Using a view after that raises an error; a script that keeps a
+ * record copies it with tostring(rec).
+ *
+ * Waiting for records in q:records(ms) or q:wait([ms]) sleeps until a
+ * producer commits a record, and a producer only makes the system call
+ * that wakes the script when the script waits. The wait also ends when
+ * the service is asked to stop, through the same LuaControlWake() that
+ * wakes service.controls(), and when a control is queued for a script
+ * that takes controls, so a loop over a queue stays as responsive as
+ * one over service.controls().
+ *
+ * Records that find the ring full are dropped by the producer and
+ * counted. The count is traced as it grows and returned by
+ * q:dropped().
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "luaservice.h"
+#include "SvcQueue.h"
+
+/** Metatable name for queue userdata. */
+#define SHQ_META "LuaService.shmqueue"
+
+/** Metatable name for record view userdata. */
+#define SHQVIEW_META "LuaService.shmview"
+
+/** Bytes in the ring of a queue by default. */
+#define SHQ_DEFAULT (1024 * 1024)
+
+/** Longest time in ms a wait goes without looking at ServiceStopping,
+ * which a signal handler sets without waking anyone. */
+#define SHQ_SLICE 100
+
+/** A record of the ring, as the script sees it. */
+typedef struct ShqView {
+    const char *p;          /**< The record, or NULL once taken out. */
+    DWORD len;              /**< Bytes in the record. */
+} ShqView;
+
+/** A queue opened by service.shmqueue(). */
+typedef struct ShqQueue {
+    SvcQueue *q;            /**< The queue, or NULL once closed. */
+    ShqView *view;          /**< The view the iterator returns. */
+    int viewref;            /**< Registry reference to the view. */
+    DWORD dropped;          /**< Dropped records already traced. */
+    struct ShqQueue *next;  /**< Next open queue. */
+} ShqQueue;
+
+/** Guards ShqOpen. */
+static SvcMutex ShqLock = SVC_MUTEX_INIT;
+
+/** The open queues, for LuaShmQueueWake(). */
+static ShqQueue *ShqOpen;
+
+/** Get the queue at \a idx, raising an error if it is closed. */
+static ShqQueue *ShqCheck(lua_State *L, int idx)
+{
+    ShqQueue *s = (ShqQueue *)luaL_checkudata(L, idx, SHQ_META);
+
+    if (!s->q)
+        luaL_error(L, "shared memory queue is closed");
+    return s;
+}
+
+/** Get the record view at \a idx, raising an error if its record has
+ * been taken out. */
+static ShqView *ShqCheckView(lua_State *L, int idx)
+{
+    ShqView *v = (ShqView *)luaL_checkudata(L, idx, SHQVIEW_META);
+
+    if (!v->p)
+        luaL_error(L, "record is no longer in the queue");
+    return v;
+}
+
+/** Take the record the view shows, if any, out of the ring. */
+static void ShqRelease(ShqQueue *s)
+{
+    if (s->view->p) {
+        s->view->p = NULL;
+        SvcQueuePop(s->q);
+    }
+}
+
+/** Trace records dropped since last time. */
+static void ShqDropped(ShqQueue *s)
+{
+    DWORD dropped = SvcQueueDropped(s->q);
+
+    if (dropped != s->dropped) {
+        SvcDebugTrace("Shared memory queue full, %d records dropped\n",
+                dropped - s->dropped);
+        s->dropped = dropped;
+    }
+}
+
+/** Wait at most \a ms ms for a record.
+ *
+ * Returns early if the service is stopping or a control is queued.
+ *
+ * \returns Non-zero if the queue has a record.
+ */
+static int ShqWait(lua_State *L, ShqQueue *s, DWORD ms)
+{
+    DWORD seen = SvcQueueWakeCount(s->q);
+    DWORD start, spent = 0;
+    DWORD len;
+    int ready = 0;
+
+    if (SvcQueuePeek(s->q, &len))
+        return 1;
+    if (!ms || ServiceStopping || LuaControlPending())
+        return 0;
+    LuaProfilerSleep(L, 1);
+    LuaWatchdogSleep(1);
+    start = SvcTicks();
+    while (!ready && !ServiceStopping && !LuaControlPending()
+            && SvcQueueWakeCount(s->q) == seen
+            && (spent = SvcTicks() - start) < ms)
+        ready = SvcQueueWait(s->q, seen,
+                ms - spent < SHQ_SLICE ? ms - spent : SHQ_SLICE);
+    LuaWatchdogSleep(0);
+    LuaProfilerSleep(L, 0);
+    return ready;
+}
+
+/** The iterator returned by q:records().
+ *
+ * Takes the record of the previous step out of the ring, and returns
+ * the view of the next, waiting for one on the first call if its
+ * upvalue is a positive time in ms, or nil once the ring is empty.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int ShqNext(lua_State *L)
+{
+    ShqQueue *s = ShqCheck(L, 1);
+    lua_Number wait = lua_tonumber(L, lua_upvalueindex(1));
+    const void *p;
+    DWORD len;
+
+    ShqRelease(s);
+    if (wait > 0) {
+        lua_pushnumber(L, 0);
+        lua_replace(L, lua_upvalueindex(1));
+        ShqWait(L, s, (DWORD)wait);
+        ShqDropped(s);
+    }
+    p = SvcQueuePeek(s->q, &len);
+    if (!p)
+        return 0;
+    s->view->p = (const char *)p;
+    s->view->len = len;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, s->viewref);
+    return 1;
+}
+
+/** Implement the Lua method q:records([ms]).
+ *
+ * Return an iterator over the records in the ring, for use in a
+ * generic for. If there is none, the first step waits up to \a ms ms
+ * for one, like service.controls().
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int shqRecords(lua_State *L)
+{
+    ShqQueue *s = ShqCheck(L, 1);
+    lua_Number wait = luaL_optnumber(L, 2, 0);
+
+    ShqRelease(s);
+    ShqDropped(s);
+    LuaIdle(L);
+    lua_pushnumber(L, wait);
+    lua_pushcclosure(L, ShqNext, 1);
+    lua_pushvalue(L, 1);
+    return 2;
+}
+
+/** Implement the Lua method q:wait([ms]).
+ *
+ * Wait up to \a ms ms, or for as long as it takes if \a ms is not
+ * given, for a record, a stop request or a control.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int shqWait(lua_State *L)
+{
+    ShqQueue *s = ShqCheck(L, 1);
+    lua_Number wait = luaL_optnumber(L, 2, SVC_INFINITE);
+    int ready;
+
+    ShqRelease(s);
+    ready = ShqWait(L, s, wait > 0 ? (DWORD)wait : 0);
+    ShqDropped(s);
+    LuaIdle(L);
+    lua_pushboolean(L, ready);
+    return 1;
+}
+
+/** Implement the Lua method q:dropped().
+ *
+ * Return the count of records producers dropped because the ring was
+ * full, since the queue was created.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int shqDropped(lua_State *L)
+{
+    ShqQueue *s = ShqCheck(L, 1);
+
+    lua_pushnumber(L, (lua_Number)SvcQueueDropped(s->q));
+    return 1;
+}
+
+/** Implement the Lua method q:close() and the __gc metamethod.
+ *
+ * Closing a queue twice is harmless. Records left in the ring stay
+ * for the next script to create the queue.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int shqClose(lua_State *L)
+{
+    ShqQueue *s = (ShqQueue *)luaL_checkudata(L, 1, SHQ_META);
+    ShqQueue **pp;
+
+    if (s->q) {
+        ShqRelease(s);
+        SvcMutexLock(&ShqLock);
+        for (pp = &ShqOpen; *pp; pp = &(*pp)->next)
+            if (*pp == s) {
+                *pp = s->next;
+                break;
+            }
+        SvcMutexUnlock(&ShqLock);
+        SvcQueueClose(s->q);
+        s->q = NULL;
+    }
+    if (s->viewref != LUA_NOREF) {
+        s->view->p = NULL;
+        luaL_unref(L, LUA_REGISTRYINDEX, s->viewref);
+        s->viewref = LUA_NOREF;
+    }
+    return 0;
+}
+
+/** Implement the __len metamethod of a record view.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int shqViewLen(lua_State *L)
+{
+    lua_pushinteger(L, (lua_Integer)ShqCheckView(L, 1)->len);
+    return 1;
+}
+
+/** Implement the __tostring metamethod of a record view, which copies
+ * the record into a string.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int shqViewString(lua_State *L)
+{
+    ShqView *v = ShqCheckView(L, 1);
+
+    lua_pushlstring(L, v->p, v->len);
+    return 1;
+}
+
+/** Turn a position in a record as string.sub() takes it into one
+ * counted from 1, clamped to the record.
+ */
+static lua_Integer ShqPos(lua_Integer pos, DWORD len)
+{
+    if (pos < 0)
+        pos += (lua_Integer)len + 1;
+    if (pos < 1)
+        return 1;
+    return pos > (lua_Integer)len ? (lua_Integer)len + 1 : pos;
+}
+
+/** Implement the Lua method rec:sub(i [, j]).
+ *
+ * Copy bytes \a i to \a j of the record into a string, as string.sub()
+ * would.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int shqViewSub(lua_State *L)
+{
+    ShqView *v = ShqCheckView(L, 1);
+    lua_Integer i = ShqPos(luaL_checkinteger(L, 2), v->len);
+    lua_Integer j = luaL_optinteger(L, 3, -1);
+
+    j = j < 0 ? j + (lua_Integer)v->len + 1 : j;
+    if (j > (lua_Integer)v->len)
+        j = (lua_Integer)v->len;
+    if (i > j)
+        lua_pushliteral(L, "");
+    else
+        lua_pushlstring(L, v->p + i - 1, (size_t)(j - i + 1));
+    return 1;
+}
+
+/** Implement the Lua method rec:byte([i [, j]]).
+ *
+ * Return the values of bytes \a i to \a j of the record, as
+ * string.byte() would.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int shqViewByte(lua_State *L)
+{
+    ShqView *v = ShqCheckView(L, 1);
+    lua_Integer i = ShqPos(luaL_optinteger(L, 2, 1), v->len);
+    lua_Integer j = luaL_optinteger(L, 3, i);
+    int n;
+
+    j = j < 0 ? j + (lua_Integer)v->len + 1 : j;
+    if (j > (lua_Integer)v->len)
+        j = (lua_Integer)v->len;
+    if (i > j)
+        return 0;
+    n = (int)(j - i + 1);
+    luaL_checkstack(L, n, "record slice too long");
+    for (; i <= j; ++i)
+        lua_pushinteger(L, (unsigned char)v->p[i - 1]);
+    return n;
+}
+
+/** Implement the Lua method rec:ptr().
+ *
+ * Return the address of the record as a light userdata, and its
+ * length, for C modules or an FFI to read it in place. The address is
+ * 8 byte aligned.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+static int shqViewPtr(lua_State *L)
+{
+    ShqView *v = ShqCheckView(L, 1);
+
+    lua_pushlightuserdata(L, (void *)v->p);
+    lua_pushinteger(L, (lua_Integer)v->len);
+    return 2;
+}
+
+/** Methods of a queue object. */
+static const struct luaL_Reg shqMethods[] = {
+        {"records", shqRecords},
+        {"wait", shqWait},
+        {"dropped", shqDropped},
+        {"close", shqClose},
+        {NULL, NULL},
+};
+
+/** Methods of a record view. */
+static const struct luaL_Reg shqViewMethods[] = {
+        {"sub", shqViewSub},
+        {"byte", shqViewByte},
+        {"ptr", shqViewPtr},
+        {NULL, NULL},
+};
+
+/** Implement the Lua function service.shmqueue(name [, size [, multi]]).
+ *
+ * Create the shared memory queue \a name for producers to write
+ * records into, or take over the one an earlier script left, with the
+ * records in it. The ring holds \a size bytes, 1 MB by default,
+ * rounded up to a power of two, and a record may take up to half of
+ * it. With \a multi true, many producers may write at once.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+int LuaShmQueueOpen(lua_State *L)
+{
+    const char *name = luaL_checkstring(L, 1);
+    lua_Number want = luaL_optnumber(L, 2, SHQ_DEFAULT);
+    int flags = lua_toboolean(L, 3) ? SVC_QUEUE_MULTI : 0;
+    DWORD size = SVC_QUEUE_MIN;
+    ShqQueue *s;
+
+    luaL_argcheck(L, *name && !strpbrk(name, "/\\"), 1, "invalid queue name");
+    luaL_argcheck(L, want > 0 && want <= SVC_QUEUE_MAX, 2,
+            "size out of range");
+    while (size < want)
+        size <<= 1;
+
+    s = (ShqQueue *)lua_newuserdata(L, sizeof(ShqQueue));
+    memset(s, 0, sizeof(*s));
+    s->viewref = LUA_NOREF;
+    if (luaL_newmetatable(L, SHQ_META)) {
+        lua_newtable(L);
+        luaL_register(L, NULL, shqMethods);
+        lua_setfield(L, -2, "__index");
+        lua_pushcfunction(L, shqClose);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+
+    s->view = (ShqView *)lua_newuserdata(L, sizeof(ShqView));
+    memset(s->view, 0, sizeof(*s->view));
+    if (luaL_newmetatable(L, SHQVIEW_META)) {
+        lua_newtable(L);
+        luaL_register(L, NULL, shqViewMethods);
+        lua_setfield(L, -2, "__index");
+        lua_pushcfunction(L, shqViewLen);
+        lua_setfield(L, -2, "__len");
+        lua_pushcfunction(L, shqViewString);
+        lua_setfield(L, -2, "__tostring");
+    }
+    lua_setmetatable(L, -2);
+    s->viewref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    s->q = SvcQueueCreate(name, size, flags);
+    if (!s->q)
+        return luaL_error(L, "can't create shared memory queue %s (%d)",
+                name, (int)SvcLastError());
+    s->dropped = SvcQueueDropped(s->q);
+    SvcMutexLock(&ShqLock);
+    s->next = ShqOpen;
+    ShqOpen = s;
+    SvcMutexUnlock(&ShqLock);
+    SvcDebugTraceStr("Shared memory queue %s created\n", name);
+    return 1;
+}
+
+/** Wake the script if it waits for records, to look at the stop flag
+ * and the controls.
+ *
+ * \context
+ * Control handler
+ */
+void LuaShmQueueWake(void)
+{
+    ShqQueue *s;
+
+    SvcMutexLock(&ShqLock);
+    for (s = ShqOpen; s; s = s->next)
+        SvcQueueWake(s->q);
+    SvcMutexUnlock(&ShqLock);
+}
@@ -0,0 +1,437 @@
+/*! \file LuaStatus.c
+ *  \brief Status page of the service in shared memory.
+ *
+ * The SCM and systemd only know whether a service is running. With
+ * the init.lua field <code>status_page</code> set, the service also
+ * publishes a LuaStatusPage, declared in luaservice.h, in shared
+ * memory named <tt>LuaService-</tt>\a name after the service. Any
+ * process on the machine can map it read-only and learn the state of
+ * the service, when it last showed it was alive, how many idle points
+ * and controls its script has passed, the size of its Lua heap, its
+ * restarts and last failure, and gauges the script sets with
+ * service.gauge(name, value):
+ *
+ * \code
+ * service.gauge("queue", #queue)
+ * service.gauge("requests/s", rate)
+ * \endcode
+ *
+ * <tt>LuaService stat</tt> [\a name ...] is a reader, which prints
+ * the pages of the named services, this one by default. The same
+ * status is kept without a page, for the <code>stats</code> command
+ * of the control endpoint, see LuaCommands.c.
+ *
+ * The page is written by the worker at its idle points, at most once
+ * every ST_PERIOD ms, and when the script goes to sleep, fails or
+ * finishes, so its heartbeat is at most ST_PERIOD ms old while the
+ * script is alive. A page whose heartbeat is older and which is not
+ * marked sleeping belongs to a hung script, or to a process that has
+ * gone. Gauges set in between are written with the next heartbeat.
+ *
+ * Readers never lock anything the service waits for. The page is
+ * guarded by a sequence lock: the writer makes the sequence count odd,
+ * writes the data and makes it even again, and a reader copies the
+ * data and tries again if the count was odd or has changed meanwhile.
+ * Reading costs the service nothing, however many monitors poll it.
+ *
+ * On POSIX systems the page stays in /dev/shm after the service ends,
+ * with the state it was left in, so a reader can tell a clean stop
+ * from a crash; the next start of the service takes it over. On
+ * Windows the page goes when the process does, and a service creates
+ * it in the Global namespace so that monitors in other sessions find
+ * it, see SvcShmMap().
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "luaservice.h"
+
+/** Shortest time in ms between writes at idle points. */
+#define ST_PERIOD 100
+
+/** Times a reader tries to get a consistent copy of a page. */
+#define ST_TRIES 1000
+
+/** Longest text StFormat() writes. */
+#define ST_TEXT 2048
+
+/** Guards StData and the writing of the page. */
+static SvcMutex StLock = SVC_MUTEX_INIT;
+
+/** The mapped page, while published. */
+static SvcMap StMap;
+
+/** The page in StMap, or NULL if there is none. */
+static LuaStatusPage *StPage;
+
+/** What the next write puts in the page. */
+static LuaStatusData StData;
+
+/** Non-zero while the script has paused on a control. */
+static int StPaused;
+
+/** Get the name of the shared memory of a service's status page.
+ *
+ * \param name The service name.
+ * \param buf Receives the name, MAX_PATH bytes.
+ */
+static void StName(const char *name, char *buf)
+{
+    char *cp;
+
+    sprintf(buf, "LuaService-%.*s", MAX_PATH - 16, name);
+    for (cp = buf; *cp; ++cp)
+        if (*cp == '/' || *cp == '\\')
+            *cp = '_';
+}
+
+/** Work out the state of the service now. */
+static DWORD StState(void)
+{
+    if (ServiceStopping)
+        return LUASERVICE_STATE_STOP_PENDING;
+    if (!ServiceReady)
+        return LUASERVICE_STATE_START_PENDING;
+    return StPaused ? LUASERVICE_STATE_PAUSED : LUASERVICE_STATE_RUNNING;
+}
+
+/** Bring StData up to date, and write it to the page, if there is
+ * one, under the sequence lock.
+ *
+ * Called with StLock held.
+ */
+static void StWrite(void)
+{
+    StData.heartbeat = SvcMicros();
+    if (StData.state != LUASERVICE_STATE_STOPPED)
+        StData.state = StState();
+    if (!StPage)
+        return;
+    SvcAtomicAdd32(&StPage->seq, 1);
+    memcpy(&StPage->data, &StData, sizeof(StData));
+    SvcAtomicAdd32(&StPage->seq, 1);
+}
+
+/** Start keeping the status, and publish the status page if init.lua
+ * asks for one.
+ *
+ * Called as the service starts, so not by a process that only
+ * controls the service.
+ */
+void LuaStatusStart(void)
+{
+    char name[MAX_PATH];
+
+    if (StData.started)
+        return;
+    StData.started = SvcMicros();
+    StData.heartbeat = StData.started;
+    if (!ServiceStatusPage)
+        return;
+    StName(ServiceName, name);
+    if (!SvcShmMap(name, sizeof(LuaStatusPage),
+            SVC_FILE_WRITE | SVC_FILE_CREATE, &StMap)) {
+        SvcDebugTraceStr("Can't publish status page %s", name);
+        SvcDebugTrace(" (%d)\n", SvcLastError());
+        return;
+    }
+    SvcMutexLock(&StLock);
+    StPage = (LuaStatusPage *)StMap.base;
+    if (StPage->magic != LUASERVICE_STATUS_MAGIC
+            || StPage->version != LUASERVICE_STATUS_VERSION)
+        memset(StPage, 0, sizeof(LuaStatusPage));
+    else if (StPage->seq & 1)
+        SvcAtomicAdd32(&StPage->seq, 1);
+    StPage->version = LUASERVICE_STATUS_VERSION;
+    StPage->size = sizeof(LuaStatusPage);
+    StPage->pid = SvcProcessId();
+    StWrite();
+    SvcMemoryBarrier();
+    StPage->magic = LUASERVICE_STATUS_MAGIC;
+    SvcMutexUnlock(&StLock);
+    SvcDebugTraceStr("Status page published as %s\n", name);
+}
+
+/** Count an idle point of the script, and write the page if it was
+ * last written ST_PERIOD ms ago.
+ *
+ * \context
+ * Service worker thread
+ *
+ * \param L Lua state context of the worker.
+ */
+void LuaStatusPoll(lua_State *L)
+{
+    SvcU64 now;
+
+    if (!StData.started)
+        return;
+    ++StData.loops;
+    now = SvcMicros();
+    if (now - StData.heartbeat < ST_PERIOD * 1000)
+        return;
+    SvcMutexLock(&StLock);
+    StData.heap = (SvcU64)lua_gc(L, LUA_GCCOUNT, 0) * 1024
+            + (SvcU64)lua_gc(L, LUA_GCCOUNTB, 0);
+    StWrite();
+    SvcMutexUnlock(&StLock);
+}
+
+/** Note that the worker is going to sleep, or is back.
+ *
+ * Going to sleep is written at once, since the heartbeat stops until
+ * the script wakes up.
+ *
+ * \param sleeping Non-zero on entry to the sleep, zero after it.
+ */
+void LuaStatusSleep(int sleeping)
+{
+    if (!StData.started)
+        return;
+    SvcMutexLock(&StLock);
+    StData.sleeping = (DWORD)sleeping;
+    if (sleeping)
+        StWrite();
+    SvcMutexUnlock(&StLock);
+}
+
+/** Count a control taken by the script, and follow pause and continue.
+ *
+ * \param code The control.
+ */
+void LuaStatusControl(DWORD code)
+{
+    if (code == LUASERVICE_CONTROL_PAUSE)
+        StPaused = 1;
+    else if (code == LUASERVICE_CONTROL_CONTINUE)
+        StPaused = 0;
+    if (!StData.started)
+        return;
+    SvcMutexLock(&StLock);
+    ++StData.controls;
+    StWrite();
+    SvcMutexUnlock(&StLock);
+}
+
+/** Record a failure of the service script.
+ *
+ * \param err The error message, or NULL.
+ * \param restarts The restarts of the script so far.
+ */
+void LuaStatusFailed(const char *err, int restarts)
+{
+    if (!StData.started)
+        return;
+    SvcMutexLock(&StLock);
+    strncpy(StData.last_error, err ? err : "?",
+            sizeof(StData.last_error) - 1);
+    StData.failed = SvcMicros();
+    StData.restarts = (DWORD)restarts;
+    StPaused = 0;
+    StWrite();
+    SvcMutexUnlock(&StLock);
+}
+
+/** Mark the service stopped when the service script has finished.
+ *
+ * The page is left in place, see the file description.
+ *
+ * \context
+ * Service worker thread
+ */
+void LuaStatusFinal(void)
+{
+    if (!StData.started)
+        return;
+    SvcMutexLock(&StLock);
+    StData.state = LUASERVICE_STATE_STOPPED;
+    StData.sleeping = 0;
+    StWrite();
+    SvcMutexUnlock(&StLock);
+}
+
+/** Implement the Lua function service.gauge(name, value).
+ *
+ * Set the gauge \a name in the status page to the number \a value. A
+ * name longer than the page holds is cut off. Without a status page
+ * the gauge is only shown by <tt>LuaService ctl stats</tt>.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+int LuaStatusGauge(lua_State *L)
+{
+    const char *name = luaL_checkstring(L, 1);
+    lua_Number value = luaL_checknumber(L, 2);
+    LuaStatusGaugeEntry *g = StData.gauge;
+    DWORD i;
+
+    for (i = 0; i < StData.gauges; ++i, ++g)
+        if (strncmp(g->name, name, sizeof(g->name) - 1) == 0)
+            break;
+    if (i == LUASERVICE_STATUS_GAUGES)
+        return luaL_error(L, "no room for gauge %s, %d are set", name,
+                LUASERVICE_STATUS_GAUGES);
+    SvcMutexLock(&StLock);
+    if (i == StData.gauges) {
+        strncpy(g->name, name, sizeof(g->name) - 1);
+        ++StData.gauges;
+    }
+    g->value = (double)value;
+    SvcMutexUnlock(&StLock);
+    return 0;
+}
+
+/** Get the name of a service state.
+ *
+ * \param state A LUASERVICE_STATE_ value.
+ * \returns Its name, a literal.
+ */
+static const char *StStateName(DWORD state)
+{
+    switch (state) {
+    case LUASERVICE_STATE_STOPPED:          return "STOPPED";
+    case LUASERVICE_STATE_START_PENDING:    return "START_PENDING";
+    case LUASERVICE_STATE_STOP_PENDING:     return "STOP_PENDING";
+    case LUASERVICE_STATE_RUNNING:          return "RUNNING";
+    case LUASERVICE_STATE_PAUSED:           return "PAUSED";
+    default:                                return "UNKNOWN";
+    }
+}
+
+/** Copy the data of a status page under its sequence lock.
+ *
+ * \param page The page.
+ * \param data Receives a consistent copy of its data.
+ * \returns Non-zero on success, zero if the writer kept changing it.
+ */
+static int StRead(const LuaStatusPage *page, LuaStatusData *data)
+{
+    DWORD seq;
+    int i;
+
+    for (i = 0; i < ST_TRIES; ++i) {
+        seq = page->seq;
+        if (seq & 1) {
+            SvcSleep(0);
+            continue;
+        }
+        SvcMemoryBarrier();
+        memcpy(data, (const void *)&page->data, sizeof(*data));
+        SvcMemoryBarrier();
+        if (page->seq == seq)
+            return 1;
+    }
+    return 0;
+}
+
+/** Describe a service's status, in lines of text.
+ *
+ * \param buf Receives the text, ST_TEXT bytes.
+ * \param name The service name.
+ * \param pid The service process.
+ * \param d The status.
+ */
+static void StFormat(char *buf, const char *name, DWORD pid,
+        const LuaStatusData *d)
+{
+    SvcU64 now = SvcMicros();
+    DWORD i;
+
+    buf += sprintf(buf, "%.64s: %s, process %lu, heartbeat %.1f s ago%s\n",
+            name, StStateName(d->state), (unsigned long)pid,
+            (double)(now - d->heartbeat) / 1e6,
+            d->sleeping ? " (sleeping)" : "");
+    buf += sprintf(buf, "  up %.0f s, %.0f loops, %.0f controls, "
+            "heap %.0f bytes\n", (double)(now - d->started) / 1e6,
+            (double)d->loops, (double)d->controls, (double)d->heap);
+    if (d->restarts || d->failed)
+        buf += sprintf(buf, "  %lu restarts, last failure %.0f s ago: %.*s\n",
+                (unsigned long)d->restarts, (double)(now - d->failed) / 1e6,
+                (int)sizeof(d->last_error), d->last_error);
+    for (i = 0; i < d->gauges && i < LUASERVICE_STATUS_GAUGES; ++i)
+        buf += sprintf(buf, "  %.*s = %.14g\n", (int)sizeof(d->gauge[i].name),
+                d->gauge[i].name, d->gauge[i].value);
+}
+
+/** Describe the status of this service, as <tt>LuaService stat</tt>
+ * would, whether or not it publishes a status page.
+ *
+ * \context
+ * Any thread
+ *
+ * \returns The text, from malloc(), or NULL.
+ */
+char *LuaStatusText(void)
+{
+    LuaStatusData d;
+    char *text = (char *)malloc(ST_TEXT);
+
+    if (!text)
+        return NULL;
+    SvcMutexLock(&StLock);
+    d = StData;
+    SvcMutexUnlock(&StLock);
+    if (d.state != LUASERVICE_STATE_STOPPED)
+        d.state = StState();
+    StFormat(text, ServiceName, SvcProcessId(), &d);
+    return text;
+}
+
+/** Print the status page of one service.
+ *
+ * \param name The service name.
+ * \returns Non-zero if the page was read.
+ */
+static int StShow(const char *name)
+{
+    char shm[MAX_PATH], text[ST_TEXT];
+    const LuaStatusPage *page;
+    LuaStatusData d;
+    SvcMap map;
+    int ok = 0;
+
+    StName(name, shm);
+    if (!SvcShmMap(shm, sizeof(LuaStatusPage), SVC_FILE_READ, &map)) {
+        printf("%s: no status page\n", name);
+        return 0;
+    }
+    page = (const LuaStatusPage *)map.base;
+    if (page->magic != LUASERVICE_STATUS_MAGIC
+            || page->version != LUASERVICE_STATUS_VERSION
+            || page->size != sizeof(LuaStatusPage))
+        printf("%s: status page of another version\n", name);
+    else if (!StRead(page, &d))
+        printf("%s: status page changing too fast to read\n", name);
+    else {
+        StFormat(text, name, page->pid, &d);
+        fputs(text, stdout);
+        ok = 1;
+    }
+    SvcFileUnmap(&map);
+    return ok;
+}
+
+/** Print the status pages of services, for <tt>LuaService stat</tt>.
+ *
+ * \param n Count of names in \a names, or zero for this service.
+ * \param names The service names.
+ * \returns Exit status, as from main(): EXIT_SUCCESS if every page
+ * was read, otherwise 3, which LSB init scripts use for a service that
+ * is not running.
+ */
+int LuaStatusShow(int n, const char **names)
+{
+    int i, ok = 1;
+
+    if (n == 0)
+        return StShow(ServiceName) ? EXIT_SUCCESS : 3;
+    for (i = 0; i < n; ++i)
+        if (!StShow(names[i]))
+            ok = 0;
+    return ok ? EXIT_SUCCESS : 3;
+}
@@ -0,0 +1,376 @@
+/*! \file LuaTimeline.c
+ *  \brief Timeline of the service lifecycle in Chrome trace event format.
+ *
+ * The framework records a span, with its start time, duration and
+ * thread, around each phase of starting and stopping the service:
+ * running init.lua, setting the environment, creating each Lua state,
+ * luaL_openlibs(), loading a script, running the service script,
+ * writing the final checkpoint and closing the state. A span named
+ * <code>stop</code> runs from the stop request to the end of the
+ * service script. Lua code adds spans of its own with service.span().
+ *
+ * The timeline is written to the file named by the init.lua field
+ * <code>timeline</code>, in the JSON array format of the Chrome trace
+ * event profiler, which chrome://tracing, Perfetto and speedscope
+ * load. Nothing is recorded if the field is not set. Spans are kept
+ * in memory from the start of the process until the service starts,
+ * since init.lua has to run before anyone knows if a timeline is
+ * wanted; a process that only controls the service writes nothing.
+ *
+ * By default every span is written. The file is opened when the
+ * service starts and spans are appended to it in batches, at least
+ * once a second while the script is idle in service.sleep(), so it is
+ * readable while the service runs. Its closing bracket is written
+ * when the service script finishes, but the viewers do not need it.
+ *
+ * With the init.lua field <code>timeline_ring</code> set, only that
+ * many of the latest spans are kept, in memory, and the file is
+ * rewritten with them when the service script finishes and on
+ * <tt>LuaService profile</tt>. That costs almost nothing, so it can
+ * be left on to find out what a service was doing just before it was
+ * looked at.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "luaservice.h"
+
+/** Longest span name recorded; longer names are cut off. */
+#define TL_MAXNAME 48
+
+/** Spans buffered before the service starts, or between writes. */
+#define TL_BUFFER 512
+
+/** Most time in microseconds between writes of a streamed timeline. */
+#define TL_FLUSH 1000000
+
+/** One recorded span. */
+typedef struct TlEvent {
+    char name[TL_MAXNAME];      /**< Its name. */
+    const char *cat;            /**< Its category, a literal. */
+    SvcU64 ts;                  /**< Start, from SvcMicros(). */
+    SvcU64 dur;                 /**< Duration in microseconds. */
+    DWORD tid;                  /**< The thread that recorded it. */
+} TlEvent;
+
+/** What is done with recorded spans. */
+enum TlMode {
+    TL_STARTUP,     /**< Kept until the service starts. */
+    TL_OFF,         /**< Not recorded. */
+    TL_STREAM,      /**< Appended to the file in batches. */
+    TL_RING         /**< The latest kept, and written on demand. */
+};
+
+/** Guards everything below. */
+static SvcMutex TlLock = SVC_MUTEX_INIT;
+
+/** What is done with recorded spans. Read without the lock to skip
+ * recording when off. */
+static volatile int TlMode = TL_STARTUP;
+
+/** Recorded spans. */
+static TlEvent TlBuffer[TL_BUFFER];
+
+/** The spans, TlBuffer or the ring of the latest spans. */
+static TlEvent *TlEvents = TlBuffer;
+
+/** The number of spans TlEvents holds. */
+static size_t TlSize = TL_BUFFER;
+
+/** The number of spans in TlEvents. */
+static size_t TlCount;
+
+/** Where the next span goes in the ring. */
+static size_t TlNext;
+
+/** Spans dropped because the buffer was full before the service
+ * started. */
+static unsigned long TlDropped;
+
+/** The streamed timeline, while open. */
+static FILE *TlFile;
+
+/** When the streamed timeline was last written. */
+static SvcU64 TlFlushed;
+
+/** Full path of ServiceTimelineFile, once resolved. */
+static char *TlPath;
+
+/** Write a string as a JSON string. */
+static void TlPutString(FILE *fp, const char *s)
+{
+    putc('"', fp);
+    for (; *s; ++s) {
+        if (*s == '"' || *s == '\\')
+            fprintf(fp, "\\%c", *s);
+        else if ((unsigned char)*s < ' ')
+            fprintf(fp, "\\u%04x", (unsigned char)*s);
+        else
+            putc(*s, fp);
+    }
+    putc('"', fp);
+}
+
+/** Write one span as an element of the JSON array, after the first. */
+static void TlPutEvent(FILE *fp, const TlEvent *e)
+{
+    fputs(",\n{\"name\":", fp);
+    TlPutString(fp, e->name);
+    fprintf(fp, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.0f,\"dur\":%.0f,"
+            "\"pid\":%lu,\"tid\":%lu}", e->cat, (double)e->ts,
+            (double)e->dur, (unsigned long)SvcProcessId(),
+            (unsigned long)e->tid);
+}
+
+/** Write the process name, which the viewers show, as the first
+ * element of the JSON array. */
+static void TlPutHeader(FILE *fp)
+{
+    fprintf(fp, "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%lu,"
+            "\"args\":{\"name\":", (unsigned long)SvcProcessId());
+    TlPutString(fp, ServiceName);
+    fputs("}}", fp);
+}
+
+/** Append the buffered spans to the streamed timeline.
+ *
+ * Called with TlLock held.
+ */
+static void TlWriteStream(void)
+{
+    size_t i;
+
+    for (i = 0; i < TlCount; ++i)
+        TlPutEvent(TlFile, &TlEvents[i]);
+    TlCount = 0;
+    fflush(TlFile);
+    TlFlushed = SvcMicros();
+}
+
+/** Rewrite the timeline file with the spans in the ring.
+ *
+ * Called with TlLock held.
+ *
+ * \returns Non-zero on success.
+ */
+static int TlWriteRing(void)
+{
+    size_t i, first = (TlNext + TlSize - TlCount) % TlSize;
+    FILE *fp;
+    int ok;
+
+    fp = fopen(TlPath, "w");
+    if (!fp) {
+        SvcDebugTraceStr("Can't write timeline %s\n", TlPath);
+        return 0;
+    }
+    TlPutHeader(fp);
+    for (i = 0; i < TlCount; ++i)
+        TlPutEvent(fp, &TlEvents[(first + i) % TlSize]);
+    fputs("\n]\n", fp);
+    ok = !ferror(fp);
+    if (fclose(fp) != 0)
+        ok = 0;
+    SvcDebugTraceStr("Timeline written to %s\n", TlPath);
+    return ok;
+}
+
+/** Record a span.
+ *
+ * \param name The name of the span.
+ * \param cat The category of the span, a literal.
+ * \param start When it started, from SvcMicros().
+ */
+static void TlRecord(const char *name, const char *cat, SvcU64 start)
+{
+    SvcU64 now = SvcMicros();
+    TlEvent *e;
+
+    if (TlMode == TL_OFF)
+        return;
+    SvcMutexLock(&TlLock);
+    if (TlMode == TL_RING) {
+        e = &TlEvents[TlNext];
+        TlNext = (TlNext + 1) % TlSize;
+        if (TlCount < TlSize)
+            ++TlCount;
+    } else if (TlMode == TL_OFF
+            || (TlMode == TL_STARTUP && TlCount == TlSize)) {
+        ++TlDropped;
+        e = NULL;
+    } else {
+        if (TlCount == TlSize)
+            TlWriteStream();
+        e = &TlEvents[TlCount++];
+    }
+    if (e) {
+        strncpy(e->name, name, TL_MAXNAME - 1);
+        e->name[TL_MAXNAME - 1] = '\0';
+        e->cat = cat;
+        e->ts = start;
+        e->dur = now - start;
+        e->tid = SvcThreadId();
+    }
+    SvcMutexUnlock(&TlLock);
+}
+
+/** Record a span of the framework from \a start until now.
+ *
+ * \param name The name of the span, which is copied.
+ * \param start When the span started, from SvcMicros().
+ */
+void SvcSpan(const char *name, SvcU64 start)
+{
+    TlRecord(name, "service", start);
+}
+
+/** Start writing the timeline, if init.lua asks for one.
+ *
+ * Called as the service starts, so not by a process that only
+ * controls the service. Spans recorded so far are kept if a timeline
+ * is wanted and dropped if not.
+ *
+ * \context
+ * Service worker thread
+ */
+void LuaTimelineStart(void)
+{
+    TlEvent *ring = NULL;
+    size_t n;
+
+    SvcMutexLock(&TlLock);
+    if (TlMode != TL_STARTUP) {
+        SvcMutexUnlock(&TlLock);
+        return;
+    }
+    if (ServiceTimelineFile)
+        TlPath = SvcFullPath(ServiceTimelineFile);
+    if (TlPath && ServiceTimelineRing > 0) {
+        ring = (TlEvent *)malloc(ServiceTimelineRing * sizeof(TlEvent));
+        if (ring) {
+            n = TlCount < (size_t)ServiceTimelineRing
+                    ? TlCount : (size_t)ServiceTimelineRing;
+            memcpy(ring, TlBuffer + TlCount - n, n * sizeof(TlEvent));
+            TlEvents = ring;
+            TlSize = (size_t)ServiceTimelineRing;
+            TlCount = n;
+            TlNext = n % TlSize;
+            TlMode = TL_RING;
+        }
+    } else if (TlPath) {
+        TlFile = fopen(TlPath, "w");
+        if (TlFile) {
+            TlPutHeader(TlFile);
+            TlMode = TL_STREAM;
+            TlWriteStream();
+        } else
+            SvcDebugTraceStr("Can't write timeline %s\n", TlPath);
+    }
+    if (TlMode == TL_STARTUP) {
+        TlMode = TL_OFF;
+        TlCount = 0;
+    } else {
+        SvcDebugTraceStr("Timeline started, writing %s\n", TlPath);
+        if (TlDropped)
+            SvcDebugTrace("Timeline dropped %u startup spans\n",
+                    (DWORD)TlDropped);
+    }
+    SvcMutexUnlock(&TlLock);
+}
+
+/** Write what the timeline holds now.
+ *
+ * Appends the buffered spans to a streamed timeline, or rewrites the
+ * file with the ring of latest spans. Called for
+ * <tt>LuaService profile</tt>.
+ *
+ * \context
+ * Any thread
+ */
+void LuaTimelineFlush(void)
+{
+    SvcMutexLock(&TlLock);
+    if (TlMode == TL_STREAM)
+        TlWriteStream();
+    else if (TlMode == TL_RING)
+        TlWriteRing();
+    SvcMutexUnlock(&TlLock);
+}
+
+/** Write a streamed timeline at least once a second.
+ *
+ * \context
+ * Service worker thread
+ *
+ * \param L Lua state context of the worker.
+ */
+void LuaTimelinePoll(lua_State *L)
+{
+    (void)L;
+    if (TlMode != TL_STREAM || SvcMicros() - TlFlushed < TL_FLUSH)
+        return;
+    SvcMutexLock(&TlLock);
+    if (TlMode == TL_STREAM && TlCount)
+        TlWriteStream();
+    SvcMutexUnlock(&TlLock);
+}
+
+/** Finish the timeline when the service script has finished.
+ *
+ * Records the <code>stop</code> span if the service was asked to
+ * stop, and writes the timeline. A streamed timeline is closed;
+ * nothing recorded afterwards is written. A ring is kept, so a
+ * restarted script adds to it.
+ *
+ * \context
+ * Service worker thread
+ */
+void LuaTimelineFinal(void)
+{
+    if (ServiceStopping)
+        SvcSpan("stop", ServiceStopMicros);
+    SvcMutexLock(&TlLock);
+    if (TlMode == TL_STREAM) {
+        TlWriteStream();
+        fputs("\n]\n", TlFile);
+        fclose(TlFile);
+        TlFile = NULL;
+        TlMode = TL_OFF;
+        SvcDebugTraceStr("Timeline written to %s\n", TlPath);
+    } else if (TlMode == TL_RING)
+        TlWriteRing();
+    SvcMutexUnlock(&TlLock);
+}
+
+/** Implement the Lua function service.span(name, fn, ...).
+ *
+ * Call \a fn with the remaining arguments and return what it returns,
+ * recording the call as a span named \a name in the timeline. An
+ * error raised by \a fn is raised again after the span is recorded.
+ * Without a timeline, \a fn is just called.
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+int LuaTimelineSpan(lua_State *L)
+{
+    const char *name = luaL_checkstring(L, 1);
+    SvcU64 start;
+    int status;
+
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    if (TlMode == TL_OFF) {
+        lua_call(L, lua_gettop(L) - 2, LUA_MULTRET);
+        return lua_gettop(L) - 1;
+    }
+    start = SvcMicros();
+    status = lua_pcall(L, lua_gettop(L) - 2, LUA_MULTRET, 0);
+    TlRecord(name, "lua", start);
+    if (status)
+        return lua_error(L);
+    return lua_gettop(L) - 1;
+}
@@ -0,0 +1,310 @@
+/*! \file LuaWatchdog.c
+ *  \brief Watchdog that catches a hung service script.
+ *
+ * A script that deadlocks in a C module or spins forever in Lua still
+ * looks running to the SCM. With the init.lua field
+ * <code>watchdog</code> set to a time in ms, the script must show that
+ * it is alive at least that often. Every call to service.sleep(),
+ * service.stopping() or service.progress() counts as a heartbeat, and
+ * so does each iteration of Service.run() from LuaService.lua, which
+ * calls service.stopping(). A script that runs long stretches without
+ * any of those calls service.heartbeat() instead. Time spent asleep in
+ * service.sleep() always counts as alive.
+ *
+ * While the script runs, a watchdog thread checks for heartbeats.
+ * When one is missed, it traces the time since the last one and asks
+ * for the shared count hook of LuaHook.c. The hook fires at the next
+ * VM instruction, on the worker thread, and traces the Lua call stack
+ * there, which shows where the script is spinning. A script stuck in
+ * C code runs no VM instructions, so if the hook has not fired after
+ * another <code>watchdog</code> ms, that is traced instead.
+ *
+ * With <code>watchdog_restart</code> also set, the hook then raises
+ * the error <code>service hung</code>, again every LUAHOOK_REPEAT
+ * instructions if it is caught, so the script fails and is restarted
+ * as configured by <code>restart</code>, or the service stops with an
+ * error. A script stuck in C code cannot be failed that way, so then
+ * the whole process ends at once with an error instead, skipping the
+ * usual cleanup, which might wait for the stuck worker. The SCM's
+ * recovery actions or the Restart= setting of a systemd unit can
+ * answer that by starting it again.
+ *
+ * Heartbeats are also passed on to SvcWatchdogPing(), which keeps the
+ * watchdog of systemd fed on POSIX systems whether or not
+ * <code>watchdog</code> is set.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "luaservice.h"
+
+/** The error raised in a hung script with watchdog_restart set. */
+#define HUNG "service hung"
+
+/** Deepest stack traced; deeper stacks are cut off. */
+#define WD_MAXDEPTH 32
+
+/** Longest source name or function name traced for a frame. */
+#define WD_MAXNAME 80
+
+/** Most bytes the description of a frame takes. */
+#define WD_FRAME (2 * WD_MAXNAME + 48)
+
+/** Guards WdQuit for the watchdog's timed wait. */
+static SvcMutex WdLock = SVC_MUTEX_INIT;
+
+/** Wakes the watchdog to quit. */
+static SvcCond WdWake;
+
+/** The watchdog thread, while a script runs. */
+static SvcThread *WdThread;
+
+/** Set to ask the watchdog to quit. */
+static volatile int WdQuit;
+
+/** Tick count of the last heartbeat. */
+static volatile DWORD WdLastBeat;
+
+/** Non-zero while the script sleeps in service.sleep(). */
+static volatile int WdSleeping;
+
+/** Tick count when the heartbeat was missed, or zero while the
+ * script is alive. */
+static DWORD WdMissed;
+
+/** Set while the hook is wanted: from a missed heartbeat until the
+ * hook has traced the stack. */
+static volatile int WdWantTrace;
+
+/** Set once the hook should raise HUNG. */
+static volatile int WdFailing;
+
+/** Describe one stack frame as debug.traceback() would.
+ *
+ * \param ar The frame, with "Sln" filled in.
+ * \param buf Receives the text, at least WD_FRAME bytes.
+ */
+static void WdFrame(lua_Debug *ar, char *buf)
+{
+    if (ar->currentline > 0)
+        sprintf(buf, "\n\t%.*s:%d: ", WD_MAXNAME, ar->short_src,
+                ar->currentline);
+    else
+        sprintf(buf, "\n\t%.*s: ", WD_MAXNAME, ar->short_src);
+    buf += strlen(buf);
+    if (ar->name)
+        sprintf(buf, "in function '%.*s'", WD_MAXNAME, ar->name);
+    else if (*ar->what == 'm')
+        strcpy(buf, "in main chunk");
+    else if (*ar->what == 'C')
+        strcpy(buf, "?");
+    else
+        sprintf(buf, "in function <%.*s:%d>", WD_MAXNAME, ar->short_src,
+                ar->linedefined);
+}
+
+/** Describe the Lua call stack of \a L as debug.traceback() would,
+ * one frame a line, each line starting with a newline and a tab.
+ *
+ * Stacks deeper than WD_MAXDEPTH, or than fits, are cut off with a
+ * line of "...".
+ *
+ * \context
+ * The thread running \a L, such as in a hook
+ *
+ * \param L The Lua state.
+ * \param buf Receives the text.
+ * \param size Size of \a buf, at least 16 bytes. Each frame takes up
+ * to WD_FRAME bytes.
+ */
+void LuaWatchdogStack(lua_State *L, char *buf, size_t size)
+{
+    lua_Debug frame;
+    char *cp = buf;
+    int level;
+
+    *cp = '\0';
+    for (level = 0; level < WD_MAXDEPTH
+            && (size_t)(cp - buf) + 2 * WD_FRAME <= size
+            && lua_getstack(L, level, &frame); ++level) {
+        lua_getinfo(L, "Sln", &frame);
+        WdFrame(&frame, cp);
+        cp += strlen(cp);
+    }
+    if (lua_getstack(L, level, &frame))
+        strcpy(cp, "\n\t...");
+}
+
+/** Handle LUAHOOK_WATCHDOG in the count hook, see LuaHook.c.
+ *
+ * Traces the Lua call stack once, and raises HUNG, again and again,
+ * if the script is to be failed.
+ *
+ * \context
+ * Service worker thread
+ *
+ * \param L The Lua state the hook fired in.
+ * \returns LUAHOOK_RAISE with the error pushed, or LUAHOOK_DONE.
+ */
+int LuaWatchdogHook(lua_State *L)
+{
+    char stack[(WD_MAXDEPTH + 1) * WD_FRAME];
+
+    if (WdWantTrace) {
+        WdWantTrace = 0;
+        LuaWatchdogStack(L, stack, sizeof(stack));
+        SvcDebugTraceStr("Watchdog: service script is running%s\n", stack);
+    }
+    if (!WdFailing)
+        return LUAHOOK_DONE;
+    lua_pushliteral(L, HUNG);
+    return LUAHOOK_RAISE;
+}
+
+/** Check the heartbeat, and act on a missed one.
+ *
+ * Called with WdLock held.
+ *
+ * \param L The worker's Lua state.
+ */
+static void WdCheck(lua_State *L)
+{
+    DWORD now = SvcTicks();
+    DWORD since = now - WdLastBeat;
+
+    if (WdSleeping || since < (DWORD)ServiceWatchdog) {
+        if (WdMissed)
+            SvcDebugTrace("Watchdog: heartbeat again after %d ms\n", since);
+        WdMissed = 0;
+        WdWantTrace = 0;
+        WdFailing = 0;
+        return;
+    }
+    if (!WdMissed) {
+        WdMissed = now ? now : 1;
+        SvcDebugTrace("Watchdog: no heartbeat for %d ms\n", since);
+        WdWantTrace = 1;
+        WdFailing = ServiceWatchdogRestart;
+    } else if (WdWantTrace && now - WdMissed >= (DWORD)ServiceWatchdog) {
+        WdWantTrace = 0;
+        SvcDebugTrace("Watchdog: service script is not running Lua code, "
+                "no heartbeat for %d ms\n", since);
+        if (WdFailing) {
+            SvcDebugTrace("Watchdog: ending the hung service\n", 0);
+            SvcProcessExit(EXIT_FAILURE);
+        }
+    }
+    if (WdWantTrace || WdFailing)
+        LuaHookRequest(L, LUAHOOK_WATCHDOG);
+}
+
+/** Body of the watchdog thread. */
+static unsigned WdWatch(void *arg)
+{
+    lua_State *L = (lua_State *)arg;
+    DWORD period;
+
+    SvcMutexLock(&WdLock);
+    while (!WdQuit) {
+        period = ServiceWatchdog > 0 ? (DWORD)ServiceWatchdog / 4 : 1000;
+        SvcCondWait(&WdWake, &WdLock, period ? period : 1);
+        if (!WdQuit && ServiceWatchdog > 0 && !ServiceStopping)
+            WdCheck(L);
+    }
+    SvcMutexUnlock(&WdLock);
+    return 0;
+}
+
+/** Start watching a service script about to run, if init.lua sets a
+ * <code>watchdog</code> time.
+ *
+ * \context
+ * Service worker thread
+ *
+ * \param h The loaded service script.
+ */
+void LuaWatchdogAttach(LUAHANDLE h)
+{
+    if (!h || WdThread || ServiceWatchdog <= 0)
+        return;
+    WdQuit = 0;
+    WdMissed = 0;
+    WdWantTrace = 0;
+    WdFailing = 0;
+    WdSleeping = 0;
+    WdLastBeat = SvcTicks();
+    SvcCondInit(&WdWake);
+    WdThread = SvcThreadStart(WdWatch, h);
+    if (!WdThread) {
+        SvcDebugTrace("Can't start watchdog (%d)\n", SvcLastError());
+        SvcCondDestroy(&WdWake);
+        return;
+    }
+    SvcDebugTrace("Watchdog started, %d ms\n", ServiceWatchdog);
+}
+
+/** Stop watching a service script that has finished.
+ *
+ * \context
+ * Service worker thread
+ *
+ * \param h The service script that finished.
+ */
+void LuaWatchdogDetach(LUAHANDLE h)
+{
+    (void)h;
+    if (!WdThread)
+        return;
+    SvcMutexLock(&WdLock);
+    WdQuit = 1;
+    SvcCondSignal(&WdWake);
+    SvcMutexUnlock(&WdLock);
+    SvcThreadWait(WdThread, SVC_INFINITE);
+    WdThread = NULL;
+    SvcCondDestroy(&WdWake);
+    WdWantTrace = 0;
+    WdFailing = 0;
+}
+
+/** Record a heartbeat of the service script.
+ *
+ * \context
+ * Service worker thread
+ */
+void LuaWatchdogBeat(void)
+{
+    WdLastBeat = SvcTicks();
+    SvcWatchdogPing();
+}
+
+/** Note that the worker is going to sleep in service.sleep(), or is
+ * back. A sleeping script is alive, and waking up is a heartbeat.
+ *
+ * \param sleeping Non-zero on entry to the sleep, zero after it.
+ */
+void LuaWatchdogSleep(int sleeping)
+{
+    WdSleeping = sleeping;
+    LuaStatusSleep(sleeping);
+    LuaWatchdogBeat();
+}
+
+/** Implement the Lua function service.heartbeat().
+ *
+ * Tell the watchdog that the script is alive, for a script that runs
+ * longer than the <code>watchdog</code> time between calls to
+ * service.sleep() or service.stopping().
+ *
+ * \param L Lua state context for the function.
+ * \returns The number of values on the Lua stack to be returned
+ * to the Lua caller.
+ */
+int LuaWatchdogHeartbeat(lua_State *L)
+{
+    LuaStatusPoll(L);
+    LuaWatchdogBeat();
+    return 0;
+}
@@ -6,9 +6,27 @@
  * will likely move some of the less critical details into a Lua
  * script, with the actual service control methods exposed via
  * a built-in module.
+ *
+ * This is the Windows controller, which talks to the SCM. The POSIX 
+ * daemon has its own, much smaller, SvcControlMain() in SvcPosix.c.
+ *
+ * Starting, stopping, pausing and continuing wait for the services to
+ * finish the change, by asking the SCM with NotifyServiceStatusChange()
+ * to say when their state changes, see ServiceControlAll(). Starting
+ * and stopping take any number of services, which are controlled all
+ * at once and then waited for together, and the time each took is 
+ * reported:
+ *
+ * \code
+ * LuaService -s -t 30000 ticker feeder archiver
+ * \endcode
  */
+#ifdef _WIN32
+
 #include <windows.h>
 #include <process.h> 
+#include <stdlib.h>
+#include <string.h>
 #include <stdio.h>
 
 #include "luaservice.h"
@@ -26,6 +44,16 @@ int ChangeConfig();
 // service control program tasks
 int ServiceRun();
 int ServiceControl(char* CONTROL);
+int ServiceControlAll(int n, const char **names, DWORD control,
+        DWORD deadline);
+
+/** Time in ms the controller waits for services to change state, unless
+ * it is given with <tt>-t</tt>. */
+#define CTL_WAIT_DEADLINE 60000
+
+/** Time in ms between looks at a service whose state changes cannot be
+ * waited for, and between checks of the deadline. */
+#define CTL_WAIT_SLICE 1000
 
 /** Entry point for service control and configuration.
  * 
@@ -37,21 +65,42 @@ int ServiceControl(char* CONTROL);
  * \return Exit status, as from main().
  */
 int SvcControlMain(int argc, char *argv[]) {
+    if (argc >= 2 && (stricmp("-r", argv[1]) == 0
+            || stricmp("-s", argv[1]) == 0)) {
+        DWORD control = stricmp("-s", argv[1]) == 0
+                ? SERVICE_CONTROL_STOP : 0;
+        DWORD deadline = CTL_WAIT_DEADLINE;
+        int first = 2;
+
+        if (argc >= 4 && stricmp("-t", argv[2]) == 0) {
+            deadline = (DWORD)atoi(argv[3]);
+            first = 4;
+        }
+        if (argc == first)
+            return ServiceControlAll(1, &ServiceName, control, deadline)
+                    ? EXIT_SUCCESS : EXIT_FAILURE;
+        return ServiceControlAll(argc - first, (const char **)argv + first,
+                control, deadline) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (argc >= 2 && stricmp("stat", argv[1]) == 0)
+        return LuaStatusShow(argc - 2, (const char **)argv + 2);
+    if (argc >= 3 && stricmp("ctl", argv[1]) == 0)
+        return LuaCommandClient(argc - 2, argv + 2);
     if (argc == 2) {
         if (stricmp("-i", argv[1]) == 0)
             InstallService();
         else if (stricmp("-u", argv[1]) == 0)
             UninstallService();
-        else if (stricmp("-r", argv[1]) == 0)
-            ServiceRun();
-        else if (stricmp("-s", argv[1]) == 0)
-            ServiceControl("STOP");
-#ifdef LUASERVICE_CAN_PAUSE_CONTINUE
-        else if (stricmp("-p", argv[1]) == 0)
-        ServiceControl("PAUSE");
-        else if (stricmp("-c", argv[1]) == 0)
-        ServiceControl("RESUME");
-#endif
+        else if (stricmp("reload", argv[1]) == 0)
+            ServiceControl("RELOAD");
+        else if (stricmp("profile", argv[1]) == 0)
+            ServiceControl("PROFILE");
+        else if (stricmp("-p", argv[1]) == 0
+                || stricmp("pause", argv[1]) == 0)
+            ServiceControl("PAUSE");
+        else if (stricmp("-c", argv[1]) == 0
+                || stricmp("continue", argv[1]) == 0)
+            ServiceControl("RESUME");
         else if (stricmp("status", argv[1]) == 0) {
             SC_HANDLE scm, service;
             //Open connection to SCM
@@ -74,6 +123,9 @@ int SvcControlMain(int argc, char *argv[]) {
             ShowUsage();
             return EXIT_FAILURE;
         }
+    } else if (argc == 3 && stricmp("control", argv[1]) == 0
+            && atoi(argv[2]) >= 128 && atoi(argv[2]) <= 255) {
+        ServiceControl(argv[2]);
     } else {
         ShowUsage();
         return EXIT_FAILURE;
@@ -190,13 +242,23 @@ void ShowUsage() {
             "Usage:\n"
             "LuaService -i\tInstall service\n"
             "LuaService -u\tUninstall service\n"
-            "LuaService -r\tRun service\n"
-            "LuaService -s\tStop service\n"
-#ifdef LUASERVICE_CAN_PAUSE_CONTINUE
+            "LuaService -r [-t ms] [name ...]\tRun services\n"
+            "LuaService run\tRun service in this console\n"
+            "LuaService simulate [ms:control ...]\tRun service under a\n"
+            "\tsimulated SCM, see SvcSimulate.c\n"
+            "LuaService -s [-t ms] [name ...]\tStop services\n"
+            "\tThe services default to this one, and each gets ms\n"
+            "\t(default 60000) to start or stop\n"
+            "LuaService reload\tReload service script\n"
+            "LuaService profile\tStart or stop the profiler\n"
             "LuaService -p\tPause service\n"
             "LuaService -c\tResume service\n"
-#endif
+            "LuaService control <code>\tSend custom control 128-255\n"
             "LuaService status\tCurrent status\n"
+            "LuaService stat [name ...]\tShow status pages of services,\n"
+            "\tby default this one, see LuaStatus.c\n"
+            "LuaService ctl <command> [arg ...]\tSend a command to the\n"
+            "\tservice's control_socket, see LuaCommands.c\n"
             "LuaService help\tDisplay this text\n"
             );
 }
@@ -305,10 +367,8 @@ int UninstallService() {
     //Stop service if necessary		
     if (status.dwCurrentState != SERVICE_STOPPED) {
         puts("Stopping service...");
-        SUCCESS = ControlService(service, SERVICE_CONTROL_STOP, &status);
-        if (!SUCCESS)
-            ErrorHandler("ControlService", GetLastError());
-        Sleep(500);
+        ServiceControlAll(1, &ServiceName, SERVICE_CONTROL_STOP,
+                CTL_WAIT_DEADLINE);
     }
 
     //Delete service
@@ -328,94 +388,227 @@ int UninstallService() {
 /** Start the service running.
  * 
  * Asks the \ref ssSCM to run the service on the local
- * machine.
+ * machine, and waits for it to be running.
  * 
  * The service name and display name are both derived from the
  * name field returned by init.lua.
  * 
- * \returns	Returns TRUE on success. The current implementation 
- * calls ErrorHandler() for all significant errors which exits
- * the process and does not return. There appear to be no 
- * insignificant errors.
+ * \returns	Returns TRUE if the service is running.
  */
 int ServiceRun() {
-    SC_HANDLE scm, Service;
-    SERVICE_STATUS ssStatus;
-    DWORD dwOldCheckPoint;
-    DWORD dwStartTickCount;
-    DWORD dwWaitTime;
-    DWORD dwStatus;
+    return ServiceControlAll(1, &ServiceName, 0, CTL_WAIT_DEADLINE);
+}
+
+/** A service being controlled by ServiceControlAll(). */
+typedef struct WaitTarget {
+    const char *name;           /**< Name of the service. */
+    SC_HANDLE service;          /**< Its handle, or NULL if it failed. */
+    DWORD pending;              /**< The pending state it should leave. */
+    DWORD want;                 /**< The state it should reach. */
+    DWORD started;              /**< Tick count when it was controlled. */
+    DWORD elapsed;              /**< Time in ms it took, once done. */
+    int armed;                  /**< Set while a notification is asked. */
+    int done;                   /**< Set once it left \a pending. */
+    SERVICE_NOTIFY notify;      /**< The notification asked for. */
+    SERVICE_STATUS_PROCESS status;  /**< Its latest status. */
+} WaitTarget;
+
+/** Get the name of a service state.
+ * 
+ * \param state The state.
+ * \returns Its name, a literal.
+ */
+static const char *StateName(DWORD state) {
+    switch (state) {
+    case SERVICE_STOPPED:           return "STOPPED";
+    case SERVICE_START_PENDING:     return "START_PENDING";
+    case SERVICE_STOP_PENDING:      return "STOP_PENDING";
+    case SERVICE_RUNNING:           return "RUNNING";
+    case SERVICE_CONTINUE_PENDING:  return "CONTINUE_PENDING";
+    case SERVICE_PAUSE_PENDING:     return "PAUSE_PENDING";
+    case SERVICE_PAUSED:            return "PAUSED";
+    default:                        return "UNKNOWN";
+    }
+}
+
+/** Note the latest status of a service, and whether it is done. */
+static void WaitUpdate(WaitTarget *t) {
+    if (!t->done && t->status.dwCurrentState != t->pending) {
+        t->done = 1;
+        t->elapsed = GetTickCount() - t->started;
+    }
+}
+
+/** Callback for NotifyServiceStatusChange(), run as an APC in the
+ * controller's thread while it waits in SleepEx().
+ * 
+ * \param param The SERVICE_NOTIFY of the WaitTarget.
+ */
+static void WINAPI WaitNotified(void *param) {
+    SERVICE_NOTIFY *n = (SERVICE_NOTIFY *)param;
+    WaitTarget *t = (WaitTarget *)n->pContext;
+
+    t->armed = 0;
+    if (n->dwNotificationStatus != ERROR_SUCCESS)
+        return;
+    t->status = n->ServiceStatus;
+    WaitUpdate(t);
+}
+
+/** Look at the status of a service without waiting. */
+static void WaitPoll(WaitTarget *t) {
+    DWORD size;
+
+    if (QueryServiceStatusEx(t->service, SC_STATUS_PROCESS_INFO,
+            (LPBYTE)&t->status, sizeof(t->status), &size))
+        WaitUpdate(t);
+}
+
+/** Wait for the services to leave their pending states.
+ * 
+ * Asks the SCM to notify each change of state, which it does with an
+ * APC while the thread waits alertably. A service for which that 
+ * cannot be asked is looked at every CTL_WAIT_SLICE ms instead.
+ * 
+ * \param t The services.
+ * \param n Count of services in \a t.
+ * \param deadline Longest time in ms to wait, from the first control.
+ */
+static void WaitServices(WaitTarget *t, int n, DWORD deadline) {
+    DWORD start = GetTickCount();
+    DWORD spent;
+    int i, waiting;
+
+    for (;;) {
+        waiting = 0;
+        for (i = 0; i < n; ++i) {
+            if (!t[i].service || t[i].done || t[i].armed)
+                continue;
+            memset(&t[i].notify, 0, sizeof(t[i].notify));
+            t[i].notify.dwVersion = SERVICE_NOTIFY_STATUS_CHANGE;
+            t[i].notify.pfnNotifyCallback = WaitNotified;
+            t[i].notify.pContext = &t[i];
+            if (NotifyServiceStatusChange(t[i].service,
+                    SERVICE_NOTIFY_STOPPED | SERVICE_NOTIFY_RUNNING
+                    | SERVICE_NOTIFY_PAUSED, &t[i].notify) == ERROR_SUCCESS)
+                t[i].armed = 1;
+            else
+                WaitPoll(&t[i]);
+        }
+        for (i = 0; i < n; ++i)
+            if (t[i].service && !t[i].done)
+                ++waiting;
+        spent = GetTickCount() - start;
+        if (!waiting || spent >= deadline)
+            break;
+        SleepEx(deadline - spent < CTL_WAIT_SLICE
+                ? deadline - spent : CTL_WAIT_SLICE, TRUE);
+    }
+}
+
+/** Start or control services, and wait for them to finish the change.
+ * 
+ * All of the services are controlled first, and then waited for 
+ * together. The time each took is printed, or why it failed.
+ * 
+ * \param n Count of services in \a names.
+ * \param names Names of the services.
+ * \param control Zero to start the services, or SERVICE_CONTROL_STOP,
+ * SERVICE_CONTROL_PAUSE or SERVICE_CONTROL_CONTINUE.
+ * \param deadline Longest time in ms to wait for them.
+ * \returns TRUE if all of the services reached the state asked for.
+ */
+int ServiceControlAll(int n, const char **names, DWORD control,
+        DWORD deadline) {
+    SC_HANDLE scm;
+    WaitTarget *t;
+    SERVICE_STATUS status;
+    DWORD err;
+    int i, ok = TRUE;
 
-    //open connection to SCM
     scm = OpenSCManager(NULL, NULL, SC_MANAGER_ALL_ACCESS);
     if (!scm)
         ErrorHandler("OpenSCManager", GetLastError());
-
-    //open service
-    Service = OpenService(scm, ServiceName, SERVICE_ALL_ACCESS);
-    if (!Service) {
-        ErrorHandler("OpenService", GetLastError());
-        return FALSE;
-    } else {
-        //start service
-        StartService(Service, 0, NULL);
-        GetStatus(Service);
-
-        // Check the status until the service is no longer start pending. 
-        if (!QueryServiceStatus(Service, &ssStatus) )
-            ErrorHandler("QueryServiceStatus", GetLastError());
-        // Save the tick count and initial checkpoint.
-        dwStartTickCount = GetTickCount();
-        dwOldCheckPoint = ssStatus.dwCheckPoint;
-
-        while (ssStatus.dwCurrentState == SERVICE_START_PENDING) {
-            // Do not wait longer than the wait hint. A good interval is 
-            // one tenth the wait hint, but no less than 1 second and no 
-            // more than 10 seconds. 
-            dwWaitTime = ssStatus.dwWaitHint / 10;
-
-            if (dwWaitTime < 1000)
-                dwWaitTime = 1000;
-            else if (dwWaitTime > 10000)
-                dwWaitTime = 10000;
-
-            Sleep(dwWaitTime);
-
-            // Check the status again. 
-            if (!QueryServiceStatus(Service, &ssStatus) )
-                break;
-
-            if (ssStatus.dwCheckPoint > dwOldCheckPoint) {
-                // The service is making progress.
-                dwStartTickCount = GetTickCount();
-                dwOldCheckPoint = ssStatus.dwCheckPoint;
-            } else {
-                if (GetTickCount()-dwStartTickCount > ssStatus.dwWaitHint) {
-                    // No progress made within the wait hint
-                    break;
-                }
-            }
+    t = (WaitTarget *)calloc((size_t)n, sizeof(WaitTarget));
+    if (!t)
+        ErrorHandler("calloc", ERROR_NOT_ENOUGH_MEMORY);
+
+    for (i = 0; i < n; ++i) {
+        t[i].name = names[i];
+        switch (control) {
+        case SERVICE_CONTROL_STOP:
+            t[i].pending = SERVICE_STOP_PENDING;
+            t[i].want = SERVICE_STOPPED;
+            break;
+        case SERVICE_CONTROL_PAUSE:
+            t[i].pending = SERVICE_PAUSE_PENDING;
+            t[i].want = SERVICE_PAUSED;
+            break;
+        case SERVICE_CONTROL_CONTINUE:
+            t[i].pending = SERVICE_CONTINUE_PENDING;
+            t[i].want = SERVICE_RUNNING;
+            break;
+        default:
+            t[i].pending = SERVICE_START_PENDING;
+            t[i].want = SERVICE_RUNNING;
+            break;
         }
-
-        if (ssStatus.dwCurrentState == SERVICE_RUNNING) {
-            GetStatus(Service);
-            dwStatus = NO_ERROR;
-        } else {
-
-            puts("\nService not started.");
-            printf("  Current State: %ld\n", ssStatus.dwCurrentState);
-            printf("  Exit Code: %ld\n", ssStatus.dwWin32ExitCode);
-            printf("  Service Specific Exit Code: %ld\n",
-                    ssStatus.dwServiceSpecificExitCode);
-            printf("  Check Point: %ld\n", ssStatus.dwCheckPoint);
-            printf("  Wait Hint: %ld\n", ssStatus.dwWaitHint);
-            dwStatus = GetLastError();
+        t[i].service = OpenService(scm, names[i], SERVICE_ALL_ACCESS);
+        if (!t[i].service) {
+            fprintf(stderr, "%s: OpenService failed (%ld)\n", names[i],
+                    GetLastError());
+            continue;
+        }
+        t[i].started = GetTickCount();
+        if (control ? ControlService(t[i].service, control, &status)
+                : StartService(t[i].service, 0, NULL)) {
+            t[i].status.dwCurrentState = t[i].pending;
+            continue;
+        }
+        err = GetLastError();
+        if ((!control && err == ERROR_SERVICE_ALREADY_RUNNING)
+                || (control == SERVICE_CONTROL_STOP
+                && err == ERROR_SERVICE_NOT_ACTIVE)) {
+            t[i].status.dwCurrentState = t[i].want;
+            t[i].done = 1;
+            continue;
         }
+        fprintf(stderr, "%s: %s failed (%ld)\n", names[i],
+                control ? "ControlService" : "StartService", err);
+        CloseServiceHandle(t[i].service);
+        t[i].service = NULL;
     }
 
+    WaitServices(t, n, deadline);
+
+    for (i = 0; i < n; ++i) {
+        if (!t[i].service) {
+            ok = FALSE;
+            continue;
+        }
+        if (t[i].status.dwCurrentState == t[i].want)
+            printf("%s: %s in %lu ms\n", t[i].name, StateName(t[i].want),
+                    (unsigned long)t[i].elapsed);
+        else if (!t[i].done)
+            printf("%s: still %s after %lu ms\n", t[i].name,
+                    StateName(t[i].status.dwCurrentState),
+                    (unsigned long)deadline);
+        else
+            printf("%s: %s in %lu ms, exit code %ld (%ld)\n", t[i].name,
+                    StateName(t[i].status.dwCurrentState),
+                    (unsigned long)t[i].elapsed,
+                    t[i].status.dwWin32ExitCode,
+                    t[i].status.dwServiceSpecificExitCode);
+        if (t[i].status.dwCurrentState != t[i].want)
+            ok = FALSE;
+        CloseServiceHandle(t[i].service);
+    }
+    // Closing the handles cancels the notifications, but some may
+    // already be queued, so run those before freeing what they use.
+    SleepEx(0, TRUE);
+    free(t);
     CloseServiceHandle(scm);
-    CloseServiceHandle(Service);
-    return TRUE;
+    return ok;
 }
 
 /** Send other controls to the service.
@@ -429,6 +622,14 @@ int ServiceRun() {
  * \param CONTROL The name of the control message to send. The 
  * following controls are understood:
  * - "STOP"
+ * - "RELOAD"
+ * - "PROFILE"
+ * - "PAUSE"
+ * - "RESUME"
+ * - A custom control code from "128" to "255"
+ * 
+ * STOP, PAUSE and RESUME wait for the service to finish the change,
+ * see ServiceControlAll().
  * 
  * \returns	Returns TRUE on success. The current implementation 
  * calls ErrorHandler() for all significant errors which exits
@@ -451,25 +652,31 @@ int ServiceControl(char* CONTROL) {
     if (!service)
         ErrorHandler("OpenService", GetLastError());
 
-    //stop the service
-    if (stricmp(CONTROL, "STOP") == 0) {
-        puts("Service is stopping...");
-        SUCCESS = ControlService(service, SERVICE_CONTROL_STOP, &status);
+    //stop, pause or continue the service, and wait for it
+    if (stricmp(CONTROL, "STOP") == 0 || stricmp(CONTROL, "PAUSE") == 0
+            || stricmp(CONTROL, "RESUME") == 0) {
+        CloseServiceHandle(service);
+        CloseServiceHandle(scm);
+        return ServiceControlAll(1, &ServiceName,
+                stricmp(CONTROL, "STOP") == 0 ? SERVICE_CONTROL_STOP
+                : stricmp(CONTROL, "PAUSE") == 0 ? SERVICE_CONTROL_PAUSE
+                : SERVICE_CONTROL_CONTINUE, CTL_WAIT_DEADLINE);
     }
-#ifdef LUASERVICE_CAN_PAUSE_CONTINUE
-    //pause the service
-    else if (stricmp(CONTROL, "PAUSE") == 0)
-    {
-        puts("Service is pausing...");
-        SUCCESS = ControlService(service, SERVICE_CONTROL_PAUSE, &status);
+    //reload the service script
+    else if (stricmp(CONTROL, "RELOAD") == 0) {
+        puts("Service is reloading its script...");
+        SUCCESS = ControlService(service, LUASERVICE_CONTROL_RELOAD, &status);
     }
-    //continue the service
-    else if (stricmp(CONTROL, "RESUME") == 0)
-    {
-        puts("Service is resuming...");
-        SUCCESS = ControlService(service, SERVICE_CONTROL_CONTINUE, &status);
+    //start or stop the profiler
+    else if (stricmp(CONTROL, "PROFILE") == 0) {
+        puts("Service is toggling its profiler...");
+        SUCCESS = ControlService(service, LUASERVICE_CONTROL_PROFILE, &status);
+    }
+    //pass a custom control to the service script
+    else if (atoi(CONTROL) >= 128 && atoi(CONTROL) <= 255) {
+        printf("Sending control %d to the service...\n", atoi(CONTROL));
+        SUCCESS = ControlService(service, (DWORD)atoi(CONTROL), &status);
     }
-#endif
     if (!SUCCESS)
         ErrorHandler("ControlService", GetLastError());
     else
@@ -616,3 +823,5 @@ int ChangeConfig() {
     CloseServiceHandle(scm);
     return TRUE;
 }
+
+#endif /* _WIN32 */
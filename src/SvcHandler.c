@@ -0,0 +1,424 @@
+/*! \file SvcHandler.c
+ *  \brief The service's side of the service manager protocol.
+ *
+ * The SCM starts a service by running its service main function, sends
+ * it controls through its control handler, and expects it to report
+ * its status as it changes. This is that side of the protocol, kept
+ * apart from the SCM itself so that SvcWin32.c runs it under the real
+ * SCM and SvcSimulate.c under a fake one, and a simulated run goes
+ * through the same code as a real one.
+ *
+ * SvcServiceStart() reports the service starting, and SvcServiceMain()
+ * then loads the script and runs it, reporting the service running
+ * once it is ready. With a <code>ready_timeout</code>, a start
+ * coordinator thread reports the progress of the startup meanwhile,
+ * and stops the service if it takes too long. SvcHandleControl() passes
+ * each control on to the script, and on a stop hands over to a stop
+ * coordinator thread, which reports the progress of the stop until the
+ * script has finished or the stop budget has run out, so that the
+ * control handler stays free to answer INTERROGATE. The functions of
+ * the SvcManagerOps the backend gives SvcManager report what the
+ * script does.
+ *
+ * The current status is kept here, and every change is passed to the
+ * setStatus() of SvcManager, which is all a service manager has to
+ * supply besides delivering the controls.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "luaservice.h"
+
+/** Time in ms between the coordinators' reports. */
+#define SVC_STOP_SLICE 1000
+
+/** Time in ms added to the wait hint of a stopping service, to cover
+ * reporting it stopped once its time has run out. */
+#define SVC_STOP_SLACK 250
+
+/** Wait hint in ms while the script is yet to take a pause or continue
+ * control from service.controls(). */
+#define SVC_PAUSE_HINT 10000
+
+/** Wait hint in ms while the service script loads, when init.lua sets
+ * no <code>ready_timeout</code>. */
+#define SVC_START_HINT 5000
+
+/** Set once the service script has finished, so the stop coordinator
+ * can tell a finished stop from one that ran out of time. */
+volatile int ServiceWorkerDone = 0;
+
+/** Guards HandlerStatus, and the coordinators' timed waits. */
+static SvcMutex HandlerLock = SVC_MUTEX_INIT;
+
+/** Wakes the coordinators when the script is ready or has finished. */
+static SvcCond HandlerWake;
+
+/** The status last reported. */
+static SvcStatus HandlerStatus;
+
+/** Set while a start coordinator waits for the script to be ready. */
+static int HandlerStarting;
+
+/** Change the status and report it. Called with HandlerLock held. */
+static void SvcReport(DWORD state, DWORD checkpoint, DWORD hint)
+{
+    HandlerStatus.state = state;
+    HandlerStatus.checkpoint = checkpoint;
+    HandlerStatus.hint = hint;
+    SvcManager->setStatus(&HandlerStatus);
+}
+
+/** See a stop request through.
+ *
+ * Waits for the script to finish for at most the time left of
+ * ServiceStopTimeout, reporting STOP_PENDING every SVC_STOP_SLICE ms
+ * meanwhile. The wait hint is the time left, and the checkpoint
+ * advances whenever the script has called service.progress() since
+ * the last report, so a script draining a queue can show that it is
+ * getting somewhere. Reports STOPPED when the script has finished or
+ * the time has run out, after which the service manager lets the
+ * process end.
+ *
+ * \context
+ * Stop coordinator thread, or the control handler's thread if that
+ * could not be started.
+ */
+static unsigned SvcStopCoordinator(void *arg)
+{
+    long seen = ServiceStopProgress;
+    int finished = 1;
+    DWORD left;
+
+    (void)arg;
+    SvcMutexLock(&HandlerLock);
+    while (!ServiceWorkerDone) {
+        left = LuaServiceStopLeft();
+        SvcCondWait(&HandlerWake, &HandlerLock,
+                left < SVC_STOP_SLICE ? left : SVC_STOP_SLICE);
+        if (ServiceWorkerDone)
+            break;
+        if (left == 0) {
+            finished = 0;
+            break;
+        }
+        if (ServiceStopProgress != seen) {
+            seen = ServiceStopProgress;
+            ++HandlerStatus.checkpoint;
+        }
+        SvcReport(LUASERVICE_STATE_STOP_PENDING, HandlerStatus.checkpoint,
+                LuaServiceStopLeft() + SVC_STOP_SLACK);
+    }
+    LuaServiceStopped(finished);
+    SvcReport(LUASERVICE_STATE_STOPPED, 0, 0);
+    SvcMutexUnlock(&HandlerLock);
+    SvcDebugTrace("Leaving Service\n", 0);
+    return 0;
+}
+
+/** Start the stop coordinator, or be it if it cannot be started. */
+static void SvcStopCoordinate(void)
+{
+    if (SvcThreadStart(SvcStopCoordinator, NULL))
+        return;
+    SvcDebugTrace("Can't start stop coordinator (%d)\n", SvcLastError());
+    SvcStopCoordinator(NULL);
+}
+
+/** See the startup of a service script with a <code>ready_timeout</code>
+ * through.
+ *
+ * Waits for the script to call service.ready() for at most the time
+ * left of ServiceReadyTimeout, reporting START_PENDING every
+ * SVC_STOP_SLICE ms meanwhile, with the checkpoint advanced whenever
+ * the script has called service.progress() since the last report. The
+ * wait hint is the time the script said its next step takes, or else
+ * the time left. Reports RUNNING once the script is ready. If the time
+ * runs out first, the service is stopped and reported stopped with
+ * LUASERVICE_ERROR_START_HANG.
+ *
+ * \context
+ * Start coordinator thread
+ */
+static unsigned SvcStartCoordinator(void *arg)
+{
+    long seen = ServiceStartProgress;
+    DWORD left;
+
+    (void)arg;
+    SvcMutexLock(&HandlerLock);
+    for (;;) {
+        left = LuaServiceReadyLeft();
+        SvcCondWait(&HandlerWake, &HandlerLock,
+                left < SVC_STOP_SLICE ? left : SVC_STOP_SLICE);
+        if (ServiceReady || ServiceStopping)
+            break;
+        if (left == 0) {
+            HandlerStarting = 0;
+            SvcMutexUnlock(&HandlerLock);
+            LuaServiceStartHung();
+            SvcMutexLock(&HandlerLock);
+            HandlerStatus.exitCode = LUASERVICE_ERROR_START_HANG;
+            SvcReport(LUASERVICE_STATE_STOP_PENDING, 0,
+                    ServiceStopTimeout + SVC_STOP_SLACK);
+            SvcMutexUnlock(&HandlerLock);
+            SvcStopCoordinator(NULL);
+            return 0;
+        }
+        if (ServiceStartProgress != seen) {
+            seen = ServiceStartProgress;
+            ++HandlerStatus.checkpoint;
+        }
+        SvcReport(LUASERVICE_STATE_START_PENDING, HandlerStatus.checkpoint,
+                ServiceStartHint ? ServiceStartHint : LuaServiceReadyLeft());
+    }
+    HandlerStarting = 0;
+    if (ServiceReady && !ServiceStopping)
+        SvcReport(LUASERVICE_STATE_RUNNING, 0, 0);
+    SvcMutexUnlock(&HandlerLock);
+    return 0;
+}
+
+/** Report the service starting.
+ *
+ * Called by the backend before SvcServiceMain(), and before it lets any
+ * control reach SvcHandleControl().
+ *
+ * \context
+ * Service main or worker thread
+ */
+void SvcServiceStart(void)
+{
+    SvcCondInit(&HandlerWake);
+    SvcMutexLock(&HandlerLock);
+    HandlerStatus.acceptsPause = 0;
+    HandlerStatus.exitCode = 0;
+    HandlerStatus.specificExitCode = 0;
+    SvcReport(LUASERVICE_STATE_START_PENDING, 0, ServiceReadyTimeout > 0
+            ? (DWORD)ServiceReadyTimeout : SVC_START_HINT);
+    SvcMutexUnlock(&HandlerLock);
+}
+
+/** Run the service, as the service main function the service manager
+ * calls to start it.
+ *
+ * Loads the service script, reports the service running or leaves
+ * that to service.ready() if init.lua sets a
+ * <code>ready_timeout</code>, and runs the script until it finishes.
+ * If it finishes without being asked to stop, or fails to load, the
+ * service is reported stopped with an error.
+ *
+ * \context
+ * Service worker thread
+ */
+void SvcServiceMain(void)
+{
+    LUAHANDLE wk = NULL;
+    DWORD status, specificError = 0;
+
+    status = LuaServiceInitialization(&wk, &specificError);
+    if (status != NO_ERROR) {
+        SvcDebugTrace("LuaServiceInitialization exitCode %u\n", status);
+        SvcDebugTrace("LuaServiceInitialization specificError %u\n",
+                specificError);
+        SvcMutexLock(&HandlerLock);
+        ServiceWorkerDone = 1;
+        HandlerStatus.exitCode = status;
+        HandlerStatus.specificExitCode = specificError;
+        SvcReport(LUASERVICE_STATE_STOPPED, 0, 0);
+        SvcMutexUnlock(&HandlerLock);
+        return;
+    }
+
+    // Initialization complete - report running status, or leave that to
+    // the script's service.ready() if init.lua asks it to say when.
+    if (ServiceReadyTimeout <= 0)
+        LuaServiceReady();
+    else {
+        HandlerStarting = 1;
+        if (!SvcThreadStart(SvcStartCoordinator, NULL)) {
+            SvcDebugTrace("Can't start start coordinator (%d)\n",
+                    SvcLastError());
+            HandlerStarting = 0;
+            LuaServiceReady();
+        }
+    }
+
+    // do the work of the service by running the loaded script,
+    // restarting it on failure if so configured.
+    SvcSupervise(wk);
+
+    SvcMutexLock(&HandlerLock);
+    ServiceWorkerDone = 1;
+    SvcCondBroadcast(&HandlerWake);
+    if (!ServiceStopping) {
+        SvcDebugTrace("Service main script exit. Stopping service... \n", 0);
+        HandlerStatus.exitCode = 1;
+        HandlerStatus.specificExitCode = (DWORD)-1;
+        SvcReport(LUASERVICE_STATE_STOPPED, 0, 0);
+    }
+    SvcMutexUnlock(&HandlerLock);
+    SvcDebugTrace("Returning to the Main Thread \n", 0);
+}
+
+/** Handle a control from the service manager.
+ *
+ * Passes the control on to the script through the queue of
+ * LuaControls.c, after doing what the framework does for it, and
+ * reports the status. Pause and continue are reported pending until
+ * the script takes them, see SvcHandlerPaused(). A stop is handed to
+ * the stop coordinator. INTERROGATE only reports the status again.
+ *
+ * \context
+ * The service manager's control handler
+ *
+ * \param code The control, a LUASERVICE_CONTROL_ value or a custom
+ * code from 128 to 255.
+ */
+void SvcHandleControl(DWORD code)
+{
+    SvcMutexLock(&HandlerLock);
+    switch (code) {
+    case LUASERVICE_CONTROL_PAUSE:
+        if (ServiceStopping)
+            break;
+        SvcDebugTrace("Telling service to pause\n", 0);
+        HandlerStatus.state = LUASERVICE_STATE_PAUSE_PENDING;
+        HandlerStatus.hint = SVC_PAUSE_HINT;
+        LuaControlPush(code);
+        LuaControlWake();
+        break;
+
+    case LUASERVICE_CONTROL_CONTINUE:
+        if (ServiceStopping)
+            break;
+        SvcDebugTrace("Telling service to continue\n", 0);
+        HandlerStatus.state = LUASERVICE_STATE_CONTINUE_PENDING;
+        HandlerStatus.hint = SVC_PAUSE_HINT;
+        LuaControlPush(code);
+        LuaControlWake();
+        break;
+
+    case LUASERVICE_CONTROL_SHUTDOWN:
+    case LUASERVICE_CONTROL_STOP:
+        // Hand the stop to the coordinator, so that the control handler
+        // stays free to answer INTERROGATE while the script finishes.
+        if (ServiceStopping)
+            break;
+        SvcDebugTrace("Telling service to stop\n", 0);
+        if (code == LUASERVICE_CONTROL_SHUTDOWN)
+            LuaControlPush(code);
+        LuaServiceStop();
+        LuaControlWake();
+        HandlerStatus.exitCode = 0;
+        SvcReport(LUASERVICE_STATE_STOP_PENDING, 0,
+                ServiceStopTimeout + SVC_STOP_SLACK);
+        SvcMutexUnlock(&HandlerLock);
+        SvcStopCoordinate();
+        return;
+
+    case LUASERVICE_CONTROL_PARAMCHANGE:
+        SvcDebugTrace("Re-reading init.lua\n", 0);
+        LuaServiceReconfigure();
+        LuaControlPush(code);
+        LuaControlWake();
+        break;
+
+    case LUASERVICE_CONTROL_RELOAD:
+        SvcDebugTrace("Telling service to reload its script\n", 0);
+        ServiceReloadPending = 1;
+        LuaControlPush(code);
+        LuaControlWake();
+        break;
+
+    case LUASERVICE_CONTROL_PROFILE:
+        SvcDebugTrace("Telling service to toggle its profiler\n", 0);
+        ServiceProfileToggle = 1;
+        ServiceHeapReportPending = 1;
+        LuaTimelineFlush();
+        LuaControlPush(code);
+        LuaControlWake();
+        break;
+
+    case LUASERVICE_CONTROL_INTERROGATE:
+        // Fall through to send current status.
+        break;
+
+    default:
+        if (code >= 128 && code <= 255) {
+            SvcDebugTrace("Passing control %d to the service\n", code);
+            LuaControlPush(code);
+            LuaControlWake();
+        } else
+            SvcDebugTrace("Unrecognized opcode %u\n", code);
+    }
+
+    // Send current status.
+    SvcManager->setStatus(&HandlerStatus);
+    SvcMutexUnlock(&HandlerLock);
+}
+
+/** Report the service running, once it is ready, see SvcManagerOps.
+ *
+ * With a start coordinator waiting for the script, it is told to make
+ * the report, so that it cannot report the service still starting
+ * after this one.
+ *
+ * \context
+ * Service worker thread
+ */
+void SvcHandlerReady(void)
+{
+    SvcMutexLock(&HandlerLock);
+    if (HandlerStarting)
+        SvcCondBroadcast(&HandlerWake);
+    else if (HandlerStatus.state == LUASERVICE_STATE_START_PENDING)
+        SvcReport(LUASERVICE_STATE_RUNNING, 0, 0);
+    SvcMutexUnlock(&HandlerLock);
+}
+
+/** Report that the script has taken a pause or continue control, see
+ * SvcManagerOps.
+ *
+ * \context
+ * Service worker thread
+ *
+ * \param paused Non-zero for a pause, zero for a continue.
+ */
+void SvcHandlerPaused(int paused)
+{
+    SvcMutexLock(&HandlerLock);
+    if (!ServiceStopping && HandlerStatus.state == (paused
+            ? LUASERVICE_STATE_PAUSE_PENDING
+            : LUASERVICE_STATE_CONTINUE_PENDING))
+        SvcReport(paused ? LUASERVICE_STATE_PAUSED
+                : LUASERVICE_STATE_RUNNING, 0, 0);
+    SvcMutexUnlock(&HandlerLock);
+}
+
+/** Accept pause and continue controls, once the script has asked for
+ * controls with service.controls(), see SvcManagerOps.
+ *
+ * \context
+ * Service worker thread
+ */
+void SvcHandlerControlsOpened(void)
+{
+    SvcMutexLock(&HandlerLock);
+    HandlerStatus.acceptsPause = 1;
+    SvcManager->setStatus(&HandlerStatus);
+    SvcMutexUnlock(&HandlerLock);
+}
+
+/** Report that init.lua has been applied again, see SvcManagerOps.
+ *
+ * The SCM expects no report for a PARAMCHANGE, so this only traces it.
+ *
+ * \context
+ * Control handler
+ */
+void SvcHandlerReconfigured(void)
+{
+    SvcDebugTrace("Service reconfigured\n", 0);
+}
@@ -0,0 +1,1451 @@
+/*! \file SvcPlatPosix.c
+ *  \brief Operating system services for POSIX systems.
+ *
+ * Implements the functions declared in SvcPlatform.h with POSIX
+ * threads and system calls, plus the readiness protocol of systemd
+ * for SvcNotify(). Only Linux is tried, but little beyond
+ * /proc/self/exe in SvcExePath() is specific to it.
+ */
+#ifndef _WIN32
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <syslog.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <linux/futex.h>
+#endif
+
+#include "SvcPlatform.h"
+
+/** Longest time in ms SvcShmEventWait() sleeps without looking at the
+ * count, where there is no futex. */
+#define SVC_SHM_SLICE 10
+
+/** Seconds from 1601 (the FILETIME epoch) to 1970. */
+#define SVC_EPOCH_DELTA 11644473600ull
+
+/** A thread started by SvcThreadStart(). */
+struct SvcThread {
+    pthread_t t;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int done;
+    SvcThreadFunc fn;
+    void *arg;
+};
+
+/** An open folder listing. */
+struct SvcDir {
+    DIR *d;
+};
+
+/** Set once trace output goes to syslog instead of stderr. */
+static int SvcUseSyslog;
+
+/** Set once trace output goes to stdout instead of stderr. */
+static int SvcUseStdout;
+
+/** Tick count of the last watchdog ping. */
+static DWORD SvcWatchdogLast;
+
+void SvcMutexInit(SvcMutex *m)
+{
+    pthread_mutex_init(m, NULL);
+}
+
+void SvcMutexDestroy(SvcMutex *m)
+{
+    pthread_mutex_destroy(m);
+}
+
+void SvcMutexLock(SvcMutex *m)
+{
+    pthread_mutex_lock(m);
+}
+
+void SvcMutexUnlock(SvcMutex *m)
+{
+    pthread_mutex_unlock(m);
+}
+
+/** Initialize a condition variable that times out on the monotonic clock. */
+void SvcCondInit(SvcCond *c)
+{
+    pthread_condattr_t a;
+    pthread_condattr_init(&a);
+    pthread_condattr_setclock(&a, CLOCK_MONOTONIC);
+    pthread_cond_init(c, &a);
+    pthread_condattr_destroy(&a);
+}
+
+void SvcCondDestroy(SvcCond *c)
+{
+    pthread_cond_destroy(c);
+}
+
+/** Wait for a condition with its lock held, for at most \a ms ms.
+ *
+ * \returns Non-zero if woken, zero on timeout.
+ */
+int SvcCondWait(SvcCond *c, SvcMutex *m, DWORD ms)
+{
+    struct timespec ts;
+    if (ms == SVC_INFINITE)
+        return pthread_cond_wait(c, m) == 0;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (long)(ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    return pthread_cond_timedwait(c, m, &ts) == 0;
+}
+
+void SvcCondSignal(SvcCond *c)
+{
+    pthread_cond_signal(c);
+}
+
+void SvcCondBroadcast(SvcCond *c)
+{
+    pthread_cond_broadcast(c);
+}
+
+/** Add to a shared counter atomically.
+ *
+ * \returns The new value.
+ */
+long SvcAtomicAdd(volatile long *p, long delta)
+{
+    return __sync_add_and_fetch(p, delta);
+}
+
+/** Add to a 32 bit counter atomically, such as one in shared memory
+ * that processes of either word size use.
+ *
+ * \returns The new value.
+ */
+DWORD SvcAtomicAdd32(volatile DWORD *p, DWORD delta)
+{
+    return __sync_add_and_fetch(p, delta);
+}
+
+/** Exchange a shared value atomically.
+ *
+ * \returns The old value.
+ */
+DWORD SvcAtomicSwap(volatile DWORD *p, DWORD value)
+{
+    DWORD old = __sync_lock_test_and_set(p, value);
+    __sync_synchronize();
+    return old;
+}
+
+/** Set a shared value to \a value if it is \a old, atomically.
+ *
+ * \returns The old value, which is \a old if it was set.
+ */
+DWORD SvcAtomicCompareSwap(volatile DWORD *p, DWORD old, DWORD value)
+{
+    return __sync_val_compare_and_swap(p, old, value);
+}
+
+/** Keep the compiler and the processor from moving memory accesses
+ * across this point. */
+void SvcMemoryBarrier(void)
+{
+    __sync_synchronize();
+}
+
+/** Common entry point of threads, which records when the body returns. */
+static void *SvcThreadMain(void *arg)
+{
+    SvcThread *t = (SvcThread *)arg;
+    t->fn(t->arg);
+    pthread_mutex_lock(&t->lock);
+    t->done = 1;
+    pthread_cond_broadcast(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+    return NULL;
+}
+
+/** Start a thread.
+ *
+ * \returns The thread, which must eventually be waited for with
+ * SvcThreadWait(), or NULL on failure.
+ */
+SvcThread *SvcThreadStart(SvcThreadFunc fn, void *arg)
+{
+    SvcThread *t = (SvcThread *)calloc(1, sizeof(SvcThread));
+    int err;
+    if (!t) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    t->fn = fn;
+    t->arg = arg;
+    pthread_mutex_init(&t->lock, NULL);
+    SvcCondInit(&t->cond);
+    err = pthread_create(&t->t, NULL, SvcThreadMain, t);
+    if (err) {
+        pthread_mutex_destroy(&t->lock);
+        pthread_cond_destroy(&t->cond);
+        free(t);
+        errno = err;
+        return NULL;
+    }
+    return t;
+}
+
+/** Wait at most \a ms ms for a thread to finish.
+ *
+ * \returns Non-zero if the thread has finished, in which case \a t
+ * has been released and must not be used again.
+ */
+int SvcThreadWait(SvcThread *t, DWORD ms)
+{
+    int done;
+    pthread_mutex_lock(&t->lock);
+    if (!t->done && ms)
+        while (SvcCondWait(&t->cond, &t->lock, ms) && !t->done)
+            ;
+    done = t->done;
+    pthread_mutex_unlock(&t->lock);
+    if (!done)
+        return 0;
+    pthread_join(t->t, NULL);
+    pthread_mutex_destroy(&t->lock);
+    pthread_cond_destroy(&t->cond);
+    free(t);
+    return 1;
+}
+
+/** End the calling thread without ending the process. */
+void SvcThreadExit(unsigned code)
+{
+    (void)code;
+    pthread_exit(NULL);
+}
+
+DWORD SvcThreadId(void)
+{
+#ifdef SYS_gettid
+    return (DWORD)syscall(SYS_gettid);
+#else
+    return (DWORD)(uintptr_t)pthread_self();
+#endif
+}
+
+DWORD SvcProcessId(void)
+{
+    return (DWORD)getpid();
+}
+
+/** Tell whether process \a pid exists. A process of another user
+ * counts, although it may not be signalled. */
+int SvcProcessAlive(DWORD pid)
+{
+    return kill((pid_t)pid, 0) == 0 || errno == EPERM;
+}
+
+/** End the process at once, without atexit handlers or flushing
+ * stdio, either of which may wait for a thread that is stuck. */
+void SvcProcessExit(int code)
+{
+    _exit(code);
+}
+
+/** Get a millisecond counter, which wraps after about 49 days. */
+DWORD SvcTicks(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (DWORD)((SvcU64)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/** Get a microsecond counter, for measuring short intervals. */
+SvcU64 SvcMicros(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (SvcU64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void SvcSleep(DWORD ms)
+{
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (long)(ms % 1000) * 1000000L;
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+        ;
+}
+
+/** Open a file.
+ *
+ * \param path The file name.
+ * \param mode SVC_FILE_xxx flags.
+ * \returns The file, or SVC_BADFILE on failure.
+ */
+SvcFile SvcFileOpen(const char *path, int mode)
+{
+    int flags = (mode & SVC_FILE_WRITE) ? O_RDWR : O_RDONLY;
+    if (mode & SVC_FILE_CREATE)
+        flags |= O_CREAT;
+    if (mode & SVC_FILE_TRUNC)
+        flags |= O_TRUNC;
+    return open(path, flags | O_CLOEXEC, 0666);
+}
+
+void SvcFileClose(SvcFile f)
+{
+    close(f);
+}
+
+/** Read from an absolute offset.
+ *
+ * \returns The number of bytes read, which is less than \a n only at
+ * the end of the file, or -1 on failure.
+ */
+long SvcFileRead(SvcFile f, SvcU64 off, void *p, size_t n)
+{
+    size_t got = 0;
+    while (got < n) {
+        ssize_t r = pread(f, (char *)p + got, n - got, (off_t)(off + got));
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (r == 0)
+            break;
+        got += (size_t)r;
+    }
+    return (long)got;
+}
+
+/** Write all of \a n bytes at an absolute offset. */
+int SvcFileWrite(SvcFile f, SvcU64 off, const void *p, size_t n)
+{
+    size_t put = 0;
+    while (put < n) {
+        ssize_t r = pwrite(f, (const char *)p + put, n - put, (off_t)(off + put));
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return 0;
+        }
+        put += (size_t)r;
+    }
+    return 1;
+}
+
+int SvcFileSize(SvcFile f, SvcU64 *size)
+{
+    struct stat st;
+    if (fstat(f, &st))
+        return 0;
+    *size = (SvcU64)st.st_size;
+    return 1;
+}
+
+int SvcFileTruncate(SvcFile f, SvcU64 size)
+{
+    return ftruncate(f, (off_t)size) == 0;
+}
+
+/** Make everything written to a file durable. */
+int SvcFileSync(SvcFile f)
+{
+    return fsync(f) == 0;
+}
+
+/** Map the first \a len bytes of a file into memory.
+ *
+ * A writable mapping extends the file to \a len bytes if needed.
+ */
+int SvcFileMap(SvcFile f, SvcU64 len, int writable, SvcMap *m)
+{
+    SvcU64 size;
+    if (writable && (!SvcFileSize(f, &size)
+            || (size < len && ftruncate(f, (off_t)len))))
+        return 0;
+    m->base = mmap(NULL, (size_t)len, PROT_READ | (writable ? PROT_WRITE : 0),
+            MAP_SHARED, f, 0);
+    if (m->base == MAP_FAILED) {
+        m->base = NULL;
+        return 0;
+    }
+    m->len = (size_t)len;
+    return 1;
+}
+
+/** Write the changed pages of a mapping back to the file. */
+int SvcFileMapSync(SvcMap *m)
+{
+    return msync(m->base, m->len, MS_SYNC) == 0;
+}
+
+void SvcFileUnmap(SvcMap *m)
+{
+    munmap(m->base, m->len);
+    m->base = NULL;
+}
+
+/** Map \a len bytes of named shared memory, visible to other processes.
+ *
+ * With SVC_FILE_CREATE the shared memory is created if needed, readable
+ * by everyone; otherwise it fails if it does not exist. The memory
+ * outlives the process until it is created again. Unmap it with
+ * SvcFileUnmap().
+ *
+ * \param name The name, without the leading '/' of shm_open().
+ * \param len The length to map.
+ * \param mode SVC_FILE_READ, SVC_FILE_WRITE, or SVC_FILE_WRITE with
+ * SVC_FILE_CREATE.
+ * \param m Receives the mapping.
+ */
+int SvcShmMap(const char *name, size_t len, int mode, SvcMap *m)
+{
+    int writable = (mode & SVC_FILE_WRITE) != 0;
+    char path[256];
+    int fd;
+
+    if (snprintf(path, sizeof(path), "/%s", name) >= (int)sizeof(path)) {
+        errno = ENAMETOOLONG;
+        return 0;
+    }
+    fd = shm_open(path, !writable ? O_RDONLY
+            : (mode & SVC_FILE_CREATE) ? O_RDWR | O_CREAT : O_RDWR, 0644);
+    if (fd < 0)
+        return 0;
+    if (!SvcFileMap(fd, len, writable, m)) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return 0;
+    }
+    close(fd);
+    return 1;
+}
+
+/** Prepare a wake-up that processes sharing memory signal each other
+ * with.
+ *
+ * The event is the count of signals in \a word, which lives in the
+ * shared memory. On Linux a waiter sleeps in a futex on it; elsewhere
+ * it looks at the count every SVC_SHM_SLICE ms.
+ *
+ * \param e Receives the event.
+ * \param name Name of the shared memory, unused here.
+ * \param word The count of signals, 4 byte aligned in the shared memory.
+ */
+int SvcShmEventOpen(SvcShmEvent *e, const char *name, volatile DWORD *word)
+{
+    (void)name;
+    e->word = word;
+    return 1;
+}
+
+void SvcShmEventClose(SvcShmEvent *e)
+{
+    e->word = NULL;
+}
+
+/** Wait at most \a ms ms for a signal after the count was \a seen.
+ *
+ * Returns at once if the count has already moved on from \a seen, so
+ * that a signal given between reading the count and waiting is not
+ * lost. May also return early for no reason.
+ *
+ * \returns Non-zero if the count moved on.
+ */
+int SvcShmEventWait(SvcShmEvent *e, DWORD seen, DWORD ms)
+{
+#ifdef __linux__
+    struct timespec ts, *tp = NULL;
+
+    if (ms != SVC_INFINITE) {
+        ts.tv_sec = ms / 1000;
+        ts.tv_nsec = (long)(ms % 1000) * 1000000L;
+        tp = &ts;
+    }
+    if (*e->word == seen)
+        syscall(SYS_futex, e->word, FUTEX_WAIT, seen, tp, NULL, 0);
+#else
+    DWORD start = SvcTicks();
+    DWORD spent;
+
+    while (*e->word == seen && (spent = SvcTicks() - start) < ms)
+        SvcSleep(ms - spent < SVC_SHM_SLICE ? ms - spent : SVC_SHM_SLICE);
+#endif
+    return *e->word != seen;
+}
+
+/** Signal the event, waking every process waiting for it. */
+void SvcShmEventSignal(SvcShmEvent *e)
+{
+    __sync_add_and_fetch(e->word, 1);
+#ifdef __linux__
+    syscall(SYS_futex, e->word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+/** Convert a stat time to the FILETIME scale. */
+static SvcU64 SvcStatTime(const struct stat *st)
+{
+    return ((SvcU64)st->st_mtim.tv_sec + SVC_EPOCH_DELTA) * 10000000u
+            + (SvcU64)st->st_mtim.tv_nsec / 100;
+}
+
+/** Get the size and time of a file.
+ *
+ * Times on every platform count 100 ns intervals since 1601, the
+ * scale of a Win32 FILETIME.
+ *
+ * \returns Non-zero if the file exists.
+ */
+int SvcFileStat(const char *path, SvcU64 *size, SvcU64 *mtime, int *isdir)
+{
+    struct stat st;
+    if (stat(path, &st))
+        return 0;
+    if (size)
+        *size = (SvcU64)st.st_size;
+    if (mtime)
+        *mtime = SvcStatTime(&st);
+    if (isdir)
+        *isdir = S_ISDIR(st.st_mode);
+    return 1;
+}
+
+/** Rename \a from to \a to, replacing it, in a single durable step.
+ *
+ * The folder holding \a to is synced after the rename, so the new
+ * name survives a crash.
+ */
+int SvcFileReplace(const char *from, const char *to)
+{
+    const char *slash = strrchr(to, '/');
+    char *dir;
+    int fd;
+
+    if (rename(from, to))
+        return 0;
+    dir = slash ? strndup(to, slash == to ? 1 : (size_t)(slash - to)) : strdup(".");
+    if (dir) {
+        fd = open(dir, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            fsync(fd);
+            close(fd);
+        }
+        free(dir);
+    }
+    return 1;
+}
+
+int SvcFileDelete(const char *path)
+{
+    return unlink(path) == 0;
+}
+
+/** Create a folder.
+ *
+ * \returns Non-zero if the folder was created or already exists.
+ */
+int SvcDirCreate(const char *path)
+{
+    int isdir;
+
+    if (mkdir(path, 0777) == 0)
+        return 1;
+    return errno == EEXIST && SvcFileStat(path, NULL, NULL, &isdir) && isdir;
+}
+
+/** Start listing the files of a folder.
+ *
+ * \returns The listing, or NULL on failure.
+ */
+SvcDir *SvcDirOpen(const char *path)
+{
+    SvcDir *d = (SvcDir *)malloc(sizeof(SvcDir));
+    if (!d) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    d->d = opendir(path);
+    if (!d->d) {
+        int err = errno;
+        free(d);
+        errno = err;
+        return NULL;
+    }
+    return d;
+}
+
+/** Get the next entry of a listing, skipping "." and "..".
+ *
+ * Entries that vanish between being listed and being examined are
+ * skipped too.
+ *
+ * \returns Zero at the end of the listing.
+ */
+int SvcDirNext(SvcDir *d, SvcDirEntry *e)
+{
+    struct dirent *de;
+    struct stat st;
+
+    while ((de = readdir(d->d)) != NULL) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        if (fstatat(dirfd(d->d), de->d_name, &st, 0))
+            continue;
+        e->name = de->d_name;
+        e->size = (SvcU64)st.st_size;
+        e->mtime = SvcStatTime(&st);
+        e->isdir = S_ISDIR(st.st_mode);
+        return 1;
+    }
+    return 0;
+}
+
+void SvcDirClose(SvcDir *d)
+{
+    closedir(d->d);
+    free(d);
+}
+
+DWORD SvcLastError(void)
+{
+    return (DWORD)errno;
+}
+
+/** Get full path and file name of the executable.
+ *
+ * \returns A string from malloc(), or NULL.
+ */
+char *SvcExePath(void)
+{
+    size_t size = 256;
+    char *buf = NULL;
+
+    for (;;) {
+        ssize_t n;
+        char *p = (char *)realloc(buf, size);
+        if (!p) {
+            free(buf);
+            return NULL;
+        }
+        buf = p;
+        n = readlink("/proc/self/exe", buf, size);
+        if (n < 0) {
+            free(buf);
+            return NULL;
+        }
+        if ((size_t)n < size) {
+            buf[n] = '\0';
+            return buf;
+        }
+        size *= 2;
+    }
+}
+
+/** Make a path absolute with respect to the current directory.
+ *
+ * \returns A string from malloc(), or NULL.
+ */
+char *SvcFullPath(const char *path)
+{
+    char *cwd, *buf;
+    if (path[0] == '/')
+        return strdup(path);
+    cwd = SvcGetCwd();
+    if (!cwd)
+        return NULL;
+    buf = (char *)malloc(strlen(cwd) + strlen(path) + 2);
+    if (buf)
+        sprintf(buf, "%s/%s", cwd, path);
+    free(cwd);
+    return buf;
+}
+
+/** Get the current directory.
+ *
+ * \returns A string from malloc(), or NULL.
+ */
+char *SvcGetCwd(void)
+{
+    return getcwd(NULL, 0);
+}
+
+int SvcSetCwd(const char *path)
+{
+    return chdir(path) == 0;
+}
+
+int SvcSetEnv(const char *name, const char *value)
+{
+    return setenv(name, value, 1) == 0;
+}
+
+/** Send trace output to syslog from now on.
+ *
+ * Used once a daemon has detached from its terminal.
+ *
+ * \param ident The name to tag messages with.
+ */
+void SvcPosixUseSyslog(const char *ident)
+{
+    openlog(ident, LOG_PID, LOG_DAEMON);
+    SvcUseSyslog = 1;
+}
+
+/** Send trace output to stdout from now on.
+ *
+ * Used by <tt>LuaService run</tt>, which runs the service in a terminal.
+ */
+void SvcDebugToConsole(void)
+{
+    SvcUseStdout = 1;
+    SvcUseSyslog = 0;
+}
+
+/** Send a line of trace output to stderr, or to syslog for a daemon.
+ *
+ * A line that does not end in a newline gets one, since the output of
+ * service.print() does not.
+ */
+void SvcDebugOutput(const char *s)
+{
+    FILE *fp = SvcUseStdout ? stdout : stderr;
+    size_t len = strlen(s);
+
+    if (SvcUseSyslog) {
+        syslog(LOG_DEBUG, "%s", s);
+        return;
+    }
+    fputs(s, fp);
+    if (!len || s[len - 1] != '\n')
+        fputc('\n', fp);
+    fflush(fp);
+}
+
+/** Report service state to the supervisor named by NOTIFY_SOCKET.
+ *
+ * This is the sd_notify() protocol of systemd: one datagram holding
+ * newline separated assignments such as "READY=1" or "STOPPING=1",
+ * sent to the Unix socket named by the environment. A name that
+ * starts with '@' is in the abstract namespace.
+ *
+ * \param state The assignments to send.
+ * \returns Non-zero if the message was sent, zero if there is no
+ * supervisor listening or sending failed.
+ */
+int SvcNotify(const char *state)
+{
+    const char *name = getenv("NOTIFY_SOCKET");
+    struct sockaddr_un sa;
+    socklen_t salen;
+    size_t len;
+    int fd, ok;
+
+    if (!name || (name[0] != '/' && name[0] != '@'))
+        return 0;
+    len = strlen(name);
+    if (len >= sizeof(sa.sun_path))
+        return 0;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    memcpy(sa.sun_path, name, len);
+    if (name[0] == '@')
+        sa.sun_path[0] = '\0';
+    salen = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + len
+            + (name[0] == '@' ? 0 : 1));
+    fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return 0;
+    ok = sendto(fd, state, strlen(state), MSG_NOSIGNAL,
+            (struct sockaddr *)&sa, salen) >= 0;
+    close(fd);
+    return ok;
+}
+
+/** Ping the supervisor's watchdog, if it asked for pings.
+ *
+ * WATCHDOG_USEC gives the period after which a silent service is
+ * considered hung. Pings are sent at most twice per period, so this
+ * is cheap enough to call from every idle point of the worker.
+ */
+void SvcWatchdogPing(void)
+{
+    static DWORD period = 0;
+    static int checked = 0;
+    DWORD now;
+
+    if (!checked) {
+        const char *usec = getenv("WATCHDOG_USEC");
+        const char *pid = getenv("WATCHDOG_PID");
+        checked = 1;
+        if (usec && (!pid || (pid_t)atol(pid) == getpid()))
+            period = (DWORD)(strtoull(usec, NULL, 10) / 2000);
+    }
+    if (!period)
+        return;
+    now = SvcTicks();
+    if (now - SvcWatchdogLast < period && SvcWatchdogLast)
+        return;
+    SvcWatchdogLast = now;
+    SvcNotify("WATCHDOG=1");
+}
+
+/** A listening Unix socket. */
+struct SvcListener {
+    int fd;                 /**< The socket. */
+    char *path;             /**< Its path, removed on close. */
+};
+
+/** Fill in the address of the Unix socket at \a name.
+ *
+ * \returns Non-zero if the name fits.
+ */
+static int SvcSocketAddr(const char *name, struct sockaddr_un *sa)
+{
+    if (strlen(name) >= sizeof(sa->sun_path)) {
+        errno = ENAMETOOLONG;
+        return 0;
+    }
+    memset(sa, 0, sizeof(*sa));
+    sa->sun_family = AF_UNIX;
+    strcpy(sa->sun_path, name);
+    return 1;
+}
+
+/** Listen for local connections on the Unix socket at path \a name.
+ *
+ * A socket left behind by a process that has gone is replaced, but one
+ * that is still accepting connections is not. The socket is created
+ * accessible to its owner only, under a umask that is set for as long
+ * as bind() takes. The umask is the process's, so this is done as the
+ * service starts, before the script creates files of its own.
+ *
+ * \returns The listener, or NULL.
+ */
+SvcListener *SvcListen(const char *name)
+{
+    struct sockaddr_un sa;
+    SvcListener *l;
+    mode_t mask;
+    int fd, err, bound;
+
+    if (!SvcSocketAddr(name, &sa))
+        return NULL;
+    fd = SvcConnect(name);
+    if (fd != SVC_BADFILE) {
+        close(fd);
+        errno = EADDRINUSE;
+        return NULL;
+    }
+    unlink(name);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return NULL;
+    mask = umask(0177);
+    bound = bind(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0;
+    umask(mask);
+    if (!bound || listen(fd, 8) != 0) {
+        err = errno;
+        close(fd);
+        errno = err;
+        return NULL;
+    }
+    l = (SvcListener *)malloc(sizeof(SvcListener));
+    if (l)
+        l->path = strdup(name);
+    if (!l || !l->path) {
+        free(l);
+        close(fd);
+        unlink(name);
+        errno = ENOMEM;
+        return NULL;
+    }
+    l->fd = fd;
+    return l;
+}
+
+/** Wait for the next connection to a listener.
+ *
+ * \returns The connection, or SVC_BADFILE.
+ */
+SvcFile SvcListenAccept(SvcListener *l)
+{
+    int fd;
+    do
+        fd = accept4(l->fd, NULL, NULL, SOCK_CLOEXEC);
+    while (fd < 0 && errno == EINTR);
+    return fd;
+}
+
+/** Stop listening, and remove the socket. */
+void SvcListenClose(SvcListener *l)
+{
+    if (!l)
+        return;
+    close(l->fd);
+    unlink(l->path);
+    free(l->path);
+    free(l);
+}
+
+/** Connect to the Unix socket at path \a name.
+ *
+ * \returns The connection, or SVC_BADFILE.
+ */
+SvcFile SvcConnect(const char *name)
+{
+    struct sockaddr_un sa;
+    int fd, err;
+
+    if (!SvcSocketAddr(name, &sa))
+        return SVC_BADFILE;
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return SVC_BADFILE;
+    if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+        err = errno;
+        close(fd);
+        errno = err;
+        return SVC_BADFILE;
+    }
+    return fd;
+}
+
+/** Read what has arrived on a connection, at most \a n bytes, waiting
+ * at most \a ms ms for something to arrive.
+ *
+ * \returns The number of bytes read, 0 once the other end has closed
+ * it, or -1 on error or timeout.
+ */
+long SvcPipeRead(SvcFile f, void *p, size_t n, DWORD ms)
+{
+    struct pollfd pfd;
+    ssize_t got;
+    int ready;
+
+    if (ms != SVC_INFINITE) {
+        pfd.fd = f;
+        pfd.events = POLLIN;
+        do
+            ready = poll(&pfd, 1, ms > INT_MAX ? INT_MAX : (int)ms);
+        while (ready < 0 && errno == EINTR);
+        if (ready == 0)
+            errno = ETIMEDOUT;
+        if (ready <= 0)
+            return -1;
+    }
+    do
+        got = read(f, p, n);
+    while (got < 0 && errno == EINTR);
+    return (long)got;
+}
+
+/** Write all of \a n bytes to a connection, waiting at most \a ms ms
+ * each time the other end has to read before more fits.
+ *
+ * \returns Non-zero on success.
+ */
+int SvcPipeWrite(SvcFile f, const void *p, size_t n, DWORD ms)
+{
+    const char *cp = (const char *)p;
+    struct pollfd pfd;
+    ssize_t put;
+    int ready;
+
+    while (n > 0) {
+        if (ms != SVC_INFINITE) {
+            pfd.fd = f;
+            pfd.events = POLLOUT;
+            do
+                ready = poll(&pfd, 1, ms > INT_MAX ? INT_MAX : (int)ms);
+            while (ready < 0 && errno == EINTR);
+            if (ready == 0)
+                errno = ETIMEDOUT;
+            if (ready <= 0)
+                return 0;
+        }
+        put = send(f, cp, n, MSG_NOSIGNAL);
+        if (put < 0 && errno == EINTR)
+            continue;
+        if (put <= 0)
+            return 0;
+        cp += put;
+        n -= (size_t)put;
+    }
+    return 1;
+}
+
+void SvcPipeClose(SvcFile f)
+{
+    close(f);
+}
+
+/** Resolve \a host and \a port for a TCP socket.
+ *
+ * \param host A name or address, or "*" or "" for any address.
+ * \returns The addresses, to free with freeaddrinfo(), or NULL.
+ */
+static struct addrinfo *SvcResolve(const char *host, const char *port,
+        int passive)
+{
+    struct addrinfo hints, *ai = NULL;
+    int rc;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    if (!*host || strcmp(host, "*") == 0)
+        host = NULL;
+    rc = getaddrinfo(host, port, &hints, &ai);
+    if (rc != 0) {
+        errno = rc == EAI_SYSTEM ? errno : EADDRNOTAVAIL;
+        return NULL;
+    }
+    return ai;
+}
+
+/** Open a TCP socket on the first of \a ai that takes it.
+ *
+ * The socket does not block.
+ *
+ * \param listening Non-zero to bind and listen, zero to connect.
+ */
+static SvcSocket SvcTcpOpen(struct addrinfo *ai, int listening)
+{
+    static const int on = 1;
+    int s = -1, err = EADDRNOTAVAIL;
+
+    for (; ai; ai = ai->ai_next) {
+        s = socket(ai->ai_family,
+                ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (s < 0) {
+            err = errno;
+            continue;
+        }
+        if (listening) {
+            setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            if (bind(s, ai->ai_addr, ai->ai_addrlen) == 0
+                    && listen(s, SOMAXCONN) == 0)
+                return s;
+        } else {
+            setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            if (connect(s, ai->ai_addr, ai->ai_addrlen) == 0
+                    || errno == EINPROGRESS)
+                return s;
+        }
+        err = errno;
+        close(s);
+        s = -1;
+    }
+    errno = err;
+    return s;
+}
+
+/** Listen for TCP connections on \a port of \a host.
+ *
+ * \param host A name or address, or "*" or "" for any address.
+ * \param port A port number or service name.
+ * \returns The listening socket, which does not block, or SVC_BADSOCKET.
+ */
+SvcSocket SvcTcpListen(const char *host, const char *port)
+{
+    struct addrinfo *ai = SvcResolve(host, port, 1);
+    SvcSocket s;
+
+    if (!ai)
+        return SVC_BADSOCKET;
+    s = SvcTcpOpen(ai, 1);
+    freeaddrinfo(ai);
+    return s;
+}
+
+/** Start connecting to \a port of \a host.
+ *
+ * The socket does not block, and becomes writable once connected, or
+ * reports an error if the connection failed.
+ *
+ * \returns The socket, or SVC_BADSOCKET.
+ */
+SvcSocket SvcTcpConnect(const char *host, const char *port)
+{
+    struct addrinfo *ai = SvcResolve(host, port, 0);
+    SvcSocket s;
+
+    if (!ai)
+        return SVC_BADSOCKET;
+    s = SvcTcpOpen(ai, 0);
+    freeaddrinfo(ai);
+    return s;
+}
+
+/** Accept a connection waiting on a listening socket.
+ *
+ * \param l The listening socket.
+ * \param peer Receives the address of the other end as host:port, or
+ * an empty string.
+ * \param size Size of \a peer, at least 64 bytes.
+ * \returns The connection, which does not block, or SVC_BADSOCKET if
+ * none is waiting (see SvcSocketWouldBlock()) or on error.
+ */
+SvcSocket SvcTcpAccept(SvcSocket l, char *peer, size_t size)
+{
+    static const int on = 1;
+    struct sockaddr_storage sa;
+    socklen_t salen = sizeof(sa);
+    char host[NI_MAXHOST], port[NI_MAXSERV];
+    int s;
+
+    do
+        s = accept4(l, (struct sockaddr *)&sa, &salen,
+                SOCK_NONBLOCK | SOCK_CLOEXEC);
+    while (s < 0 && errno == EINTR);
+    *peer = '\0';
+    if (s < 0)
+        return SVC_BADSOCKET;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (getnameinfo((struct sockaddr *)&sa, salen, host, sizeof(host),
+            port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+        snprintf(peer, size, "%s:%s", host, port);
+    return s;
+}
+
+/** Read what has arrived on a socket, at most \a n bytes.
+ *
+ * \returns The number of bytes read, 0 once the other end has closed
+ * it, or -1 on error or if nothing has arrived (see
+ * SvcSocketWouldBlock()).
+ */
+long SvcSocketRecv(SvcSocket s, void *p, size_t n)
+{
+    ssize_t got;
+    do
+        got = recv(s, p, n, 0);
+    while (got < 0 && errno == EINTR);
+    return (long)got;
+}
+
+/** Write what fits of \a n bytes to a socket.
+ *
+ * \returns The number of bytes written, or -1 on error or if none fit
+ * (see SvcSocketWouldBlock()).
+ */
+long SvcSocketSend(SvcSocket s, const void *p, size_t n)
+{
+    ssize_t put;
+    do
+        put = send(s, p, n, MSG_NOSIGNAL);
+    while (put < 0 && errno == EINTR);
+    return (long)put;
+}
+
+/** Tell whether the last socket call failed only because it would
+ * have had to wait. */
+int SvcSocketWouldBlock(void)
+{
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+void SvcSocketClose(SvcSocket s)
+{
+    close(s);
+}
+
+#ifdef __linux__
+
+/** A set of sockets waited on together, an epoll instance. */
+struct SvcPoller {
+    int ep;                 /**< The epoll instance. */
+    int wake;               /**< An eventfd, written by SvcPollerWake(). */
+};
+
+/** Open an empty set of sockets to wait on.
+ *
+ * \returns The set, or NULL.
+ */
+SvcPoller *SvcPollerOpen(void)
+{
+    SvcPoller *p = (SvcPoller *)malloc(sizeof(SvcPoller));
+    struct epoll_event ev;
+    int err;
+
+    if (!p) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    p->ep = epoll_create1(EPOLL_CLOEXEC);
+    p->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ev.events = EPOLLIN;
+    ev.data.ptr = p;
+    if (p->ep < 0 || p->wake < 0
+            || epoll_ctl(p->ep, EPOLL_CTL_ADD, p->wake, &ev) != 0) {
+        err = errno;
+        SvcPollerClose(p);
+        errno = err;
+        return NULL;
+    }
+    return p;
+}
+
+void SvcPollerClose(SvcPoller *p)
+{
+    if (!p)
+        return;
+    if (p->ep >= 0)
+        close(p->ep);
+    if (p->wake >= 0)
+        close(p->wake);
+    free(p);
+}
+
+/** Change the events of a socket in the set with \a op. */
+static int SvcPollerCtl(SvcPoller *p, int op, SvcSocket s, int events,
+        void *tag)
+{
+    struct epoll_event ev;
+
+    ev.events = ((events & SVC_POLL_IN) ? EPOLLIN : 0)
+            | ((events & SVC_POLL_OUT) ? EPOLLOUT : 0);
+    ev.data.ptr = tag;
+    return epoll_ctl(p->ep, op, s, &ev) == 0;
+}
+
+/** Add a socket to the set.
+ *
+ * \param events SVC_POLL_IN and SVC_POLL_OUT flags to wait for.
+ * \param tag Returned with the events of the socket.
+ */
+int SvcPollerAdd(SvcPoller *p, SvcSocket s, int events, void *tag)
+{
+    return SvcPollerCtl(p, EPOLL_CTL_ADD, s, events, tag);
+}
+
+/** Change the events waited for on a socket in the set. */
+int SvcPollerModify(SvcPoller *p, SvcSocket s, int events, void *tag)
+{
+    return SvcPollerCtl(p, EPOLL_CTL_MOD, s, events, tag);
+}
+
+/** Take a socket out of the set, before it is closed. */
+void SvcPollerRemove(SvcPoller *p, SvcSocket s)
+{
+    struct epoll_event ev;
+    epoll_ctl(p->ep, EPOLL_CTL_DEL, s, &ev);
+}
+
+/** Wait at most \a ms ms for sockets in the set to be ready, or for
+ * SvcPollerWake().
+ *
+ * \param ev Receives the ready sockets.
+ * \param max Size of \a ev, at most SVC_POLL_MAX.
+ * \returns The count of ready sockets, which is zero after a wake or
+ * the timeout, or -1 on error.
+ */
+int SvcPollerWait(SvcPoller *p, SvcPollEvent *ev, int max, DWORD ms)
+{
+    struct epoll_event got[SVC_POLL_MAX];
+    SvcU64 count;
+    int i, n, k = 0;
+
+    n = epoll_wait(p->ep, got, max < SVC_POLL_MAX ? max : SVC_POLL_MAX,
+            ms == SVC_INFINITE ? -1 : ms > INT_MAX ? INT_MAX : (int)ms);
+    if (n < 0)
+        return errno == EINTR ? 0 : -1;
+    for (i = 0; i < n; ++i) {
+        if (got[i].data.ptr == p) {
+            while (read(p->wake, &count, sizeof(count)) > 0)
+                ;
+            continue;
+        }
+        ev[k].tag = got[i].data.ptr;
+        ev[k].events = ((got[i].events & EPOLLIN) ? SVC_POLL_IN : 0)
+                | ((got[i].events & EPOLLOUT) ? SVC_POLL_OUT : 0)
+                | ((got[i].events & (EPOLLERR | EPOLLHUP)) ? SVC_POLL_ERR : 0);
+        ++k;
+    }
+    return k;
+}
+
+/** Wake the thread waiting in SvcPollerWait().
+ *
+ * \context
+ * Any thread
+ */
+void SvcPollerWake(SvcPoller *p)
+{
+    SvcU64 one = 1;
+    ssize_t rc = write(p->wake, &one, sizeof(one));
+    (void)rc;
+}
+
+#else /* !__linux__ */
+
+/** A set of sockets waited on together, for poll(). The first entry is
+ * the read end of a pipe written by SvcPollerWake(). */
+struct SvcPoller {
+    struct pollfd *fds;     /**< The sockets. */
+    void **tags;            /**< Their tags. */
+    int n;                  /**< Sockets in the set. */
+    int size;               /**< Room in fds and tags. */
+    int wake[2];            /**< The pipe. */
+};
+
+SvcPoller *SvcPollerOpen(void)
+{
+    SvcPoller *p = (SvcPoller *)calloc(1, sizeof(SvcPoller));
+
+    if (!p || pipe(p->wake) != 0) {
+        free(p);
+        return NULL;
+    }
+    fcntl(p->wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(p->wake[1], F_SETFL, O_NONBLOCK);
+    fcntl(p->wake[0], F_SETFD, FD_CLOEXEC);
+    fcntl(p->wake[1], F_SETFD, FD_CLOEXEC);
+    if (!SvcPollerAdd(p, p->wake[0], SVC_POLL_IN, NULL)) {
+        SvcPollerClose(p);
+        errno = ENOMEM;
+        return NULL;
+    }
+    return p;
+}
+
+void SvcPollerClose(SvcPoller *p)
+{
+    if (!p)
+        return;
+    close(p->wake[0]);
+    close(p->wake[1]);
+    free(p->fds);
+    free(p->tags);
+    free(p);
+}
+
+/** Find a socket in the set.
+ *
+ * \returns Its index, or -1.
+ */
+static int SvcPollerFind(SvcPoller *p, SvcSocket s)
+{
+    int i;
+    for (i = 1; i < p->n; ++i)
+        if (p->fds[i].fd == s)
+            return i;
+    return -1;
+}
+
+int SvcPollerAdd(SvcPoller *p, SvcSocket s, int events, void *tag)
+{
+    if (p->n && SvcPollerFind(p, s) >= 0) {
+        errno = EEXIST;
+        return 0;
+    }
+    if (p->n == p->size) {
+        int size = p->size ? 2 * p->size : 16;
+        struct pollfd *fds = (struct pollfd *)realloc(p->fds,
+                size * sizeof(struct pollfd));
+        void **tags;
+        if (fds)
+            p->fds = fds;
+        tags = fds ? (void **)realloc(p->tags, size * sizeof(void *)) : NULL;
+        if (!tags) {
+            errno = ENOMEM;
+            return 0;
+        }
+        p->tags = tags;
+        p->size = size;
+    }
+    p->fds[p->n].fd = s;
+    p->fds[p->n].revents = 0;
+    p->n++;
+    return SvcPollerModify(p, s, events, tag);
+}
+
+int SvcPollerModify(SvcPoller *p, SvcSocket s, int events, void *tag)
+{
+    int i = s == p->wake[0] ? 0 : SvcPollerFind(p, s);
+
+    if (i < 0) {
+        errno = ENOENT;
+        return 0;
+    }
+    p->fds[i].events = ((events & SVC_POLL_IN) ? POLLIN : 0)
+            | ((events & SVC_POLL_OUT) ? POLLOUT : 0);
+    p->tags[i] = tag;
+    return 1;
+}
+
+void SvcPollerRemove(SvcPoller *p, SvcSocket s)
+{
+    int i = SvcPollerFind(p, s);
+
+    if (i < 0)
+        return;
+    p->n--;
+    p->fds[i] = p->fds[p->n];
+    p->tags[i] = p->tags[p->n];
+}
+
+int SvcPollerWait(SvcPoller *p, SvcPollEvent *ev, int max, DWORD ms)
+{
+    char buf[64];
+    int i, n, k = 0;
+
+    n = poll(p->fds, (nfds_t)p->n,
+            ms == SVC_INFINITE ? -1 : ms > INT_MAX ? INT_MAX : (int)ms);
+    if (n < 0)
+        return errno == EINTR ? 0 : -1;
+    if (p->fds[0].revents)
+        while (read(p->wake[0], buf, sizeof(buf)) > 0)
+            ;
+    for (i = 1; i < p->n && k < max; ++i) {
+        short r = p->fds[i].revents;
+        if (!r)
+            continue;
+        ev[k].tag = p->tags[i];
+        ev[k].events = ((r & POLLIN) ? SVC_POLL_IN : 0)
+                | ((r & POLLOUT) ? SVC_POLL_OUT : 0)
+                | ((r & (POLLERR | POLLHUP | POLLNVAL)) ? SVC_POLL_ERR : 0);
+        ++k;
+    }
+    return k;
+}
+
+void SvcPollerWake(SvcPoller *p)
+{
+    ssize_t rc = write(p->wake[1], "", 1);
+    (void)rc;
+}
+
+#endif /* __linux__ */
+
+#endif /* !_WIN32 */
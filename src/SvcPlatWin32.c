@@ -0,0 +1,1307 @@
+/*! \file SvcPlatWin32.c
+ *  \brief Operating system services for Windows.
+ *
+ * Implements the functions declared in SvcPlatform.h with the Win32
+ * API. See SvcPlatPosix.c for the other side.
+ */
+#ifdef _WIN32
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#include <process.h>
+
+#include "SvcPlatform.h"
+
+/** A thread started by SvcThreadStart(). */
+struct SvcThread {
+    HANDLE h;
+    SvcThreadFunc fn;
+    void *arg;
+};
+
+/** An open folder listing. */
+struct SvcDir {
+    HANDLE h;
+    int first;              /**< fd holds an entry not yet returned. */
+    WIN32_FIND_DATAA fd;
+};
+
+void SvcMutexInit(SvcMutex *m)
+{
+    InitializeSRWLock(m);
+}
+
+void SvcMutexDestroy(SvcMutex *m)
+{
+    (void)m;
+}
+
+void SvcMutexLock(SvcMutex *m)
+{
+    AcquireSRWLockExclusive(m);
+}
+
+void SvcMutexUnlock(SvcMutex *m)
+{
+    ReleaseSRWLockExclusive(m);
+}
+
+void SvcCondInit(SvcCond *c)
+{
+    InitializeConditionVariable(c);
+}
+
+void SvcCondDestroy(SvcCond *c)
+{
+    (void)c;
+}
+
+/** Wait for a condition with its lock held, for at most \a ms ms.
+ *
+ * \returns Non-zero if woken, zero on timeout.
+ */
+int SvcCondWait(SvcCond *c, SvcMutex *m, DWORD ms)
+{
+    return SleepConditionVariableSRW(c, m, ms, 0);
+}
+
+void SvcCondSignal(SvcCond *c)
+{
+    WakeConditionVariable(c);
+}
+
+void SvcCondBroadcast(SvcCond *c)
+{
+    WakeAllConditionVariable(c);
+}
+
+/** Add to a shared counter atomically.
+ *
+ * \returns The new value.
+ */
+long SvcAtomicAdd(volatile long *p, long delta)
+{
+    return InterlockedExchangeAdd(p, delta) + delta;
+}
+
+/** Add to a 32 bit counter atomically, such as one in shared memory
+ * that processes of either word size use.
+ *
+ * \returns The new value.
+ */
+DWORD SvcAtomicAdd32(volatile DWORD *p, DWORD delta)
+{
+    return (DWORD)InterlockedExchangeAdd((volatile LONG *)p, (LONG)delta)
+            + delta;
+}
+
+/** Exchange a shared value atomically.
+ *
+ * \returns The old value.
+ */
+DWORD SvcAtomicSwap(volatile DWORD *p, DWORD value)
+{
+    return (DWORD)InterlockedExchange((volatile LONG *)p, (LONG)value);
+}
+
+/** Set a shared value to \a value if it is \a old, atomically.
+ *
+ * \returns The old value, which is \a old if it was set.
+ */
+DWORD SvcAtomicCompareSwap(volatile DWORD *p, DWORD old, DWORD value)
+{
+    return (DWORD)InterlockedCompareExchange((volatile LONG *)p,
+            (LONG)value, (LONG)old);
+}
+
+/** Keep the compiler and the processor from moving memory accesses
+ * across this point. */
+void SvcMemoryBarrier(void)
+{
+    MemoryBarrier();
+}
+
+/** Common entry point of threads, which gets the CRT initialized. */
+static unsigned __stdcall SvcThreadMain(void *arg)
+{
+    SvcThread *t = (SvcThread *)arg;
+    return t->fn(t->arg);
+}
+
+/** Start a thread.
+ *
+ * \returns The thread, which must eventually be waited for with
+ * SvcThreadWait(), or NULL on failure.
+ */
+SvcThread *SvcThreadStart(SvcThreadFunc fn, void *arg)
+{
+    SvcThread *t = (SvcThread *)malloc(sizeof(SvcThread));
+    if (!t) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+    t->fn = fn;
+    t->arg = arg;
+    t->h = (HANDLE)_beginthreadex(NULL, 0, SvcThreadMain, t, 0, NULL);
+    if (!t->h) {
+        free(t);
+        return NULL;
+    }
+    return t;
+}
+
+/** Wait at most \a ms ms for a thread to finish.
+ *
+ * \returns Non-zero if the thread has finished, in which case \a t
+ * has been released and must not be used again.
+ */
+int SvcThreadWait(SvcThread *t, DWORD ms)
+{
+    if (WaitForSingleObject(t->h, ms) != WAIT_OBJECT_0)
+        return 0;
+    CloseHandle(t->h);
+    free(t);
+    return 1;
+}
+
+/** End the calling thread without ending the process. */
+void SvcThreadExit(unsigned code)
+{
+    ExitThread(code);
+}
+
+DWORD SvcThreadId(void)
+{
+    return GetCurrentThreadId();
+}
+
+DWORD SvcProcessId(void)
+{
+    return GetCurrentProcessId();
+}
+
+/** Tell whether process \a pid is still running. A process that may
+ * not be opened counts as running. */
+int SvcProcessAlive(DWORD pid)
+{
+    HANDLE h = OpenProcess(SYNCHRONIZE, FALSE, pid);
+    DWORD status;
+
+    if (!h)
+        return GetLastError() == ERROR_ACCESS_DENIED;
+    status = WaitForSingleObject(h, 0);
+    CloseHandle(h);
+    return status == WAIT_TIMEOUT;
+}
+
+/** End the process at once, without atexit handlers, DLL detaching or
+ * flushing stdio, any of which may wait for a thread that is stuck. */
+void SvcProcessExit(int code)
+{
+    TerminateProcess(GetCurrentProcess(), (UINT)code);
+}
+
+/** Get a millisecond counter, which wraps after about 49 days. */
+DWORD SvcTicks(void)
+{
+    return GetTickCount();
+}
+
+/** Get a microsecond counter, for measuring short intervals. */
+SvcU64 SvcMicros(void)
+{
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+    if (!freq.QuadPart)
+        QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (SvcU64)(now.QuadPart / freq.QuadPart) * 1000000
+            + (SvcU64)(now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+}
+
+void SvcSleep(DWORD ms)
+{
+    Sleep(ms);
+}
+
+/** Open a file.
+ *
+ * \param path The file name.
+ * \param mode SVC_FILE_xxx flags.
+ * \returns The file, or SVC_BADFILE on failure.
+ */
+SvcFile SvcFileOpen(const char *path, int mode)
+{
+    DWORD access = GENERIC_READ;
+    DWORD share = FILE_SHARE_READ;
+    DWORD disp = OPEN_EXISTING;
+
+    if (mode & SVC_FILE_WRITE)
+        access |= GENERIC_WRITE;
+    else
+        share |= FILE_SHARE_WRITE;
+    if (mode & SVC_FILE_CREATE)
+        disp = (mode & SVC_FILE_TRUNC) ? CREATE_ALWAYS : OPEN_ALWAYS;
+    else if (mode & SVC_FILE_TRUNC)
+        disp = TRUNCATE_EXISTING;
+    return CreateFileA(path, access, share, NULL, disp,
+            FILE_ATTRIBUTE_NORMAL, NULL);
+}
+
+void SvcFileClose(SvcFile f)
+{
+    CloseHandle(f);
+}
+
+/** Read from an absolute offset.
+ *
+ * \returns The number of bytes read, which is less than \a n only at
+ * the end of the file, or -1 on failure.
+ */
+long SvcFileRead(SvcFile f, SvcU64 off, void *p, size_t n)
+{
+    OVERLAPPED ov;
+    DWORD got = 0;
+    memset(&ov, 0, sizeof(ov));
+    ov.Offset = (DWORD)off;
+    ov.OffsetHigh = (DWORD)(off >> 32);
+    if (!ReadFile(f, p, (DWORD)n, &got, &ov))
+        return GetLastError() == ERROR_HANDLE_EOF ? 0 : -1;
+    return (long)got;
+}
+
+/** Write all of \a n bytes at an absolute offset. */
+int SvcFileWrite(SvcFile f, SvcU64 off, const void *p, size_t n)
+{
+    OVERLAPPED ov;
+    DWORD put = 0;
+    memset(&ov, 0, sizeof(ov));
+    ov.Offset = (DWORD)off;
+    ov.OffsetHigh = (DWORD)(off >> 32);
+    return WriteFile(f, p, (DWORD)n, &put, &ov) && put == n;
+}
+
+int SvcFileSize(SvcFile f, SvcU64 *size)
+{
+    LARGE_INTEGER li;
+    if (!GetFileSizeEx(f, &li))
+        return 0;
+    *size = (SvcU64)li.QuadPart;
+    return 1;
+}
+
+int SvcFileTruncate(SvcFile f, SvcU64 size)
+{
+    LARGE_INTEGER li;
+    li.QuadPart = (LONGLONG)size;
+    return SetFilePointerEx(f, li, NULL, FILE_BEGIN) && SetEndOfFile(f);
+}
+
+/** Make everything written to a file durable. */
+int SvcFileSync(SvcFile f)
+{
+    return FlushFileBuffers(f);
+}
+
+/** Map the first \a len bytes of a file into memory.
+ *
+ * A writable mapping extends the file to \a len bytes if needed.
+ */
+int SvcFileMap(SvcFile f, SvcU64 len, int writable, SvcMap *m)
+{
+    m->section = CreateFileMappingA(f, NULL,
+            writable ? PAGE_READWRITE : PAGE_READONLY,
+            (DWORD)(len >> 32), (DWORD)len, NULL);
+    if (!m->section)
+        return 0;
+    m->base = MapViewOfFile(m->section,
+            writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, (SIZE_T)len);
+    if (!m->base) {
+        DWORD err = GetLastError();
+        CloseHandle(m->section);
+        SetLastError(err);
+        return 0;
+    }
+    m->len = (size_t)len;
+    return 1;
+}
+
+/** Write the changed pages of a mapping back to the file. */
+int SvcFileMapSync(SvcMap *m)
+{
+    return FlushViewOfFile(m->base, 0);
+}
+
+void SvcFileUnmap(SvcMap *m)
+{
+    UnmapViewOfFile(m->base);
+    CloseHandle(m->section);
+    m->base = NULL;
+}
+
+/** Map \a len bytes of named shared memory, visible to other processes.
+ *
+ * The name is looked up in the Global namespace, so that a monitor in
+ * another session finds the memory of a service. Creating memory there
+ * takes SeCreateGlobalPrivilege, which services have, so a process
+ * without it, such as a service run in a console, falls back to the
+ * Local namespace of its session. Without SVC_FILE_CREATE the mapping
+ * fails if the memory does not exist. The memory lasts while any
+ * process has it mapped. Unmap it with SvcFileUnmap().
+ *
+ * \param name The name, without a namespace prefix.
+ * \param len The length to map.
+ * \param mode SVC_FILE_READ, SVC_FILE_WRITE, or SVC_FILE_WRITE with
+ * SVC_FILE_CREATE.
+ * \param m Receives the mapping.
+ */
+int SvcShmMap(const char *name, size_t len, int mode, SvcMap *m)
+{
+    static const char *const spaces[] = { "Global\\", "Local\\" };
+    int writable = (mode & SVC_FILE_WRITE) != 0;
+    char path[MAX_PATH];
+    int i;
+
+    if (strlen(name) + 8 >= sizeof(path)) {
+        SetLastError(ERROR_FILENAME_EXCED_RANGE);
+        return 0;
+    }
+    for (i = 0; i < 2; ++i) {
+        strcpy(path, spaces[i]);
+        strcat(path, name);
+        m->section = (mode & SVC_FILE_CREATE)
+                ? CreateFileMappingA(INVALID_HANDLE_VALUE, NULL,
+                        PAGE_READWRITE, 0, (DWORD)len, path)
+                : OpenFileMappingA(writable ? FILE_MAP_WRITE : FILE_MAP_READ,
+                        FALSE, path);
+        if (m->section)
+            break;
+    }
+    if (!m->section)
+        return 0;
+    m->base = MapViewOfFile(m->section,
+            writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, len);
+    if (!m->base) {
+        DWORD err = GetLastError();
+        CloseHandle(m->section);
+        SetLastError(err);
+        return 0;
+    }
+    m->len = len;
+    return 1;
+}
+
+/** Prepare a wake-up that processes sharing memory signal each other
+ * with.
+ *
+ * Each signal counts in \a word, which lives in the shared memory, and
+ * sets an auto-reset event named for the memory, in the namespace
+ * SvcShmMap() would find it in. Every process opening the event with
+ * the same name shares it.
+ *
+ * \param e Receives the event.
+ * \param name Name of the shared memory, without a namespace prefix.
+ * \param word The count of signals, 4 byte aligned in the shared memory.
+ */
+int SvcShmEventOpen(SvcShmEvent *e, const char *name, volatile DWORD *word)
+{
+    static const char *const spaces[] = { "Global\\", "Local\\" };
+    char path[MAX_PATH];
+    int i;
+
+    if (strlen(name) + 16 >= sizeof(path)) {
+        SetLastError(ERROR_FILENAME_EXCED_RANGE);
+        return 0;
+    }
+    e->word = word;
+    for (i = 0; i < 2; ++i) {
+        strcpy(path, spaces[i]);
+        strcat(path, name);
+        strcat(path, "-wake");
+        e->event = CreateEventA(NULL, FALSE, FALSE, path);
+        if (e->event)
+            return 1;
+    }
+    return 0;
+}
+
+void SvcShmEventClose(SvcShmEvent *e)
+{
+    if (e->event)
+        CloseHandle(e->event);
+    e->event = NULL;
+    e->word = NULL;
+}
+
+/** Wait at most \a ms ms for a signal after the count was \a seen.
+ *
+ * Returns at once if the count has already moved on from \a seen, so
+ * that a signal given between reading the count and waiting is not
+ * lost. May also return early for no reason.
+ *
+ * \returns Non-zero if the count moved on.
+ */
+int SvcShmEventWait(SvcShmEvent *e, DWORD seen, DWORD ms)
+{
+    if (*e->word == seen)
+        WaitForSingleObject(e->event, ms);
+    return *e->word != seen;
+}
+
+/** Signal the event, waking a process waiting for it. */
+void SvcShmEventSignal(SvcShmEvent *e)
+{
+    InterlockedIncrement((volatile LONG *)e->word);
+    SetEvent(e->event);
+}
+
+/** Get the size and time of a file.
+ *
+ * Times on every platform count 100 ns intervals since 1601, the
+ * scale of a Win32 FILETIME.
+ *
+ * \returns Non-zero if the file exists.
+ */
+int SvcFileStat(const char *path, SvcU64 *size, SvcU64 *mtime, int *isdir)
+{
+    WIN32_FILE_ATTRIBUTE_DATA fa;
+    if (!GetFileAttributesExA(path, GetFileExInfoStandard, &fa))
+        return 0;
+    if (size)
+        *size = ((SvcU64)fa.nFileSizeHigh << 32) | fa.nFileSizeLow;
+    if (mtime)
+        *mtime = ((SvcU64)fa.ftLastWriteTime.dwHighDateTime << 32)
+                | fa.ftLastWriteTime.dwLowDateTime;
+    if (isdir)
+        *isdir = (fa.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+    return 1;
+}
+
+/** Rename \a from to \a to, replacing it, in a single durable step. */
+int SvcFileReplace(const char *from, const char *to)
+{
+    return MoveFileExA(from, to,
+            MOVEFILE_REPLACE_EXISTING|MOVEFILE_WRITE_THROUGH);
+}
+
+int SvcFileDelete(const char *path)
+{
+    return DeleteFileA(path);
+}
+
+/** Create a folder.
+ *
+ * \returns Non-zero if the folder was created or already exists.
+ */
+int SvcDirCreate(const char *path)
+{
+    DWORD attr;
+
+    if (CreateDirectoryA(path, NULL))
+        return 1;
+    attr = GetFileAttributesA(path);
+    return attr != INVALID_FILE_ATTRIBUTES
+            && (attr & FILE_ATTRIBUTE_DIRECTORY) != 0;
+}
+
+/** Start listing the files of a folder.
+ *
+ * \returns The listing, or NULL on failure.
+ */
+SvcDir *SvcDirOpen(const char *path)
+{
+    size_t len = strlen(path);
+    char *pattern = (char *)malloc(len + 3);
+    SvcDir *d = (SvcDir *)malloc(sizeof(SvcDir));
+
+    if (!pattern || !d) {
+        free(pattern);
+        free(d);
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+    memcpy(pattern, path, len);
+    strcpy(pattern + len, "\\*");
+    d->h = FindFirstFileA(pattern, &d->fd);
+    free(pattern);
+    if (d->h == INVALID_HANDLE_VALUE) {
+        if (GetLastError() != ERROR_FILE_NOT_FOUND) {
+            free(d);
+            return NULL;
+        }
+        d->first = 0;
+    } else
+        d->first = 1;
+    return d;
+}
+
+/** Get the next entry of a listing, skipping "." and "..".
+ *
+ * \returns Zero at the end of the listing.
+ */
+int SvcDirNext(SvcDir *d, SvcDirEntry *e)
+{
+    for (;;) {
+        if (d->h == INVALID_HANDLE_VALUE)
+            return 0;
+        if (!d->first && !FindNextFileA(d->h, &d->fd))
+            return 0;
+        d->first = 0;
+        if (strcmp(d->fd.cFileName, ".") && strcmp(d->fd.cFileName, ".."))
+            break;
+    }
+    e->name = d->fd.cFileName;
+    e->size = ((SvcU64)d->fd.nFileSizeHigh << 32) | d->fd.nFileSizeLow;
+    e->mtime = ((SvcU64)d->fd.ftLastWriteTime.dwHighDateTime << 32)
+            | d->fd.ftLastWriteTime.dwLowDateTime;
+    e->isdir = (d->fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+    return 1;
+}
+
+void SvcDirClose(SvcDir *d)
+{
+    if (d->h != INVALID_HANDLE_VALUE)
+        FindClose(d->h);
+    free(d);
+}
+
+DWORD SvcLastError(void)
+{
+    return GetLastError();
+}
+
+/** Get full path and file name of the executable.
+ *
+ * \returns A string from malloc(), or NULL.
+ */
+char *SvcExePath(void)
+{
+    size_t pathSize = MAX_PATH + 2;
+    char *szPath = 0;
+    int i;
+
+    /* limit number attempts to ~10M */
+    for(i = 1; i < 10; ++i){
+        DWORD size;
+
+#ifdef USE_ONLY_MALLOC
+        if (szPath) {
+            free(szPath);
+        }
+        szPath = (char *)malloc(pathSize);
+#else
+        szPath = (char *)realloc((void*)szPath, pathSize);
+#endif
+
+        if (!szPath) {
+            return 0;
+        }
+
+        size = GetModuleFileNameA(GetModuleHandle(NULL), szPath, pathSize - 1);
+
+        /*Check either we get some error*/
+        if (size == 0) {
+            free(szPath);
+            return 0;
+        }
+
+        /*we can be sure that path fit to buffer*/
+        if (size < pathSize - 1) {
+            /*GetModuleFileName may not add EOL*/
+            szPath[pathSize - 1] = 0;
+            return szPath;
+        }
+
+        /*buffer may be too small or path equal to pathSize*/
+        pathSize *= 1.5;
+    }
+
+    return 0;
+}
+
+/** Make a path absolute with respect to the current directory.
+ *
+ * \returns A string from malloc(), or NULL.
+ */
+char *SvcFullPath(const char *path)
+{
+    DWORD n = GetFullPathNameA(path, 0, NULL, NULL);
+    char *buf;
+    if (!n || !(buf = (char *)malloc(n)))
+        return NULL;
+    GetFullPathNameA(path, n, buf, NULL);
+    return buf;
+}
+
+/** Get the current directory.
+ *
+ * \returns A string from malloc(), or NULL.
+ */
+char *SvcGetCwd(void)
+{
+    DWORD len = GetCurrentDirectoryA(0, NULL);
+    char *buf;
+    if (!len || !(buf = (char *)malloc(len + 1)))
+        return NULL;
+    GetCurrentDirectoryA(len + 1, buf);
+    return buf;
+}
+
+int SvcSetCwd(const char *path)
+{
+    return SetCurrentDirectoryA(path);
+}
+
+int SvcSetEnv(const char *name, const char *value)
+{
+    return _putenv_s(name, value) == 0;
+}
+
+/** Set once trace output goes to stdout instead of the debugger. */
+static int SvcUseStdout;
+
+/** Send trace output to stdout from now on.
+ *
+ * Used by <tt>LuaService run</tt>, which runs the service in a console.
+ */
+void SvcDebugToConsole(void)
+{
+    SvcUseStdout = 1;
+}
+
+/** Send a line of trace output to the debugger, or to stdout.
+ *
+ * On stdout, a line that does not end in a newline gets one, since
+ * the output of service.print() does not.
+ */
+void SvcDebugOutput(const char *s)
+{
+    size_t len;
+
+    if (!SvcUseStdout) {
+        OutputDebugStringA(s);
+        return;
+    }
+    len = strlen(s);
+    fputs(s, stdout);
+    if (!len || s[len - 1] != '\n')
+        fputc('\n', stdout);
+    fflush(stdout);
+}
+
+/** Report service state to a supervisor other than the SCM.
+ *
+ * Windows reports to the SCM through SetServiceStatus() instead, so
+ * there is nothing to do here.
+ */
+int SvcNotify(const char *state)
+{
+    (void)state;
+    return 0;
+}
+
+void SvcWatchdogPing(void)
+{
+}
+
+/** A named pipe waiting for clients. */
+struct SvcListener {
+    char path[MAX_PATH];    /**< The full name of the pipe. */
+    HANDLE next;            /**< The instance for the next client. */
+};
+
+/** Get the full name of the pipe named \a name.
+ *
+ * \returns Non-zero if the name fits.
+ */
+static int SvcPipePath(const char *name, char *path)
+{
+    const char *prefix = strncmp(name, "\\\\", 2) == 0 ? "" : "\\\\.\\pipe\\";
+
+    if (strlen(prefix) + strlen(name) >= MAX_PATH) {
+        SetLastError(ERROR_FILENAME_EXCED_RANGE);
+        return 0;
+    }
+    strcpy(path, prefix);
+    strcat(path, name);
+    return 1;
+}
+
+/** Create an instance of a pipe for SvcListenAccept(). It is opened
+ * for overlapped I/O, so that SvcPipeRead() can give up waiting. */
+static HANDLE SvcPipeInstance(const char *path, int first)
+{
+    return CreateNamedPipeA(path, PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED
+            | (first ? FILE_FLAG_FIRST_PIPE_INSTANCE : 0),
+            PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT
+            | PIPE_REJECT_REMOTE_CLIENTS, PIPE_UNLIMITED_INSTANCES,
+            4096, 4096, 0, NULL);
+}
+
+/** Listen for local connections on the named pipe \a name.
+ *
+ * A name that does not start with two backslashes is put in the usual
+ * <tt>\\\\.\\pipe\\</tt> folder. The pipe may not already exist, and has the
+ * default security of a pipe, which gives clients other than the
+ * administrators and the owner read access only.
+ *
+ * \returns The listener, or NULL.
+ */
+SvcListener *SvcListen(const char *name)
+{
+    SvcListener *l = (SvcListener *)malloc(sizeof(SvcListener));
+
+    if (!l) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+    if (!SvcPipePath(name, l->path)
+            || (l->next = SvcPipeInstance(l->path, 1))
+                    == INVALID_HANDLE_VALUE) {
+        DWORD err = GetLastError();
+        free(l);
+        SetLastError(err);
+        return NULL;
+    }
+    return l;
+}
+
+/** Prepare \a ov for overlapped I/O on a connection.
+ *
+ * \returns Non-zero on success.
+ */
+static int SvcPipeStart(OVERLAPPED *ov)
+{
+    memset(ov, 0, sizeof(*ov));
+    ov->hEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+    return ov->hEvent != NULL;
+}
+
+/** Finish overlapped I/O on connection \a f, waiting at most \a ms ms
+ * and cancelling it if it takes longer.
+ *
+ * A connection opened by SvcConnect() is not overlapped, and its I/O
+ * has finished by the time this is called.
+ *
+ * \param ok What the call that started it returned.
+ * \param done Receives the bytes transferred.
+ * \returns Non-zero on success. On timeout, GetLastError() is
+ * ERROR_TIMEOUT.
+ */
+static int SvcPipeFinish(HANDLE f, OVERLAPPED *ov, BOOL ok, DWORD ms,
+        DWORD *done)
+{
+    int result;
+
+    *done = 0;
+    if (!ok && GetLastError() != ERROR_IO_PENDING)
+        result = 0;
+    else if (!ok && WaitForSingleObject(ov->hEvent, ms) != WAIT_OBJECT_0) {
+        CancelIo(f);
+        result = GetOverlappedResult(f, ov, done, TRUE);
+        if (!result && GetLastError() == ERROR_OPERATION_ABORTED)
+            SetLastError(ERROR_TIMEOUT);
+    } else
+        result = GetOverlappedResult(f, ov, done, FALSE);
+    if (ov->hEvent) {
+        DWORD err = GetLastError();
+        CloseHandle(ov->hEvent);
+        SetLastError(err);
+    }
+    return result;
+}
+
+/** Wait for the next connection to a listener.
+ *
+ * \returns The connection, or SVC_BADFILE.
+ */
+SvcFile SvcListenAccept(SvcListener *l)
+{
+    HANDLE h = l->next;
+    OVERLAPPED ov;
+    DWORD done, err;
+
+    l->next = INVALID_HANDLE_VALUE;
+    if (h == INVALID_HANDLE_VALUE)
+        h = SvcPipeInstance(l->path, 0);
+    if (h == INVALID_HANDLE_VALUE)
+        return SVC_BADFILE;
+    if (SvcPipeStart(&ov)) {
+        if (ConnectNamedPipe(h, &ov) || GetLastError() == ERROR_PIPE_CONNECTED) {
+            CloseHandle(ov.hEvent);
+            return h;
+        }
+        if (SvcPipeFinish(h, &ov, FALSE, INFINITE, &done))
+            return h;
+    }
+    err = GetLastError();
+    CloseHandle(h);
+    SetLastError(err);
+    return SVC_BADFILE;
+}
+
+/** Stop listening. */
+void SvcListenClose(SvcListener *l)
+{
+    if (!l)
+        return;
+    if (l->next != INVALID_HANDLE_VALUE)
+        CloseHandle(l->next);
+    free(l);
+}
+
+/** Connect to the named pipe \a name, waiting a while if it is busy.
+ *
+ * \returns The connection, or SVC_BADFILE.
+ */
+SvcFile SvcConnect(const char *name)
+{
+    char path[MAX_PATH];
+    HANDLE h;
+
+    if (!SvcPipePath(name, path))
+        return SVC_BADFILE;
+    for (;;) {
+        h = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+                OPEN_EXISTING, 0, NULL);
+        if (h != INVALID_HANDLE_VALUE || GetLastError() != ERROR_PIPE_BUSY
+                || !WaitNamedPipeA(path, 2000))
+            return h;
+    }
+}
+
+/** Read what has arrived on a connection, at most \a n bytes, waiting
+ * at most \a ms ms for something to arrive.
+ *
+ * \returns The number of bytes read, 0 once the other end has closed
+ * it, or -1 on error or timeout.
+ */
+long SvcPipeRead(SvcFile f, void *p, size_t n, DWORD ms)
+{
+    OVERLAPPED ov;
+    DWORD got;
+
+    if (!SvcPipeStart(&ov))
+        return -1;
+    if (!SvcPipeFinish(f, &ov, ReadFile(f, p, (DWORD)n, NULL, &ov), ms,
+            &got))
+        return GetLastError() == ERROR_BROKEN_PIPE ? 0 : -1;
+    return (long)got;
+}
+
+/** Write all of \a n bytes to a connection, waiting at most \a ms ms
+ * each time the other end has to read before more fits.
+ *
+ * \returns Non-zero on success.
+ */
+int SvcPipeWrite(SvcFile f, const void *p, size_t n, DWORD ms)
+{
+    const char *cp = (const char *)p;
+    OVERLAPPED ov;
+    DWORD put;
+
+    while (n > 0) {
+        if (!SvcPipeStart(&ov))
+            return 0;
+        if (!SvcPipeFinish(f, &ov, WriteFile(f, cp, (DWORD)n, NULL, &ov),
+                ms, &put))
+            return 0;
+        cp += put;
+        n -= put;
+    }
+    return 1;
+}
+
+/** Close a connection. What was written to it and is still unread
+ * stays for the other end to read, since the pipe is not disconnected
+ * first, and a client that never reads cannot hold this end up. */
+void SvcPipeClose(SvcFile f)
+{
+    CloseHandle(f);
+}
+
+/** Guards SvcWinsockReady. */
+static SRWLOCK SvcWinsockLock = SRWLOCK_INIT;
+
+/** Set once Winsock has been started. */
+static int SvcWinsockReady;
+
+/** Start Winsock for the process the first time it is needed. It is
+ * never cleaned up, which ending the process does.
+ *
+ * \returns Non-zero if it is started.
+ */
+static int SvcWinsockStart(void)
+{
+    WSADATA wd;
+    int rc = 0;
+
+    AcquireSRWLockExclusive(&SvcWinsockLock);
+    if (!SvcWinsockReady) {
+        rc = WSAStartup(MAKEWORD(2, 2), &wd);
+        SvcWinsockReady = rc == 0;
+    }
+    ReleaseSRWLockExclusive(&SvcWinsockLock);
+    if (rc)
+        SetLastError((DWORD)rc);
+    return SvcWinsockReady;
+}
+
+/** Keep a socket from blocking, and from being inherited. */
+static void SvcSocketSetup(SOCKET s)
+{
+    u_long on = 1;
+    ioctlsocket(s, FIONBIO, &on);
+    SetHandleInformation((HANDLE)s, HANDLE_FLAG_INHERIT, 0);
+}
+
+/** Resolve \a host and \a port for a TCP socket.
+ *
+ * \param host A name or address, or "*" or "" for any address.
+ * \returns The addresses, to free with freeaddrinfo(), or NULL.
+ */
+static struct addrinfo *SvcResolve(const char *host, const char *port,
+        int passive)
+{
+    struct addrinfo hints, *ai = NULL;
+    int rc;
+
+    if (!SvcWinsockStart())
+        return NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    if (!*host || strcmp(host, "*") == 0)
+        host = NULL;
+    rc = getaddrinfo(host, port, &hints, &ai);
+    if (rc != 0) {
+        SetLastError((DWORD)rc);
+        return NULL;
+    }
+    return ai;
+}
+
+/** Open a TCP socket on the first of \a ai that takes it.
+ *
+ * The socket does not block. A listening socket is bound exclusively,
+ * since Winsock lets SO_REUSEADDR steal a port in use.
+ *
+ * \param listening Non-zero to bind and listen, zero to connect.
+ */
+static SvcSocket SvcTcpOpen(struct addrinfo *ai, int listening)
+{
+    static const BOOL on = TRUE;
+    SOCKET s = INVALID_SOCKET;
+    DWORD err = WSAEADDRNOTAVAIL;
+
+    for (; ai; ai = ai->ai_next) {
+        s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (s == INVALID_SOCKET) {
+            err = WSAGetLastError();
+            continue;
+        }
+        SvcSocketSetup(s);
+        if (listening) {
+            setsockopt(s, SOL_SOCKET, SO_EXCLUSIVEADDRUSE,
+                    (const char *)&on, sizeof(on));
+            if (bind(s, ai->ai_addr, (int)ai->ai_addrlen) == 0
+                    && listen(s, SOMAXCONN) == 0)
+                return s;
+        } else {
+            setsockopt(s, IPPROTO_TCP, TCP_NODELAY,
+                    (const char *)&on, sizeof(on));
+            if (connect(s, ai->ai_addr, (int)ai->ai_addrlen) == 0
+                    || WSAGetLastError() == WSAEWOULDBLOCK)
+                return s;
+        }
+        err = WSAGetLastError();
+        closesocket(s);
+        s = INVALID_SOCKET;
+    }
+    SetLastError(err);
+    return s;
+}
+
+/** Listen for TCP connections on \a port of \a host.
+ *
+ * \param host A name or address, or "*" or "" for any address.
+ * \param port A port number or service name.
+ * \returns The listening socket, which does not block, or SVC_BADSOCKET.
+ */
+SvcSocket SvcTcpListen(const char *host, const char *port)
+{
+    struct addrinfo *ai = SvcResolve(host, port, 1);
+    SvcSocket s;
+
+    if (!ai)
+        return SVC_BADSOCKET;
+    s = SvcTcpOpen(ai, 1);
+    freeaddrinfo(ai);
+    return s;
+}
+
+/** Start connecting to \a port of \a host.
+ *
+ * The socket does not block, and becomes writable once connected, or
+ * reports an error if the connection failed.
+ *
+ * \returns The socket, or SVC_BADSOCKET.
+ */
+SvcSocket SvcTcpConnect(const char *host, const char *port)
+{
+    struct addrinfo *ai = SvcResolve(host, port, 0);
+    SvcSocket s;
+
+    if (!ai)
+        return SVC_BADSOCKET;
+    s = SvcTcpOpen(ai, 0);
+    freeaddrinfo(ai);
+    return s;
+}
+
+/** Accept a connection waiting on a listening socket.
+ *
+ * \param l The listening socket.
+ * \param peer Receives the address of the other end as host:port, or
+ * an empty string.
+ * \param size Size of \a peer, at least 64 bytes.
+ * \returns The connection, which does not block, or SVC_BADSOCKET if
+ * none is waiting (see SvcSocketWouldBlock()) or on error.
+ */
+SvcSocket SvcTcpAccept(SvcSocket l, char *peer, size_t size)
+{
+    static const BOOL on = TRUE;
+    struct sockaddr_storage sa;
+    int salen = sizeof(sa);
+    char host[NI_MAXHOST], port[NI_MAXSERV];
+    SOCKET s;
+
+    *peer = '\0';
+    s = accept(l, (struct sockaddr *)&sa, &salen);
+    if (s == INVALID_SOCKET)
+        return SVC_BADSOCKET;
+    SvcSocketSetup(s);
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char *)&on, sizeof(on));
+    if (getnameinfo((struct sockaddr *)&sa, salen, host, sizeof(host),
+            port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+        _snprintf(peer, size - 1, "%s:%s", host, port);
+    peer[size - 1] = '\0';
+    return s;
+}
+
+/** Read what has arrived on a socket, at most \a n bytes.
+ *
+ * \returns The number of bytes read, 0 once the other end has closed
+ * it, or -1 on error or if nothing has arrived (see
+ * SvcSocketWouldBlock()).
+ */
+long SvcSocketRecv(SvcSocket s, void *p, size_t n)
+{
+    return recv(s, (char *)p, n > INT_MAX ? INT_MAX : (int)n, 0);
+}
+
+/** Write what fits of \a n bytes to a socket.
+ *
+ * \returns The number of bytes written, or -1 on error or if none fit
+ * (see SvcSocketWouldBlock()).
+ */
+long SvcSocketSend(SvcSocket s, const void *p, size_t n)
+{
+    return send(s, (const char *)p, n > INT_MAX ? INT_MAX : (int)n, 0);
+}
+
+/** Tell whether the last socket call failed only because it would
+ * have had to wait. */
+int SvcSocketWouldBlock(void)
+{
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+}
+
+void SvcSocketClose(SvcSocket s)
+{
+    closesocket(s);
+}
+
+/** A set of sockets waited on together, for WSAPoll(). The first entry
+ * is a UDP socket connected to itself, which SvcPollerWake() sends a
+ * byte to, since WSAPoll() waits for nothing but sockets. */
+struct SvcPoller {
+    WSAPOLLFD *fds;         /**< The sockets. */
+    void **tags;            /**< Their tags. */
+    int n;                  /**< Sockets in the set. */
+    int size;               /**< Room in fds and tags. */
+    SOCKET wake;            /**< The UDP socket. */
+};
+
+/** Open an empty set of sockets to wait on.
+ *
+ * \returns The set, or NULL.
+ */
+SvcPoller *SvcPollerOpen(void)
+{
+    SvcPoller *p;
+    struct sockaddr_in sa;
+    int salen = sizeof(sa);
+
+    if (!SvcWinsockStart())
+        return NULL;
+    p = (SvcPoller *)calloc(1, sizeof(SvcPoller));
+    if (!p) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    p->wake = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (p->wake == INVALID_SOCKET
+            || bind(p->wake, (struct sockaddr *)&sa, sizeof(sa)) != 0
+            || getsockname(p->wake, (struct sockaddr *)&sa, &salen) != 0
+            || connect(p->wake, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+        DWORD err = WSAGetLastError();
+        SvcPollerClose(p);
+        SetLastError(err);
+        return NULL;
+    }
+    SvcSocketSetup(p->wake);
+    if (!SvcPollerAdd(p, p->wake, SVC_POLL_IN, NULL)) {
+        SvcPollerClose(p);
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+    return p;
+}
+
+void SvcPollerClose(SvcPoller *p)
+{
+    if (!p)
+        return;
+    if (p->wake != INVALID_SOCKET)
+        closesocket(p->wake);
+    free(p->fds);
+    free(p->tags);
+    free(p);
+}
+
+/** Find a socket in the set.
+ *
+ * \returns Its index, or -1.
+ */
+static int SvcPollerFind(SvcPoller *p, SvcSocket s)
+{
+    int i;
+    for (i = 0; i < p->n; ++i)
+        if (p->fds[i].fd == s)
+            return i;
+    return -1;
+}
+
+/** Add a socket to the set.
+ *
+ * \param events SVC_POLL_IN and SVC_POLL_OUT flags to wait for.
+ * \param tag Returned with the events of the socket.
+ */
+int SvcPollerAdd(SvcPoller *p, SvcSocket s, int events, void *tag)
+{
+    if (SvcPollerFind(p, s) >= 0) {
+        SetLastError(ERROR_ALREADY_EXISTS);
+        return 0;
+    }
+    if (p->n == p->size) {
+        int size = p->size ? 2 * p->size : 16;
+        WSAPOLLFD *fds = (WSAPOLLFD *)realloc(p->fds,
+                size * sizeof(WSAPOLLFD));
+        void **tags;
+        if (fds)
+            p->fds = fds;
+        tags = fds ? (void **)realloc(p->tags, size * sizeof(void *)) : NULL;
+        if (!tags) {
+            SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+            return 0;
+        }
+        p->tags = tags;
+        p->size = size;
+    }
+    p->fds[p->n].fd = s;
+    p->fds[p->n].revents = 0;
+    p->n++;
+    return SvcPollerModify(p, s, events, tag);
+}
+
+/** Change the events waited for on a socket in the set. */
+int SvcPollerModify(SvcPoller *p, SvcSocket s, int events, void *tag)
+{
+    int i = SvcPollerFind(p, s);
+
+    if (i < 0) {
+        SetLastError(ERROR_NOT_FOUND);
+        return 0;
+    }
+    p->fds[i].events = (SHORT)(((events & SVC_POLL_IN) ? POLLRDNORM : 0)
+            | ((events & SVC_POLL_OUT) ? POLLWRNORM : 0));
+    p->tags[i] = tag;
+    return 1;
+}
+
+/** Take a socket out of the set, before it is closed. */
+void SvcPollerRemove(SvcPoller *p, SvcSocket s)
+{
+    int i = SvcPollerFind(p, s);
+
+    if (i <= 0)
+        return;
+    p->n--;
+    p->fds[i] = p->fds[p->n];
+    p->tags[i] = p->tags[p->n];
+}
+
+/** Wait at most \a ms ms for sockets in the set to be ready, or for
+ * SvcPollerWake().
+ *
+ * \param ev Receives the ready sockets.
+ * \param max Size of \a ev, at most SVC_POLL_MAX.
+ * \returns The count of ready sockets, which is zero after a wake or
+ * the timeout, or -1 on error.
+ */
+int SvcPollerWait(SvcPoller *p, SvcPollEvent *ev, int max, DWORD ms)
+{
+    char buf[64];
+    int i, n, k = 0;
+
+    n = WSAPoll(p->fds, (ULONG)p->n,
+            ms == SVC_INFINITE ? -1 : ms > INT_MAX ? INT_MAX : (INT)ms);
+    if (n == SOCKET_ERROR)
+        return -1;
+    if (p->fds[0].revents)
+        while (recv(p->wake, buf, sizeof(buf), 0) > 0)
+            ;
+    for (i = 1; i < p->n && k < max; ++i) {
+        SHORT r = p->fds[i].revents;
+        if (!r)
+            continue;
+        ev[k].tag = p->tags[i];
+        ev[k].events = ((r & POLLRDNORM) ? SVC_POLL_IN : 0)
+                | ((r & POLLWRNORM) ? SVC_POLL_OUT : 0)
+                | ((r & (POLLERR | POLLHUP | POLLNVAL)) ? SVC_POLL_ERR : 0);
+        ++k;
+    }
+    return k;
+}
+
+/** Wake the thread waiting in SvcPollerWait().
+ *
+ * \context
+ * Any thread
+ */
+void SvcPollerWake(SvcPoller *p)
+{
+    send(p->wake, "", 1, 0);
+}
+
+#endif /* _WIN32 */
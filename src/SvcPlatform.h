@@ -0,0 +1,242 @@
+/*!
+ * \file SvcPlatform.h
+ * \brief Operating system services used by the Lua host.
+ *
+ * The service backends (SvcWin32.c and SvcController.c for the
+ * Windows SCM, SvcPosix.c for everything else) are written directly
+ * against their own operating system. The Lua host in LuaMain.c, the
+ * portable startup in LuaService.c and the modules of the service
+ * table use the operating system only through the types and functions
+ * declared here, which are implemented in SvcPlatWin32.c and
+ * SvcPlatPosix.c.
+ *
+ * Functions that return an int report success as non-zero. After a
+ * failure, SvcLastError() returns the system error code, which is a
+ * Win32 error on Windows and an errno value elsewhere.
+ */
+#ifndef SVCPLATFORM_H_
+#define SVCPLATFORM_H_
+
+#include <stddef.h>
+
+#ifdef _WIN32
+
+#include <windows.h>
+
+/** An unsigned 64 bit integer. */
+typedef unsigned __int64 SvcU64;
+/** A lock, which may be statically initialized with SVC_MUTEX_INIT. */
+typedef SRWLOCK SvcMutex;
+/** A condition variable used with a SvcMutex. */
+typedef CONDITION_VARIABLE SvcCond;
+/** An open file. */
+typedef HANDLE SvcFile;
+/** A socket, the SOCKET of Winsock, which SvcPlatform.h does not include. */
+typedef UINT_PTR SvcSocket;
+
+#define SVC_MUTEX_INIT      SRWLOCK_INIT
+#define SVC_BADFILE         INVALID_HANDLE_VALUE
+#define SVC_BADSOCKET       (~(SvcSocket)0)
+#define SVC_INFINITE        INFINITE
+#define SVC_ENOMEM          ERROR_NOT_ENOUGH_MEMORY
+#define SVC_DIRSEP          '\\'
+#define SVC_PATHLISTSEP     ";"
+#define SvcPathCompare      _stricmp
+#define SvcPathIsAbsolute(p) ((p)[0] == '\\' || (p)[0] == '/' \
+                             || ((p)[0] && (p)[1] == ':'))
+
+#else /* !_WIN32 */
+
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+
+typedef uint64_t SvcU64;
+typedef pthread_mutex_t SvcMutex;
+typedef pthread_cond_t SvcCond;
+typedef int SvcFile;
+typedef int SvcSocket;
+
+#define SVC_MUTEX_INIT      PTHREAD_MUTEX_INITIALIZER
+#define SVC_BADFILE         (-1)
+#define SVC_BADSOCKET       (-1)
+#define SVC_INFINITE        0xFFFFFFFFu
+#define SVC_ENOMEM          ENOMEM
+#define SVC_DIRSEP          '/'
+#define SVC_PATHLISTSEP     ":"
+#define SvcPathCompare      strcmp
+#define SvcPathIsAbsolute(p) ((p)[0] == '/')
+
+/* The few Win32 names used by the portable parts of LuaService. */
+typedef uint32_t DWORD;
+typedef long LONG;
+typedef int BOOL;
+typedef const char *LPCSTR;
+#ifndef TRUE
+#  define TRUE 1
+#  define FALSE 0
+#endif
+#define NO_ERROR 0
+#ifdef PATH_MAX
+#  define MAX_PATH PATH_MAX
+#else
+#  define MAX_PATH 4096
+#endif
+
+#endif /* _WIN32 */
+
+/** Modes for SvcFileOpen(), combined with |. */
+#define SVC_FILE_READ   0x00 /**< Open an existing file for reading. */
+#define SVC_FILE_WRITE  0x01 /**< Also allow writing. */
+#define SVC_FILE_CREATE 0x02 /**< Create the file if it does not exist. */
+#define SVC_FILE_TRUNC  0x04 /**< Discard any existing content. */
+
+/** Readiness of a socket for SvcPollerAdd(), combined with |. */
+#define SVC_POLL_IN     0x01 /**< Readable, or a connection to accept. */
+#define SVC_POLL_OUT    0x02 /**< Writable, or connected. */
+#define SVC_POLL_ERR    0x04 /**< Failed or hung up; only reported. */
+
+/** Most events SvcPollerWait() returns at once. */
+#define SVC_POLL_MAX    64
+
+/** A socket found ready by SvcPollerWait(). */
+typedef struct SvcPollEvent {
+    void *tag;              /**< The tag it was added with. */
+    int events;             /**< SVC_POLL_xxx flags. */
+} SvcPollEvent;
+
+/** A mapping of a file into memory. */
+typedef struct SvcMap {
+    void *base;             /**< First mapped byte. */
+    size_t len;             /**< Mapped length. */
+#ifdef _WIN32
+    HANDLE section;         /**< The file mapping object. */
+#endif
+} SvcMap;
+
+/** An entry returned by SvcDirNext(). */
+typedef struct SvcDirEntry {
+    const char *name;       /**< Name, valid until the next call. */
+    SvcU64 size;            /**< Size in bytes. */
+    SvcU64 mtime;           /**< Last write time, see SvcFileStat(). */
+    int isdir;              /**< Non-zero for a sub-folder. */
+} SvcDirEntry;
+
+/** An open folder listing. */
+typedef struct SvcDir SvcDir;
+
+/** A thread started by SvcThreadStart(). */
+typedef struct SvcThread SvcThread;
+
+/** A local endpoint from SvcListen(). */
+typedef struct SvcListener SvcListener;
+
+/** A set of sockets waited on together, see SvcPollerOpen(). */
+typedef struct SvcPoller SvcPoller;
+
+/** A wake-up shared between processes, see SvcShmEventOpen(). */
+typedef struct SvcShmEvent {
+    volatile DWORD *word;   /**< Count of signals, in shared memory. */
+#ifdef _WIN32
+    HANDLE event;           /**< Named event set by each signal. */
+#endif
+} SvcShmEvent;
+
+/** The body of a thread. */
+typedef unsigned (*SvcThreadFunc)(void *arg);
+
+// Locks and conditions
+extern void SvcMutexInit(SvcMutex *m);
+extern void SvcMutexDestroy(SvcMutex *m);
+extern void SvcMutexLock(SvcMutex *m);
+extern void SvcMutexUnlock(SvcMutex *m);
+extern void SvcCondInit(SvcCond *c);
+extern void SvcCondDestroy(SvcCond *c);
+extern int SvcCondWait(SvcCond *c, SvcMutex *m, DWORD ms);
+extern void SvcCondSignal(SvcCond *c);
+extern void SvcCondBroadcast(SvcCond *c);
+extern long SvcAtomicAdd(volatile long *p, long delta);
+extern DWORD SvcAtomicAdd32(volatile DWORD *p, DWORD delta);
+extern DWORD SvcAtomicSwap(volatile DWORD *p, DWORD value);
+extern DWORD SvcAtomicCompareSwap(volatile DWORD *p, DWORD old, DWORD value);
+extern void SvcMemoryBarrier(void);
+
+// Threads and time
+extern SvcThread *SvcThreadStart(SvcThreadFunc fn, void *arg);
+extern int SvcThreadWait(SvcThread *t, DWORD ms);
+extern void SvcThreadExit(unsigned code);
+extern DWORD SvcThreadId(void);
+extern DWORD SvcProcessId(void);
+extern int SvcProcessAlive(DWORD pid);
+extern void SvcProcessExit(int code);
+extern DWORD SvcTicks(void);
+extern SvcU64 SvcMicros(void);
+extern void SvcSleep(DWORD ms);
+
+// Files
+extern SvcFile SvcFileOpen(const char *path, int mode);
+extern void SvcFileClose(SvcFile f);
+extern long SvcFileRead(SvcFile f, SvcU64 off, void *p, size_t n);
+extern int SvcFileWrite(SvcFile f, SvcU64 off, const void *p, size_t n);
+extern int SvcFileSize(SvcFile f, SvcU64 *size);
+extern int SvcFileTruncate(SvcFile f, SvcU64 size);
+extern int SvcFileSync(SvcFile f);
+extern int SvcFileMap(SvcFile f, SvcU64 len, int writable, SvcMap *m);
+extern int SvcFileMapSync(SvcMap *m);
+extern void SvcFileUnmap(SvcMap *m);
+extern int SvcShmMap(const char *name, size_t len, int mode, SvcMap *m);
+extern int SvcShmEventOpen(SvcShmEvent *e, const char *name, volatile DWORD *word);
+extern void SvcShmEventClose(SvcShmEvent *e);
+extern int SvcShmEventWait(SvcShmEvent *e, DWORD seen, DWORD ms);
+extern void SvcShmEventSignal(SvcShmEvent *e);
+extern int SvcFileStat(const char *path, SvcU64 *size, SvcU64 *mtime, int *isdir);
+extern int SvcFileReplace(const char *from, const char *to);
+extern int SvcFileDelete(const char *path);
+extern int SvcDirCreate(const char *path);
+extern SvcDir *SvcDirOpen(const char *path);
+extern int SvcDirNext(SvcDir *d, SvcDirEntry *e);
+extern void SvcDirClose(SvcDir *d);
+extern DWORD SvcLastError(void);
+
+// Process
+extern char *SvcExePath(void);
+extern char *SvcFullPath(const char *path);
+extern char *SvcGetCwd(void);
+extern int SvcSetCwd(const char *path);
+extern int SvcSetEnv(const char *name, const char *value);
+extern void SvcDebugOutput(const char *s);
+extern void SvcDebugToConsole(void);
+extern int SvcNotify(const char *state);
+extern void SvcWatchdogPing(void);
+
+// Local connections
+extern SvcListener *SvcListen(const char *name);
+extern SvcFile SvcListenAccept(SvcListener *l);
+extern void SvcListenClose(SvcListener *l);
+extern SvcFile SvcConnect(const char *name);
+extern long SvcPipeRead(SvcFile f, void *p, size_t n, DWORD ms);
+extern int SvcPipeWrite(SvcFile f, const void *p, size_t n, DWORD ms);
+extern void SvcPipeClose(SvcFile f);
+
+// Sockets and readiness
+extern SvcSocket SvcTcpListen(const char *host, const char *port);
+extern SvcSocket SvcTcpConnect(const char *host, const char *port);
+extern SvcSocket SvcTcpAccept(SvcSocket l, char *peer, size_t size);
+extern long SvcSocketRecv(SvcSocket s, void *p, size_t n);
+extern long SvcSocketSend(SvcSocket s, const void *p, size_t n);
+extern int SvcSocketWouldBlock(void);
+extern void SvcSocketClose(SvcSocket s);
+extern SvcPoller *SvcPollerOpen(void);
+extern void SvcPollerClose(SvcPoller *p);
+extern int SvcPollerAdd(SvcPoller *p, SvcSocket s, int events, void *tag);
+extern int SvcPollerModify(SvcPoller *p, SvcSocket s, int events, void *tag);
+extern void SvcPollerRemove(SvcPoller *p, SvcSocket s);
+extern int SvcPollerWait(SvcPoller *p, SvcPollEvent *ev, int max, DWORD ms);
+extern void SvcPollerWake(SvcPoller *p);
+
+#ifndef _WIN32
+extern void SvcPosixUseSyslog(const char *ident);
+#endif
+
+#endif /*SVCPLATFORM_H_*/
@@ -0,0 +1,593 @@
+/*! \file SvcPosix.c
+ *  \brief POSIX service backend.
+ *
+ * Runs the service as a daemon on systems without the Windows SCM.
+ * The service manager there is whatever started the process: an init
+ * system such as systemd, a supervisor, or a user at a terminal. It
+ * controls the service with signals instead of control requests:
+ *
+ * - SIGTERM or SIGINT -- stop, like SERVICE_CONTROL_STOP. The script
+ *   has <code>stop_timeout</code> ms to notice service.stopping() and
+ *   finish before the process exits anyway.
+ * - SIGHUP -- re-read init.lua, like SERVICE_CONTROL_PARAMCHANGE.
+ * - SIGUSR1 -- hot reload the service script, like
+ *   LUASERVICE_CONTROL_RELOAD.
+ * - SIGPROF -- start or stop the profiler and write the heap report
+ *   and timeline, like LUASERVICE_CONTROL_PROFILE.
+ * - SIGTSTP and SIGCONT -- pause and continue, like
+ *   SERVICE_CONTROL_PAUSE and SERVICE_CONTROL_CONTINUE. The process
+ *   itself is not stopped; the script takes them from
+ *   service.controls() and decides what pausing means.
+ * - SIGRTMIN with a value from sigqueue() -- the custom control of
+ *   that value, from 128 to 255.
+ *
+ * Every signal that is a control is also queued for the script, see
+ * LuaControls.c.
+ *
+ * If NOTIFY_SOCKET is set, readiness, reloading and stopping are
+ * reported to it with SvcNotify(), so a systemd unit may use
+ * <code>Type=notify</code>. While stopping, each second in which the
+ * script called service.progress() extends the unit's stop timeout
+ * to the time left of <code>stop_timeout</code>. With 
+ * <code>ready_timeout</code> set, the service is ready when the script
+ * calls service.ready(), and service.progress() before that extends
+ * the start timeout in the same way. A script not ready in time is
+ * stopped, and the process exits with an error.
+ *
+ * The command line is:
+ *
+ * - <code>LuaService</code> -- run the service in the foreground.
+ * - <code>LuaService -d</code> -- run the service as a background
+ *   daemon, tracing to syslog.
+ * - <code>LuaService run</code> -- run the service in the terminal with
+ *   trace output on stdout, see LuaServiceRunConsole().
+ * - <code>LuaService simulate</code> \a ms:control ... -- run the service
+ *   under a simulated service manager, see SvcSimulate.c.
+ * - <code>LuaService stop|reload|profile|pause|continue|status</code> --
+ *   control the running daemon through its <code>pidfile</code>.
+ * - <code>LuaService control</code> \a code -- send the daemon a custom
+ *   control.
+ */
+#ifndef _WIN32
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "luaservice.h"
+
+/** Time in ms between checks for progress while stopping. */
+#define SVC_STOP_SLICE 1000
+
+/** Queue control \a code for the script and wake it. */
+#define SvcControl(code) (LuaControlPush(code), LuaControlWake())
+
+/** Set by the worker if the service failed to initialize. */
+static volatile int ServiceInitFailed = 0;
+
+/** Body of the service worker thread.
+ *
+ * Loads and runs the service script, and tells the main thread when
+ * it is done by raising SIGUSR2.
+ *
+ * \context
+ * Service worker thread
+ */
+static unsigned SvcPosixWorker(void *arg)
+{
+    LUAHANDLE wk = NULL;
+    DWORD specificError = 0;
+    DWORD status;
+
+    (void)arg;
+    SvcDebugTrace("Entered SvcPosixWorker\n", 0);
+    status = LuaServiceInitialization(&wk, &specificError);
+    if (status != NO_ERROR) {
+        SvcDebugTrace("LuaServiceInitialization exitCode %u\n", status);
+        SvcDebugTrace("LuaServiceInitialization specificError %u\n",
+                specificError);
+        ServiceInitFailed = 1;
+    } else {
+        if (ServiceReadyTimeout <= 0)
+            LuaServiceReady();
+        SvcSupervise(wk);
+    }
+    if (!ServiceStopping)
+        SvcDebugTrace("Service main script exit. Stopping service... \n", 0);
+    kill(getpid(), SIGUSR2);
+    return 0;
+}
+
+/** Detach from the terminal and continue in the background.
+ *
+ * \returns Non-zero in the daemon, zero if it could not be started.
+ * The original process exits once the daemon has been forked.
+ */
+static int SvcDaemonize(void)
+{
+    pid_t pid;
+    int fd;
+
+    pid = fork();
+    if (pid < 0)
+        return 0;
+    if (pid > 0)
+        _exit(EXIT_SUCCESS);
+    setsid();
+    pid = fork();
+    if (pid < 0)
+        return 0;
+    if (pid > 0)
+        _exit(EXIT_SUCCESS);
+    fd = open("/dev/null", O_RDWR);
+    if (fd >= 0) {
+        dup2(fd, STDIN_FILENO);
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        if (fd > STDERR_FILENO)
+            close(fd);
+    }
+    SvcPosixUseSyslog(ServiceName);
+    return 1;
+}
+
+/** Read the process id of the running daemon from its pidfile.
+ *
+ * \returns The process id, or zero if there is none.
+ */
+static pid_t SvcReadPid(void)
+{
+    FILE *fp;
+    long pid = 0;
+
+    if (!ServicePidFile)
+        return 0;
+    fp = fopen(ServicePidFile, "r");
+    if (!fp)
+        return 0;
+    if (fscanf(fp, "%ld", &pid) != 1)
+        pid = 0;
+    fclose(fp);
+    return (pid_t)pid;
+}
+
+/** Write the process id to the pidfile, if one is configured. */
+static void SvcWritePid(void)
+{
+    FILE *fp;
+
+    if (!ServicePidFile)
+        return;
+    fp = fopen(ServicePidFile, "w");
+    if (!fp) {
+        SvcDebugTraceStr("Can't write pidfile %s\n", ServicePidFile);
+        return;
+    }
+    fprintf(fp, "%ld\n", (long)getpid());
+    fclose(fp);
+}
+
+/** Wait at most \a ms ms for one of the signals in \a set.
+ *
+ * \param set The signals to wait for.
+ * \param info Receives what sigtimedwait() tells of the signal.
+ * \param ms The longest time to wait.
+ * \returns The signal, or -1 if none arrived in time.
+ */
+static int SvcTimedWait(const sigset_t *set, siginfo_t *info, DWORD ms)
+{
+    struct timespec ts;
+
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (long)(ms % 1000) * 1000000L;
+    return sigtimedwait(set, info, &ts);
+}
+
+/** Run the service until it stops.
+ *
+ * The main thread starts the worker and then waits for signals, all
+ * of which are blocked in every thread so that only this wait sees
+ * them. If the script does not finish within the stop budget, the
+ * process ends with _exit() instead of returning.
+ *
+ * \context
+ * Service main thread
+ *
+ * \param daemonize Non-zero to run in the background.
+ * \returns The ANSI C process exit status.
+ */
+static int SvcPosixRun(int daemonize)
+{
+    sigset_t set;
+    siginfo_t info;
+    SvcThread *worker;
+    long seen = 0;
+    long started = 0;
+    char msg[64];
+    int sig;
+    int status;
+
+    if (daemonize && !SvcDaemonize()) {
+        fprintf(stderr, "Can't start daemon (%d)\n", errno);
+        return EXIT_FAILURE;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    sigemptyset(&set);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
+    sigaddset(&set, SIGPROF);
+    sigaddset(&set, SIGTSTP);
+    sigaddset(&set, SIGCONT);
+    sigaddset(&set, SIGRTMIN);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    SvcWritePid();
+
+    worker = SvcThreadStart(SvcPosixWorker, NULL);
+    if (!worker) {
+        SvcDebugTrace("Can't start worker thread (%d)\n", SvcLastError());
+        if (ServicePidFile)
+            unlink(ServicePidFile);
+        return EXIT_FAILURE;
+    }
+
+    for (;;) {
+        if (ServiceStopping) {
+            DWORD left = LuaServiceStopLeft();
+            sig = SvcTimedWait(&set, &info,
+                    left < SVC_STOP_SLICE ? left : SVC_STOP_SLICE);
+            if (sig < 0 && errno == EAGAIN) {
+                if (left == 0) {
+                    LuaServiceStopped(0);
+                    worker = NULL;
+                    break;
+                }
+                if (ServiceStopProgress != seen) {
+                    seen = ServiceStopProgress;
+                    sprintf(msg, "EXTEND_TIMEOUT_USEC=%lu000",
+                            (unsigned long)LuaServiceStopLeft());
+                    SvcNotify(msg);
+                }
+                continue;
+            }
+        } else if (!ServiceReady && ServiceReadyTimeout > 0) {
+            DWORD left = LuaServiceReadyLeft();
+            sig = SvcTimedWait(&set, &info,
+                    left < SVC_STOP_SLICE ? left : SVC_STOP_SLICE);
+            if (sig < 0 && errno == EAGAIN) {
+                if (ServiceReady)
+                    continue;
+                if (left == 0) {
+                    ServiceInitFailed = 1;
+                    SvcNotify("STOPPING=1");
+                    LuaServiceStartHung();
+                    continue;
+                }
+                if (ServiceStartProgress != started) {
+                    started = ServiceStartProgress;
+                    sprintf(msg, "EXTEND_TIMEOUT_USEC=%lu000",
+                            (unsigned long)(ServiceStartHint 
+                            ? ServiceStartHint : LuaServiceReadyLeft()));
+                    SvcNotify(msg);
+                }
+                continue;
+            }
+        } else
+            sig = sigwaitinfo(&set, &info);
+        if (sig == SIGUSR2)
+            break;
+        if (sig == SIGRTMIN) {
+            if (info.si_code == SI_QUEUE && info.si_value.sival_int >= 128
+                    && info.si_value.sival_int <= 255) {
+                SvcDebugTrace("Passing control %d to the service\n",
+                        (DWORD)info.si_value.sival_int);
+                SvcControl((DWORD)info.si_value.sival_int);
+            }
+            continue;
+        }
+        switch (sig) {
+        case SIGTERM:
+        case SIGINT:
+            if (!ServiceStopping) {
+                SvcDebugTrace("Telling service to stop\n", 0);
+                SvcNotify("STOPPING=1");
+                LuaServiceStop();
+                LuaControlWake();
+            }
+            break;
+
+        case SIGHUP:
+            SvcDebugTrace("Re-reading init.lua\n", 0);
+            SvcNotify("RELOADING=1");
+            LuaServiceReconfigure();
+            SvcControl(LUASERVICE_CONTROL_PARAMCHANGE);
+            break;
+
+        case SIGUSR1:
+            SvcDebugTrace("Telling service to reload its script\n", 0);
+            ServiceReloadPending = 1;
+            SvcControl(LUASERVICE_CONTROL_RELOAD);
+            break;
+
+        case SIGPROF:
+            SvcDebugTrace("Telling service to toggle its profiler\n", 0);
+            ServiceProfileToggle = 1;
+            ServiceHeapReportPending = 1;
+            LuaTimelineFlush();
+            SvcControl(LUASERVICE_CONTROL_PROFILE);
+            break;
+
+        case SIGTSTP:
+            if (!ServiceStopping) {
+                SvcDebugTrace("Telling service to pause\n", 0);
+                SvcControl(LUASERVICE_CONTROL_PAUSE);
+            }
+            break;
+
+        case SIGCONT:
+            if (!ServiceStopping) {
+                SvcDebugTrace("Telling service to continue\n", 0);
+                SvcControl(LUASERVICE_CONTROL_CONTINUE);
+            }
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    if (worker) {
+        SvcThreadWait(worker, SVC_INFINITE);
+        if (ServiceStopping)
+            LuaServiceStopped(1);
+    }
+    if (ServicePidFile)
+        unlink(ServicePidFile);
+    SvcDebugTrace("Leaving Service\n", 0);
+    status = ServiceStopping && !ServiceInitFailed ? EXIT_SUCCESS : EXIT_FAILURE;
+    if (!worker) {
+        /* the worker is still in Lua, so returning from main() would
+         * run atexit handlers and tear down stdio under it */
+        _exit(status);
+    }
+    return status;
+}
+
+/** Note that the script has asked for controls.
+ *
+ * Signals need no announcement, so there is nothing to do.
+ */
+static void SvcControlsOpened(void)
+{
+}
+
+/** Report the service ready to the service manager.
+ *
+ * \context
+ * Service worker thread
+ */
+static void SvcReportReady(void)
+{
+    SvcNotify("READY=1");
+}
+
+/** Report that the script has taken a pause or continue control.
+ *
+ * \context
+ * Service worker thread
+ *
+ * \param paused Non-zero for a pause, zero for a continue.
+ */
+static void SvcReportPaused(int paused)
+{
+    SvcDebugTrace(paused ? "Service paused\n" : "Service continued\n", 0);
+    SvcNotify(paused ? "STATUS=Paused" : "STATUS=Running");
+}
+
+/** Report that init.lua has been applied again after SIGHUP.
+ *
+ * \context
+ * Service main thread
+ */
+static void SvcReportReconfigured(void)
+{
+    if (ServiceReady)
+        SvcNotify("READY=1");
+}
+
+/** Report a status of SvcHandler.c.
+ *
+ * The daemon tells systemd how it is doing itself, from the signal
+ * thread, and so does not run SvcHandler.c, which only <tt>LuaService
+ * simulate</tt> does here with a service manager of its own. A status
+ * that gets here anyway is only traced.
+ *
+ * \param status The status.
+ */
+static void SvcReportStatus(const SvcStatus *status)
+{
+    SvcDebugTrace("Service status %u\n", status->state);
+}
+
+/** Whatever started the daemon, as the framework sees it. */
+static const SvcManagerOps PosixManager = {
+    "POSIX", SvcReportReady, SvcReportPaused, SvcControlsOpened,
+    SvcReportReconfigured, SvcReportStatus
+};
+
+/** The service manager the framework reports to. */
+const SvcManagerOps *SvcManager = &PosixManager;
+
+/** Signal handler for <tt>LuaService run</tt>.
+ *
+ * The handler is reset by the first signal, so a second Ctrl-C ends
+ * the process at once.
+ */
+static void SvcConsoleSignal(int sig)
+{
+    (void)sig;
+    LuaServiceStop();
+}
+
+/** Run the service in the terminal, see LuaServiceRunConsole(). */
+static int SvcPosixRunConsole(void)
+{
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SvcConsoleSignal;
+    sa.sa_flags = SA_RESETHAND;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    return LuaServiceRunConsole();
+}
+
+/** Show the command line usage. */
+static void SvcPosixUsage(void)
+{
+    printf("Usage: LuaService [-d | run | stop | reload | profile | pause\n"
+            "                  | continue | control <code> | status\n"
+            "                  | stat [name ...] | ctl <command> [arg ...]\n"
+            "                  | simulate [ms:control ...]]\n"
+            "  (no option)  Run the service in the foreground\n"
+            "  -d           Run the service as a daemon\n"
+            "  run          Run the service with trace output on stdout\n"
+            "  stop         Stop the running daemon\n"
+            "  reload       Reload the running daemon's script\n"
+            "  profile      Start or stop the running daemon's profiler\n"
+            "  pause        Ask the running daemon to pause\n"
+            "  continue     Ask the running daemon to continue\n"
+            "  control <code>  Send the running daemon custom control 128-255\n"
+            "  status       Report whether the daemon is running\n"
+            "  stat [name ...]  Show the status pages of services, by\n"
+            "               default this one, see LuaStatus.c\n"
+            "  ctl <command> [arg ...]  Send a command to the running\n"
+            "               daemon's control_socket, see LuaCommands.c\n"
+            "  simulate [ms:control ...]  Run the service under a simulated\n"
+            "               service manager, see SvcSimulate.c\n");
+}
+
+/** Entry point for service control.
+ *
+ * Called from main() for any command line that does not run the
+ * service. The running daemon is found through its pidfile, so the
+ * init.lua field <code>pidfile</code> must be set.
+ *
+ * \param argc Count of arguments in \a argv.
+ * \param argv Array of arguments.
+ * \return Exit status, as from main().
+ */
+int SvcControlMain(int argc, char *argv[])
+{
+    union sigval value;
+    pid_t pid;
+    int code = 0;
+    int sig;
+
+    if (argc >= 2 && strcmp(argv[1], "stat") == 0)
+        return LuaStatusShow(argc - 2, (const char **)argv + 2);
+    if (argc >= 3 && strcmp(argv[1], "ctl") == 0)
+        return LuaCommandClient(argc - 2, argv + 2);
+    if (argc == 3 && strcmp(argv[1], "control") == 0)
+        code = atoi(argv[2]);
+    if (argc == 3 ? code < 128 || code > 255
+            : argc != 2 || (strcmp(argv[1], "stop") && strcmp(argv[1], "-s")
+            && strcmp(argv[1], "reload") && strcmp(argv[1], "profile")
+            && strcmp(argv[1], "pause") && strcmp(argv[1], "continue")
+            && strcmp(argv[1], "status"))) {
+        SvcPosixUsage();
+        return EXIT_FAILURE;
+    }
+    if (!ServicePidFile) {
+        fprintf(stderr, "init.lua sets no pidfile for %s\n", ServiceName);
+        return EXIT_FAILURE;
+    }
+    pid = SvcReadPid();
+    if (!pid || kill(pid, 0) != 0) {
+        printf("%s is not running\n", ServiceName);
+        return strcmp(argv[1], "status") == 0 ? 3 : EXIT_FAILURE;
+    }
+    if (strcmp(argv[1], "status") == 0) {
+        printf("%s is running as process %ld\n", ServiceName, (long)pid);
+        return EXIT_SUCCESS;
+    }
+    if (code) {
+        value.sival_int = code;
+        if (sigqueue(pid, SIGRTMIN, value) != 0) {
+            fprintf(stderr, "Can't signal process %ld (%d)\n", (long)pid,
+                    errno);
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+    if (strcmp(argv[1], "reload") == 0)
+        sig = SIGUSR1;
+    else if (strcmp(argv[1], "profile") == 0)
+        sig = SIGPROF;
+    else if (strcmp(argv[1], "pause") == 0)
+        sig = SIGTSTP;
+    else if (strcmp(argv[1], "continue") == 0)
+        sig = SIGCONT;
+    else
+        sig = SIGTERM;
+    if (kill(pid, sig) != 0) {
+        fprintf(stderr, "Can't signal process %ld (%d)\n", (long)pid, errno);
+        return EXIT_FAILURE;
+    }
+    if (sig == SIGTERM) {
+        DWORD start = SvcTicks();
+        while (kill(pid, 0) == 0
+                && SvcTicks() - start < (DWORD)ServiceStopTimeout + 5000)
+            SvcSleep(100);
+        if (kill(pid, 0) == 0) {
+            fprintf(stderr, "%s did not stop\n", ServiceName);
+            return EXIT_FAILURE;
+        }
+        printf("%s stopped in %lu ms\n", ServiceName,
+                (unsigned long)(SvcTicks() - start));
+    }
+    return EXIT_SUCCESS;
+}
+
+#ifndef LUASERVICE_NO_MAIN
+/** Process entry point.
+ *
+ * Runs init.lua and then either runs the service or controls the one
+ * already running, depending on the command line.
+ *
+ * \param argc The count of arguments.
+ * \param argv The list of arguments.
+ * \returns The ANSI C process exit status.
+ *
+ * Left out of builds with LUASERVICE_NO_MAIN defined, such as
+ * LuaBench, which link the service runtime into another program.
+ */
+int main(int argc, char *argv[])
+{
+    SvcDebugTrace("Entered main\n", 0);
+    if (LuaServiceStartup(argc, argv) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+    SvcDebugTraceStr("Service name: %s\n", ServiceName);
+    if (argc == 1)
+        return SvcPosixRun(0);
+    if (argc == 2 && strcmp(argv[1], "-d") == 0)
+        return SvcPosixRun(1);
+    if (argc == 2 && strcmp(argv[1], "run") == 0)
+        return SvcPosixRunConsole();
+    if (argc >= 2 && strcmp(argv[1], "simulate") == 0)
+        return SvcSimulate(argc - 2, argv + 2);
+    return SvcControlMain(argc, argv);
+}
+#endif /* !LUASERVICE_NO_MAIN */
+
+#endif /* !_WIN32 */
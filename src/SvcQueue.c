@@ -0,0 +1,453 @@
+/*! \file SvcQueue.c
+ *  \brief Ring of records in shared memory, fed by other processes.
+ *
+ * See SvcQueue.h for the use. The shared memory holds a SqHeader and
+ * then the ring. Each record in the ring is an SQ_HDR byte header,
+ * whose first DWORD is the length, followed by the bytes of the record
+ * and padding to a multiple of SQ_HDR, so that every record starts 8
+ * byte aligned. A record that would run past the end of the ring is
+ * put at its start instead, after a header of SQ_PAD that tells the
+ * consumer to skip the rest.
+ *
+ * The head, where the consumer reads, and the tail, where producers
+ * write, count bytes since the ring was created and wrap around at
+ * 2^32, which the size of the ring, a power of two, divides. Only the
+ * consumer moves the head and only the producer holding the lock moves
+ * the tail, each after the bytes it is done with, so the ring needs no
+ * other lock. They sit on cache lines of their own, so that producer
+ * and consumer do not slow each other down.
+ *
+ * A consumer about to wait sets the waiting flag before it looks at
+ * the ring a last time, and a producer looks at the flag after moving
+ * the tail, so one of them always sees the other. Only when the flag
+ * is set does a producer signal the wake-up event, so a consumer that
+ * keeps up costs producers no system calls.
+ *
+ * With many producers, the lock holds the process id of the producer
+ * holding it. A producer that dies between SvcQueueReserve() and
+ * SvcQueueCommit() has not moved the tail, so what it wrote is not in
+ * the ring, and a producer waiting for the lock takes it over once it
+ * finds that process gone. A producer held up by a live one for longer
+ * than SQ_LOCK_WAIT refuses its record rather than wait on.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "SvcQueue.h"
+
+/** Signature of the shared memory of a queue. */
+#define SQ_MAGIC 0x5153534CUL /* "LSSQ" */
+
+/** Version of the layout of the shared memory. */
+#define SQ_VERSION 1
+
+/** Size of a record header, and the alignment of records. */
+#define SQ_HDR 8
+
+/** Length in a record header that skips to the start of the ring. */
+#define SQ_PAD 0xFFFFFFFFUL
+
+/** Time in ms a producer waits for the lock before it refuses the
+ * record. */
+#define SQ_LOCK_WAIT 1000
+
+/** Turns a producer waits for the lock between looks at whether its
+ * holder is still alive. */
+#define SQ_LOCK_CHECK 64
+
+/** Size of a cache line. */
+#define SQ_LINE 64
+
+/** Prefix of the name of the shared memory. */
+#define SQ_PREFIX "LuaService-q-"
+
+/** Bytes a record of \a len bytes takes in the ring. */
+#define SQ_RECORD(len) (((len) + 2 * SQ_HDR - 1) & ~(DWORD)(SQ_HDR - 1))
+
+/** Start of the shared memory of a queue, followed by the ring. */
+typedef struct SqHeader {
+    DWORD magic;                /**< SQ_MAGIC, once the rest is set. */
+    DWORD version;              /**< SQ_VERSION. */
+    DWORD size;                 /**< Bytes in the ring, a power of two. */
+    DWORD flags;                /**< SVC_QUEUE_xxx flags. */
+    volatile DWORD wake;        /**< Count of wake-up signals. */
+    volatile DWORD waiting;     /**< Set while the consumer waits. */
+    volatile DWORD lock;        /**< Process id of the producer
+                                 * writing, or zero. */
+    volatile DWORD dropped;     /**< Count of records refused. */
+    char line0[SQ_LINE - 8 * sizeof(DWORD)];
+    volatile DWORD head;        /**< Bytes read by the consumer. */
+    char line1[SQ_LINE - sizeof(DWORD)];
+    volatile DWORD tail;        /**< Bytes written by producers. */
+    char line2[SQ_LINE - sizeof(DWORD)];
+} SqHeader;
+
+/** An open queue. */
+struct SvcQueue {
+    SvcMap map;             /**< The shared memory. */
+    SqHeader *h;            /**< Its header. */
+    unsigned char *ring;    /**< Its ring. */
+    DWORD size;             /**< Bytes in the ring when it was opened. */
+    DWORD next;             /**< Producer: the tail after the reserved
+                             * record. Consumer: bytes the record
+                             * returned by SvcQueuePeek() takes. */
+    int reserved;           /**< Producer: a record is reserved. */
+    SvcShmEvent ev;         /**< Wakes the consumer. */
+};
+
+/** Get the name of the shared memory of queue \a name.
+ *
+ * \param buf Receives the name, MAX_PATH bytes.
+ * \returns Non-zero if it fits.
+ */
+static int SqName(const char *name, char *buf)
+{
+    if (strlen(name) + sizeof(SQ_PREFIX) + 16 > MAX_PATH)
+        return 0;
+    strcpy(buf, SQ_PREFIX);
+    strcat(buf, name);
+    return 1;
+}
+
+/** Map the header and ring of \a size bytes, and open the event.
+ *
+ * \returns The queue, or NULL on failure.
+ */
+static SvcQueue *SqMap(const char *shm, DWORD size, int mode)
+{
+    SvcQueue *q = (SvcQueue *)calloc(1, sizeof(SvcQueue));
+
+    if (!q)
+        return NULL;
+    if (!SvcShmMap(shm, sizeof(SqHeader) + size, mode, &q->map)) {
+        free(q);
+        return NULL;
+    }
+    q->h = (SqHeader *)q->map.base;
+    q->ring = (unsigned char *)q->map.base + sizeof(SqHeader);
+    q->size = size;
+    if (!SvcShmEventOpen(&q->ev, shm, &q->h->wake)) {
+        SvcFileUnmap(&q->map);
+        free(q);
+        return NULL;
+    }
+    return q;
+}
+
+/** Create a queue, as its consumer.
+ *
+ * A queue left by an earlier consumer with the same size and flags is
+ * taken over with the records still in it, so that a restarted script
+ * carries on where it stopped. Otherwise the queue starts empty, and
+ * producers that had the old one open are refused from then on.
+ *
+ * \param name The name producers open it by.
+ * \param size Bytes in the ring, a power of two from SVC_QUEUE_MIN to
+ * SVC_QUEUE_MAX. A record may take up to half of it.
+ * \param flags SVC_QUEUE_MULTI, or zero for a single producer.
+ * \returns The queue, or NULL on failure.
+ */
+SvcQueue *SvcQueueCreate(const char *name, DWORD size, int flags)
+{
+    char shm[MAX_PATH];
+    SvcQueue *q;
+    SqHeader *h;
+
+    if (size < SVC_QUEUE_MIN || size > SVC_QUEUE_MAX || (size & (size - 1))
+            || !SqName(name, shm))
+        return NULL;
+    q = SqMap(shm, size, SVC_FILE_WRITE | SVC_FILE_CREATE);
+    if (!q)
+        return NULL;
+    h = q->h;
+    if (h->magic == SQ_MAGIC && h->version == SQ_VERSION && h->size == size
+            && h->flags == (DWORD)flags && h->tail - h->head <= size
+            && (h->head & (SQ_HDR - 1)) == 0) {
+        DWORD owner = h->lock;
+
+        /* a live producer may be writing; only free a dead one's lock */
+        if (owner && !SvcProcessAlive(owner))
+            SvcAtomicCompareSwap(&h->lock, owner, 0);
+        return q;
+    }
+    h->magic = 0;
+    SvcMemoryBarrier();
+    h->version = SQ_VERSION;
+    h->size = size;
+    h->flags = (DWORD)flags;
+    h->waiting = 0;
+    h->lock = 0;
+    h->dropped = 0;
+    h->head = 0;
+    h->tail = 0;
+    SvcMemoryBarrier();
+    h->magic = SQ_MAGIC;
+    return q;
+}
+
+/** Open a queue created by a service, as a producer.
+ *
+ * \param name The name the service created it with.
+ * \returns The queue, or NULL if there is none.
+ */
+SvcQueue *SvcQueueOpen(const char *name)
+{
+    char shm[MAX_PATH];
+    SvcMap map;
+    SqHeader *h;
+    DWORD size;
+    SvcQueue *q;
+
+    if (!SqName(name, shm) || !SvcShmMap(shm, sizeof(SqHeader),
+            SVC_FILE_READ, &map))
+        return NULL;
+    h = (SqHeader *)map.base;
+    size = h->magic == SQ_MAGIC && h->version == SQ_VERSION ? h->size : 0;
+    SvcFileUnmap(&map);
+    if (size < SVC_QUEUE_MIN || size > SVC_QUEUE_MAX)
+        return NULL;
+    q = SqMap(shm, size, SVC_FILE_WRITE);
+    if (q && (q->h->magic != SQ_MAGIC || q->h->size != size)) {
+        SvcQueueClose(q);
+        return NULL;
+    }
+    return q;
+}
+
+/** Close a queue, of the consumer or of a producer.
+ *
+ * A producer must not close a queue with a record reserved.
+ */
+void SvcQueueClose(SvcQueue *q)
+{
+    if (!q)
+        return;
+    SvcShmEventClose(&q->ev);
+    SvcFileUnmap(&q->map);
+    free(q);
+}
+
+/** Take the lock of a queue with many producers, from a producer
+ * that died holding it if need be.
+ *
+ * \returns Non-zero if taken, zero if a live producer held it for
+ * longer than SQ_LOCK_WAIT.
+ */
+static int SqLock(SvcQueue *q)
+{
+    SqHeader *h = q->h;
+    DWORD me = SvcProcessId();
+    DWORD owner, start;
+    unsigned turns;
+
+    if (SvcAtomicCompareSwap(&h->lock, 0, me) == 0)
+        return 1;
+    start = SvcTicks();
+    for (turns = 1;; ++turns) {
+        SvcSleep(0);
+        owner = SvcAtomicCompareSwap(&h->lock, 0, me);
+        if (!owner)
+            return 1;
+        if (turns % SQ_LOCK_CHECK)
+            continue;
+        if (owner != me && !SvcProcessAlive(owner)
+                && SvcAtomicCompareSwap(&h->lock, owner, me) == owner)
+            return 1;
+        if (SvcTicks() - start > SQ_LOCK_WAIT)
+            return 0;
+    }
+}
+
+/** Release the lock of a queue with many producers. */
+static void SqUnlock(SvcQueue *q)
+{
+    if (q->h->flags & SVC_QUEUE_MULTI)
+        SvcAtomicSwap(&q->h->lock, 0);
+}
+
+/** Reserve room for a record of \a len bytes at the tail of the queue.
+ *
+ * The producer writes the record into the room returned and then calls
+ * SvcQueueCommit(), which passes it to the consumer. With many
+ * producers, the others wait from here until then, so the record
+ * should be ready to write.
+ *
+ * A record that does not fit is refused and counted as dropped, as is
+ * every record once the consumer has created the queue anew, and a
+ * record whose producer waited too long for the lock.
+ *
+ * \param q The queue, opened by SvcQueueOpen().
+ * \param len Bytes in the record, at most half the ring less SQ_HDR.
+ * \returns The room, 8 byte aligned, or NULL if the record was refused.
+ */
+void *SvcQueueReserve(SvcQueue *q, DWORD len)
+{
+    SqHeader *h = q->h;
+    DWORD need = SQ_RECORD(len);
+    DWORD tail, off, pad;
+
+    if (q->reserved || len > q->size / 2 - SQ_HDR)
+        return NULL;
+    if ((h->flags & SVC_QUEUE_MULTI) && !SqLock(q)) {
+        SvcAtomicAdd32(&h->dropped, 1);
+        return NULL;
+    }
+    if (h->magic != SQ_MAGIC || h->size != q->size) {
+        SqUnlock(q);
+        return NULL;
+    }
+    tail = h->tail;
+    off = tail & (q->size - 1);
+    pad = off + need > q->size ? q->size - off : 0;
+    SvcMemoryBarrier();
+    if (tail + pad + need - h->head > q->size) {
+        SvcAtomicAdd32(&h->dropped, 1);
+        SqUnlock(q);
+        return NULL;
+    }
+    if (pad) {
+        *(volatile DWORD *)(q->ring + off) = SQ_PAD;
+        off = 0;
+    }
+    *(volatile DWORD *)(q->ring + off) = len;
+    q->next = tail + pad + need;
+    q->reserved = 1;
+    return q->ring + off + SQ_HDR;
+}
+
+/** Pass the record reserved by SvcQueueReserve() to the consumer, and
+ * wake it if it waits.
+ */
+void SvcQueueCommit(SvcQueue *q)
+{
+    SqHeader *h = q->h;
+
+    if (!q->reserved)
+        return;
+    q->reserved = 0;
+    SvcMemoryBarrier();
+    h->tail = q->next;
+    SvcMemoryBarrier();
+    SqUnlock(q);
+    if (h->waiting)
+        SvcShmEventSignal(&q->ev);
+}
+
+/** Copy a record to the tail of the queue.
+ *
+ * \param q The queue, opened by SvcQueueOpen().
+ * \param p The record.
+ * \param len Bytes in the record.
+ * \returns Non-zero if it was queued, zero if it was refused.
+ */
+int SvcQueuePush(SvcQueue *q, const void *p, DWORD len)
+{
+    void *room = SvcQueueReserve(q, len);
+
+    if (!room)
+        return 0;
+    memcpy(room, p, len);
+    SvcQueueCommit(q);
+    return 1;
+}
+
+/** Get the record at the head of the queue, without taking it out.
+ *
+ * The record stays where it is in the shared memory until
+ * SvcQueuePop() takes it out.
+ *
+ * \param q The queue, created by SvcQueueCreate().
+ * \param len Receives the bytes in the record.
+ * \returns The record, 8 byte aligned, or NULL if the queue is empty.
+ */
+const void *SvcQueuePeek(SvcQueue *q, DWORD *len)
+{
+    SqHeader *h = q->h;
+    DWORD head = h->head;
+    DWORD off, n;
+
+    for (;;) {
+        if (head == h->tail)
+            return NULL;
+        SvcMemoryBarrier();
+        off = head & (q->size - 1);
+        n = *(volatile DWORD *)(q->ring + off);
+        if (n != SQ_PAD)
+            break;
+        head += q->size - off;
+        h->head = head;
+    }
+    if (n > q->size / 2 - SQ_HDR) {
+        /* Written by something that is not a producer; give up on it */
+        h->head = h->tail;
+        return NULL;
+    }
+    q->next = SQ_RECORD(n);
+    *len = n;
+    return q->ring + off + SQ_HDR;
+}
+
+/** Take the record returned by SvcQueuePeek() out of the queue, making
+ * its room free for producers.
+ */
+void SvcQueuePop(SvcQueue *q)
+{
+    if (!q->next)
+        return;
+    SvcMemoryBarrier();
+    q->h->head += q->next;
+    q->next = 0;
+}
+
+/** Get the count of wake-up signals, to pass to SvcQueueWait() after
+ * looking for other reasons not to wait.
+ */
+DWORD SvcQueueWakeCount(SvcQueue *q)
+{
+    return q->h->wake;
+}
+
+/** Wait at most \a ms ms for the queue to have a record.
+ *
+ * Also returns when SvcQueueWake() is called after the count of
+ * signals was \a seen, or at times for no reason.
+ *
+ * \param q The queue, created by SvcQueueCreate().
+ * \param seen The count from SvcQueueWakeCount().
+ * \param ms The longest wait.
+ * \returns Non-zero if the queue has a record.
+ */
+int SvcQueueWait(SvcQueue *q, DWORD seen, DWORD ms)
+{
+    SqHeader *h = q->h;
+
+    h->waiting = 1;
+    SvcMemoryBarrier();
+    if (h->head == h->tail)
+        SvcShmEventWait(&q->ev, seen, ms);
+    h->waiting = 0;
+    return h->head != h->tail;
+}
+
+/** Wake the consumer of a queue from SvcQueueWait().
+ *
+ * \context
+ * Any thread or process
+ */
+void SvcQueueWake(SvcQueue *q)
+{
+    SvcShmEventSignal(&q->ev);
+}
+
+/** Get the count of records refused since the queue was created. */
+DWORD SvcQueueDropped(SvcQueue *q)
+{
+    return q->h->dropped;
+}
+
+/** Get the bytes in the ring of a queue. */
+DWORD SvcQueueSize(SvcQueue *q)
+{
+    return q->size;
+}
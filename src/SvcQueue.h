@@ -0,0 +1,65 @@
+/*!
+ * \file SvcQueue.h
+ * \brief Ring of records in shared memory, fed by other processes.
+ *
+ * A queue is a ring buffer in named shared memory that producer
+ * processes write records into and a service script reads them from,
+ * with no copy and no system call per record. The service creates it
+ * with service.shmqueue() in LuaShmQueue.c; a producer links
+ * SvcQueue.c with SvcPlatform.h and the SvcPlat file of its system,
+ * and does no more than:
+ *
+ * \code
+ * SvcQueue *q = SvcQueueOpen("collector");
+ * if (!q || !SvcQueuePush(q, rec, len))
+ *     ... the service is not there, or not keeping up
+ * \endcode
+ *
+ * SvcQueueReserve() and SvcQueueCommit() build a record in place
+ * instead of copying it in.
+ *
+ * A queue has a single producer unless it was created for many, in
+ * which case producers take turns through a spin lock in the shared
+ * memory, which is freed if its holder dies. A producer never waits
+ * for room: a record that does not fit is refused, and SvcQueuePush()
+ * counts it as dropped.
+ *
+ * The layout of the shared memory is the same for 32 and 64 bit
+ * processes, so either may feed either.
+ */
+#ifndef SVCQUEUE_H_
+#define SVCQUEUE_H_
+
+#include "SvcPlatform.h"
+
+/** An open queue, of the consumer or of a producer. */
+typedef struct SvcQueue SvcQueue;
+
+/** Flag of SvcQueueCreate(): many producers may write at once. */
+#define SVC_QUEUE_MULTI 0x0001
+
+/** Smallest ring, in bytes. */
+#define SVC_QUEUE_MIN   4096
+
+/** Largest ring, in bytes. */
+#define SVC_QUEUE_MAX   0x40000000UL
+
+// Consumer
+extern SvcQueue *SvcQueueCreate(const char *name, DWORD size, int flags);
+extern const void *SvcQueuePeek(SvcQueue *q, DWORD *len);
+extern void SvcQueuePop(SvcQueue *q);
+extern DWORD SvcQueueWakeCount(SvcQueue *q);
+extern int SvcQueueWait(SvcQueue *q, DWORD seen, DWORD ms);
+extern void SvcQueueWake(SvcQueue *q);
+extern DWORD SvcQueueDropped(SvcQueue *q);
+extern DWORD SvcQueueSize(SvcQueue *q);
+
+// Producer
+extern SvcQueue *SvcQueueOpen(const char *name);
+extern void *SvcQueueReserve(SvcQueue *q, DWORD len);
+extern void SvcQueueCommit(SvcQueue *q);
+extern int SvcQueuePush(SvcQueue *q, const void *p, DWORD len);
+
+extern void SvcQueueClose(SvcQueue *q);
+
+#endif /*SVCQUEUE_H_*/
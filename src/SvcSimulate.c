@@ -0,0 +1,377 @@
+/*! \file SvcSimulate.c
+ *  \brief In-process simulation of the service manager.
+ *
+ * <tt>LuaService simulate</tt> runs the service script under a fake
+ * service manager inside the process, on any platform, instead of
+ * under the SCM or an init system. The fake plays the part of the SCM:
+ * it runs the service main function and the control handler of
+ * SvcHandler.c, which SvcWin32.c runs under the real SCM, delivers
+ * controls on a schedule given on the command line, and records every
+ * change of the status the service reports, with its time. So the
+ * lifecycle the backends share, from loading the script through
+ * service.ready(), service.controls() and the stop budget to
+ * service.on_stop(), can be run and timed the same way every time,
+ * also where there is no SCM.
+ *
+ * Each argument after <tt>simulate</tt> is one control, as \a ms
+ * <tt>:</tt> \a control, with \a ms the time since the start and the
+ * controls in time order:
+ *
+ * \code
+ * LuaService simulate 500:interrogate 1000:pause 1500:continue 2000:130 3000:stop
+ * \endcode
+ *
+ * A control is <tt>stop</tt>, <tt>pause</tt>, <tt>continue</tt>,
+ * <tt>interrogate</tt>, <tt>shutdown</tt>, <tt>paramchange</tt>,
+ * <tt>reload</tt>, <tt>profile</tt> or a custom code from 128 to 255.
+ * As the SCM would, the fake rejects controls other than stop,
+ * shutdown and interrogate while the service is starting, and pause
+ * and continue unless the script has asked for controls and the
+ * service is running or paused. A run always ends with a stop, sent
+ * right after the last control if the schedule has none.
+ *
+ * When the service has stopped, the recorded statuses and controls
+ * are printed, followed by the time from the start to RUNNING and
+ * from the stop to STOPPED. The exit status is an error unless the
+ * script started and then finished within <code>stop_timeout</code>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "luaservice.h"
+
+/** Longest schedule, and most events recorded. */
+#define SIM_MAXLOG 1024
+
+/** Longest time in ms between looks at the schedule while waiting. */
+#define SIM_SLICE 100
+
+/** Names of the service states, by LUASERVICE_STATE_ value. */
+static const char *const SimStates[] = {
+    "?", "STOPPED", "START_PENDING", "STOP_PENDING", "RUNNING",
+    "CONTINUE_PENDING", "PAUSE_PENDING", "PAUSED"
+};
+
+/** Names of the controls a schedule may give. */
+static const struct {
+    const char *name;       /**< Name on the command line. */
+    DWORD code;             /**< Its control code. */
+} SimControls[] = {
+    { "stop",           LUASERVICE_CONTROL_STOP },
+    { "pause",          LUASERVICE_CONTROL_PAUSE },
+    { "continue",       LUASERVICE_CONTROL_CONTINUE },
+    { "interrogate",    LUASERVICE_CONTROL_INTERROGATE },
+    { "shutdown",       LUASERVICE_CONTROL_SHUTDOWN },
+    { "paramchange",    LUASERVICE_CONTROL_PARAMCHANGE },
+    { "reload",         LUASERVICE_CONTROL_RELOAD },
+    { "profile",        LUASERVICE_CONTROL_PROFILE },
+    { NULL, 0 }
+};
+
+/** A control of the schedule. */
+typedef struct SimControl {
+    DWORD at;               /**< Time in ms since the start to send it. */
+    DWORD code;             /**< The control. */
+    const char *name;       /**< Its name, as given. */
+} SimControl;
+
+/** An event of the simulated run. */
+typedef struct SimEvent {
+    SvcU64 at;              /**< SvcMicros() when it happened. */
+    const char *kind;       /**< "status", "control", "answer",
+                                 "rejected" or "note". */
+    const char *name;       /**< The state, control or note. */
+    DWORD checkpoint;       /**< The checkpoint of a status. */
+    DWORD hint;             /**< The wait hint of a status. */
+} SimEvent;
+
+/** Guards the status and the log. */
+static SvcMutex SimLock = SVC_MUTEX_INIT;
+
+/** Signaled when the status changes. */
+static SvcCond SimWake;
+
+/** The recorded events. */
+static SimEvent SimLog[SIM_MAXLOG];
+
+/** Count of events in SimLog. */
+static int SimLogged;
+
+/** The status the service reports. */
+static DWORD SimState, SimCheckpoint, SimHint, SimExitCode;
+
+/** Non-zero once the service accepts pause and continue. */
+static int SimAcceptsPause;
+
+/** Get the state the service last reported, which the worker may be
+ * changing. */
+static DWORD SimGetState(void)
+{
+    DWORD state;
+
+    SvcMutexLock(&SimLock);
+    state = SimState;
+    SvcMutexUnlock(&SimLock);
+    return state;
+}
+
+/** Record an event. Called with SimLock held. */
+static void SimRecord(SvcU64 at, const char *kind, const char *name,
+        DWORD checkpoint, DWORD hint)
+{
+    SimEvent *e;
+
+    if (SimLogged == SIM_MAXLOG)
+        return;
+    e = &SimLog[SimLogged++];
+    e->at = at;
+    e->kind = kind;
+    e->name = name;
+    e->checkpoint = checkpoint;
+    e->hint = hint;
+}
+
+/** Take a status the service reports, recording it if it changed, see
+ * SvcManagerOps.
+ *
+ * \param status The status.
+ */
+static void SimSetStatus(const SvcStatus *status)
+{
+    SvcU64 now = SvcMicros();
+
+    SvcMutexLock(&SimLock);
+    if (status->acceptsPause && !SimAcceptsPause)
+        SimRecord(now, "note", "accepts pause and continue", 0, 0);
+    SimAcceptsPause = status->acceptsPause;
+    SimExitCode = status->exitCode;
+    if (status->state != SimState || status->checkpoint != SimCheckpoint
+            || status->hint != SimHint) {
+        SimState = status->state;
+        SimCheckpoint = status->checkpoint;
+        SimHint = status->hint;
+        SimRecord(now, "status", SimStates[SimState], SimCheckpoint, SimHint);
+        SvcDebugTraceStr("Simulated status %s\n", SimStates[SimState]);
+    }
+    SvcCondSignal(&SimWake);
+    SvcMutexUnlock(&SimLock);
+}
+
+/** The fake service manager. */
+static const SvcManagerOps SimManager = {
+    "simulator", SvcHandlerReady, SvcHandlerPaused, SvcHandlerControlsOpened,
+    SvcHandlerReconfigured, SimSetStatus
+};
+
+/** Body of the simulated service's worker thread, which runs the
+ * service main function as the SCM would. */
+static unsigned SimWorker(void *arg)
+{
+    (void)arg;
+    SvcServiceMain();
+    return 0;
+}
+
+/** Deliver a control to the simulated service, as the SCM would.
+ *
+ * A control the SCM would refuse in the current state is recorded as
+ * rejected, INTERROGATE is answered from the status the service last
+ * reported, and the rest go to SvcHandleControl().
+ *
+ * \param c The control.
+ */
+static void SimDeliver(const SimControl *c)
+{
+    const char *reject = NULL;
+    DWORD state;
+
+    SvcMutexLock(&SimLock);
+    SimRecord(SvcMicros(), "control", c->name, 0, 0);
+    state = SimState;
+    if (c->code == LUASERVICE_CONTROL_INTERROGATE)
+        SimRecord(SvcMicros(), "answer", SimStates[state], SimCheckpoint,
+                SimHint);
+    else if (c->code == LUASERVICE_CONTROL_STOP
+            || c->code == LUASERVICE_CONTROL_SHUTDOWN) {
+        if (ServiceStopping || state == LUASERVICE_STATE_STOPPED)
+            reject = "service is stopping";
+    } else if (state == LUASERVICE_STATE_START_PENDING 
+            || state == LUASERVICE_STATE_STOP_PENDING)
+        reject = "service cannot accept control";
+    else if (c->code == LUASERVICE_CONTROL_PAUSE
+            || c->code == LUASERVICE_CONTROL_CONTINUE) {
+        if (!SimAcceptsPause)
+            reject = "invalid service control";
+        else if (state != (c->code == LUASERVICE_CONTROL_PAUSE
+                ? LUASERVICE_STATE_RUNNING : LUASERVICE_STATE_PAUSED))
+            reject = "service cannot accept control";
+    }
+    if (reject)
+        SimRecord(SvcMicros(), "rejected", reject, 0, 0);
+    SvcMutexUnlock(&SimLock);
+    if (!reject)
+        SvcHandleControl(c->code);
+}
+
+/** Read the schedule from the command line.
+ *
+ * \param argc Count of controls in \a argv.
+ * \param argv The controls, as \a ms:\a control.
+ * \param sched Receives the schedule, room for SIM_MAXLOG controls.
+ * \returns The count of controls, or -1 after printing an error.
+ */
+static int SimParse(int argc, char *argv[], SimControl *sched)
+{
+    char *colon;
+    int i, j;
+
+    if (argc > SIM_MAXLOG) {
+        fprintf(stderr, "simulate: at most %d controls\n", SIM_MAXLOG);
+        return -1;
+    }
+    for (i = 0; i < argc; ++i) {
+        colon = strchr(argv[i], ':');
+        if (!colon || colon == argv[i]) {
+            fprintf(stderr, "simulate: %s is not ms:control\n", argv[i]);
+            return -1;
+        }
+        sched[i].at = (DWORD)strtoul(argv[i], NULL, 10);
+        sched[i].name = colon + 1;
+        sched[i].code = 0;
+        for (j = 0; SimControls[j].name; ++j)
+            if (strcmp(SimControls[j].name, colon + 1) == 0)
+                sched[i].code = SimControls[j].code;
+        if (!sched[i].code && atoi(colon + 1) >= 128
+                && atoi(colon + 1) <= 255)
+            sched[i].code = (DWORD)atoi(colon + 1);
+        if (!sched[i].code) {
+            fprintf(stderr, "simulate: unknown control %s\n", colon + 1);
+            return -1;
+        }
+        if (i > 0 && sched[i].at < sched[i - 1].at) {
+            fprintf(stderr, "simulate: %s is out of time order\n", argv[i]);
+            return -1;
+        }
+    }
+    return argc;
+}
+
+/** Print the recorded events and the start and stop latencies.
+ *
+ * \param start SvcMicros() at the start.
+ */
+static void SimReport(SvcU64 start)
+{
+    SvcU64 running = 0, stop = 0, stopped = 0;
+    SimEvent *e;
+    int i;
+
+    printf("%s: simulated run\n", ServiceName);
+    for (i = 0; i < SimLogged; ++i) {
+        e = &SimLog[i];
+        if (strcmp(e->kind, "status") == 0) {
+            printf("%12.3f ms  status    %-16s checkpoint %lu, "
+                    "wait hint %lu\n", (double)(e->at - start) / 1000.0,
+                    e->name, (unsigned long)e->checkpoint,
+                    (unsigned long)e->hint);
+            if (!running && strcmp(e->name, "RUNNING") == 0)
+                running = e->at;
+            if (strcmp(e->name, "STOPPED") == 0)
+                stopped = e->at;
+        } else {
+            printf("%12.3f ms  %-9s %s\n", (double)(e->at - start) / 1000.0,
+                    e->kind, e->name);
+            if (!stop && strcmp(e->kind, "control") == 0
+                    && (strcmp(e->name, "stop") == 0
+                    || strcmp(e->name, "shutdown") == 0))
+                stop = e->at;
+        }
+    }
+    if (running)
+        printf("start to RUNNING: %.3f ms\n",
+                (double)(running - start) / 1000.0);
+    else
+        printf("start to RUNNING: never\n");
+    if (stop && stopped)
+        printf("stop to STOPPED: %.3f ms\n",
+                (double)(stopped - stop) / 1000.0);
+    if (SimLogged == SIM_MAXLOG)
+        printf("(log full, later events not recorded)\n");
+}
+
+/** Run the service under the fake service manager.
+ *
+ * Implements <tt>LuaService simulate</tt>, called from main() after
+ * init.lua has run.
+ *
+ * \context
+ * Service main thread
+ *
+ * \param argc Count of controls in \a argv.
+ * \param argv The schedule, see SvcSimulate.c.
+ * \returns The ANSI C process exit status.
+ */
+int SvcSimulate(int argc, char *argv[])
+{
+    static SimControl sched[SIM_MAXLOG];
+    static const SimControl finalStop = {
+        0, LUASERVICE_CONTROL_STOP, "stop"
+    };
+    SvcThread *worker;
+    SvcU64 start;
+    DWORD now, wait, state;
+    int n, next = 0, finished;
+
+    n = SimParse(argc, argv, sched);
+    if (n < 0)
+        return EXIT_FAILURE;
+    SvcDebugToConsole();
+    SvcManager = &SimManager;
+    SvcCondInit(&SimWake);
+
+    start = SvcMicros();
+    SvcServiceStart();
+    worker = SvcThreadStart(SimWorker, NULL);
+    if (!worker) {
+        fprintf(stderr, "simulate: can't start worker thread (%d)\n",
+                (int)SvcLastError());
+        return EXIT_FAILURE;
+    }
+
+    for (;;) {
+        now = (DWORD)((SvcMicros() - start) / 1000);
+        while (next < n && sched[next].at <= now
+                && SimGetState() != LUASERVICE_STATE_STOPPED)
+            SimDeliver(&sched[next++]);
+        state = SimGetState();
+        if (state != LUASERVICE_STATE_STOPPED && next == n 
+                && !ServiceStopping 
+                && state != LUASERVICE_STATE_START_PENDING)
+            SimDeliver(&finalStop);
+
+        SvcMutexLock(&SimLock);
+        if (SimState == LUASERVICE_STATE_STOPPED) {
+            SvcMutexUnlock(&SimLock);
+            break;
+        }
+        wait = SIM_SLICE;
+        if (next < n && sched[next].at > now && sched[next].at - now < wait)
+            wait = sched[next].at - now;
+        SvcCondWait(&SimWake, &SimLock, wait ? wait : 1);
+        SvcMutexUnlock(&SimLock);
+    }
+
+    finished = ServiceWorkerDone;
+    if (finished)
+        SvcThreadWait(worker, SVC_INFINITE);
+    SvcMutexLock(&SimLock);
+    if (SimExitCode == LUASERVICE_ERROR_START_HANG)
+        SimRecord(SvcMicros(), "note", "ERROR_SERVICE_START_HANG", 0, 0);
+    else if (SimExitCode)
+        SimRecord(SvcMicros(), "note", "service script ended", 0, 0);
+    SvcMutexUnlock(&SimLock);
+    SimReport(start);
+    return finished && !SimExitCode && ServiceStopping
+            ? EXIT_SUCCESS : EXIT_FAILURE;
+}
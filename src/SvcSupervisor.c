@@ -0,0 +1,213 @@
+/*! \file SvcSupervisor.c
+ *  \brief Supervision of the service script inside the service process.
+ *
+ * Without supervision, a service script that raises an error ends the
+ * service, and getting it back depends on the recovery actions set in
+ * the SCM, which restart the whole process after a delay.
+ *
+ * With the init.lua field <code>restart</code> set, a failed script
+ * is instead restarted in a fresh Lua state inside the same process.
+ * Consecutive restarts wait <code>restart_delay</code> ms, doubling
+ * each time up to <code>restart_max_delay</code> ms. A script that
+ * ran for longer than <code>restart_window</code> ms before failing
+ * starts over from the shortest delay. If the script fails more than
+ * <code>restart_limit</code> times within one window, it is taken
+ * to be in a crash loop and the service stops as it would without
+ * supervision.
+ *
+ * With <code>standby</code> also set, a second state with the script
+ * already loaded and compiled is kept ready, so a failure is answered
+ * by running the standby without loading the script again, and a new
+ * standby is loaded in the background. A standby is subject to the
+ * same delays between restarts, except after the first failure in a
+ * window, which it answers at once.
+ *
+ * Each run of the script starts with the service folder as the current
+ * directory.
+ *
+ * A restarted script finds the number of restarts so far in
+ * service.restarts, and the error message with traceback of the last
+ * failure in service.last_error.
+ *
+ * A script that finishes because it is being replaced by a hot reload
+ * is followed by its replacement, whether it failed or not, see
+ * LuaReload.c. A reload is not counted as a restart.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "luaservice.h"
+
+/** Thread loading the next standby state, or NULL. */
+static SvcThread *StandbyLoader;
+
+/** The standby state, once StandbyLoader has finished. */
+static LUAHANDLE Standby;
+
+/** Body of the standby loader thread. */
+static unsigned SupStandbyThread(void *arg)
+{
+    (void)arg;
+    Standby = LuaServiceLoadWorker();
+    SvcDebugTrace(Standby ? "Standby state ready\n"
+            : "Standby state failed to load\n", 0);
+    return 0;
+}
+
+/** Start loading a standby state in the background. */
+static void SupStartStandby(void)
+{
+    Standby = NULL;
+    StandbyLoader = SvcThreadStart(SupStandbyThread, NULL);
+    if (!StandbyLoader)
+        SvcDebugTrace("Can't start standby loader (%d)\n", SvcLastError());
+}
+
+/** Wait for the standby loader and take the state it loaded.
+ *
+ * \returns The standby state, or NULL if there is none.
+ */
+static LUAHANDLE SupTakeStandby(void)
+{
+    LUAHANDLE h;
+    if (!StandbyLoader)
+        return NULL;
+    SvcThreadWait(StandbyLoader, SVC_INFINITE);
+    StandbyLoader = NULL;
+    h = Standby;
+    Standby = NULL;
+    return h;
+}
+
+/** Wait before a restart, giving up early if the service is stopping.
+ *
+ * \param ms The time to wait.
+ * \returns Non-zero if the service is stopping.
+ */
+static int SupDelay(DWORD ms)
+{
+    DWORD start = SvcTicks();
+    DWORD spent;
+    while (!ServiceStopping && (spent = SvcTicks() - start) < ms)
+        SvcSleep(ms - spent < 100 ? ms - spent : 100);
+    return ServiceStopping;
+}
+
+/** Run the service script, restarting it as configured if it fails.
+ *
+ * Takes ownership of \a wk, which is always cleaned up on return. The
+ * checkpoint is restored before each run and saved after it.
+ *
+ * \context
+ * Service worker thread
+ *
+ * \param wk The loaded service script.
+ * \returns Non-zero if the script finished without error, zero if it
+ * failed and was not (or no longer) restarted.
+ */
+int SvcSupervise(LUAHANDLE wk)
+{
+    DWORD delay = ServiceRestartDelay;
+    DWORD windowStart = SvcTicks();
+    DWORD started;
+    LUAHANDLE next;
+    SvcU64 t;
+    int failures = 0;
+    int restarts = 0;
+    int ok = 0;
+    char *err = NULL;
+
+    if (ServiceRestart && ServiceStandby)
+        SupStartStandby();
+
+    for (;;) {
+        started = SvcTicks();
+        if (wk) {
+            LuaServiceEnterFolder();
+            LuaWorkerSetInt(wk, "restarts", restarts);
+            LuaWorkerSetString(wk, "last_error", err);
+            free(err);
+            LuaCheckpointRestore(wk);
+            LuaProfilerAttach(wk);
+            LuaCancelAttach(wk);
+            LuaWatchdogAttach(wk);
+            LuaCommandAttach(wk);
+            t = SvcMicros();
+            ok = LuaWorkerRun(wk) != NULL;
+            SvcSpan("service script", t);
+            err = ok ? NULL : LuaWorkerError(wk);
+            LuaCommandDetach(wk);
+            LuaWatchdogDetach(wk);
+            LuaCancelFinal(wk);
+            next = LuaReloadTake();
+            t = SvcMicros();
+            LuaCheckpointFinal(wk);
+            LuaHeapFinal(wk);
+            SvcSpan("final checkpoint", t);
+            LuaWorkerCleanup(wk);
+            wk = NULL;
+            if (next && !ServiceStopping) {
+                if (!ok)
+                    SvcDebugTraceStr("Replaced script failed: %s\n", err);
+                SvcDebugTrace("Running reloaded script\n", 0);
+                free(err);
+                err = NULL;
+                wk = next;
+                if (ServiceStandby && StandbyLoader) {
+                    LuaWorkerCleanup(SupTakeStandby());
+                    SupStartStandby();
+                }
+                continue;
+            }
+            LuaWorkerCleanup(next);
+        } else {
+            free(err);
+            err = strdup("service script failed to load");
+        }
+        if (!ok)
+            LuaStatusFailed(err, restarts);
+        if (ok || ServiceStopping || !ServiceRestart)
+            break;
+
+        SvcDebugTraceStr("Service script failed: %s\n", err);
+        if (SvcTicks() - started >= (DWORD)ServiceRestartWindow)
+            delay = ServiceRestartDelay;
+        if (SvcTicks() - windowStart >= (DWORD)ServiceRestartWindow) {
+            windowStart = SvcTicks();
+            failures = 0;
+        }
+        if (++failures > ServiceRestartLimit) {
+            SvcDebugTrace("Service script failed %d times, giving up\n",
+                    failures);
+            break;
+        }
+
+        ++restarts;
+        if (StandbyLoader && failures == 1) {
+            SvcDebugTrace("Failing over to standby state (restart %d)\n",
+                    restarts);
+        } else {
+            SvcDebugTrace("Restarting service script in %d ms\n", delay);
+            if (SupDelay(delay))
+                break;
+            delay = delay * 2 < (DWORD)ServiceRestartMaxDelay
+                    ? delay * 2 : (DWORD)ServiceRestartMaxDelay;
+        }
+        wk = SupTakeStandby();
+        if (wk)
+            SvcDebugTrace("Running standby state\n", 0);
+        else
+            wk = LuaServiceLoadWorker();
+        if (ServiceStandby)
+            SupStartStandby();
+    }
+
+    free(err);
+    LuaWorkerCleanup(wk);
+    LuaWorkerCleanup(SupTakeStandby());
+    LuaStatusFinal();
+    LuaCommandStop();
+    LuaTimelineFinal();
+    return ok;
+}
@@ -0,0 +1,236 @@
+/*! \file SvcWin32.c
+ *  \brief Windows service backend.
+ *
+ * Connects the portable startup in LuaService.c to the Service Control
+ * Manager: the process entry point, the service main function run by
+ * the SCM, and the handler of the service control requests it sends.
+ * The last two hand over to SvcHandler.c, which is shared with the
+ * simulated SCM of SvcSimulate.c, and which reports the status of the
+ * service through SvcSetStatus(). The POSIX equivalent is SvcPosix.c.
+ *
+ * Controls other than INTERROGATE are also passed to the script
+ * through the queue of LuaControls.c, which is also how PAUSE and
+ * CONTINUE reach it. Those are only accepted once the script has 
+ * asked for controls.
+ */
+#ifdef _WIN32
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+
+#include "luaservice.h"
+
+/** Current service status.
+ * 
+ * \context 
+ * Service main and worker threads
+ */
+SERVICE_STATUS LuaServiceStatus;
+
+/** Handle to the SCM for the running service to report status.
+ * 
+ * This is global because it is discovered by the worker thread,
+ * and needed by the thread in which the control request handler
+ * executes, which is apparently (but not particularly documented) 
+ * the main thread.
+ * 
+ * \context 
+ * Service main and worker threads
+ */
+SERVICE_STATUS_HANDLE LuaServiceStatusHandle;
+
+/** Report a status to the SCM, see SvcManagerOps.
+ * 
+ * \context
+ * Whichever thread SvcHandler.c reports from
+ * 
+ * \param status The status.
+ */
+static void SvcSetStatus(const SvcStatus *status)
+{
+    LuaServiceStatus.dwCurrentState = status->state;
+    LuaServiceStatus.dwCheckPoint = status->checkpoint;
+    LuaServiceStatus.dwWaitHint = status->hint;
+    LuaServiceStatus.dwWin32ExitCode = status->exitCode;
+    LuaServiceStatus.dwServiceSpecificExitCode = status->specificExitCode;
+    LuaServiceStatus.dwControlsAccepted = SERVICE_ACCEPT_STOP 
+            | SERVICE_ACCEPT_PARAMCHANGE | SERVICE_ACCEPT_SHUTDOWN
+            | (status->acceptsPause ? SERVICE_ACCEPT_PAUSE_CONTINUE : 0);
+    if (!LuaServiceStatusHandle)
+        return;
+    if (!SetServiceStatus(LuaServiceStatusHandle, &LuaServiceStatus))
+        SvcDebugTrace("SetServiceStatus error %ld\n", GetLastError());
+}
+
+/** Service Control Handler.
+ * 
+ * Called in the main thread when the SCM needs to deliver a
+ * status or control request to the service, which SvcHandleControl()
+ * handles.
+ * 
+ * \context
+ * Service main thread
+ * 
+ * \param Opcode The control operation to handle.
+ * 
+ * \see ssSvc
+ */
+void WINAPI LuaServiceCtrlHandler(DWORD Opcode)
+{
+    SvcDebugTrace("Entered LuaServiceCtrlHandler(%d)\n", Opcode);
+    SvcHandleControl(Opcode);
+}
+
+/** The SCM, as the framework sees it. */
+static const SvcManagerOps Win32Manager = {
+    "SCM", SvcHandlerReady, SvcHandlerPaused, SvcHandlerControlsOpened,
+    SvcHandlerReconfigured, SvcSetStatus
+};
+
+/** The service manager the framework reports to. */
+const SvcManagerOps *SvcManager = &Win32Manager;
+
+/** Service Main function.
+ * 
+ * The entry point of the service's primary worker thread. Since
+ * this thread was created by system library code, it apparently 
+ * has not had the CRT completely initialized. 
+ * 
+ * \todo Should LuaService push its Lua implementation into a second
+ * worker thread that has its CRT properly initialized by using 
+ * _beginthreadex() to create it instead of CreateThread()?
+ * 
+ * \context
+ * Service worker thread
+ * 
+ * \param argc The count of arguments.
+ * \param argv The list of arguments.
+ * 
+ * \see \ref ssSvc
+ */
+void WINAPI LuaServiceMain(DWORD argc, LPTSTR *argv)
+{
+    SvcDebugTrace("Entered LuaServiceMain\n", 0);
+
+    LuaServiceStatus.dwServiceType = SERVICE_WIN32_OWN_PROCESS; // SERVICE_WIN32; 
+    LuaServiceStatusHandle = RegisterServiceCtrlHandler(
+            ServiceName,
+            LuaServiceCtrlHandler);
+
+    if (LuaServiceStatusHandle == (SERVICE_STATUS_HANDLE)0) {
+        SvcDebugTrace("RegisterServiceCtrlHandler failed %d\n",
+                GetLastError());
+        return;
+    }
+
+    SvcServiceStart();
+    SvcServiceMain();
+}
+
+/** Console control handler for <tt>LuaService run</tt>.
+ * 
+ * The first Ctrl-C, Ctrl-Break or close of the console asks the service
+ * to stop just as a SERVICE_CONTROL_STOP would. A second one is left to
+ * the default handler, which ends the process at once.
+ * 
+ * \context 
+ * Console control thread
+ * 
+ * \param type The console event.
+ * \returns TRUE if the event was handled.
+ */
+static BOOL WINAPI LuaConsoleCtrlHandler(DWORD type)
+{
+    switch (type) {
+    case CTRL_C_EVENT:
+    case CTRL_BREAK_EVENT:
+    case CTRL_CLOSE_EVENT:
+        if (ServiceStopping)
+            return FALSE;
+        SvcDebugTrace("Telling service to stop\n", 0);
+        LuaServiceStop();
+        LuaControlWake();
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+#ifndef LUASERVICE_NO_MAIN
+/** Process entry point.
+ * 
+ * Invoked when the process starts either by a user at a command prompt 
+ * to setup or control the service, or by the Service Control Manager to
+ * start the service.
+ * 
+ * To Distinguish between the three kinds of service-related programs 
+ * (the service program, the service control program, and the service 
+ * configuration program) that we can call StartServiceCtrlDispatcher() 
+ * early on and use its success or failure to connect to the SCM as an 
+ * indication of the calling context. If it succeeds, then the process 
+ * was started by the SCM and is the service program. If it fails with
+ * the specific error code ERROR_FAILED_SERVICE_CONTROLLER_CONNECT, then
+ * it is not the service program, and it can depend on its command line
+ * to distinguish control from configuration. If any other error is 
+ * returned, then it might have been a service program, but something
+ * is so horribly wrong that the service cannot start.
+ * 
+ * The command line <tt>LuaService run</tt> is handled before trying the
+ * SCM at all. It runs the service in the console instead, with trace 
+ * output on stdout, see LuaServiceRunConsole().
+ * 
+ * \context 
+ * Service, Configuration, Control
+ *  
+ * \param argc The count of arguments.
+ * \param argv The list of arguments.
+ * \returns The ANSI C process exit status.
+ * 
+ * Left out of builds with LUASERVICE_NO_MAIN defined, such as
+ * LuaBench, which link the service runtime into another program.
+ * 
+ * \see ssSvc
+ */
+int main(int argc, char *argv[])
+{
+    SERVICE_TABLE_ENTRY DispatchTable[2]; // note room for terminating record.
+
+    memset(DispatchTable, 0, sizeof(DispatchTable));
+
+    SvcDebugTrace("Entered main\n", 0);
+    if (LuaServiceStartup(argc, argv) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+    if (argc == 2 && stricmp("run", argv[1]) == 0) {
+        SetConsoleCtrlHandler(LuaConsoleCtrlHandler, TRUE);
+        return LuaServiceRunConsole();
+    }
+    if (argc >= 2 && stricmp("simulate", argv[1]) == 0)
+        return SvcSimulate(argc - 2, argv + 2);
+
+    DispatchTable[0].lpServiceName = (LPSTR)ServiceName;
+    DispatchTable[0].lpServiceProc = LuaServiceMain;
+    SvcDebugTraceStr("Service name: %s\n", ServiceName);
+    if (!StartServiceCtrlDispatcher(DispatchTable)) {
+        DWORD err = GetLastError();
+        if (err == ERROR_FAILED_SERVICE_CONTROLLER_CONNECT) {
+            /*
+             * A failure to connect to the SCM implies we are not running 
+             * under the SCM's control, so we must not be the actual 
+             * service application. 
+             * 
+             * We try being a controller or configurer instead.
+             */
+            return SvcControlMain(argc, argv);
+        } else {
+            SvcDebugTrace("StartServiceCtrlDispatcher failed %ld\n", err);
+            return EXIT_FAILURE;
+        }
+    }
+    SvcDebugTrace("Leaving main\n", 0);
+    return EXIT_SUCCESS;
+}
+#endif /* !LUASERVICE_NO_MAIN */
+
+#endif /* _WIN32 */
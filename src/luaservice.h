@@ -5,17 +5,138 @@
 #ifndef LUASERVICE_H_
 #define LUASERVICE_H_
 
+#include "SvcPlatform.h"
+
+struct lua_State;
+
 // From LuaMain.c
 /** An opaque pointer to a Lua state. */
 typedef void *LUAHANDLE;
 extern LUAHANDLE LuaWorkerLoad(LUAHANDLE h, const char *cmd);
+extern LUAHANDLE LuaConfigLoad(const char *cmd);
 extern LUAHANDLE LuaWorkerRun(LUAHANDLE h);
 extern void LuaWorkerCleanup(LUAHANDLE h);
 extern char *LuaResultString(LUAHANDLE h, int item);
 extern int LuaResultInt(LUAHANDLE h, int item);
 extern char *LuaResultFieldString(LUAHANDLE h, int item, const char *field);
 extern int LuaResultFieldInt(LUAHANDLE h, int item, const char *field);
+extern int LuaResultFieldIsSet(LUAHANDLE h, int item, const char *field);
 extern void LuaWorkerSetArgs(LUAHANDLE h, size_t argc, const char **argv);
+extern char *LuaWorkerError(LUAHANDLE h);
+extern void LuaWorkerSetString(LUAHANDLE h, const char *field, const char *value);
+extern void LuaWorkerSetInt(LUAHANDLE h, const char *field, int value);
+extern void *LuaAlloc(void *ud, void *ptr, size_t osize, size_t nsize);
+extern void LuaIdle(struct lua_State *L);
+
+// From LuaDirIndex.c
+extern int LuaDirIndexOpen(struct lua_State *L);
+
+// From LuaKV.c
+extern void LuaKVRegister(struct lua_State *L);
+
+// From LuaCheckpoint.c
+extern int LuaCheckpointSet(struct lua_State *L);
+extern void LuaCheckpointPoll(struct lua_State *L);
+extern void LuaCheckpointRestore(LUAHANDLE h);
+extern void LuaCheckpointFinal(LUAHANDLE h);
+extern char *LuaStateSerialize(struct lua_State *L, int idx, size_t *plen);
+extern int LuaStateDeserialize(struct lua_State *L, const char *p, size_t len);
+
+// From LuaProfiler.c
+extern void LuaProfilerRegister(struct lua_State *L);
+extern void LuaProfilerAttach(LUAHANDLE h);
+extern void LuaProfilerDetach(struct lua_State *L);
+extern void LuaProfilerSleep(struct lua_State *L, int sleeping);
+extern void LuaProfilerPoll(struct lua_State *L);
+extern int LuaProfilerHook(struct lua_State *L);
+
+// From LuaHeap.c
+extern void LuaHeapAttach(struct lua_State *L);
+extern void LuaHeapFree(void *ud);
+extern void *LuaHeapAllocf(void *ud, void *ptr, size_t osize, size_t nsize);
+extern void LuaHeapPoll(struct lua_State *L);
+extern void LuaHeapFinal(LUAHANDLE wk);
+extern void LuaHeapRegister(struct lua_State *L);
+
+// From LuaHeapDump.c
+extern int LuaHeapDump(struct lua_State *L);
+extern void LuaHeapDumpPoll(struct lua_State *L);
+extern void LuaHeapDumpAbort(struct lua_State *L);
+
+// From LuaTimeline.c
+extern void SvcSpan(const char *name, SvcU64 start);
+extern void LuaTimelineStart(void);
+extern void LuaTimelineFlush(void);
+extern void LuaTimelinePoll(struct lua_State *L);
+extern void LuaTimelineFinal(void);
+extern int LuaTimelineSpan(struct lua_State *L);
+
+// From LuaHook.c
+extern void LuaHookRequest(struct lua_State *L, DWORD what);
+
+/** Request flags of the features that share the count hook, see
+ * LuaHook.c. */
+#define LUAHOOK_SAMPLE      1   /**< Take a profiler sample. */
+#define LUAHOOK_TRACEBACK   2   /**< Take a traceback for a command. */
+#define LUAHOOK_WATCHDOG    4   /**< Trace or fail a hung script. */
+#define LUAHOOK_CANCEL      8   /**< Cancel a stopping script. */
+
+/** What a handler of the count hook returns. */
+#define LUAHOOK_DONE    0   /**< Done until asked again. */
+#define LUAHOOK_AGAIN   1   /**< Call again after a while. */
+#define LUAHOOK_RAISE   2   /**< Raise the error at the top of the 
+                             *   stack, and call again after a while. */
+
+// From LuaCancel.c
+extern void LuaCancelAttach(LUAHANDLE h);
+extern void LuaCancelFinal(LUAHANDLE h);
+extern int LuaCancelOnStop(struct lua_State *L);
+extern void LuaCancelRegister(struct lua_State *L);
+extern int LuaCancelHook(struct lua_State *L);
+
+// From LuaWatchdog.c
+extern void LuaWatchdogAttach(LUAHANDLE h);
+extern void LuaWatchdogDetach(LUAHANDLE h);
+extern void LuaWatchdogBeat(void);
+extern void LuaWatchdogSleep(int sleeping);
+extern int LuaWatchdogHeartbeat(struct lua_State *L);
+extern void LuaWatchdogStack(struct lua_State *L, char *buf, size_t size);
+extern int LuaWatchdogHook(struct lua_State *L);
+
+// From LuaControls.c
+extern int LuaControlPush(DWORD code);
+extern void LuaControlWake(void);
+extern int LuaControlPending(void);
+extern int LuaControls(struct lua_State *L);
+
+// From LuaShmQueue.c
+extern int LuaShmQueueOpen(struct lua_State *L);
+extern void LuaShmQueueWake(void);
+
+// From LuaReactor.c
+extern int LuaReactorOpen(struct lua_State *L);
+extern void LuaReactorWake(void);
+
+// From LuaStatus.c
+extern void LuaStatusStart(void);
+extern void LuaStatusPoll(struct lua_State *L);
+extern void LuaStatusSleep(int sleeping);
+extern void LuaStatusControl(DWORD code);
+extern void LuaStatusFailed(const char *err, int restarts);
+extern void LuaStatusFinal(void);
+extern int LuaStatusGauge(struct lua_State *L);
+extern char *LuaStatusText(void);
+extern int LuaStatusShow(int n, const char **names);
+
+// From LuaCommands.c
+extern void LuaCommandStart(void);
+extern void LuaCommandStop(void);
+extern void LuaCommandAttach(LUAHANDLE h);
+extern void LuaCommandDetach(LUAHANDLE h);
+extern void LuaCommandPoll(struct lua_State *L);
+extern int LuaCommandSet(struct lua_State *L);
+extern int LuaCommandClient(int argc, char *argv[]);
+extern int LuaCommandHook(struct lua_State *L);
 
 // From LuaService.c
 extern void SvcDebugTrace(LPCSTR fmt, DWORD Status);
@@ -27,17 +148,198 @@ extern const char *ServiceScript;
 extern const char *LuaPackagePath;
 extern const char *LuaPackageCPath;
 extern const char *LuaInitScript;
+extern const char *CheckpointFile;
+extern int CheckpointInterval;
+extern int ServiceRestart;
+extern int ServiceRestartDelay;
+extern int ServiceRestartMaxDelay;
+extern int ServiceRestartLimit;
+extern int ServiceRestartWindow;
+extern int ServiceStandby;
+extern LUAHANDLE LuaServiceLoadWorker(void);
 extern volatile int ServiceStopping;
+extern volatile int ServiceReloadPending;
+extern int ServiceReloadWatch;
+extern int ServiceGcPause;
+extern int ServiceGcStepmul;
+extern volatile int ServiceConfigGeneration;
+extern void LuaServiceReconfigure(void);
+extern void LuaServiceEnterFolder(void);
 extern const char **LuaServiceArgv;
 extern size_t LuaServiceArgc;
+extern const char *ServicePidFile;
+extern DWORD LuaServiceInitialization(LUAHANDLE *ph, DWORD *perror);
+extern int LuaServiceStartup(int argc, char *argv[]);
+extern int LuaServiceRunConsole(void);
+extern void LuaServiceStop(void);
+extern volatile DWORD ServiceStopTicks;
+extern volatile SvcU64 ServiceStopMicros;
+extern int ServiceStopTimeout;
+extern int ServiceStopGrace;
+extern int ServiceWatchdog;
+extern int ServiceWatchdogRestart;
+extern int ServiceStatusPage;
+extern const char *ServiceControlSocket;
+extern volatile long ServiceStopProgress;
+extern DWORD ServiceStopLatency;
+extern DWORD LuaServiceStopLeft(void);
+extern void LuaServiceStopped(int finished);
+extern int ServiceReadyTimeout;
+extern volatile int ServiceReady;
+extern volatile long ServiceStartProgress;
+extern volatile DWORD ServiceStartHint;
+extern DWORD LuaServiceReadyLeft(void);
+extern void LuaServiceReady(void);
+extern void LuaServiceStartHung(void);
+extern int ServiceProfile;
+extern const char *ServiceProfileFile;
+extern int ServiceProfileInterval;
+extern int ServiceProfileOverhead;
+extern volatile int ServiceProfileToggle;
+extern int ServiceHeapProfile;
+extern int ServiceHeapSample;
+extern const char *ServiceHeapFile;
+extern volatile int ServiceHeapReportPending;
+extern const char *ServiceTimelineFile;
+extern int ServiceTimelineRing;
+
+// From LuaReload.c
+extern void LuaReloadPoll(struct lua_State *L);
+extern int LuaReloadRetiring(struct lua_State *L);
+extern LUAHANDLE LuaReloadTake(void);
 
-// From SvcController.c
+// From SvcSupervisor.c
+extern int SvcSupervise(LUAHANDLE wk);
+
+// From SvcController.c on Windows, SvcPosix.c elsewhere
 extern int SvcControlMain(int argc, char *argv[]);
 
+/** A service status, as SvcHandler.c reports it with the setStatus()
+ * of SvcManagerOps. The fields have the meaning of those of the SCM's
+ * SERVICE_STATUS. */
+typedef struct SvcStatus {
+    DWORD state;                /**< A LUASERVICE_STATE_ value. */
+    DWORD checkpoint;           /**< Advanced while a change progresses. */
+    DWORD hint;                 /**< Time in ms the change may yet take. */
+    DWORD exitCode;             /**< Why the service stopped, or zero. */
+    DWORD specificExitCode;     /**< Detail of \a exitCode. */
+    int acceptsPause;           /**< Non-zero to accept pause and continue. */
+} SvcStatus;
+
+/** What the framework tells the service manager, besides what the 
+ * backend reports itself. Each backend provides one, and SvcSimulate.c
+ * puts its own in place for a simulated run.
+ */
+typedef struct SvcManagerOps {
+    const char *name;               /**< Name of the service manager. */
+    void (*ready)(void);            /**< Report the service running. */
+    void (*paused)(int paused);     /**< Report a pause or continue done. */
+    void (*controlsOpened)(void);   /**< Accept pause and continue. */
+    void (*reconfigured)(void);     /**< Report init.lua applied again. */
+    void (*setStatus)(const SvcStatus *status); /**< Report a status of
+                                                 *   SvcHandler.c. */
+} SvcManagerOps;
+
+// From SvcWin32.c on Windows, SvcPosix.c elsewhere
+extern const SvcManagerOps *SvcManager;
+
+// From SvcHandler.c
+extern volatile int ServiceWorkerDone;
+extern void SvcServiceStart(void);
+extern void SvcServiceMain(void);
+extern void SvcHandleControl(DWORD code);
+extern void SvcHandlerReady(void);
+extern void SvcHandlerPaused(int paused);
+extern void SvcHandlerControlsOpened(void);
+extern void SvcHandlerReconfigured(void);
+
+// From SvcSimulate.c
+extern int SvcSimulate(int argc, char *argv[]);
+
 #ifndef LUA_OK
 #  define LUA_OK 0
 #endif
 
+#if defined lauxlib_h && LUA_VERSION_NUM >= 502 && !defined luaL_register
+/* Defined in LuaMain.c for Lua versions that dropped it. */
+extern void luaL_register(lua_State *L, const char *libname, const luaL_Reg *l);
+#endif
+
+/** Service controls as queued for service.controls(), see
+ * LuaControls.c. These have the values of the SCM's SERVICE_CONTROL_
+ * codes, so those pass straight through. INTERROGATE is never queued. */
+#define LUASERVICE_CONTROL_STOP         1
+#define LUASERVICE_CONTROL_PAUSE        2
+#define LUASERVICE_CONTROL_CONTINUE     3
+#define LUASERVICE_CONTROL_INTERROGATE  4
+#define LUASERVICE_CONTROL_SHUTDOWN     5
+#define LUASERVICE_CONTROL_PARAMCHANGE  6
+
+/** Custom service control that asks for a hot reload of the script. */
+#define LUASERVICE_CONTROL_RELOAD 128
+
+/** Custom service control that starts or stops the profiler. */
+#define LUASERVICE_CONTROL_PROFILE 129
+
+/** Service states, with the values of the SCM's SERVICE_ states. The
+ * status page publishes all but the pause and continue pending. */
+#define LUASERVICE_STATE_STOPPED            1
+#define LUASERVICE_STATE_START_PENDING      2
+#define LUASERVICE_STATE_STOP_PENDING       3
+#define LUASERVICE_STATE_RUNNING            4
+#define LUASERVICE_STATE_CONTINUE_PENDING   5
+#define LUASERVICE_STATE_PAUSE_PENDING      6
+#define LUASERVICE_STATE_PAUSED             7
+
+/** Exit code of a service that did not get ready in time, the value of
+ * the SCM's ERROR_SERVICE_START_HANG. */
+#define LUASERVICE_ERROR_START_HANG     1053
+
+/** First bytes of a status page, "LSSP". */
+#define LUASERVICE_STATUS_MAGIC     0x5053534CUL
+
+/** Layout version of the status page, changed whenever a field moves. */
+#define LUASERVICE_STATUS_VERSION   2
+
+/** Gauges a status page holds. */
+#define LUASERVICE_STATUS_GAUGES    16
+
+/** One gauge set by service.gauge(). */
+typedef struct LuaStatusGaugeEntry {
+    char name[24];                  /**< Its name, cut off to fit. */
+    double value;                   /**< Its last value. */
+} LuaStatusGaugeEntry;
+
+/** What a status page tells, see LuaStatus.c. Times are from
+ * SvcMicros(), which counts from the same point in every process. */
+typedef struct LuaStatusData {
+    DWORD state;                    /**< A LUASERVICE_STATE_ value. */
+    DWORD sleeping;                 /**< Non-zero while in service.sleep(). */
+    SvcU64 started;                 /**< When the page was opened. */
+    SvcU64 heartbeat;               /**< When the page was last written. */
+    SvcU64 loops;                   /**< Idle points the script passed. */
+    SvcU64 controls;                /**< Controls the script took. */
+    SvcU64 heap;                    /**< Bytes in the worker's Lua heap. */
+    SvcU64 failed;                  /**< When the script last failed. */
+    DWORD restarts;                 /**< Restarts before the last failure. */
+    DWORD gauges;                   /**< Gauges in use. */
+    char last_error[256];           /**< Last failure, cut off to fit. */
+    LuaStatusGaugeEntry gauge[LUASERVICE_STATUS_GAUGES];
+} LuaStatusData;
+
+/** The status page, as mapped into shared memory. Fits in one 4 KB
+ * memory page. Every field sits at its natural alignment, so the
+ * layout is the same for 32 and 64 bit processes. */
+typedef struct LuaStatusPage {
+    DWORD magic;                    /**< LUASERVICE_STATUS_MAGIC. */
+    DWORD version;                  /**< LUASERVICE_STATUS_VERSION. */
+    DWORD size;                     /**< sizeof(LuaStatusPage). */
+    DWORD pid;                      /**< The service process. */
+    volatile DWORD seq;             /**< Odd while data is written. */
+    DWORD pad;                      /**< Aligns \a data to 8 bytes. */
+    LuaStatusData data;             /**< What the service tells. */
+} LuaStatusPage;
+
 #define LUA_INIT_VAR "LUA_INIT"
 
 #if defined LUA_VERSION_MAJOR && defined LUA_VERSION_MINOR
@@ -21,11 +21,20 @@ SET DEFS=%DEFS% USE_LUA_ALLOCATOR
 SET CFLAGS=/nologo -c /MD /O2 /WX /D_CRT_SECURE_NO_DEPRECATE /DNDEBUG /I%LUA_INCDIR%
 SET LFLAGS=/nologo /INCREMENTAL:NO /LIBPATH:%LUA_LIBDIR%
 SET RFLAGS=/nologo
-SET LIBS=kernel32.lib Advapi32.lib %LUALIB%
+SET LIBS=kernel32.lib Advapi32.lib ws2_32.lib %LUALIB%
 
 SET CFILES=src\LuaMain.c src\LuaService.c src\SvcController.c
+SET CFILES=%CFILES% src\LuaDirIndex.c src\LuaKV.c src\LuaCheckpoint.c src\SvcSupervisor.c src\LuaReload.c src\LuaProfiler.c src\LuaHeap.c src\LuaHeapDump.c src\LuaTimeline.c src\LuaHook.c src\LuaCancel.c src\LuaWatchdog.c src\LuaControls.c src\LuaStatus.c src\LuaCommands.c src\LuaShmQueue.c src\SvcQueue.c src\LuaReactor.c src\SvcHandler.c src\SvcSimulate.c src\SvcPlatWin32.c src\SvcWin32.c
 SET RFILES=src\LuaService.rc
 
+:: vcbuild bench builds LuaBench into the bench folder, beside its scripts
+IF "%1"=="bench" (
+  SET OUTNAME=LuaBench.exe
+  SET OUTDIR=bench
+  SET DEFS=%DEFS% LUASERVICE_NO_MAIN
+  SET CFILES=%CFILES% bench\LuaBench.c bench\LuaBenchLoad.c
+)
+
 set DEFS_=
 FOR %%S IN (%DEFS%) DO SET DEFS_=!DEFS_! /D%%S
 